@@ -10,7 +10,9 @@
 
 /* This is to make sure that the assembly files can still include 64bit.h without getting compilation errors. */
 #ifndef __ASSEMBLER__
-extern void _64bit_init(void *multiboot_header, uint64_t highest_address);
+#include "common/boot_info.h"
+
+extern void _64bit_init(void *multiboot_header, uint64_t highest_address, boot_info_t *boot_info, uint32_t pml4_address);
 #endif
 
 // The entry point of the 64-bit kernel.
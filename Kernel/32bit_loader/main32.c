@@ -7,6 +7,10 @@
 
 #include <stdint.h>
 
+#include "common/acpi.h"
+#include "common/memory.h"
+#include "common/boot_info.h"
+#include "common/cpu.h"
 #include "common/misc.h"
 #include "64bit.h"
 #include "io32.h"
@@ -15,6 +19,125 @@
 #include "string32.h"
 #include "vm32.h"
 
+// The information being passed on to the 64-bit kernel. It is located in the loader's BSS, which is reserved memory as far as
+// the kernel is concerned.
+static boot_info_t boot_info;
+
+// These symbols are provided by start.S and the linker, respectively.
+extern uint8_t start[];
+extern uint8_t _end[];
+
+/**
+ * Add a region to the memory map. The regions are kept sorted by their base address, and a region that is adjacent to
+ * another region of the same type is merged with it. Overlapping regions are not handled in any special way; the boot
+ * loaders we care about don't report such.
+ *
+ * @param base_address  The physical base address of the region.
+ * @param length  The length of the region, in bytes.
+ * @param type  The type of the region (MEMORY_REGION_TYPE_*).
+ */
+static void memory_map_add_region(uint64_t base_address, uint64_t length, uint32_t type)
+{
+    memory_map_t *memory_map = &boot_info.memory_map;
+
+    if (length == 0)
+    {
+        return;
+    }
+
+    if (memory_map->count == MEMORY_MAP_MAX_REGIONS)
+    {
+        io_print_line("Too many regions in the memory map. Ignoring the rest of them.");
+        return;
+    }
+
+    // Find the place where this region should go, and move the ones above it out of the way.
+    uint32_t index = memory_map->count;
+    while (index > 0 && memory_map->regions[index - 1].base_address > base_address)
+    {
+        memory_map->regions[index] = memory_map->regions[index - 1];
+        index--;
+    }
+
+    memory_map->regions[index].base_address = base_address;
+    memory_map->regions[index].length = length;
+    memory_map->regions[index].type = type;
+    memory_map->regions[index].reserved = 0;
+    memory_map->count++;
+
+    // Merge with the following region, if possible...
+    if (index + 1 < memory_map->count &&
+        memory_map->regions[index + 1].type == type &&
+        memory_map->regions[index + 1].base_address == base_address + length)
+    {
+        memory_map->regions[index].length += memory_map->regions[index + 1].length;
+        memory_copy(&memory_map->regions[index + 1], &memory_map->regions[index + 2],
+                    (memory_map->count - index - 2) * sizeof(memory_map_region_t));
+        memory_map->count--;
+    }
+
+    // ...and with the preceding one.
+    if (index > 0 &&
+        memory_map->regions[index - 1].type == type &&
+        memory_map->regions[index - 1].base_address + memory_map->regions[index - 1].length == base_address)
+    {
+        memory_map->regions[index - 1].length += memory_map->regions[index].length;
+        memory_copy(&memory_map->regions[index], &memory_map->regions[index + 1],
+                    (memory_map->count - index - 1) * sizeof(memory_map_region_t));
+        memory_map->count--;
+    }
+}
+
+/**
+ * Search a memory area for the ACPI Root System Description Pointer. The RSDP is always aligned on a 16-byte boundary.
+ *
+ * @param start  The start of the area to search.
+ * @param end  The end of the area to search (exclusive).
+ * @returns the address of the RSDP, or 0 if it was not found.
+ */
+static uint32_t acpi_search_rsdp(uint32_t start, uint32_t end)
+{
+    for (uint32_t address = start; address + ACPI_RSDP_V1_SIZE <= end; address += 16)
+    {
+        const char *signature = (const char *) address;
+        int i;
+        for (i = 0; i < ACPI_RSDP_SIGNATURE_LENGTH && signature[i] == ACPI_RSDP_SIGNATURE[i]; i++);
+
+        if (i == ACPI_RSDP_SIGNATURE_LENGTH && acpi_checksum_valid((const void *) address, ACPI_RSDP_V1_SIZE))
+        {
+            return address;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Find the ACPI Root System Description Pointer. On BIOS systems, it is located either in the first KiB of the Extended
+ * BIOS Data Area or in the BIOS ROM area between 0xE0000 and 0xFFFFF. This is done here rather than in the 64-bit kernel,
+ * since the kernel keeps the first page (where the EBDA pointer lives) unmapped.
+ *
+ * @returns the address of the RSDP, or 0 if it was not found.
+ */
+static uint32_t acpi_find_rsdp(void)
+{
+    // The real-mode segment of the EBDA is stored at 0x40E in the BIOS Data Area.
+    uint32_t ebda_address = (uint32_t) *(volatile uint16_t *) 0x40E << 4;
+    uint32_t rsdp_address = 0;
+
+    if (ebda_address != 0)
+    {
+        rsdp_address = acpi_search_rsdp(ebda_address, ebda_address + 1024);
+    }
+
+    if (rsdp_address == 0)
+    {
+        rsdp_address = acpi_search_rsdp(0xE0000, 0x100000);
+    }
+
+    return rsdp_address;
+}
+
 /*
  * This is where execution starts when the entry point code in start.S has finished setting the most fundamental parts up.
  *
@@ -23,6 +146,14 @@
  */
 void main (uint32_t magic, multiboot_info_t *multiboot_info)
 {
+    // The time-stamp counter has been running since the CPU was reset, so this tells us how long the firmware and the
+    // boot loader took.
+    boot_info.phase_end_tsc[boot_phase_firmware] = cpu_read_tsc();
+
+    // The memory primitives are used by pretty much everything else, so they must be set up first of all. Until this
+    // has been done, they fall back to the (slow) bytewise variants.
+    memory_init();
+
     io_init();
     io_print_line("cocOS32 version 0.1.0 loading...");
 
@@ -39,13 +170,26 @@ void main (uint32_t magic, multiboot_info_t *multiboot_info)
     {
         multiboot_module_info_t *module_info = (multiboot_module_info_t *) multiboot_info->modules_info;
 
-        // An extremely inefficient way to do a memcpy(), but it works... :-)
-        uint8_t *kernel = (uint8_t *) _64BIT_KERNEL_ENTRY_POINT;
-        uint8_t *module = (uint8_t *) module_info->start;
-        for (int i = 0; i < module_info->end - module_info->start; i++)
+        if (module_info->end - module_info->start > KERNEL_IMAGE_ZONE_END - KERNEL_IMAGE_ZONE_START)
         {
-            kernel[i] = module[i];
+            io_print_line("The 64-bit kernel is too large to fit in the kernel image zone. Kernel halted.");
+            HALT();
         }
+
+        memory_copy((void *) _64BIT_KERNEL_ENTRY_POINT, (void *) module_info->start, module_info->end - module_info->start);
+
+        // Any other modules are left where the boot loader put them, so they must not be overwritten. (The original copy
+        // of the kernel is not needed any more, so it doesn't have to be reserved.)
+        for (uint32_t i = 1; i < multiboot_info->modules_count; i++)
+        {
+            if (!boot_info_add_reserved_range(&boot_info, module_info[i].start, module_info[i].end))
+            {
+                io_print_line("Too many modules. Kernel halted.");
+                HALT();
+            }
+        }
+
+        boot_info.phase_end_tsc[boot_phase_loader_kernel_copy] = cpu_read_tsc();
     }
     else
     {
@@ -57,6 +201,9 @@ void main (uint32_t magic, multiboot_info_t *multiboot_info)
     // Before we move on, we want to determine the amount of memory available available in the machine. This is used by the
     // kernel to know how much physical memory to map. We do this to make life a bit simpler for the 64-bit kernel, since it
     // initially only has access to a limited part of the physical memory, before paging is properly set up.
+    //
+    // While we're at it, we also convert the memory map to our own format. It is needed to determine the memory types of
+    // the pages in the identity map (RAM is cached, memory-mapped I/O is not).
     uint64_t available_memory = 0;
     if (multiboot_info->flags.has_memory_map)
     {
@@ -65,20 +212,23 @@ void main (uint32_t magic, multiboot_info_t *multiboot_info)
         {
             // Pointer arithmetics is always a bit dangerous, but this one should be safe: memory_map_address is defined as
             // an integer, so we won't get any weird unexpected semantics...
-            multiboot_memory_map_t *memory_map = (multiboot_memory_map_t *) (multiboot_info->memory_map_address + index);
-            if (memory_map->type == MULTIBOOT_MEMORY_MAP_TYPE_RAM)
+            multiboot_memory_map_t *multiboot_memory_map = (multiboot_memory_map_t *) (multiboot_info->memory_map_address + index);
+            uint64_t base_address = ((uint64_t) multiboot_memory_map->base_address_high << 32) + multiboot_memory_map->base_address_low;
+            uint64_t length = ((uint64_t) multiboot_memory_map->length_high << 32) + multiboot_memory_map->length_low;
+
+            memory_map_add_region(base_address, length, multiboot_memory_map->type);
+
+            if (multiboot_memory_map->type == MULTIBOOT_MEMORY_MAP_TYPE_RAM)
             {
-                uint64_t base_address = ((uint64_t) memory_map->base_address_high << 32) + memory_map->base_address_low;
-                uint64_t length = ((uint64_t) memory_map->length_high << 32) + memory_map->length_low;
                 available_memory = MAX(available_memory, base_address + length);
-
-                // This can be handy when debugging so I'll leave it in the code, commented out.
-                //io_print_formatted("Index: %u, Memory info: %X %X, type: %u\n", index, base_address, length, memory_map->type);
             }
 
+            // This can be handy when debugging so I'll leave it in the code, commented out.
+            //io_print_formatted("Index: %u, Memory info: %X %X, type: %u\n", index, base_address, length, multiboot_memory_map->type);
+
             // The record size is the size of the record MINUS the record size field... which is a 32-bit integer. So, we
             // need to add 4 here to get it right.
-            index += memory_map->size + 4;
+            index += multiboot_memory_map->size + 4;
         }
     }
     else if (multiboot_info->flags.has_memory_info)
@@ -87,6 +237,9 @@ void main (uint32_t magic, multiboot_info_t *multiboot_info)
         // autodetection at all in this case and just halt (and perhaps let the memory size be overridable by means of a
         // kernel command line parameter).
         available_memory = (multiboot_info->memory_upper * 1024) + (1024 * 1024);
+
+        memory_map_add_region(0, multiboot_info->memory_lower * 1024, MEMORY_REGION_TYPE_RAM);
+        memory_map_add_region(1 * MiB, multiboot_info->memory_upper * 1024, MEMORY_REGION_TYPE_RAM);
     }
     else
     {
@@ -94,7 +247,31 @@ void main (uint32_t magic, multiboot_info_t *multiboot_info)
         HALT();
     }
 
-    string_copy(KERNEL_COMMAND_LINE, (char *) multiboot_info->command_line);
+    boot_info.phase_end_tsc[boot_phase_loader_memory_map] = cpu_read_tsc();
+
+    // If the boot loader has set up a graphical framebuffer for us, it should be mapped write-combining. (The text mode
+    // video memory is always mapped like that, so we don't need to treat that case specially.)
+    uint64_t framebuffer_address = 0;
+    uint64_t framebuffer_size = 0;
+    if (multiboot_info->flags.has_framebuffer_info &&
+        multiboot_info->framebuffer_type != MULTIBOOT_FRAMEBUFFER_TYPE_EGA_TEXT)
+    {
+        framebuffer_address = multiboot_info->framebuffer_address;
+        framebuffer_size = (uint64_t) multiboot_info->framebuffer_pitch * multiboot_info->framebuffer_height;
+    }
+
+    // The command line is copied into the boot information, since the Multiboot structures can be located anywhere in
+    // memory -- including in the RAM that the paging structures get allocated from.
+    string_copy_bounded(boot_info.command_line, (char *) multiboot_info->command_line, BOOT_INFO_COMMAND_LINE_SIZE);
+
+    // The ACPI tables are needed by the kernel to find the other CPU:s in the machine.
+    boot_info.acpi_rsdp_address = acpi_find_rsdp();
+
+    // The loader itself (including its stack, which the kernel keeps using for the time being) and the kernel image zone
+    // must not be touched by any memory allocator.
+    boot_info_add_reserved_range(&boot_info, (uint32_t) start, (uint32_t) _end);
+    boot_info_add_reserved_range(&boot_info, KERNEL_IMAGE_ZONE_START, KERNEL_IMAGE_ZONE_END);
+    boot_info.phase_end_tsc[boot_phase_loader_boot_info] = cpu_read_tsc();
 
     // Alright, let's get moving. What we do now is set up basic data structures to be able to activate the ultra-cool amd64
     // "long mode". :-) But first, we will need to detect that the CPU is actually a 64-bit CPU, and similar.
@@ -103,10 +280,11 @@ void main (uint32_t magic, multiboot_info_t *multiboot_info)
     // elegant to do it all in one single assembly function, IMO (_64bit_init). The only thing we do in C (because of
     // convenience and code cleanness) is to set up the 4-level long mode paging structures, which is done by the function
     // below.
-    vm_setup_paging_structures(available_memory);
+    vm_setup_paging_structures(available_memory, &boot_info, framebuffer_address, framebuffer_size);
+    boot_info.phase_end_tsc[boot_phase_loader_paging] = cpu_read_tsc();
 
     // We now have VM set up, so let's call the aforementioned 64-bit initialization function.
     //
     // Because of its nature, this function will never return. If 64-bit initialization fails, it will halt the CPU.
-    _64bit_init(multiboot_info, available_memory);
+    _64bit_init(multiboot_info, available_memory, &boot_info, (uint32_t) boot_info.pml4_address);
 }
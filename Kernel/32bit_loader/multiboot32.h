@@ -26,6 +26,9 @@
 /* RAM that can be used by the OS. */
 #define MULTIBOOT_MEMORY_MAP_TYPE_RAM   1
 
+/* Framebuffer types. The EGA text type means that the "framebuffer" is the good old text mode video memory. */
+#define MULTIBOOT_FRAMEBUFFER_TYPE_EGA_TEXT 2
+
 /* Data structures. */
 /* The following code should not be available to assembly code, only C. */
 #ifndef __ASSEMBLER__
@@ -59,7 +62,9 @@ typedef struct
         uint32_t has_module_info: 1;
         uint32_t reserved1: 2;
         uint32_t has_memory_map: 1;
-        uint32_t reserved2: 25;  // We don't care about the rest of these, even though some can actually be used.
+        uint32_t reserved2: 5;  // We don't care about these, even though some can actually be used.
+        uint32_t has_framebuffer_info: 1;
+        uint32_t reserved3: 19;
     } flags;
     uint32_t memory_lower;
     uint32_t memory_upper;
@@ -77,6 +82,25 @@ typedef struct
     elf_section_header_table;
     uint32_t memory_map_length;
     uint32_t memory_map_address;
+    uint32_t drives_length;
+    uint32_t drives_address;
+    uint32_t config_table;
+    uint32_t boot_loader_name;
+    uint32_t apm_table;
+    uint32_t vbe_control_info;
+    uint32_t vbe_mode_info;
+    uint16_t vbe_mode;
+    uint16_t vbe_interface_segment;
+    uint16_t vbe_interface_offset;
+    uint16_t vbe_interface_length;
+
+    // Only valid if flags.has_framebuffer_info is set.
+    uint64_t framebuffer_address;
+    uint32_t framebuffer_pitch;
+    uint32_t framebuffer_width;
+    uint32_t framebuffer_height;
+    uint8_t framebuffer_bpp;
+    uint8_t framebuffer_type;
 } multiboot_info_t;
 
 /* The multiboot module info structure. If the module information is present, there is one of these for each module. */
@@ -26,4 +26,23 @@ static inline void string_copy(char *target, const char *source)
     target[i] = '\0';
 }
 
+/**
+ * Copy the source string to the target, copying at most size - 1 characters. The target string will always be
+ * zero-terminated, even if the source string had to be truncated.
+ *
+ * @param target the target string.
+ * @param source the source string.
+ * @param size the size of the target buffer, in bytes.
+ */
+static inline void string_copy_bounded(char *target, const char *source, int size)
+{
+    int i;
+    for (i = 0; source[i] != '\0' && i < size - 1; i++)
+    {
+        target[i] = source[i];
+    }
+
+    target[i] = '\0';
+}
+
 #endif /* !__STRING32_H__ */
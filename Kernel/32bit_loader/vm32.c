@@ -5,10 +5,16 @@
  * Copyright: © 2008-2009, 2013 Per Lundberg
  */
 
+#include <stddef.h>
+
+#include "common/boot_info.h"
+#include "common/cpu.h"
+#include "common/memory.h"
+#include "common/memory_map.h"
+#include "common/memory_type.h"
 #include "common/misc.h"
 #include "common/vm.h"
 #include "io32.h"
-#include "memory.h"
 #include "vm32.h"
 
 // Virtual memory is set up by this file.
@@ -23,233 +29,332 @@
 //
 // FIXME: I think we should actually move this to the 64-bit kernel ASAP, it makes more sense to have it there. We need to
 // put the PML4 and so forth in a typedef anyway (something like thread_vm_t), and that structure is irrelevant in the 32-bit
-// loader context. The problem though, is that we NEED to have 3 statically defined pages somewhere where we can place the
-// temporary PML4/PDP/PD stuff, to be able to do this. This is not as trivial as it seems: if we put it at 2 MiB (for
-// example),w e must know that GRUB/the multiboot boot loader hasn't put anything else important there...
-//
-// I'd need to read a bit about what memory assumptions we can make on the multiboot loader some day.
-
-// Define this to get some VM initialization debugging output. Good for checking out that the algorithms work properly.
-//#define VM_DEBUG 1
+// loader context. The problem though, used to be that we NEED to have a few statically defined pages somewhere where we can
+// place the temporary PML4/PDP/PD stuff, to be able to do this. This is not as trivial as it seems: if we put it at 2 MiB
+// (for example), we must know that GRUB/the multiboot boot loader hasn't put anything else important there... Nowadays, we
+// allocate the paging structures from the RAM in the memory map instead, so that particular problem is gone.
 
 // Paging structures. These will need to be individualized for the threads later on (since each thread will need to have
 // parts of its own address space thread-local, we need to duplicate all of those actually).
-static pml4e_t *pml4 = (pml4e_t *) VM_STRUCTURES_PML4_ADDRESS;
-static pdpe_t *pdp = (pdpe_t *) VM_STRUCTURES_PDP_ADDRESS;
-static pde_t *pd;
-static pte_t *low_pt = (pte_t *) VM_STRUCTURES_LOW_PAGE_TABLE_ADDRESS;
+static uint64_t *pml4;
+
+// Builds the identity mapping in the paging structures above. It also keeps track of the number of pages of each size
+// mapped, so we can report the page size mix.
+static vm_builder_t builder;
+
+// The boot information being passed on to the kernel. The paging structures are allocated from the RAM in its memory map,
+// avoiding its reserved ranges, and the ranges being used for the paging structures are added to it.
+static boot_info_t *boot_info;
+
+// The paging structures are allocated top-down, one page at a time; this is the lowest address allocated so far. The
+// reserved range currently being grown downwards is also kept track of, since we want to add as few ranges as possible to
+// the boot information.
+static uint64_t lowest_structure_address = VM_STRUCTURES_HIGHEST_ADDRESS;
+static boot_info_range_t *structure_range;
+static uint32_t structure_pages;
+
+// The amount of memory mapped with each memory type.
+static uint64_t mapped_bytes[MEMORY_TYPE_COUNT];
+
+// The text mode video memory. Writes to it are never read back, so write-combining is the best memory type for it.
+#define VGA_TEXT_MEMORY_START           0xB8000
+#define VGA_TEXT_MEMORY_END             0xC0000
+
+// The maximum number of write-combining ranges: the text mode video memory and the graphical framebuffer.
+#define MAX_WRITE_COMBINING_RANGES      2
+
+typedef struct
+{
+    uint64_t start;
+    uint64_t end;
+} address_range_t;
+
+// The physical memory map, as provided by the multiboot loader. This is what decides which pages are cached, and where the
+// paging structures can be placed.
+static const memory_map_t *memory_map;
+
+static address_range_t write_combining_ranges[MAX_WRITE_COMBINING_RANGES];
+static int write_combining_range_count;
 
 /**
- * Map a physical page into the virtual memory zone reserved for "physical" address space. ("identity mapped" = 1-to-1, each
- * physical address matches the same address in the virtual address space)
+ * Find the highest page of free RAM below a given address. A page is free if it is completely covered by a RAM region in
+ * the memory map, and does not overlap any of the reserved ranges.
  *
- * Ideally, this function should be supplied the address to the PML4 etc by a parameter or similar. Right now, we make it
- * pretty hardwired. If we supply the PML4, we still have to tell the function where all the other tables should be placed so
- * it's not so easy to make it generic like that...
- *
- * @param virtual_page  The number of the page that should be mapped (in the virtual address space).
- * @param physical_page  The number of the page that should be mapped (in the physical address space)
- * @param page_size  The size of the page that should be mapped.
+ * @param limit  The address to search below.
+ * @returns the address of the page, or 0 if there is no free page between VM_STRUCTURES_LOWEST_ADDRESS and the limit.
  */
-static void vm_map_physical_memory(uint64_t virtual_page, uint64_t physical_page, page_size_e page_size)
+static uint64_t vm_find_free_page(uint64_t limit)
 {
-    // We want the page indices to be in terms of 4 KiB pages, since that's the way the PML4, PDP, PD and PT structures are
-    // built up. So, if we were called to perform a 2 MiB mapping request, let's convert the page indices a bit.
-    if (page_size == _2mib)
+    const uint64_t page_mask = VM_4KIB_PAGE_SIZE - 1;
+    uint64_t page = (limit & ~page_mask) - VM_4KIB_PAGE_SIZE;
+
+    while (page >= VM_STRUCTURES_LOWEST_ADDRESS)
     {
-        virtual_page = virtual_page * (VM_2MIB_PAGE_SIZE / VM_4KIB_PAGE_SIZE);
-        physical_page = physical_page * (VM_2MIB_PAGE_SIZE / VM_4KIB_PAGE_SIZE);
+        // If the page is reserved, continue right below the reserved range.
+        bool is_reserved = false;
+        for (uint32_t i = 0; i < boot_info->reserved_range_count; i++)
+        {
+            const boot_info_range_t *range = &boot_info->reserved_ranges[i];
+            if (page < range->end && page + VM_4KIB_PAGE_SIZE > range->start)
+            {
+                is_reserved = true;
+                if ((range->start & ~page_mask) < VM_STRUCTURES_LOWEST_ADDRESS + VM_4KIB_PAGE_SIZE)
+                {
+                    return 0;
+                }
+
+                page = (range->start & ~page_mask) - VM_4KIB_PAGE_SIZE;
+                break;
+            }
+        }
+
+        if (is_reserved)
+        {
+            continue;
+        }
+
+        // If the page is RAM, we're done. Otherwise, continue at the top of the closest RAM region below the page. Just
+        // like when deciding the memory types, partial pages at the edges of the regions are not considered to be RAM.
+        uint64_t closest_ram_end = 0;
+        for (uint32_t i = 0; i < memory_map->count; i++)
+        {
+            const memory_map_region_t *region = &memory_map->regions[i];
+            if (region->type != MEMORY_REGION_TYPE_RAM)
+            {
+                continue;
+            }
+
+            uint64_t start = (region->base_address + page_mask) & ~page_mask;
+            uint64_t end = (region->base_address + region->length) & ~page_mask;
+            if (start <= page && page + VM_4KIB_PAGE_SIZE <= end)
+            {
+                return page;
+            }
+
+            if (end <= page && end > closest_ram_end)
+            {
+                closest_ram_end = end;
+            }
+        }
+
+        if (closest_ram_end < VM_STRUCTURES_LOWEST_ADDRESS + VM_4KIB_PAGE_SIZE)
+        {
+            return 0;
+        }
+
+        page = closest_ram_end - VM_4KIB_PAGE_SIZE;
     }
 
-    // Calculate which indices we should look at when setting up the mapping for this virtual page.
-    int pml4_index = (virtual_page >> VM_PML4_INDEX_LOW_BIT) & VM_INDEX_MASK;
-    int pdp_index = (virtual_page >> VM_PDP_INDEX_LOW_BIT) & VM_INDEX_MASK;
-    int pd_index = (virtual_page >> VM_PD_INDEX_LOW_BIT) & VM_INDEX_MASK;
-    int pt_index = (virtual_page >> VM_PT_INDEX_LOW_BIT) & VM_INDEX_MASK;
+    return 0;
+}
 
-    if (!pml4[pml4_index].present)
+/**
+ * Allocate a page for a paging structure (PML4, PDP, PD or PT). The pages are taken from the top of the free RAM below
+ * 4 GiB, and are zeroed before they are returned. This means that the number of paging structures is only limited by the
+ * amount of RAM, so we can map pretty much any amount of memory.
+ *
+ * @returns the address of the newly allocated page.
+ */
+static void *vm_allocate_structure(void)
+{
+    uint64_t page = vm_find_free_page(lowest_structure_address);
+    if (page == 0)
     {
-#ifdef VM_DEBUG
-        io_print_formatted("Setting up PML4 entry %u\n", pml4_index);
-#endif
-        // This PML4 entry is not present. We need to set it up.
-        //
-        // The PDP base address is the physical address with the lower 12 bits shifted off. In other words, it must be
-        // page aligned and the "address" can really be seen as a physical 4 KiB page number.
-        pml4[pml4_index].pdp_base_address = ((uint32_t)pdp + pml4_index * VM_4KIB_PAGE_SIZE) / VM_4KIB_PAGE_SIZE;
-
-        // We enable write/through caching for this PML4 entry, since that takes precedence over all pages below it.
-        pml4[pml4_index].pwt = 1;
-        pml4[pml4_index].writable = 1;
-        pml4[pml4_index].present = 1;
+        io_print_formatted("Out of memory for paging structures (%u pages allocated). Halting.\n", structure_pages);
+        HALT();
     }
 
-    if (!pdp[pdp_index].present)
+    // Grow the current reserved range if the page is adjacent to it. Otherwise (the first time, and whenever we have had to
+    // skip a reserved range or a hole in the memory map), we need to start a new one.
+    if (structure_range != NULL && structure_range->start == page + VM_4KIB_PAGE_SIZE)
     {
-#ifdef VM_DEBUG
-        io_print_formatted("Setting up PDP entry %u\n", pdp_index);
-#endif
-        // This PDP entry is not present. We need to set it up.
-        //
-        // The logic for this address is the same as for the other tables.
-        pdp[pdp_index].pd_base_address = ((uint32_t)pd + pdp_index * VM_4KIB_PAGE_SIZE) / VM_4KIB_PAGE_SIZE;
-
-        // We enable write/through caching for this PML4 entry, since that takes precedence over all pages below it.
-        pdp[pdp_index].pwt = 1;
-        pdp[pdp_index].writable = 1;
-        pdp[pdp_index].present = 1;
+        structure_range->start = page;
     }
-
-    switch (page_size)
+    else
     {
-        case _4kib:
+        if (!boot_info_add_reserved_range(boot_info, page, page + VM_4KIB_PAGE_SIZE))
         {
-            // If we make stupid limitations, let's at least admit it openly.  :-)
-            if (pd_index > 1)
-            {
-                io_print_formatted("Invalid mapping attempted! %X = %X. For small pages, we currently only have VM structures set up for the first two MiB of RAM.\n",
-                                   virtual_page, physical_page);
-                HALT();
-            }
+            io_print_formatted("Too many reserved ranges for the paging structures. Halting.\n");
+            HALT();
+        }
 
-            if (!pd[pd_index].present)
-            {
-#ifdef VM_DEBUG
-                io_print_formatted("Setting up PD entry %u\n", pd_index);
-#endif
-                // Likewise for the page directory; if the entry is not present, set it up.
-                
-                // The logic for this address is the same as for the other tables. Note that this code is not >125
-                // GiB-compliant for the moment. We need to update it before the 125 GiB barrier is exceeded (see the
-                // MemoryMap for more information). It should be pretty simple to fix actually, but I'll not put any time
-                // into it right now.
-                pd[pd_index].base_address = ((uint32_t)low_pt + pd_index * VM_4KIB_PAGE_SIZE) / VM_4KIB_PAGE_SIZE;
-                
-                // We enable write/through caching for this PML4 entry, since that takes precedence over all pages below it.
-                pd[pd_index].pwt = 1;
-                pd[pd_index].writable = 1;
-                pd[pd_index].present = 1;
-            }
-            
-            // ...and finally, the 4-level VM structures has come to its most fine-grained part: the page table. Here, we
-            // don't even check the "present" flag since we reset it anyway. Other than that, the code is basically the same
-            // as above, EXCEPT... one important exception: the page_base_address is obviously not set to Yet Another Paging
-            // Table<tm>, but rather to the actual page itself (phew!)
-#ifdef VM_DEBUG
-            io_print_formatted("Setting up PT %u\n", pt_index);
-#endif
-            
-            low_pt[pt_index].present = 1;
-            low_pt[pt_index].writable = 1;
-            low_pt[pt_index].pwt = 1;
-            low_pt[pt_index].global = 1;
-            low_pt[pt_index].page_base_address = physical_page;
-
-            break;
+        structure_range = &boot_info->reserved_ranges[boot_info->reserved_range_count - 1];
+    }
+
+    lowest_structure_address = page;
+    structure_pages++;
+
+    void *structure = VM_PHYSICAL_TO_POINTER(page);
+    memory_zero(structure, VM_4KIB_PAGE_SIZE);
+    return structure;
+}
+
+/**
+ * Get the memory type that a given page should be mapped with. A page is mapped write-back only if it is completely
+ * covered by RAM (which includes the ACPI tables and NVS); everything else is considered memory-mapped I/O and mapped
+ * uncached. The exceptions are the video memory and framebuffer, which are mapped write-combining.
+ *
+ * @param address  The address of the page.
+ * @returns the memory type.
+ */
+static memory_type_e vm_memory_type_of_page(uint64_t address)
+{
+    for (int i = 0; i < write_combining_range_count; i++)
+    {
+        if (address < write_combining_ranges[i].end && address + VM_4KIB_PAGE_SIZE > write_combining_ranges[i].start)
+        {
+            return memory_type_write_combining;
         }
-        
-        case _2mib:
+    }
+
+    for (uint32_t i = 0; i < memory_map->count; i++)
+    {
+        const memory_map_region_t *region = &memory_map->regions[i];
+        if (region->type != MEMORY_REGION_TYPE_RAM &&
+            region->type != MEMORY_REGION_TYPE_ACPI &&
+            region->type != MEMORY_REGION_TYPE_ACPI_NVS)
         {
-#ifdef VM_DEBUG
-            io_print_formatted("Setting up 2 MiB PD entry %u\n", pd_index);
-#endif
-            
-            // We enable write/through caching for this PML4 entry, since that takes precedence over all pages below it.
-            pd[pd_index].present = 1;
-            pd[pd_index].writable = 1;
-            pd[pd_index].pwt = 1;
-            pd[pd_index].global = 1;
-            pd[pd_index].page_size = 1;
-            
-            // The logic for this address is the same as for the other tables, except that this entry references the
-            // actual page, rather than yet another table.
-            pd[pd_index].base_address = physical_page;
-            
-            break;
+            continue;
         }
-        
-        default:
+
+        if (region->base_address <= address && address + VM_4KIB_PAGE_SIZE <= region->base_address + region->length)
         {
-            io_print_formatted("Invalid page size %x\n", page_size);
-            HALT();
+            return memory_type_write_back;
         }
     }
+
+    return memory_type_uncached;
 }
 
 /**
- * Debug function to print out all the memory mappings that has been done.
+ * Find the next address (after the given one) where the memory type could potentially change. This is always at a page
+ * aligned boundary of a memory map region or a write-combining range.
+ *
+ * @param address  The address to start looking from.
+ * @param end_address  The end of the memory being mapped. Returned if no boundary is found before it.
+ * @returns the address of the next boundary.
  */
-void vm_print_memory_mapping()
+static uint64_t vm_next_boundary(uint64_t address, uint64_t end_address)
 {
-    io_print_formatted("Memory map:\n\n");
+    const uint64_t page_mask = VM_4KIB_PAGE_SIZE - 1;
+    uint64_t next_boundary = end_address;
+
+    for (uint32_t i = 0; i < memory_map->count; i++)
+    {
+        // Regions that start or end in the middle of a page "own" the page partially, which means that it will be mapped
+        // uncached. So, the boundaries are rounded towards the inside of the region.
+        uint64_t start = (memory_map->regions[i].base_address + page_mask) & ~page_mask;
+        uint64_t end = (memory_map->regions[i].base_address + memory_map->regions[i].length) & ~page_mask;
 
-    io_print_formatted("PML4: %X\n", pml4[0]);
-    io_print_formatted("PDP: %X\n", pdp[0]);
-    io_print_formatted("PD: %X\n", pd[0]);
+        if (start > address && start < next_boundary)
+        {
+            next_boundary = start;
+        }
+
+        if (end > address && end < next_boundary)
+        {
+            next_boundary = end;
+        }
+    }
 
-    for (int virtual_page = 0; virtual_page < 5; virtual_page++)
+    for (int i = 0; i < write_combining_range_count; i++)
     {
-        int pml4_index = (virtual_page >> VM_PML4_INDEX_LOW_BIT) & VM_INDEX_MASK;
-        int pdp_index = (virtual_page >> VM_PDP_INDEX_LOW_BIT) & VM_INDEX_MASK;
-        int pd_index = (virtual_page >> VM_PD_INDEX_LOW_BIT) & VM_INDEX_MASK;
-        int pt_index = (virtual_page >> VM_PT_INDEX_LOW_BIT) & VM_INDEX_MASK;
+        // ...whereas the write-combining ranges are rounded outwards.
+        uint64_t start = write_combining_ranges[i].start & ~page_mask;
+        uint64_t end = (write_combining_ranges[i].end + page_mask) & ~page_mask;
 
-        pdpe_t *pdp = (pdpe_t *) (uint32_t) (pml4[pml4_index].pdp_base_address * VM_4KIB_PAGE_SIZE);
-        pde_t *pd = (pde_t *) (uint32_t) (pdp[pdp_index].pd_base_address * VM_4KIB_PAGE_SIZE);
+        if (start > address && start < next_boundary)
+        {
+            next_boundary = start;
+        }
 
-        // Only go down to the fourth level in the VM hierarchy when it is relevant.
-        if (pd[pd_index].page_size == 0)
+        if (end > address && end < next_boundary)
         {
-            pte_t *pt = (pte_t *) (uint32_t) (pd[pd_index].base_address * VM_4KIB_PAGE_SIZE);
-            
-#ifdef VM_DEBUG            
-            io_print_formatted("Virtual page %u is mapped to physical page %u.\n", virtual_page, pt[pt_index].page_base_address);
-#endif
-            io_print_formatted("PT: %X\n", pt[pt_index]);
+            next_boundary = end;
         }
     }
+
+    return next_boundary;
+}
+
+/**
+ * Identity-map a range of memory which has the same memory type throughout, using the largest pages possible. Every fully
+ * covered, aligned GiB gets a 1 GiB page if the CPU supports it; the rest uses 2 MiB pages, and any fragment which is not
+ * aligned on (or evenly divisible with) 2 MiB is mapped using 4 KiB pages.
+ *
+ * @param address  The start of the range. Must be page aligned.
+ * @param end_address  The end of the range (exclusive). Must be page aligned.
+ * @param memory_type  The memory type of the range.
+ */
+static void vm_map_range(uint64_t address, uint64_t end_address, memory_type_e memory_type)
+{
+    // Note that the PWT and PCD bits in the entries referencing paging structures only control how the CPU accesses the
+    // paging structure itself, not the pages below it. We want those to be cached (write-back), which is what you get with
+    // both bits cleared; vm_structure_entry() takes care of that. The memory type of the pages is selected by the PAT, PCD
+    // and PWT bits of the entries referencing them.
+    uint64_t attributes = VM_ENTRY_PRESENT | VM_ENTRY_WRITABLE | VM_ENTRY_GLOBAL | vm_memory_type_bits(memory_type);
+
+    // The paging structures are allocated by vm_allocate_structure(), which halts rather than returning if it runs out of
+    // memory. So this can't really fail.
+    if (!vm_builder_map(&builder, address, address, end_address - address, attributes))
+    {
+        io_print_formatted("Failed to map %X-%X. Halting.\n", address, end_address);
+        HALT();
+    }
 }
 
-void vm_setup_paging_structures(uint64_t available_memory)
+void vm_setup_paging_structures(uint64_t available_memory, boot_info_t *kernel_boot_info,
+                                uint64_t framebuffer_address, uint64_t framebuffer_size)
 {
-    // As mentioned in the vm.h file, the number of PDP tables is variable, depending on the amount of available RAM in the
-    // machine. There will always be at least one PDP table, but if the amount of RAM in the machine gets above 512 GiB,
-    // there will be multiple.
-    int num_pdps = available_memory / (512 * GiB);
-
-    // If the amount of memory in the machine is not evenly divisible with 512 * GiB, we need to take this into account when
-    // doing these calculations.
-    if (available_memory % (512 * GiB) != 0)
+    // Does the CPU support 1 GiB pages? If so, we use them for every gigabyte of RAM which is fully covered by physical
+    // memory. This saves a lot of TLB entries, as well as memory for the page directories.
+    bool has_1gib_pages = false;
+    if (cpu_has_cpuid_leaf(CPUID_LEAF_EXTENDED_INFO))
     {
-        num_pdps++;
+        cpuid_registers_t extended_info;
+        cpu_cpuid(CPUID_LEAF_EXTENDED_INFO, 0, &extended_info);
+        has_1gib_pages = (extended_info.edx & CPUID_EXTENDED_INFO_EDX_PAGE_1GB) != 0;
     }
 
-    // Exactly the same theory can be applied to the number of PDs.
-    int num_pds = available_memory / (1 * GiB);
+    // Program the PAT before we set up any mappings, since the encoding of the memory types depends on whether it could be
+    // done or not.
+    bool has_pat = memory_type_init();
 
-    if (available_memory % (1 * GiB) != 0)
+    boot_info = kernel_boot_info;
+    memory_map = &boot_info->memory_map;
+
+    // Start from scratch. This only matters if the paging structures are set up more than once, which never happens when
+    // booting, but all the time in the hosted build (see the hosted folder).
+    lowest_structure_address = VM_STRUCTURES_HIGHEST_ADDRESS;
+    structure_range = NULL;
+    structure_pages = 0;
+    write_combining_range_count = 0;
+    memory_zero(mapped_bytes, sizeof(mapped_bytes));
+
+    // The text mode video memory is always mapped write-combining, as is the graphical framebuffer if there is one.
+    write_combining_ranges[write_combining_range_count].start = VGA_TEXT_MEMORY_START;
+    write_combining_ranges[write_combining_range_count].end = VGA_TEXT_MEMORY_END;
+    write_combining_range_count++;
+
+    if (framebuffer_size > 0)
     {
-        num_pds++;
+        write_combining_ranges[write_combining_range_count].start = framebuffer_address;
+        write_combining_ranges[write_combining_range_count].end = framebuffer_address + framebuffer_size;
+        write_combining_range_count++;
     }
 
-    pd = (pde_t *)((void *)pdp + num_pdps * VM_4KIB_PAGE_SIZE);
-#ifdef VM_DEBUG
-    io_print_formatted("PML4: %x\n", pml4);
-    io_print_formatted("PDP base: %x\n", pdp);
-    io_print_formatted("PD base: %x\n", pd);
-    io_print_formatted("Low PT base: %x\n", low_pt);
-    io_print_formatted("Sizeof pml4e_t: %u\n", sizeof(pml4e_t));
-#endif
-
-    // Start off by zapping the pages used for the PML4, PDP, PD and low page tables, just so we make sure they have
-    // reasonable content.
-    memory_zero(pml4, VM_4KIB_PAGE_SIZE);
-    memory_zero(pdp, VM_4KIB_PAGE_SIZE * num_pdps);
-    memory_zero(pd, VM_4KIB_PAGE_SIZE * num_pds);
-    memory_zero(low_pt, VM_4KIB_PAGE_SIZE);
-
-    // Just some security precautions since the for loop below doesn't take any RAM size into consideration. We can at least
-    // be nice and crash in a sensible way, in the extremely bizarre situation that someone has constructed an x86-64 machine
+    // Start off by allocating the PML4. Just like the other paging structures, it is zeroed as part of the allocation, so we
+    // can be sure that it has reasonable content.
+    pml4 = vm_allocate_structure();
+    boot_info->pml4_address = VM_POINTER_TO_PHYSICAL(pml4);
+
+    memory_zero(&builder, sizeof(builder));
+    builder.pml4 = pml4;
+    builder.allocate_structure = vm_allocate_structure;
+    builder.has_1gib_pages = has_1gib_pages;
+
+    // Just some security precautions since the loops below don't take any RAM size into consideration. We can at least be
+    // nice and crash in a sensible way, in the extremely bizarre situation that someone has constructed an x86-64 machine
     // with less than 2 megs of RAM. ;-) For physical machines, this will really never happen, but for virtual machines it
     // could very well be the case. Still, it is extremely unlikely, and e.g. VMWare Server only lets you configure 4 megs or
     // more for a VM...
@@ -258,25 +363,51 @@ void vm_setup_paging_structures(uint64_t available_memory)
         io_print_formatted("Less than 2 MiB of RAM. This is not supported by cocOS. Halting.");
         HALT();
     }
-    
-    // OK, all tables are set up. We try to map up the low 2 MiB first. Since we want the first block of it unmapped (to be
-    // able to trap NULL pointer references), we can't just map it using a "large page" (which is exactly 2 MiB
-    // large). Instead, we need to map those two megs of RAM using small (4 KiB) pages.
-    for (uint64_t page_number = 1; page_number < VM_ENTRIES_PER_PAGE; page_number++)
+
+    // We map all of the RAM, but also at least the first 4 GiB of the physical address space, since that's where the
+    // memory-mapped I/O (local APIC, I/O APIC, HPET, PCI devices etc) lives. The memory types make sure that the I/O
+    // regions are not cached. The framebuffer can sometimes be located above 4 GiB, so we make sure to include it as well.
+    uint64_t end_address = available_memory & ~((uint64_t) VM_4KIB_PAGE_SIZE - 1);
+    if (end_address < 4 * GiB)
     {
-        vm_map_physical_memory(page_number, page_number, _4kib);
+        end_address = 4 * GiB;
     }
 
-#ifdef VM_DEBUG
-    vm_print_memory_mapping();
-#endif
+    uint64_t framebuffer_end = (framebuffer_address + framebuffer_size + VM_4KIB_PAGE_SIZE - 1) &
+                               ~((uint64_t) VM_4KIB_PAGE_SIZE - 1);
+    if (framebuffer_size > 0 && framebuffer_end > end_address)
+    {
+        end_address = framebuffer_end;
+    }
 
-    // Now, map the rest of the memory using 2 MiB pages. If we end up having a fragment of memory available "on top"
-    // (e.g. the memory is not evenly divisible with 2 MiB), we could map that up using 4KiB pages. Right now, we just round
-    // the memory size down to its closest 2 MiB figure. This is done automatically when we perform an integer division.
-    int available_2mib_pages = available_memory / (2 * MiB);
-    for (uint64_t page_number = 1; page_number < available_2mib_pages; page_number++)
+    // Now, map the memory in runs of the same memory type. We start at the second page of memory, since we want the first
+    // block of it unmapped (to be able to trap NULL pointer references). This means that the low 2 MiB can't be mapped
+    // using a "large page" (which is exactly 2 MiB large); the alignment rules in vm_map_range() take care of mapping
+    // those two megs of RAM using small (4 KiB) pages instead.
+    uint64_t address = VM_4KIB_PAGE_SIZE;
+    while (address < end_address)
     {
-        vm_map_physical_memory(page_number, page_number, _2mib);
+        memory_type_e memory_type = vm_memory_type_of_page(address);
+
+        // Extend the run as far as possible. The next boundary is only a potential change of the memory type; two
+        // adjacent regions can very well have the same one.
+        uint64_t run_end_address = address;
+        do
+        {
+            run_end_address = vm_next_boundary(run_end_address, end_address);
+        } while (run_end_address < end_address && vm_memory_type_of_page(run_end_address) == memory_type);
+
+        vm_map_range(address, run_end_address, memory_type);
+        mapped_bytes[memory_type] += run_end_address - address;
+        address = run_end_address;
     }
+
+    io_print_formatted("Identity mapped %U MiB: %u x 1 GiB, %u x 2 MiB and %u x 4 KiB pages, %u KiB of paging structures.\n",
+                       end_address / MiB, (uint32_t) builder.pages[_1gib], (uint32_t) builder.pages[_2mib],
+                       (uint32_t) builder.pages[_4kib],
+                       structure_pages * (uint32_t) (VM_4KIB_PAGE_SIZE / KiB));
+    io_print_formatted("Memory types: %U MiB write-back, %U KiB write-combining, %U MiB uncached",
+                       mapped_bytes[memory_type_write_back] / MiB, mapped_bytes[memory_type_write_combining] / KiB,
+                       mapped_bytes[memory_type_uncached] / MiB);
+    io_print_formatted(has_pat ? " (PAT programmed).\n" : " (no PAT, write-combining falls back to uncached).\n");
 }
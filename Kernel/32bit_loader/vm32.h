@@ -10,11 +10,22 @@
 
 #include "stdint.h"
 
+#include "common/boot_info.h"
+
 /**
- * Set up the paging (VM) structures: PML4, PDP and PD tables.
+ * Set up the paging (VM) structures: PML4, PDP and PD tables. This also programs the PAT, so that the memory type of each
+ * page can be set correctly.
+ *
+ * The paging structures are allocated from free RAM, as described by the memory map in the boot information. The ranges
+ * being used for them are added to its reserved ranges, and the address of the PML4 is stored in it.
  *
  * @param available_memory  The amount of available memory in the machine (in bytes).
+ * @param boot_info  The boot information. Its memory map decides the memory types: RAM is mapped write-back, everything
+ * else uncached.
+ * @param framebuffer_address  The physical address of the graphical framebuffer, or 0 if there is none.
+ * @param framebuffer_size  The size of the framebuffer, in bytes.
  */
-extern void vm_setup_paging_structures(uint64_t available_memory);
+extern void vm_setup_paging_structures(uint64_t available_memory, boot_info_t *boot_info,
+                                       uint64_t framebuffer_address, uint64_t framebuffer_size);
 
 #endif // !__VM32_H__
@@ -0,0 +1,110 @@
+/*
+ * acpi.c - Access to the ACPI system description tables. All the tables are located in physical memory below 4 GiB on
+ * every machine we have seen so far, which means that they are covered by the identity mapping and can be accessed
+ * directly.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "acpi.h"
+#include "apic.h"
+#include "io.h"
+
+// The root table: either the RSDT (with 32-bit pointers to the other tables) or the XSDT (with 64-bit pointers).
+static const acpi_table_header_t *root_table;
+static bool root_table_is_xsdt;
+
+void acpi_init(uint64_t rsdp_address)
+{
+    if (rsdp_address == 0)
+    {
+        io_print_line("ACPI: no RSDP found.");
+        return;
+    }
+
+    const acpi_rsdp_t *rsdp = (const acpi_rsdp_t *) rsdp_address;
+    if (rsdp->revision >= 2 && rsdp->xsdt_address != 0 && acpi_checksum_valid(rsdp, rsdp->length))
+    {
+        root_table = (const acpi_table_header_t *) rsdp->xsdt_address;
+        root_table_is_xsdt = true;
+    }
+    else
+    {
+        root_table = (const acpi_table_header_t *) (uint64_t) rsdp->rsdt_address;
+        root_table_is_xsdt = false;
+    }
+
+    if (!acpi_checksum_valid(root_table, root_table->length))
+    {
+        io_print_line("ACPI: the root table has an invalid checksum, ignoring it.");
+        root_table = NULL;
+    }
+}
+
+const acpi_table_header_t *acpi_find_table(const char *signature)
+{
+    if (root_table == NULL)
+    {
+        return NULL;
+    }
+
+    // The root table header is followed by an array of pointers to the other tables.
+    const uint8_t *entries = (const uint8_t *) root_table + sizeof(acpi_table_header_t);
+    uint32_t entry_size = root_table_is_xsdt ? sizeof(uint64_t) : sizeof(uint32_t);
+    uint32_t entry_count = (root_table->length - sizeof(acpi_table_header_t)) / entry_size;
+
+    for (uint32_t i = 0; i < entry_count; i++)
+    {
+        // The entries in the XSDT are not necessarily 8-byte aligned, so they are read in two halves.
+        uint64_t address = *(const uint32_t *) (entries + i * entry_size);
+        if (root_table_is_xsdt)
+        {
+            address |= (uint64_t) *(const uint32_t *) (entries + i * entry_size + 4) << 32;
+        }
+
+        const acpi_table_header_t *table = (const acpi_table_header_t *) address;
+        if (table == NULL)
+        {
+            continue;
+        }
+
+        if (table->signature[0] == signature[0] && table->signature[1] == signature[1] &&
+            table->signature[2] == signature[2] && table->signature[3] == signature[3] &&
+            acpi_checksum_valid(table, table->length))
+        {
+            return table;
+        }
+    }
+
+    return NULL;
+}
+
+uint64_t acpi_local_apic_address(void)
+{
+    const acpi_madt_t *madt = (const acpi_madt_t *) acpi_find_table(ACPI_MADT_SIGNATURE);
+    if (madt == NULL)
+    {
+        return APIC_DEFAULT_ADDRESS;
+    }
+
+    // The 32-bit address in the MADT header can be overridden by a 64-bit one in an entry of its own.
+    uint64_t address = madt->local_apic_address;
+    const uint8_t *entries_end = (const uint8_t *) madt + madt->header.length;
+    const uint8_t *entry = (const uint8_t *) madt + sizeof(acpi_madt_t);
+    while (entry < entries_end && ((const acpi_madt_entry_t *) entry)->length != 0)
+    {
+        if (((const acpi_madt_entry_t *) entry)->type == ACPI_MADT_TYPE_LOCAL_APIC_OVERRIDE)
+        {
+            address = ((const acpi_madt_local_apic_override_t *) entry)->local_apic_address;
+        }
+
+        entry += ((const acpi_madt_entry_t *) entry)->length;
+    }
+
+    return address;
+}
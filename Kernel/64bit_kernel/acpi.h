@@ -0,0 +1,39 @@
+/*
+ * acpi.h - Access to the ACPI system description tables.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#ifndef __ACPI_H__
+#define __ACPI_H__ 1
+
+#include <stdint.h>
+
+#include "common/acpi.h"
+
+//// Function prototypes
+/**
+ * Initialize the ACPI table access. The tables are located via the root table (the XSDT if available, otherwise the
+ * RSDT) pointed to by the RSDP.
+ *
+ * @param rsdp_address  The physical address of the RSDP, as found by the 32-bit loader. If 0, no tables will be found.
+ */
+extern void acpi_init(uint64_t rsdp_address);
+
+/**
+ * Find an ACPI table. Tables with an invalid checksum are ignored.
+ *
+ * @param signature  The four-character signature of the table, for example "APIC" for the MADT.
+ * @returns the table, or NULL if it could not be found.
+ */
+extern const acpi_table_header_t *acpi_find_table(const char *signature);
+
+/**
+ * Get the physical address of the local APIC registers, as given by the MADT.
+ *
+ * @returns the address, or APIC_DEFAULT_ADDRESS if there is no (valid) MADT.
+ */
+extern uint64_t acpi_local_apic_address(void);
+
+#endif // !__ACPI_H__
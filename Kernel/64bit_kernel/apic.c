@@ -0,0 +1,172 @@
+/*
+ * apic.c - The local APIC. We use it in xAPIC mode, where the registers are memory-mapped. The register page is covered
+ * by the identity mapping; since it is not RAM, it is mapped uncached by the 32-bit loader, which is exactly what we
+ * want.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#include <stdint.h>
+
+#include "apic.h"
+#include "cpu.h"
+#include "interrupt.h"
+#include "log.h"
+#include "pit.h"
+#include "profile.h"
+
+// The registers we use, as offsets from the base address.
+#define APIC_REGISTER_ID                0x020
+#define APIC_REGISTER_EOI               0x0B0
+#define APIC_REGISTER_SPURIOUS_VECTOR   0x0F0
+#define APIC_REGISTER_ICR_LOW           0x300
+#define APIC_REGISTER_ICR_HIGH          0x310
+#define APIC_REGISTER_LVT_TIMER         0x320
+#define APIC_REGISTER_LVT_PERFORMANCE_COUNTER 0x340
+#define APIC_REGISTER_TIMER_INITIAL     0x380
+#define APIC_REGISTER_TIMER_CURRENT     0x390
+#define APIC_REGISTER_TIMER_DIVIDE      0x3E0
+
+// The spurious interrupt vector register: bit 8 software-enables the APIC, the low 8 bits are the vector used for spurious
+// interrupts.
+#define APIC_SPURIOUS_VECTOR_ENABLE     (1 << 8)
+
+// The local vector table entry of the timer.
+#define APIC_LVT_MASKED                 (1 << 16)
+#define APIC_LVT_TIMER_PERIODIC         (1 << 17)
+#define APIC_LVT_DELIVERY_NMI           (4 << 8)
+
+// The timer counts down at the bus clock frequency divided by 16.
+#define APIC_TIMER_DIVIDE_BY_16         0x3
+
+// The time we measure the timer for when calibrating it. Longer means more precision, but a slower boot.
+#define APIC_TIMER_CALIBRATION_MICROSECONDS 10000
+
+// The interrupt command register. The delivery status bit is set while the IPI has not yet been accepted by the target.
+#define APIC_ICR_DELIVERY_FIXED         (0 << 8)
+#define APIC_ICR_DELIVERY_INIT          (5 << 8)
+#define APIC_ICR_DELIVERY_STARTUP       (6 << 8)
+#define APIC_ICR_DELIVERY_STATUS        (1 << 12)
+#define APIC_ICR_LEVEL_ASSERT           (1 << 14)
+#define APIC_ICR_DESTINATION_SHIFT      24
+
+static volatile uint8_t *apic_base;
+
+// The number of timer ticks per second, as measured by apic_timer_calibrate().
+static uint64_t timer_frequency;
+
+// The number of timer interrupts per second.
+static unsigned int tick_frequency = APIC_TIMER_TICK_FREQUENCY;
+
+static inline uint32_t apic_read(uint32_t reg)
+{
+    return *(volatile uint32_t *) (apic_base + reg);
+}
+
+static inline void apic_write(uint32_t reg, uint32_t value)
+{
+    *(volatile uint32_t *) (apic_base + reg) = value;
+}
+
+/**
+ * Send an IPI and wait for it to be accepted by the target CPU.
+ */
+static void apic_send_ipi(uint32_t apic_id, uint32_t command)
+{
+    // The IPI is sent when the low half of the ICR is written, so the destination must be written first.
+    apic_write(APIC_REGISTER_ICR_HIGH, apic_id << APIC_ICR_DESTINATION_SHIFT);
+    apic_write(APIC_REGISTER_ICR_LOW, command);
+
+    while ((apic_read(APIC_REGISTER_ICR_LOW) & APIC_ICR_DELIVERY_STATUS) != 0)
+    {
+        cpu_relax();
+    }
+}
+
+/**
+ * The handler of the timer interrupt.
+ */
+static void apic_timer_interrupt(interrupt_frame_t *frame)
+{
+    cpu_current()->timer_ticks++;
+    profile_timer_tick(frame);
+    apic_end_of_interrupt();
+}
+
+/**
+ * The handler of the spurious interrupt. As the name implies, there is nothing to do; not even an EOI.
+ */
+static void apic_spurious_interrupt(interrupt_frame_t *frame)
+{
+}
+
+void apic_init(uint64_t address)
+{
+    apic_base = (volatile uint8_t *) address;
+    interrupt_register_handler(INTERRUPT_VECTOR_APIC_SPURIOUS, apic_spurious_interrupt);
+    apic_init_cpu();
+}
+
+void apic_init_cpu(void)
+{
+    apic_write(APIC_REGISTER_SPURIOUS_VECTOR, APIC_SPURIOUS_VECTOR_ENABLE | INTERRUPT_VECTOR_APIC_SPURIOUS);
+}
+
+void apic_end_of_interrupt(void)
+{
+    apic_write(APIC_REGISTER_EOI, 0);
+}
+
+void apic_timer_calibrate(void)
+{
+    // Let the timer count down (with its interrupt masked) from the highest possible value for a known amount of time.
+    apic_write(APIC_REGISTER_TIMER_DIVIDE, APIC_TIMER_DIVIDE_BY_16);
+    apic_write(APIC_REGISTER_LVT_TIMER, APIC_LVT_MASKED | INTERRUPT_VECTOR_APIC_TIMER);
+    apic_write(APIC_REGISTER_TIMER_INITIAL, 0xFFFFFFFF);
+    pit_delay(APIC_TIMER_CALIBRATION_MICROSECONDS);
+    uint32_t elapsed = 0xFFFFFFFF - apic_read(APIC_REGISTER_TIMER_CURRENT);
+    apic_write(APIC_REGISTER_TIMER_INITIAL, 0);
+
+    timer_frequency = (uint64_t) elapsed * 1000000 / APIC_TIMER_CALIBRATION_MICROSECONDS;
+    interrupt_register_handler(INTERRUPT_VECTOR_APIC_TIMER, apic_timer_interrupt);
+
+    log_print(log_level_info, "APIC timer: %U kHz, ticking at %u Hz.\n", timer_frequency / 1000, tick_frequency);
+}
+
+void apic_timer_start(void)
+{
+    apic_write(APIC_REGISTER_TIMER_DIVIDE, APIC_TIMER_DIVIDE_BY_16);
+    apic_write(APIC_REGISTER_LVT_TIMER, APIC_LVT_TIMER_PERIODIC | INTERRUPT_VECTOR_APIC_TIMER);
+    apic_write(APIC_REGISTER_TIMER_INITIAL, timer_frequency / tick_frequency);
+}
+
+void apic_timer_set_frequency(unsigned int frequency)
+{
+    tick_frequency = frequency;
+}
+
+void apic_performance_counter_nmi(void)
+{
+    apic_write(APIC_REGISTER_LVT_PERFORMANCE_COUNTER, APIC_LVT_DELIVERY_NMI);
+}
+
+uint32_t apic_get_id(void)
+{
+    return apic_read(APIC_REGISTER_ID) >> 24;
+}
+
+void apic_send_fixed(uint32_t apic_id, uint8_t vector)
+{
+    apic_send_ipi(apic_id, APIC_ICR_DELIVERY_FIXED | APIC_ICR_LEVEL_ASSERT | vector);
+}
+
+void apic_send_init(uint32_t apic_id)
+{
+    apic_send_ipi(apic_id, APIC_ICR_DELIVERY_INIT | APIC_ICR_LEVEL_ASSERT);
+}
+
+void apic_send_startup(uint32_t apic_id, uint8_t vector)
+{
+    apic_send_ipi(apic_id, APIC_ICR_DELIVERY_STARTUP | APIC_ICR_LEVEL_ASSERT | vector);
+}
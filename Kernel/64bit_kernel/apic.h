@@ -0,0 +1,101 @@
+/*
+ * apic.h - The local APIC, which every CPU has one of. It is used for sending inter-processor interrupts (IPIs).
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#ifndef __APIC_H__
+#define __APIC_H__ 1
+
+#include <stdint.h>
+
+//// Defines.
+// The address the local APIC registers are located at after reset. The MADT tells us if it has been moved.
+#define APIC_DEFAULT_ADDRESS            0xFEE00000
+
+// The highest APIC ID that can be addressed in xAPIC mode. CPU:s with higher IDs (which only exist on machines with more
+// than 255 CPU:s) require x2APIC mode, which we don't support yet.
+#define APIC_MAX_XAPIC_ID               0xFE
+
+// The frequency of the timer interrupt on each CPU, in Hz, unless changed with apic_timer_set_frequency().
+#define APIC_TIMER_TICK_FREQUENCY       100
+
+//// Function prototypes
+/**
+ * Initialize the local APIC of the bootstrap processor: software-enable it, so that it can send and receive IPIs.
+ *
+ * @param address  The physical address of the local APIC registers. This is the same on all the CPU:s; each CPU sees its
+ * own local APIC there.
+ */
+extern void apic_init(uint64_t address);
+
+/**
+ * Initialize the local APIC of an application processor.
+ */
+extern void apic_init_cpu(void);
+
+/**
+ * Signal the end of an interrupt to the local APIC. Must be done by the handlers of all interrupts coming from the APIC,
+ * except for the spurious interrupt.
+ */
+extern void apic_end_of_interrupt(void);
+
+/**
+ * Measure the frequency of the local APIC timer against the PIT. The timer runs off the bus (or core crystal) clock, which
+ * is the same for all the CPU:s, so this only needs to be done once, on the bootstrap processor.
+ */
+extern void apic_timer_calibrate(void);
+
+/**
+ * Start the local APIC timer of the current CPU in periodic mode, generating APIC_TIMER_TICK_FREQUENCY interrupts per
+ * second. apic_timer_calibrate() must have been called first.
+ */
+extern void apic_timer_start(void);
+
+/**
+ * Change the frequency of the timer interrupt. This takes effect on each CPU when apic_timer_start() is called, so it
+ * must be done before the timers are started.
+ *
+ * @param frequency  The number of timer interrupts per second.
+ */
+extern void apic_timer_set_frequency(unsigned int frequency);
+
+/**
+ * Make the performance monitoring counters of the current CPU raise an NMI when they overflow. The local APIC masks the
+ * NMI when it is delivered, so this must be done again for each one.
+ */
+extern void apic_performance_counter_nmi(void);
+
+/**
+ * Get the APIC ID of the current CPU.
+ *
+ * @returns the APIC ID.
+ */
+extern uint32_t apic_get_id(void);
+
+/**
+ * Send an interrupt to another CPU. Returns once the IPI has been accepted by the target CPU, which doesn't mean that it
+ * has been handled yet.
+ *
+ * @param apic_id  The APIC ID of the target CPU.
+ * @param vector  The interrupt vector.
+ */
+extern void apic_send_fixed(uint32_t apic_id, uint8_t vector);
+
+/**
+ * Send an INIT IPI to another CPU, putting it in the wait-for-SIPI state.
+ *
+ * @param apic_id  The APIC ID of the target CPU.
+ */
+extern void apic_send_init(uint32_t apic_id);
+
+/**
+ * Send a STARTUP IPI to another CPU. The CPU starts executing in real mode at the address vector * 4 KiB.
+ *
+ * @param apic_id  The APIC ID of the target CPU.
+ * @param vector  The start page of the code to execute. Must be below 1 MiB, i.e. less than 0x100.
+ */
+extern void apic_send_startup(uint32_t apic_id, uint8_t vector);
+
+#endif // !__APIC_H__
@@ -0,0 +1,95 @@
+/*
+ * backtrace.c - Walking the call stack by following the chain of frame pointers.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "backtrace.h"
+#include "cpu.h"
+#include "io.h"
+#include "symbols.h"
+
+// Set while a CPU is printing a call stack. If the walk itself faults (because the stack is broken beyond what the
+// checks in backtrace_walk() catch), the exception handler will try to print the call stack again; this stops it from
+// going around in circles.
+static volatile bool printing[CPU_MAX_COUNT];
+
+unsigned int backtrace_walk(uint64_t rbp, uint64_t rsp, uint64_t *return_addresses, unsigned int max_depth)
+{
+    unsigned int depth = 0;
+    uint64_t frame = rbp;
+
+    while (depth < max_depth)
+    {
+        // A frame holds the saved RBP of the caller and the return address.
+        if (frame < rsp || frame + 2 * sizeof(uint64_t) > rsp + BACKTRACE_STACK_WINDOW || frame % sizeof(uint64_t) != 0)
+        {
+            break;
+        }
+
+        const uint64_t *saved = (const uint64_t *) frame;
+        if (!symbol_is_code(saved[1]))
+        {
+            break;
+        }
+
+        return_addresses[depth++] = saved[1];
+
+        // The stack grows downwards, so the frames of the callers are always further up.
+        if (saved[0] <= frame)
+        {
+            break;
+        }
+
+        frame = saved[0];
+    }
+
+    return depth;
+}
+
+/**
+ * Print a code address, and the function it belongs to.
+ *
+ * @param address  The address.
+ */
+static void print_address(uint64_t address)
+{
+    uint64_t offset;
+    const char *name = symbol_lookup(address, &offset);
+    if (name != NULL)
+    {
+        io_print_formatted("  %p  %s+0x%X\n", address, name, offset);
+    }
+    else
+    {
+        io_print_formatted("  %p\n", address);
+    }
+}
+
+void backtrace_print(uint64_t rip, uint64_t rbp, uint64_t rsp)
+{
+    unsigned int cpu_id = cpu_current_id();
+    if (printing[cpu_id])
+    {
+        return;
+    }
+
+    printing[cpu_id] = true;
+
+    uint64_t return_addresses[BACKTRACE_PRINT_DEPTH];
+    unsigned int depth = backtrace_walk(rbp, rsp, return_addresses, BACKTRACE_PRINT_DEPTH);
+
+    io_print_line("Call stack:");
+    print_address(rip);
+    for (unsigned int i = 0; i < depth; i++)
+    {
+        print_address(return_addresses[i]);
+    }
+
+    printing[cpu_id] = false;
+}
@@ -0,0 +1,49 @@
+/*
+ * backtrace.h - Walking the call stack by following the chain of frame pointers. The kernel is compiled with frame
+ * pointers (see Makefile.common), so each function saves the RBP of its caller at the start of its stack frame, right
+ * below the return address, and points RBP at it.
+ *
+ * The caller of a function that has not yet set up its frame (i.e. when stopped in the first couple of instructions),
+ * or of one written in assembly without a frame, does not show up in the walk.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#ifndef __BACKTRACE_H__
+#define __BACKTRACE_H__ 1
+
+#include <stdint.h>
+
+//// Defines.
+// The frames are only followed this far above the stack pointer. All the stacks in the kernel are smaller than this, so
+// a frame pointer outside of this window (e.g. when RBP is used as a general-purpose register) ends the walk before it
+// reads something that is not a stack.
+#define BACKTRACE_STACK_WINDOW          (64 * 1024)
+
+// The number of frames printed by backtrace_print().
+#define BACKTRACE_PRINT_DEPTH           16
+
+//// Function prototypes
+/**
+ * Walk the call stack. The walk stops at the first frame that does not look like one: outside of the stack, not above
+ * the previous one, or with a return address outside of the kernel code.
+ *
+ * @param rbp  The frame pointer of the code to walk the call stack of.
+ * @param rsp  The stack pointer of the same code.
+ * @param return_addresses  The return addresses, innermost first [out]
+ * @param max_depth  The maximum number of return addresses to store.
+ * @returns the number of return addresses stored.
+ */
+extern unsigned int backtrace_walk(uint64_t rbp, uint64_t rsp, uint64_t *return_addresses, unsigned int max_depth);
+
+/**
+ * Print the call stack of some code, with the function names looked up in the kernel symbol table.
+ *
+ * @param rip  The instruction pointer of the code.
+ * @param rbp  The frame pointer of the code.
+ * @param rsp  The stack pointer of the code.
+ */
+extern void backtrace_print(uint64_t rip, uint64_t rbp, uint64_t rsp);
+
+#endif // !__BACKTRACE_H__
@@ -0,0 +1,243 @@
+/*
+ * benchmark.c - Microbenchmarks of kernel hot paths. See benchmark.h for how the benchmarks are declared and selected.
+ *
+ * The timed region starts with LFENCE + RDTSC + LFENCE and ends with RDTSCP + LFENCE (or LFENCE + RDTSC + LFENCE on
+ * CPU:s without RDTSCP), so that the CPU can neither start the measured code early nor let it leak past the end of the
+ * measurement. The cost of the timing itself is measured once and subtracted from every sample.
+ *
+ * Interrupts are left enabled, since some of the code being measured (the console, for instance) may wait for an
+ * interrupt. The batches that happen to be hit by one are rejected as outliers instead: anything more than three
+ * interquartile ranges above the third quartile (Tukey's "far out" fence) is thrown away. Nothing is rejected at the low
+ * end; a batch can't run faster than the code allows.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common/cpu.h"
+#include "benchmark.h"
+#include "command_line.h"
+#include "io.h"
+#include "result.h"
+
+// The number of timed batches per benchmark. An odd number gives us a proper median.
+#define SAMPLES                         101
+
+// The number of untimed batches run first, to warm up the caches, the TLB and the branch predictors.
+#define WARMUP_BATCHES                  8
+
+// The number of iterations per batch is doubled until a batch takes at least this many cycles, or until it reaches the
+// maximum.
+#define MIN_BATCH_CYCLES                20000
+#define MAX_BATCH_ITERATIONS            (1 << 20)
+
+// The number of measurements of the timing overhead. The smallest one is used.
+#define OVERHEAD_MEASUREMENTS           64
+
+// How far above the third quartile a sample may be before it is rejected, in interquartile ranges.
+#define OUTLIER_FENCE_FACTOR            3
+
+// The statistics of a benchmark, in hundredths of cycles per operation.
+typedef struct
+{
+    uint64_t min;
+    uint64_t median;
+    uint64_t p99;
+    unsigned int outliers;
+} statistics_t;
+
+// These symbols are provided by the linker, for the section the BENCHMARK() macro puts the benchmarks in.
+extern const benchmark_t __start_benchmarks[];
+extern const benchmark_t __stop_benchmarks[];
+
+static bool has_rdtscp;
+
+// The cycles taken by the timing itself, with nothing in between.
+static uint64_t timing_overhead;
+
+// The samples of the benchmark being run. Too large to keep on the stack.
+static uint64_t samples[SAMPLES];
+
+/**
+ * Read the TSC at the end of a timed region.
+ *
+ * @returns the TSC value.
+ */
+static inline uint64_t benchmark_stop(void)
+{
+    return has_rdtscp ? cpu_read_tscp() : cpu_read_tsc_serialized();
+}
+
+/**
+ * Measure the cost of the timing, i.e. of an empty timed region.
+ */
+static void measure_timing_overhead(void)
+{
+    cpuid_registers_t registers;
+    if (cpu_has_cpuid_leaf(CPUID_LEAF_EXTENDED_INFO))
+    {
+        cpu_cpuid(CPUID_LEAF_EXTENDED_INFO, 0, &registers);
+        has_rdtscp = (registers.edx & CPUID_EXTENDED_INFO_EDX_RDTSCP) != 0;
+    }
+
+    timing_overhead = UINT64_MAX;
+    for (int i = 0; i < OVERHEAD_MEASUREMENTS; i++)
+    {
+        uint64_t start = cpu_read_tsc_serialized();
+        uint64_t cycles = benchmark_stop() - start;
+        if (cycles < timing_overhead)
+        {
+            timing_overhead = cycles;
+        }
+    }
+}
+
+/**
+ * Run a batch of iterations of a benchmark, and time it.
+ *
+ * @param benchmark  The benchmark.
+ * @param iterations  The number of iterations.
+ * @returns the number of cycles it took, not counting the timing overhead.
+ */
+static uint64_t run_batch(const benchmark_t *benchmark, uint64_t iterations)
+{
+    uint64_t start = cpu_read_tsc_serialized();
+    benchmark->function(iterations);
+    uint64_t cycles = benchmark_stop() - start;
+
+    return cycles > timing_overhead ? cycles - timing_overhead : 0;
+}
+
+/**
+ * Sort the samples in ascending order. There are few enough of them for an insertion sort to be the simplest choice.
+ *
+ * @param count  The number of samples.
+ */
+static void sort_samples(unsigned int count)
+{
+    for (unsigned int i = 1; i < count; i++)
+    {
+        uint64_t sample = samples[i];
+        unsigned int j = i;
+        while (j > 0 && samples[j - 1] > sample)
+        {
+            samples[j] = samples[j - 1];
+            j--;
+        }
+
+        samples[j] = sample;
+    }
+}
+
+/**
+ * Run a benchmark, and compute its statistics.
+ *
+ * @param benchmark  The benchmark.
+ * @param statistics  The statistics [out]
+ */
+static void measure(const benchmark_t *benchmark, statistics_t *statistics)
+{
+    uint64_t iterations = 1;
+    while (iterations < MAX_BATCH_ITERATIONS && run_batch(benchmark, iterations) < MIN_BATCH_CYCLES)
+    {
+        iterations *= 2;
+    }
+
+    for (int i = 0; i < WARMUP_BATCHES; i++)
+    {
+        benchmark->function(iterations);
+    }
+
+    for (int i = 0; i < SAMPLES; i++)
+    {
+        samples[i] = run_batch(benchmark, iterations) * 100 / iterations;
+    }
+
+    sort_samples(SAMPLES);
+
+    uint64_t first_quartile = samples[SAMPLES / 4];
+    uint64_t third_quartile = samples[(3 * SAMPLES) / 4];
+    uint64_t fence = third_quartile + OUTLIER_FENCE_FACTOR * (third_quartile - first_quartile);
+
+    unsigned int kept = SAMPLES;
+    while (samples[kept - 1] > fence)
+    {
+        kept--;
+    }
+
+    statistics->min = samples[0];
+    statistics->median = samples[kept / 2];
+    statistics->p99 = samples[(99 * kept + 99) / 100 - 1];
+    statistics->outliers = SAMPLES - kept;
+}
+
+/**
+ * Print a number of hundredths with two decimals.
+ *
+ * @param hundredths  The number.
+ */
+static void print_hundredths(uint64_t hundredths)
+{
+    io_print_formatted("%U.%02U", hundredths / 100, hundredths % 100);
+}
+
+void benchmark_run_selected(void)
+{
+    const char *list = command_line_option_value("benchmark");
+    if (list == NULL)
+    {
+        return;
+    }
+
+    if (command_line_list_selects(list, "list"))
+    {
+        io_print_line("Benchmarks:");
+        for (const benchmark_t *benchmark = __start_benchmarks; benchmark < __stop_benchmarks; benchmark++)
+        {
+            io_print_formatted("  %s\n", benchmark->name);
+        }
+
+        return;
+    }
+
+    measure_timing_overhead();
+    io_print_formatted("Microbenchmarks, cycles per operation (timing overhead %U cycles, %s):\n", timing_overhead,
+                       has_rdtscp ? "RDTSCP" : "LFENCE + RDTSC");
+
+    for (const benchmark_t *benchmark = __start_benchmarks; benchmark < __stop_benchmarks; benchmark++)
+    {
+        if (!command_line_list_selects(list, benchmark->name) && !command_line_list_selects(list, "all"))
+        {
+            continue;
+        }
+
+        if (benchmark->setup != NULL && !benchmark->setup())
+        {
+            continue;
+        }
+
+        statistics_t statistics;
+        measure(benchmark, &statistics);
+
+        if (benchmark->teardown != NULL)
+        {
+            benchmark->teardown();
+        }
+
+        io_print_formatted("  %-32s min ", benchmark->name);
+        print_hundredths(statistics.min);
+        io_print(", median ");
+        print_hundredths(statistics.median);
+        io_print(", p99 ");
+        print_hundredths(statistics.p99);
+        io_print_formatted(" (%u of %u samples rejected)\n", statistics.outliers, SAMPLES);
+
+        result_report(statistics.min, 100, "cycles", "%s.min", benchmark->name);
+        result_report(statistics.median, 100, "cycles", "%s.median", benchmark->name);
+        result_report(statistics.p99, 100, "cycles", "%s.p99", benchmark->name);
+    }
+}
@@ -0,0 +1,66 @@
+/*
+ * benchmark.h - Microbenchmarks of kernel hot paths. A benchmark is declared anywhere in the kernel with the BENCHMARK()
+ * macro, and run by passing benchmark=<name> on the kernel command line.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#ifndef __BENCHMARK_H__
+#define __BENCHMARK_H__ 1
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//// Type definitions and structures
+typedef struct
+{
+    // The name of the benchmark: the name of the subsystem and of the operation separated by a dot, e.g.
+    // memory.copy_4kib.
+    const char *name;
+
+    // Perform the operation being measured a given number of times. The cycles per operation are what gets reported, so
+    // anything done once per call (rather than once per iteration) should be kept to a minimum.
+    void (*function)(uint64_t iterations);
+
+    // Called before and after the measurements, outside of the timed region. Either may be NULL. If the setup function
+    // returns false, the benchmark is skipped; it should print the reason why.
+    bool (*setup)(void);
+    void (*teardown)(void);
+} benchmark_t;
+
+//// Macros
+/**
+ * Declare a benchmark. The benchmarks are collected in a section of their own by the linker, so there is no list of
+ * them to keep up to date.
+ *
+ * @param name  The name of the benchmark, as a string.
+ * @param function  The function performing the operation being measured.
+ * @param setup  The setup function, or NULL.
+ * @param teardown  The teardown function, or NULL.
+ */
+#define BENCHMARK(name, function, setup, teardown)                                                                     \
+    static const benchmark_t benchmark_##function                                                                      \
+        __attribute__((used, section("benchmarks"), aligned(sizeof(void *)))) = { name, function, setup, teardown }
+
+/**
+ * Make the compiler believe that a value is used, so that the computation of it can't be optimized away.
+ *
+ * @param value  The value.
+ */
+#define BENCHMARK_USE(value) asm volatile("" : : "r"(value) : "memory")
+
+//// Function prototypes
+/**
+ * Run the benchmarks selected on the kernel command line, e.g. benchmark=memory.copy_4kib,format. Each name in the
+ * comma-separated list selects the benchmark with that name, as well as all the benchmarks whose names start with it
+ * followed by a dot; all selects every benchmark there is, and list just prints their names.
+ *
+ * For each benchmark, the number of iterations per batch is chosen so that a batch takes long enough for the timing
+ * overhead to be negligible. After a few untimed warmup batches, a number of batches are timed, and the batches far
+ * slower than the rest (typically the ones hit by an interrupt) are rejected as outliers. The minimum, median and 99th
+ * percentile cycles per operation are printed, and reported with result_report().
+ */
+extern void benchmark_run_selected(void);
+
+#endif // !__BENCHMARK_H__
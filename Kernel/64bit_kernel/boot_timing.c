@@ -0,0 +1,74 @@
+/*
+ * boot_timing.c - Timing of the phases of the boot.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#include <stdint.h>
+
+#include "common/boot_info.h"
+#include "common/cpu.h"
+#include "boot_timing.h"
+#include "clock.h"
+#include "io.h"
+#include "result.h"
+
+static const char *phase_names[boot_phase_count] =
+{
+    [boot_phase_firmware] = "firmware",
+    [boot_phase_loader_kernel_copy] = "loader.kernel_copy",
+    [boot_phase_loader_memory_map] = "loader.memory_map",
+    [boot_phase_loader_boot_info] = "loader.boot_info",
+    [boot_phase_loader_paging] = "loader.paging",
+    [boot_phase_loader_long_mode] = "loader.long_mode",
+    [boot_phase_kernel_early] = "kernel.early",
+    [boot_phase_kernel_memory] = "kernel.memory",
+    [boot_phase_kernel_interrupts] = "kernel.interrupts",
+    [boot_phase_kernel_cpus] = "kernel.cpus",
+    [boot_phase_kernel_devices] = "kernel.devices",
+    [boot_phase_kernel_vm] = "kernel.vm"
+};
+
+// The time-stamp counter at the end of each phase, or 0 if it has not been recorded.
+static uint64_t phase_end_tsc[boot_phase_count];
+
+void boot_timing_init(const boot_info_t *boot_info, uint64_t kernel_entry_tsc)
+{
+    for (int phase = 0; phase < boot_phase_loader_long_mode; phase++)
+    {
+        phase_end_tsc[phase] = boot_info->phase_end_tsc[phase];
+    }
+
+    phase_end_tsc[boot_phase_loader_long_mode] = kernel_entry_tsc;
+}
+
+void boot_timing_end_phase(boot_phase_e phase)
+{
+    phase_end_tsc[phase] = cpu_read_tsc();
+}
+
+void boot_timing_report(void)
+{
+    io_print_line("Boot phases:");
+
+    // A phase that was not recorded is counted as part of the next one.
+    uint64_t start_tsc = 0;
+    for (int phase = 0; phase < boot_phase_count; phase++)
+    {
+        if (phase_end_tsc[phase] == 0)
+        {
+            continue;
+        }
+
+        uint64_t nanoseconds = clock_cycles_to_nanoseconds(phase_end_tsc[phase] - start_tsc);
+        io_print_formatted("  %-20s %8U us\n", phase_names[phase], nanoseconds / 1000);
+        result_report(nanoseconds, 1000, "us", "boot.phase.%s", phase_names[phase]);
+
+        start_tsc = phase_end_tsc[phase];
+    }
+
+    uint64_t nanoseconds = clock_cycles_to_nanoseconds(start_tsc);
+    io_print_formatted("  %-20s %8U us\n", "total", nanoseconds / 1000);
+    result_report(nanoseconds, 1000, "us", "boot.time");
+}
@@ -0,0 +1,42 @@
+/*
+ * boot_timing.h - Timing of the phases of the boot, from the firmware to the kernel being up and running. The phases
+ * are listed in common/boot_info.h; the 32-bit loader records the time-stamp counter at the end of each of its phases,
+ * and the kernel does the same for the rest. The TSC keeps counting across the switch to long mode, so all of them can
+ * be compared directly.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#ifndef __BOOT_TIMING_H__
+#define __BOOT_TIMING_H__ 1
+
+#include <stdint.h>
+
+#include "common/boot_info.h"
+
+//// Function prototypes
+/**
+ * Take over the timestamps recorded by the 32-bit loader.
+ *
+ * @param boot_info  The boot information from the loader.
+ * @param kernel_entry_tsc  The time-stamp counter when the kernel was entered, which is the end of the switch to long
+ * mode. It is read before the BSS is cleared, which is why it is passed in rather than recorded here.
+ */
+extern void boot_timing_init(const boot_info_t *boot_info, uint64_t kernel_entry_tsc);
+
+/**
+ * Record the end of a phase of the boot.
+ *
+ * @param phase  The phase.
+ */
+extern void boot_timing_end_phase(boot_phase_e phase);
+
+/**
+ * Print how long each phase of the boot took, and report the times with result_report(): as boot.phase.<phase> (e.g.
+ * boot.phase.loader.paging), and the total time since the CPU was reset as boot.time. Must be called after
+ * clock_init().
+ */
+extern void boot_timing_report(void);
+
+#endif // !__BOOT_TIMING_H__
@@ -0,0 +1,143 @@
+/*
+ * clock.c - Time keeping, based on the time-stamp counter. The TSC is read in a couple of cycles without leaving the CPU,
+ * which makes it by far the cheapest time source there is. Its frequency is not reported by the CPU (except by some of
+ * the newer ones, in CPUID leaf 0x15 -- and not reliably even there), so we measure it against the PIT, whose frequency
+ * is fixed.
+ *
+ * All the conversions between cycles and nanoseconds are done as a multiplication and a shift, with the factors computed
+ * once at calibration. This avoids a 64-bit division (which is slow) or a 128-bit one (which needs libgcc) on every call.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "common/cpu.h"
+#include "clock.h"
+#include "cpu.h"
+#include "io.h"
+#include "pit.h"
+
+// Each calibration round measures the TSC over this long. The PIT delay has a fixed setup overhead of a few microseconds
+// (the port accesses), which is well below 0.1% at this length.
+#define CALIBRATION_MICROSECONDS        10000
+
+// The number of calibration rounds. We use the shortest of the measurements, since anything disturbing the measurement
+// (an SMI, or the host preempting us when running under emulation) can only make a round longer.
+#define CALIBRATION_ROUNDS              3
+
+// The shifts used in the fixed-point conversion factors. Large enough to give us a precision well below one part per
+// million, but small enough that the factors themselves fit in 64 bits for any TSC frequency up to 64 GHz.
+#define NANOSECONDS_SHIFT               32
+#define CYCLES_SHIFT                    24
+
+#define NANOSECONDS_PER_SECOND          1000000000ULL
+
+static uint64_t tsc_frequency;
+
+// The value of the TSC when the clock was initialized.
+static uint64_t tsc_start;
+
+// nanoseconds = (cycles * nanoseconds_factor) >> NANOSECONDS_SHIFT
+static uint64_t nanoseconds_factor;
+
+// cycles = (nanoseconds * cycles_factor) >> CYCLES_SHIFT
+static uint64_t cycles_factor;
+
+/**
+ * Measure the number of TSC cycles during one calibration round.
+ *
+ * @returns the number of cycles.
+ */
+static uint64_t clock_measure(void)
+{
+    uint64_t start = cpu_read_tsc();
+    pit_delay(CALIBRATION_MICROSECONDS);
+    return cpu_read_tsc() - start;
+}
+
+void clock_init(void)
+{
+    uint64_t cycles = clock_measure();
+    for (int i = 1; i < CALIBRATION_ROUNDS; i++)
+    {
+        uint64_t round_cycles = clock_measure();
+        if (round_cycles < cycles)
+        {
+            cycles = round_cycles;
+        }
+    }
+
+    uint64_t frequency = cycles * (1000000 / CALIBRATION_MICROSECONDS);
+    nanoseconds_factor = (NANOSECONDS_PER_SECOND << NANOSECONDS_SHIFT) / frequency;
+    cycles_factor = (frequency << CYCLES_SHIFT) / NANOSECONDS_PER_SECOND;
+    tsc_start = cpu_read_tsc();
+
+    // The frequency is published last, since it is what tells the other functions that the factors are valid.
+    __atomic_store_n(&tsc_frequency, frequency, __ATOMIC_RELEASE);
+
+    bool invariant = false;
+    if (cpu_has_cpuid_leaf(CPUID_LEAF_POWER_MANAGEMENT))
+    {
+        cpuid_registers_t registers;
+        cpu_cpuid(CPUID_LEAF_POWER_MANAGEMENT, 0, &registers);
+        invariant = (registers.edx & CPUID_POWER_MANAGEMENT_EDX_INVARIANT_TSC) != 0;
+    }
+
+    io_print_formatted("Clock: TSC running at %U kHz", frequency / 1000);
+    io_print_line(invariant ? "." : " (not invariant; time may drift with power management).");
+}
+
+uint64_t clock_tsc_frequency(void)
+{
+    return __atomic_load_n(&tsc_frequency, __ATOMIC_ACQUIRE);
+}
+
+uint64_t clock_nanoseconds(void)
+{
+    return clock_tsc_to_nanoseconds(cpu_read_tsc());
+}
+
+uint64_t clock_tsc_to_nanoseconds(uint64_t tsc)
+{
+    if (clock_tsc_frequency() == 0 || tsc < tsc_start)
+    {
+        return 0;
+    }
+
+    return clock_cycles_to_nanoseconds(tsc - tsc_start);
+}
+
+uint64_t clock_cycles_to_nanoseconds(uint64_t cycles)
+{
+    if (clock_tsc_frequency() == 0)
+    {
+        return 0;
+    }
+
+    return ((unsigned __int128) cycles * nanoseconds_factor) >> NANOSECONDS_SHIFT;
+}
+
+void udelay(uint64_t microseconds)
+{
+    ndelay(microseconds * 1000);
+}
+
+void ndelay(uint64_t nanoseconds)
+{
+    if (clock_tsc_frequency() == 0)
+    {
+        pit_delay((nanoseconds + 999) / 1000);
+        return;
+    }
+
+    uint64_t start = cpu_read_tsc();
+    uint64_t cycles = ((unsigned __int128) nanoseconds * cycles_factor) >> CYCLES_SHIFT;
+
+    while (cpu_read_tsc() - start < cycles)
+    {
+        cpu_relax();
+    }
+}
@@ -0,0 +1,68 @@
+/*
+ * clock.h - Time keeping, based on the time-stamp counter.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#ifndef __CLOCK_H__
+#define __CLOCK_H__ 1
+
+#include <stdint.h>
+
+//// Function prototypes
+/**
+ * Measure the frequency of the time-stamp counter against the PIT. The time returned by clock_nanoseconds() starts
+ * counting from here.
+ */
+extern void clock_init(void);
+
+/**
+ * Get the frequency of the time-stamp counter.
+ *
+ * @returns the number of TSC cycles per second, or 0 if clock_init() has not been called yet.
+ */
+extern uint64_t clock_tsc_frequency(void);
+
+/**
+ * Get the monotonic time. The time-stamp counters of all the CPU:s are started at the same time at reset, so the value is
+ * consistent between CPU:s (on machines with an invariant TSC, which is all of them from the last decade or so).
+ *
+ * @returns the number of nanoseconds since clock_init() was called, or 0 if it has not been called yet.
+ */
+extern uint64_t clock_nanoseconds(void);
+
+/**
+ * Convert a value read from the time-stamp counter to monotonic time, i.e. the same time scale as clock_nanoseconds().
+ *
+ * @param tsc  The value of the time-stamp counter.
+ * @returns the number of nanoseconds since clock_init() was called, or 0 if the value is from before that.
+ */
+extern uint64_t clock_tsc_to_nanoseconds(uint64_t tsc);
+
+/**
+ * Convert a number of TSC cycles to nanoseconds. Unlike clock_tsc_to_nanoseconds(), this works for any length of time,
+ * like the difference between two values of the TSC.
+ *
+ * @param cycles  The number of cycles.
+ * @returns the number of nanoseconds, or 0 if clock_init() has not been called yet.
+ */
+extern uint64_t clock_cycles_to_nanoseconds(uint64_t cycles);
+
+/**
+ * Busy-wait for a given number of microseconds. Before clock_init() has been called, this falls back to using the PIT.
+ *
+ * @param microseconds  The number of microseconds to wait.
+ */
+extern void udelay(uint64_t microseconds);
+
+/**
+ * Busy-wait for a given number of nanoseconds. Before clock_init() has been called, this falls back to using the PIT
+ * (rounding up to whole microseconds). Note that the overhead of the call itself is in the tens of nanoseconds, so very
+ * short delays will be longer than asked for.
+ *
+ * @param nanoseconds  The number of nanoseconds to wait.
+ */
+extern void ndelay(uint64_t nanoseconds);
+
+#endif // !__CLOCK_H__
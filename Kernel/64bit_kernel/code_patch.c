@@ -0,0 +1,121 @@
+/*
+ * code_patch.c - Modifying the kernel code while it is running. A CPU may have fetched and decoded an instruction long
+ * before executing it, so just writing the new instruction over the old one could make another CPU execute a mix of
+ * the two. Instead, the first byte is replaced with an INT3 first; once all the CPU:s have been made to execute a
+ * serializing instruction, none of them can have the old instruction in flight, and anyone running into it ends up in
+ * the breakpoint handler. The rest of the instruction can then be replaced, followed by the first byte. This is the
+ * same approach as the one taken by Linux.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "apic.h"
+#include "code_patch.h"
+#include "cpu.h"
+#include "interrupt.h"
+#include "spinlock.h"
+
+#define INT3                            0xCC
+
+// The instruction being replaced, if any.
+static uint8_t *volatile patch_address;
+static volatile unsigned int patch_length;
+
+// The number of CPU:s that have handled the last synchronization IPI.
+static volatile unsigned int sync_count;
+
+static bool handlers_registered;
+
+// Held while patching, since there can only be one instruction being replaced at a time.
+static spinlock_t lock;
+
+/**
+ * The handler of the breakpoint exception. A CPU running into the instruction being replaced continues after it.
+ *
+ * @param frame  The state of the interrupted code.
+ */
+static void breakpoint_handler(interrupt_frame_t *frame)
+{
+    // The breakpoint exception is a trap: the saved RIP points after the INT3.
+    uint8_t *address = patch_address;
+    if (address != NULL && frame->rip - 1 == (uint64_t) address)
+    {
+        frame->rip = (uint64_t) address + patch_length;
+        return;
+    }
+
+    interrupt_panic(frame);
+}
+
+/**
+ * The handler of the synchronization IPI. There is nothing to do; returning from the interrupt is what serializes the
+ * CPU.
+ *
+ * @param frame  The state of the interrupted code.
+ */
+static void sync_handler(interrupt_frame_t *frame)
+{
+    __atomic_add_fetch(&sync_count, 1, __ATOMIC_RELEASE);
+    apic_end_of_interrupt();
+}
+
+/**
+ * Make all the other online CPU:s execute a serializing instruction, and wait for them to do so.
+ */
+static void sync_cpus(void)
+{
+    unsigned int current_id = cpu_current_id();
+    unsigned int cpu_count = cpu_online_count();
+
+    __atomic_store_n(&sync_count, 0, __ATOMIC_RELAXED);
+    for (unsigned int id = 0; id < cpu_count; id++)
+    {
+        if (id != current_id)
+        {
+            apic_send_fixed(cpu_data[id].apic_id, INTERRUPT_VECTOR_SYNC);
+        }
+    }
+
+    while (__atomic_load_n(&sync_count, __ATOMIC_ACQUIRE) < cpu_count - 1)
+    {
+        cpu_relax();
+    }
+}
+
+void code_patch(uint8_t *address, const uint8_t *instruction, unsigned int length)
+{
+    volatile uint8_t *code = address;
+
+    spinlock_lock(&lock);
+
+    if (!handlers_registered)
+    {
+        interrupt_register_handler(INTERRUPT_VECTOR_BREAKPOINT, breakpoint_handler);
+        interrupt_register_handler(INTERRUPT_VECTOR_SYNC, sync_handler);
+        handlers_registered = true;
+    }
+
+    patch_length = length;
+    patch_address = address;
+
+    code[0] = INT3;
+    sync_cpus();
+
+    for (unsigned int i = 1; i < length; i++)
+    {
+        code[i] = instruction[i];
+    }
+
+    sync_cpus();
+
+    code[0] = instruction[0];
+    sync_cpus();
+
+    patch_address = NULL;
+    spinlock_unlock(&lock);
+}
@@ -0,0 +1,31 @@
+/*
+ * code_patch.h - Modifying the kernel code while it is running, e.g. to turn tracepoints on and off.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#ifndef __CODE_PATCH_H__
+#define __CODE_PATCH_H__ 1
+
+#include <stdint.h>
+
+//// Defines.
+// The longest instruction that can be replaced.
+#define CODE_PATCH_MAX_LENGTH           15
+
+//// Function prototypes
+/**
+ * Replace an instruction in the kernel code with another one of the same length. The other CPU:s may be running the
+ * code at the same time. They never see a mix of the two instructions: while the instruction is being replaced, a CPU
+ * running into it skips it altogether. This means that only instructions which can be skipped can be replaced, like the
+ * NOP:s and the jumps over optional code used by tracepoints. The other CPU:s are synchronized with IPI:s, so this must
+ * be called with interrupts enabled once the application processors have been started.
+ *
+ * @param address  The address of the instruction.
+ * @param instruction  The new instruction.
+ * @param length  The length of the instruction, in bytes. At most CODE_PATCH_MAX_LENGTH.
+ */
+extern void code_patch(uint8_t *address, const uint8_t *instruction, unsigned int length);
+
+#endif // !__CODE_PATCH_H__
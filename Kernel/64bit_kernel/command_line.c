@@ -0,0 +1,145 @@
+/*
+ * command_line.c - Access to the kernel command line.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "command_line.h"
+
+// The kernel command line. It is located in the boot information, which is owned by main().
+static const char *command_line = "";
+
+void command_line_init(const char *kernel_command_line)
+{
+    command_line = kernel_command_line;
+}
+
+/**
+ * Find a given option on the kernel command line.
+ *
+ * @param option  The name of the option to look for.
+ * @returns a pointer to the first character after the option name (which is either a space, an equals sign or a NUL
+ * character), or NULL if the option could not be found.
+ */
+static const char *find_option(const char *option)
+{
+    // The first word on the command line is the name of the loader itself (as given to the Multiboot boot loader), but
+    // there is no need to treat it specially; it is highly unlikely to ever match an option name.
+    int i = 0;
+    while (command_line[i] != '\0')
+    {
+        // Skip any leading spaces.
+        while (command_line[i] == ' ')
+        {
+            i++;
+        }
+
+        // Try to match the option name at this position.
+        int j = 0;
+        while (option[j] != '\0' && command_line[i + j] == option[j])
+        {
+            j++;
+        }
+
+        if (option[j] == '\0' &&
+            (command_line[i + j] == '\0' || command_line[i + j] == ' ' || command_line[i + j] == '='))
+        {
+            return &command_line[i + j];
+        }
+
+        // No match. Skip to the next word.
+        while (command_line[i] != '\0' && command_line[i] != ' ')
+        {
+            i++;
+        }
+    }
+
+    return NULL;
+}
+
+bool command_line_has_option(const char *option)
+{
+    return find_option(option) != NULL;
+}
+
+bool command_line_option_has_value(const char *option, const char *value)
+{
+    const char *option_end = find_option(option);
+    if (option_end == NULL || *option_end != '=')
+    {
+        return false;
+    }
+
+    const char *option_value = option_end + 1;
+    int i = 0;
+    while (value[i] != '\0' && option_value[i] == value[i])
+    {
+        i++;
+    }
+
+    return value[i] == '\0' && (option_value[i] == '\0' || option_value[i] == ' ');
+}
+
+const char *command_line_option_value(const char *option)
+{
+    const char *option_end = find_option(option);
+    if (option_end == NULL || *option_end != '=')
+    {
+        return NULL;
+    }
+
+    return option_end + 1;
+}
+
+uint64_t command_line_option_number(const char *option, uint64_t default_value)
+{
+    const char *value = command_line_option_value(option);
+    if (value == NULL || value[0] < '0' || value[0] > '9')
+    {
+        return default_value;
+    }
+
+    uint64_t number = 0;
+    for (int i = 0; value[i] >= '0' && value[i] <= '9'; i++)
+    {
+        number = number * 10 + (value[i] - '0');
+    }
+
+    return number;
+}
+
+bool command_line_list_selects(const char *list, const char *name)
+{
+    const char *item = list;
+    while (*item != '\0' && *item != ' ')
+    {
+        int i = 0;
+        while (item[i] != '\0' && item[i] != ' ' && item[i] != ',' && item[i] == name[i])
+        {
+            i++;
+        }
+
+        bool item_ended = item[i] == '\0' || item[i] == ' ' || item[i] == ',';
+        if (item_ended && (name[i] == '\0' || name[i] == '.'))
+        {
+            return true;
+        }
+
+        // Skip to the next item.
+        while (*item != '\0' && *item != ' ' && *item != ',')
+        {
+            item++;
+        }
+
+        if (*item == ',')
+        {
+            item++;
+        }
+    }
+
+    return false;
+}
@@ -0,0 +1,68 @@
+/*
+ * command_line.h - Access to the kernel command line.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#ifndef __COMMAND_LINE_H__
+#define __COMMAND_LINE_H__ 1
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Initialize the command line support.
+ *
+ * @param command_line  The kernel command line. The string must stay around for as long as the kernel is running.
+ */
+extern void command_line_init(const char *command_line);
+
+/**
+ * Check if a given option has been specified on the kernel command line. Options are separated by spaces, and can
+ * optionally have a value (option=value). The value is not taken into consideration when matching.
+ *
+ * @param option  The name of the option, e.g. "qemu_exit".
+ * @returns true if the option is present, false otherwise.
+ */
+extern bool command_line_has_option(const char *option);
+
+/**
+ * Check if a given option has been specified on the kernel command line with a given value, e.g. console=serial.
+ *
+ * @param option  The name of the option, e.g. "console".
+ * @param value  The value to look for, e.g. "serial".
+ * @returns true if the option is present with the given value, false otherwise.
+ */
+extern bool command_line_option_has_value(const char *option, const char *value);
+
+/**
+ * Get the value of an option on the kernel command line.
+ *
+ * @param option  The name of the option, e.g. "benchmark".
+ * @returns a pointer to the value, or NULL if the option is not present or has no value. The value is not NUL-terminated;
+ * it ends at the first space or NUL character.
+ */
+extern const char *command_line_option_value(const char *option);
+
+/**
+ * Get the value of an option on the kernel command line as a (decimal) number, e.g. profile=1000.
+ *
+ * @param option  The name of the option, e.g. "profile".
+ * @param default_value  The value to return if the option is not present, has no value or the value is not a number.
+ * @returns the value of the option.
+ */
+extern uint64_t command_line_option_number(const char *option, uint64_t default_value);
+
+/**
+ * Check if a name is selected by a comma-separated list of names, like the value of benchmark=memory.copy_4kib,format.
+ * Each item in the list selects the name it is equal to, as well as all the names starting with it followed by a dot:
+ * format selects format.decimal, but not formatting.
+ *
+ * @param list  The list, which ends at the first space or NUL character.
+ * @param name  The name.
+ * @returns true if the name is selected, false otherwise.
+ */
+extern bool command_line_list_selects(const char *list, const char *name);
+
+#endif // !__COMMAND_LINE_H__
@@ -0,0 +1,54 @@
+/*
+ * console_benchmark.c - Benchmarks of the console output, run with benchmark=console (see benchmark.h).
+ *
+ * Every line printed scrolls the screen, which is the worst case: all the rows are dirty on every flush.
+ * console.print_line goes through io_print_line(), and so includes the serial port (where enabled); the others measure
+ * the VGA console only.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common/console.h"
+#include "benchmark.h"
+#include "io.h"
+
+// A line of typical length. (Not a full row, since that would give us an extra empty row after each line.)
+static const char line[] = "Console benchmark: the quick brown fox jumps over the lazy dog.";
+
+static void put_character(uint64_t iterations)
+{
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        console_put_character(line[i % (sizeof(line) - 1)], CONSOLE_DEFAULT_ATTRIBUTE);
+    }
+}
+
+static void print_line_flushed(uint64_t iterations)
+{
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        for (int c = 0; line[c] != '\0'; c++)
+        {
+            console_put_character(line[c], CONSOLE_DEFAULT_ATTRIBUTE);
+        }
+
+        console_put_character('\n', CONSOLE_DEFAULT_ATTRIBUTE);
+        console_flush();
+    }
+}
+
+static void print_line(uint64_t iterations)
+{
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        io_print_line(line);
+    }
+}
+
+BENCHMARK("console.put_character", put_character, NULL, console_flush);
+BENCHMARK("console.print_line_flushed", print_line_flushed, NULL, NULL);
+BENCHMARK("console.print_line", print_line, NULL, NULL);
@@ -10,8 +10,49 @@
 #ifndef __CPU_H__
 #define __CPU_H__ 1
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
+#include "common/cpu.h"
+
+// The maximum number of CPU:s supported. The per-CPU data structures are statically allocated for this many CPU:s.
+#define CPU_MAX_COUNT                   64
+
+// The size of a cache line. Data that is written by different CPU:s must be placed in different cache lines, or they will
+// keep stealing the line from each other ("false sharing").
+#define CPU_CACHE_LINE_SIZE             64
+
+// The MSR holding the base address of the GS segment. In 64-bit mode, this is the only way to set a base address of more
+// than 32 bits.
+#define MSR_GS_BASE                     0xC0000101
+
+// The per-CPU data area. Each CPU has its GS base pointing at its own area, so that CPU-local state can be accessed with a
+// single GS-relative instruction: no locking is needed (no other CPU touches it), and we don't even need to know which
+// CPU we are running on.
+typedef struct cpu_data
+{
+    // Points at the structure itself, so that a plain pointer to the area can be fetched with a single instruction.
+    struct cpu_data *self;
+
+    // The ID of the CPU (see cpu_current_id()) and the ID of its local APIC, which is what other CPU:s use for sending
+    // IPIs to it.
+    uint32_t id;
+    uint32_t apic_id;
+
+    // Set when the CPU has finished its initialization.
+    volatile bool online;
+
+    // The thread running on the CPU. See scheduler.c.
+    struct thread *current_thread;
+
+    // The number of local APIC timer interrupts the CPU has received.
+    volatile uint64_t timer_ticks;
+} __attribute__((aligned(CPU_CACHE_LINE_SIZE))) cpu_data_t;
+
+// The per-CPU data areas, indexed by CPU ID.
+extern cpu_data_t cpu_data[CPU_MAX_COUNT];
+
 /*
  * Get the value of the RSP register.
  *
@@ -38,4 +79,79 @@ static inline uint64_t cpu_get_rbp(void)
     return rsp;
 }
 
+/*
+ * Get the value of the CR2 register, which holds the address that caused the last page fault.
+ *
+ * @returns the value of the CR2 register.
+ */
+static inline uint64_t cpu_get_cr2(void)
+{
+    uint64_t cr2;
+    asm volatile("movq %%cr2, %0"
+                 : "=r"(cr2));
+    return cr2;
+}
+
+/**
+ * Get the ID of the CPU we are running on. The IDs are numbered from zero and up, with the bootstrap processor being 0.
+ *
+ * @returns the ID of the current CPU.
+ */
+static inline unsigned int cpu_current_id(void)
+{
+#ifdef HOSTED
+    // There is no per-CPU data area in the hosted build; it only ever runs the code on a single thread.
+    return 0;
+#else
+    uint32_t id;
+    asm volatile("movl %%gs:%c1, %0"
+                 : "=r"(id)
+                 : "i"(offsetof(cpu_data_t, id)));
+    return id;
+#endif
+}
+
+/**
+ * Get the per-CPU data area of the CPU we are running on.
+ *
+ * @returns the per-CPU data area.
+ */
+static inline cpu_data_t *cpu_current(void)
+{
+    cpu_data_t *data;
+    asm volatile("movq %%gs:%c1, %0"
+                 : "=r"(data)
+                 : "i"(offsetof(cpu_data_t, self)));
+    return data;
+}
+
+/**
+ * Make the GS base point at the per-CPU data area of a given CPU. Must be called on that CPU, before anything else uses
+ * cpu_current_id() or cpu_current().
+ *
+ * @param id  The ID of the CPU we are running on.
+ */
+static inline void cpu_data_init(unsigned int id)
+{
+    cpu_data[id].self = &cpu_data[id];
+    cpu_data[id].id = id;
+    cpu_write_msr(MSR_GS_BASE, (uint64_t) &cpu_data[id]);
+}
+
+/**
+ * Get the number of CPU:s that are up and running. The online CPU:s always have the IDs 0 up to this number minus one.
+ *
+ * @returns the number of online CPU:s.
+ */
+extern unsigned int cpu_online_count(void);
+
+/**
+ * Tell the CPU that we are in a spin-wait loop. This saves power, and avoids a memory order violation (and the pipeline
+ * flush that comes with it) when the loop exits.
+ */
+static inline void cpu_relax(void)
+{
+    asm volatile("pause" : : : "memory");
+}
+
 #endif /* !__CPU_H__ */
@@ -0,0 +1,143 @@
+/*
+ * format_benchmark.c - Benchmarks of the number formatting, compared to the digit-at-a-time conversion with a run-time
+ * base that io_print_formatted() used before. Run with benchmark=format (see benchmark.h).
+ *
+ * The numbers are formatted into a buffer, so that the (much slower) console output doesn't drown out the difference.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common/format.h"
+#include "benchmark.h"
+
+// The size of the output buffer: large enough for any 64-bit value in any of the bases used here.
+#define BUFFER_SIZE                     FORMAT_NUMBER_BUFFER_SIZE
+
+//// The conversion we compare against: one run-time division and one run-time modulo per digit, with the string built
+//// backwards and reversed afterwards.
+static void reference_number_to_string(uint64_t value, int base, char *output)
+{
+    char temporary_output[65];
+    int c = 0;
+
+    do
+    {
+        int digit = value % base;
+        temporary_output[c++] = digit < 10 ? '0' + digit : 'A' + (digit - 10);
+        value /= base;
+    } while (value > 0);
+
+    for (int i = 0; i < c; i++)
+    {
+        output[i] = temporary_output[c - 1 - i];
+    }
+
+    output[c] = '\0';
+}
+
+/**
+ * Get the value to format in a given iteration. The values are spread out over all magnitudes, from one digit up to the
+ * full 64 bits, since the cost of the conversion depends on the number of digits.
+ *
+ * @param state  The state of the pseudo-random number generator.
+ * @returns the value.
+ */
+static uint64_t next_value(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+
+    return *state >> (*state & 63);
+}
+
+static void format_decimal(uint64_t iterations)
+{
+    char buffer[BUFFER_SIZE];
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        BENCHMARK_USE(format_number(next_value(&state), 10, buffer + BUFFER_SIZE));
+    }
+}
+
+static void format_hexadecimal(uint64_t iterations)
+{
+    char buffer[BUFFER_SIZE];
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        BENCHMARK_USE(format_number(next_value(&state), 16, buffer + BUFFER_SIZE));
+    }
+}
+
+static void format_reference_decimal(uint64_t iterations)
+{
+    char buffer[BUFFER_SIZE + 1];
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        reference_number_to_string(next_value(&state), 10, buffer);
+        BENCHMARK_USE(buffer[0]);
+    }
+}
+
+static void format_reference_hexadecimal(uint64_t iterations)
+{
+    char buffer[BUFFER_SIZE + 1];
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        reference_number_to_string(next_value(&state), 16, buffer);
+        BENCHMARK_USE(buffer[0]);
+    }
+}
+
+/**
+ * Format a number of values with format_to_buffer(), i.e. with the whole formatting engine including the parsing of the
+ * format string.
+ *
+ * @param iterations  The number of values.
+ * @param format  The format string, with a single 64-bit conversion.
+ */
+static void format_to_buffer_values(uint64_t iterations, const char *format)
+{
+    char buffer[BUFFER_SIZE];
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        BENCHMARK_USE(format_to_buffer(buffer, sizeof(buffer), format, next_value(&state)));
+    }
+}
+
+static void format_to_buffer_decimal(uint64_t iterations)
+{
+    format_to_buffer_values(iterations, "%U");
+}
+
+static void format_to_buffer_hexadecimal(uint64_t iterations)
+{
+    format_to_buffer_values(iterations, "%X");
+}
+
+static void format_to_buffer_padded(uint64_t iterations)
+{
+    format_to_buffer_values(iterations, "%020U");
+}
+
+BENCHMARK("format.decimal", format_decimal, NULL, NULL);
+BENCHMARK("format.hexadecimal", format_hexadecimal, NULL, NULL);
+BENCHMARK("format.reference_decimal", format_reference_decimal, NULL, NULL);
+BENCHMARK("format.reference_hexadecimal", format_reference_hexadecimal, NULL, NULL);
+BENCHMARK("format.to_buffer_decimal", format_to_buffer_decimal, NULL, NULL);
+BENCHMARK("format.to_buffer_hexadecimal", format_to_buffer_hexadecimal, NULL, NULL);
+BENCHMARK("format.to_buffer_padded", format_to_buffer_padded, NULL, NULL);
@@ -0,0 +1,108 @@
+/*
+ * gdt.c - The Global Descriptor Table, and the Task State Segment of each CPU. In 64-bit mode, segmentation is pretty
+ * much gone; the only reason we need a GDT of our own (rather than the minimal one set up by the 32-bit loader) is the
+ * TSS, which holds the Interrupt Stack Table. Each CPU needs a TSS of its own, and each TSS needs a descriptor of its own.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#include <stdint.h>
+
+#include "common/misc.h"
+#include "cpu.h"
+#include "gdt.h"
+#include "io.h"
+#include "page_allocator.h"
+
+// The number of IST stacks we use, and the size of each of them as a page allocator order: 4 KiB << 1 = 8 KiB.
+#define IST_STACK_COUNT                 3
+#define IST_STACK_ORDER                 1
+
+// The descriptors: a 64-bit code segment and a writable data segment, both present and with DPL 0.
+#define GDT_DESCRIPTOR_KERNEL_CODE      0x00209A0000000000ULL
+#define GDT_DESCRIPTOR_KERNEL_DATA      0x0000920000000000ULL
+
+// The type of a present, available 64-bit TSS descriptor.
+#define GDT_DESCRIPTOR_TSS_TYPE         0x89ULL
+
+// The first entry used for the TSS descriptors. Each of them takes up two entries.
+#define GDT_TSS_FIRST_ENTRY             3
+#define GDT_ENTRY_COUNT                 (GDT_TSS_FIRST_ENTRY + 2 * CPU_MAX_COUNT)
+
+// The 64-bit Task State Segment. The only parts used in the kernel are the IST pointers.
+typedef struct
+{
+    uint32_t reserved0;
+    uint64_t rsp[3];
+    uint64_t reserved1;
+    uint64_t ist[7];
+    uint64_t reserved2;
+    uint16_t reserved3;
+    uint16_t io_map_base;
+} __attribute__((packed)) tss_t;
+
+// The GDT pointer, as used by the LGDT instruction.
+typedef struct
+{
+    uint16_t limit;
+    uint64_t base;
+} __attribute__((packed)) gdt_pointer_t;
+
+static uint64_t gdt[GDT_ENTRY_COUNT] __attribute__((aligned(16)));
+
+static tss_t tss[CPU_MAX_COUNT];
+
+void gdt_init_cpu(void)
+{
+    unsigned int id = cpu_current_id();
+
+    if (id == 0)
+    {
+        gdt[0] = 0;
+        gdt[1] = GDT_DESCRIPTOR_KERNEL_CODE;
+        gdt[2] = GDT_DESCRIPTOR_KERNEL_DATA;
+    }
+
+    for (int i = 0; i < IST_STACK_COUNT; i++)
+    {
+        uint64_t stack = page_allocate(IST_STACK_ORDER);
+        if (stack == 0)
+        {
+            io_print_formatted("Out of memory when allocating the interrupt stacks for CPU %u. Halting.\n", id);
+            HALT();
+        }
+
+        // The IST entries are numbered from 1, so ist[0] is IST 1.
+        tss[id].ist[i] = stack + ((uint64_t) PAGE_SIZE << IST_STACK_ORDER);
+    }
+
+    // There is no I/O permission bitmap; pointing it beyond the end of the TSS tells the CPU so.
+    tss[id].io_map_base = sizeof(tss_t);
+
+    uint64_t base = (uint64_t) &tss[id];
+    uint64_t limit = sizeof(tss_t) - 1;
+    unsigned int entry = GDT_TSS_FIRST_ENTRY + 2 * id;
+
+    gdt[entry] = (limit & 0xFFFF) |
+        ((base & 0xFFFFFF) << 16) |
+        (GDT_DESCRIPTOR_TSS_TYPE << 40) |
+        (((limit >> 16) & 0xF) << 48) |
+        (((base >> 24) & 0xFF) << 56);
+    gdt[entry + 1] = base >> 32;
+
+    gdt_pointer_t gdt_pointer = { sizeof(gdt) - 1, (uint64_t) gdt };
+
+    // After loading the GDT, CS is reloaded with a far return (there is no far jump to an absolute address in 64-bit
+    // mode). The selector is the same as before, but this makes sure the CPU uses the descriptor from our GDT.
+    asm volatile("lgdt %0\n\t"
+                 "pushq %1\n\t"
+                 "leaq 1f(%%rip), %%rax\n\t"
+                 "pushq %%rax\n\t"
+                 "lretq\n"
+                 "1:\n\t"
+                 "ltr %w2"
+                 :
+                 : "m"(gdt_pointer), "i"(GDT_KERNEL_CODE_SELECTOR), "r"(entry * 8)
+                 : "rax", "memory");
+}
@@ -0,0 +1,29 @@
+/*
+ * gdt.h - The Global Descriptor Table, and the Task State Segment of each CPU.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#ifndef __GDT_H__
+#define __GDT_H__ 1
+
+//// Defines.
+// The segment selectors. The code and data selectors are the same as in the GDT set up by the 32-bit loader.
+#define GDT_KERNEL_CODE_SELECTOR        0x08
+#define GDT_KERNEL_DATA_SELECTOR        0x10
+
+// The Interrupt Stack Table entries. The exceptions that can happen when the stack itself is broken (or at any time at
+// all, like an NMI) are given stacks of their own, so that we get a chance to report them instead of triple-faulting.
+#define GDT_IST_DOUBLE_FAULT            1
+#define GDT_IST_NMI                     2
+#define GDT_IST_MACHINE_CHECK           3
+
+//// Function prototypes
+/**
+ * Load the kernel GDT on the current CPU, and set up its Task State Segment with the Interrupt Stack Table stacks. Must be
+ * called once on every CPU, the bootstrap processor first. The page allocator must be initialized.
+ */
+extern void gdt_init_cpu(void);
+
+#endif // !__GDT_H__
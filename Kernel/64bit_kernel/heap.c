@@ -0,0 +1,96 @@
+/*
+ * heap.c - The kernel heap, for allocating memory of arbitrary sizes. This is a thin layer on top of the slab allocator
+ * and the page allocator.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common/misc.h"
+#include "heap.h"
+#include "io.h"
+#include "page_allocator.h"
+#include "slab.h"
+
+// The smallest and the largest size class, as powers of two. Anything larger than the largest size class is allocated
+// directly from the page allocator, in whole pages.
+#define SMALLEST_SIZE_CLASS_SHIFT       4
+#define LARGEST_SIZE_CLASS_SHIFT        11
+
+#define SIZE_CLASS_COUNT                (LARGEST_SIZE_CLASS_SHIFT - SMALLEST_SIZE_CLASS_SHIFT + 1)
+
+static slab_cache_t *size_classes[SIZE_CLASS_COUNT];
+
+static const char *size_class_names[SIZE_CLASS_COUNT] =
+{
+    "heap-16", "heap-32", "heap-64", "heap-128", "heap-256", "heap-512", "heap-1024", "heap-2048"
+};
+
+/**
+ * Get the smallest shift (power of two) that is at least as large as the given size.
+ */
+static unsigned int size_shift(size_t size)
+{
+    unsigned int shift = 0;
+    while (((size_t) 1 << shift) < size)
+    {
+        shift++;
+    }
+
+    return shift;
+}
+
+void heap_init(void)
+{
+    for (int i = 0; i < SIZE_CLASS_COUNT; i++)
+    {
+        size_t size = (size_t) 1 << (i + SMALLEST_SIZE_CLASS_SHIFT);
+
+        // The size classes below a cache line are packed tightly, since they would waste a lot of memory otherwise. The
+        // larger ones are aligned on cache lines anyway, because of their sizes.
+        size_classes[i] = slab_cache_create(size_class_names[i], size, size < CPU_CACHE_LINE_SIZE ? size : 0);
+        if (size_classes[i] == NULL)
+        {
+            io_print_line("Out of memory when creating the heap size classes. Halting.");
+            HALT();
+        }
+    }
+}
+
+void *heap_allocate(size_t size)
+{
+    unsigned int shift = size_shift(size);
+    if (shift < SMALLEST_SIZE_CLASS_SHIFT)
+    {
+        shift = SMALLEST_SIZE_CLASS_SHIFT;
+    }
+
+    if (shift <= LARGEST_SIZE_CLASS_SHIFT)
+    {
+        return slab_allocate(size_classes[shift - SMALLEST_SIZE_CLASS_SHIFT]);
+    }
+
+    unsigned int order = shift > PAGE_SHIFT ? shift - PAGE_SHIFT : 0;
+    return (void *) page_allocate(order);
+}
+
+void heap_free(void *memory, size_t size)
+{
+    unsigned int shift = size_shift(size);
+    if (shift < SMALLEST_SIZE_CLASS_SHIFT)
+    {
+        shift = SMALLEST_SIZE_CLASS_SHIFT;
+    }
+
+    if (shift <= LARGEST_SIZE_CLASS_SHIFT)
+    {
+        slab_free(size_classes[shift - SMALLEST_SIZE_CLASS_SHIFT], memory);
+        return;
+    }
+
+    unsigned int order = shift > PAGE_SHIFT ? shift - PAGE_SHIFT : 0;
+    page_free((uint64_t) memory, order);
+}
@@ -0,0 +1,37 @@
+/*
+ * heap.h - The kernel heap, for allocating memory of arbitrary sizes.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#ifndef __HEAP_H__
+#define __HEAP_H__ 1
+
+#include <stddef.h>
+
+/**
+ * Initialize the kernel heap. This creates the slab caches for the different size classes, so the page allocator must have
+ * been initialized before calling this.
+ */
+extern void heap_init(void);
+
+/**
+ * Allocate memory from the kernel heap. Small allocations are served from slab caches with power-of-two size classes;
+ * larger ones go directly to the page allocator. Allocations of 64 bytes or more are aligned on cache lines.
+ *
+ * @param size  The number of bytes to allocate.
+ * @returns the allocated memory, or NULL if we are out of memory.
+ */
+extern void *heap_allocate(size_t size);
+
+/**
+ * Return memory to the kernel heap.
+ *
+ * @param memory  The memory, as returned by heap_allocate().
+ * @param size  The size of the memory. Must be the same as when it was allocated. (Keeping track of the size is left to
+ * the caller, since it always knows it anyway. This means that we don't need a header in front of every allocation.)
+ */
+extern void heap_free(void *memory, size_t size);
+
+#endif // !__HEAP_H__
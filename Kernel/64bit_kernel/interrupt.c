@@ -0,0 +1,209 @@
+/*
+ * interrupt.c - Interrupt and exception handling. All the vectors go through the stubs in interrupt_stubs.S, which save
+ * the registers and call interrupt_dispatch() below; it then calls the handler registered for the vector.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "backtrace.h"
+#include "cpu.h"
+#include "gdt.h"
+#include "interrupt.h"
+#include "io.h"
+#include "log.h"
+#include "pic.h"
+#include "qemu.h"
+#include "serial.h"
+#include "trace.h"
+
+// The type and attributes of an IDT entry: a present 64-bit interrupt gate with DPL 0. Interrupt gates (as opposed to trap
+// gates) disable interrupts on entry, which is what we want for all vectors.
+#define IDT_INTERRUPT_GATE              0x8E
+
+typedef struct
+{
+    uint16_t offset_low;
+    uint16_t selector;
+    uint8_t ist;
+    uint8_t type_attributes;
+    uint16_t offset_middle;
+    uint32_t offset_high;
+    uint32_t reserved;
+} __attribute__((packed)) idt_entry_t;
+
+// The IDT pointer, as used by the LIDT instruction.
+typedef struct
+{
+    uint16_t limit;
+    uint64_t base;
+} __attribute__((packed)) idt_pointer_t;
+
+// The entry points of all the vectors. This table is provided by interrupt_stubs.S.
+extern const uint64_t interrupt_stub_table[INTERRUPT_VECTOR_COUNT];
+
+// The IDT is shared by all the CPU:s.
+static idt_entry_t idt[INTERRUPT_VECTOR_COUNT] __attribute__((aligned(16)));
+
+static volatile interrupt_handler_t handlers[INTERRUPT_VECTOR_COUNT];
+
+static const char *exception_names[INTERRUPT_EXCEPTION_COUNT] =
+{
+    [0] = "Divide error",
+    [1] = "Debug exception",
+    [2] = "Non-maskable interrupt",
+    [3] = "Breakpoint",
+    [4] = "Overflow",
+    [5] = "BOUND range exceeded",
+    [6] = "Invalid opcode",
+    [7] = "Device not available",
+    [8] = "Double fault",
+    [9] = "Coprocessor segment overrun",
+    [10] = "Invalid TSS",
+    [11] = "Segment not present",
+    [12] = "Stack-segment fault",
+    [13] = "General protection fault",
+    [14] = "Page fault",
+    [16] = "x87 floating-point error",
+    [17] = "Alignment check",
+    [18] = "Machine check",
+    [19] = "SIMD floating-point exception",
+    [20] = "Virtualization exception",
+    [21] = "Control protection exception",
+    [28] = "Hypervisor injection exception",
+    [29] = "VMM communication exception",
+    [30] = "Security exception"
+};
+
+/**
+ * Point an IDT entry at a given address.
+ *
+ * @param vector  The vector.
+ * @param address  The address of the code to run for the vector.
+ * @param ist  The Interrupt Stack Table entry to use, or 0 to stay on the current stack.
+ */
+static void interrupt_set_gate(uint8_t vector, uint64_t address, uint8_t ist)
+{
+    idt[vector].offset_low = address & 0xFFFF;
+    idt[vector].selector = GDT_KERNEL_CODE_SELECTOR;
+    idt[vector].ist = ist;
+    idt[vector].type_attributes = IDT_INTERRUPT_GATE;
+    idt[vector].offset_middle = (address >> 16) & 0xFFFF;
+    idt[vector].offset_high = address >> 32;
+    idt[vector].reserved = 0;
+}
+
+void interrupt_panic(interrupt_frame_t *frame)
+{
+    const char *name = exception_names[frame->vector] != NULL ? exception_names[frame->vector] : "Reserved exception";
+
+    // Get the messages logged before the crash out of the way first; they may very well explain it.
+    log_drain();
+
+    io_print("\n");
+    io_print(name);
+    io_print_formatted(" (vector %u, error code %x) on CPU %u.\n", (uint32_t) frame->vector,
+                       (uint32_t) frame->error_code, cpu_current_id());
+    io_print_formatted("RIP: %X  CS: %x  RFLAGS: %X\n", frame->rip, (uint32_t) frame->cs, frame->rflags);
+    io_print_formatted("RSP: %X  SS: %x  CR2: %X\n", frame->rsp, (uint32_t) frame->ss, cpu_get_cr2());
+    io_print_formatted("RAX: %X  RBX: %X  RCX: %X\n", frame->rax, frame->rbx, frame->rcx);
+    io_print_formatted("RDX: %X  RSI: %X  RDI: %X\n", frame->rdx, frame->rsi, frame->rdi);
+    io_print_formatted("RBP: %X  R8:  %X  R9:  %X\n", frame->rbp, frame->r8, frame->r9);
+    io_print_formatted("R10: %X  R11: %X  R12: %X\n", frame->r10, frame->r11, frame->r12);
+    io_print_formatted("R13: %X  R14: %X  R15: %X\n", frame->r13, frame->r14, frame->r15);
+    backtrace_print(frame->rip, frame->rbp, frame->rsp);
+    io_print_line("CPU halted.");
+
+    // Interrupts stay disabled from here on, so whatever is waiting to be sent to the serial port must be sent now.
+    serial_drain();
+    qemu_exit(false);
+
+    while (1 == 1)
+    {
+        asm volatile("cli\n\t"
+                     "hlt");
+    }
+}
+
+/**
+ * Called by the interrupt stubs for all vectors.
+ *
+ * @param frame  The state of the interrupted code.
+ */
+void interrupt_dispatch(interrupt_frame_t *frame)
+{
+    interrupt_handler_t handler = handlers[frame->vector];
+
+    // The exceptions are not traced. Among them are the NMI:s, which may arrive while a tracepoint is being patched,
+    // and the breakpoint exceptions taken when running into such a tracepoint (see code_patch.c); both would end up
+    // running into it again.
+    if (frame->vector < INTERRUPT_EXCEPTION_COUNT)
+    {
+        if (handler != NULL)
+        {
+            handler(frame);
+        }
+        else
+        {
+            interrupt_panic(frame);
+        }
+
+        return;
+    }
+
+    TRACE(trace_event_interrupt_begin, frame->vector, frame->rip);
+
+    if (handler != NULL)
+    {
+        handler(frame);
+    }
+    else if (frame->vector >= INTERRUPT_VECTOR_PIC_BASE &&
+             frame->vector < INTERRUPT_VECTOR_PIC_BASE + INTERRUPT_VECTOR_PIC_COUNT)
+    {
+        // A spurious interrupt from the (masked) legacy PIC. Nothing to do.
+    }
+    else
+    {
+        log_print(log_level_warning, "Unexpected interrupt %u on CPU %u, ignoring it.\n", (uint32_t) frame->vector,
+                  cpu_current_id());
+    }
+
+    TRACE(trace_event_interrupt_end, frame->vector, 0);
+}
+
+void interrupt_init(void)
+{
+    for (int vector = 0; vector < INTERRUPT_VECTOR_COUNT; vector++)
+    {
+        interrupt_set_gate(vector, interrupt_stub_table[vector], 0);
+    }
+
+    idt[INTERRUPT_VECTOR_NMI].ist = GDT_IST_NMI;
+    idt[8].ist = GDT_IST_DOUBLE_FAULT;
+    idt[18].ist = GDT_IST_MACHINE_CHECK;
+
+    pic_disable(INTERRUPT_VECTOR_PIC_BASE);
+    interrupt_init_cpu();
+}
+
+void interrupt_init_cpu(void)
+{
+    idt_pointer_t idt_pointer = { sizeof(idt) - 1, (uint64_t) idt };
+    asm volatile("lidt %0"
+                 :
+                 : "m"(idt_pointer));
+}
+
+void interrupt_register_handler(uint8_t vector, interrupt_handler_t handler)
+{
+    handlers[vector] = handler;
+}
+
+void interrupt_install_stub(uint8_t vector, void (*stub)(void))
+{
+    uint64_t address = stub != NULL ? (uint64_t) stub : interrupt_stub_table[vector];
+    interrupt_set_gate(vector, address, idt[vector].ist);
+}
@@ -0,0 +1,178 @@
+/*
+ * interrupt.h - Interrupt and exception handling.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#ifndef __INTERRUPT_H__
+#define __INTERRUPT_H__ 1
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "common/cpu.h"
+
+//// Defines.
+// The interrupt vectors. 0-31 are reserved for CPU exceptions.
+#define INTERRUPT_VECTOR_COUNT          256
+#define INTERRUPT_EXCEPTION_COUNT       32
+
+// The non-maskable interrupt. Besides hardware failures, it is used by the profiler (see profile.c).
+#define INTERRUPT_VECTOR_NMI            2
+
+// The breakpoint exception, raised by the INT3 instruction. Used when patching code (see code_patch.c).
+#define INTERRUPT_VECTOR_BREAKPOINT     3
+
+// The legacy PIC is remapped here, so that the spurious interrupts it can produce even when all its inputs are masked
+// don't end up looking like CPU exceptions.
+#define INTERRUPT_VECTOR_PIC_BASE       0x20
+#define INTERRUPT_VECTOR_PIC_COUNT      16
+
+#define INTERRUPT_VECTOR_APIC_TIMER     0x30
+
+// The legacy ISA IRQs, as routed through the I/O APIC.
+#define INTERRUPT_VECTOR_ISA_BASE       0x40
+#define INTERRUPT_VECTOR_ISA_COUNT      16
+
+// Sent to the CPU:s running an address space, to make them invalidate the TLB entries of the mappings that have been
+// changed. See tlb.c.
+#define INTERRUPT_VECTOR_TLB_SHOOTDOWN  0xFC
+
+// Sent to the other CPU:s to make them execute a serializing instruction (the IRETQ at the end of the handler), after
+// code has been modified. See code_patch.c.
+#define INTERRUPT_VECTOR_SYNC           0xFD
+
+#define INTERRUPT_VECTOR_BENCHMARK      0xFE
+
+// The vector used by the local APIC for spurious interrupts. The low four bits must be all ones on older CPU:s.
+#define INTERRUPT_VECTOR_APIC_SPURIOUS  0xFF
+
+//// Type definitions and structures
+// The state of the interrupted code, as saved on the stack by the CPU and the interrupt stubs. The general-purpose
+// registers can be modified by the handler; the new values are loaded when returning from the interrupt.
+typedef struct
+{
+    uint64_t r15;
+    uint64_t r14;
+    uint64_t r13;
+    uint64_t r12;
+    uint64_t r11;
+    uint64_t r10;
+    uint64_t r9;
+    uint64_t r8;
+    uint64_t rbp;
+    uint64_t rdi;
+    uint64_t rsi;
+    uint64_t rdx;
+    uint64_t rcx;
+    uint64_t rbx;
+    uint64_t rax;
+
+    // Pushed by the stub. The error code is zero for the vectors where the CPU does not push one.
+    uint64_t vector;
+    uint64_t error_code;
+
+    // Pushed by the CPU.
+    uint64_t rip;
+    uint64_t cs;
+    uint64_t rflags;
+    uint64_t rsp;
+    uint64_t ss;
+} interrupt_frame_t;
+
+// An interrupt handler. Only the general-purpose registers are saved by the interrupt stubs, so the handlers (and
+// everything they call) must not touch the SSE registers. The kernel is compiled with -mno-sse, so this only concerns
+// hand-written code -- most notably the SSE variants of memory_copy() and memory_zero(), which must not be used from
+// interrupt handlers.
+typedef void (*interrupt_handler_t)(interrupt_frame_t *frame);
+
+//// Function prototypes
+/**
+ * Set up the IDT and mask the legacy PIC, and load the IDT on the bootstrap processor. Unhandled exceptions print the
+ * state of the CPU and halt it.
+ */
+extern void interrupt_init(void);
+
+/**
+ * Load the IDT on the current CPU. Must be called once on every application processor.
+ */
+extern void interrupt_init_cpu(void);
+
+/**
+ * Register the handler for an interrupt vector. There can only be one handler per vector; a previously registered
+ * handler is replaced.
+ *
+ * @param vector  The vector.
+ * @param handler  The handler, or NULL to remove the handler.
+ */
+extern void interrupt_register_handler(uint8_t vector, interrupt_handler_t handler);
+
+/**
+ * Print the state of the CPU at the time of an exception, and halt the CPU. This is what happens to exceptions without
+ * a handler; handlers that find that they can't deal with an exception after all can call it themselves.
+ *
+ * @param frame  The interrupt frame.
+ */
+extern void interrupt_panic(interrupt_frame_t *frame) __attribute__((noreturn));
+
+/**
+ * Point an interrupt vector directly at a stub of our own, bypassing the common entry code and the handler dispatch.
+ * This is meant for benchmarking; real interrupt handlers should use interrupt_register_handler().
+ *
+ * @param vector  The vector.
+ * @param stub  The stub, which must save and restore whatever registers it uses and return with IRETQ. If NULL, the
+ * vector is pointed back at its regular stub.
+ */
+extern void interrupt_install_stub(uint8_t vector, void (*stub)(void));
+
+// These are always inlined, even at -O0: an out-of-line copy in main.c would otherwise end up in front of main(), which
+// must be the very first code in the kernel binary.
+
+/**
+ * Enable interrupts on the current CPU.
+ */
+static inline __attribute__((always_inline)) void interrupt_enable(void)
+{
+    asm volatile("sti" : : : "memory");
+}
+
+/**
+ * Disable interrupts on the current CPU.
+ */
+static inline __attribute__((always_inline)) void interrupt_disable(void)
+{
+    asm volatile("cli" : : : "memory");
+}
+
+/**
+ * Disable interrupts on the current CPU, remembering whether they were enabled.
+ *
+ * @returns the RFLAGS register before interrupts were disabled, to be passed to interrupt_restore().
+ */
+static inline __attribute__((always_inline)) uint64_t interrupt_save_disable(void)
+{
+    uint64_t flags;
+    asm volatile("pushfq\n\t"
+                 "popq %0\n\t"
+                 "cli"
+                 : "=r"(flags)
+                 :
+                 : "memory");
+    return flags;
+}
+
+/**
+ * Enable interrupts on the current CPU again, if they were enabled when interrupt_save_disable() was called.
+ *
+ * @param flags  The value returned by interrupt_save_disable().
+ */
+static inline __attribute__((always_inline)) void interrupt_restore(uint64_t flags)
+{
+    if ((flags & RFLAGS_IF) != 0)
+    {
+        interrupt_enable();
+    }
+}
+
+#endif // !__INTERRUPT_H__
@@ -0,0 +1,78 @@
+/*
+ * interrupt_benchmark.c - Benchmarks of the interrupt entry and exit paths, run with benchmark=interrupt (see
+ * benchmark.h).
+ *
+ * The interrupts are raised with the INT instruction, which takes the same path through the IDT as a hardware interrupt
+ * does (minus the EOI). interrupt.full goes through our own stub, the dispatch code and an empty handler. interrupt.bare
+ * measures the cost of the CPU itself delivering the interrupt and returning from it, with a stub that does nothing but
+ * IRETQ; the difference between the two is what our own stub and dispatch code add.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "benchmark.h"
+#include "interrupt.h"
+
+// This stub is provided by interrupt_stubs.S.
+extern void interrupt_null_stub(void);
+
+static void empty_handler(interrupt_frame_t *frame)
+{
+}
+
+/**
+ * Raise the benchmark interrupt a number of times.
+ *
+ * @param iterations  The number of times.
+ */
+static void raise_interrupts(uint64_t iterations)
+{
+    // The timer interrupt would otherwise be included in the measurement every now and then.
+    interrupt_disable();
+
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        asm volatile("int %0"
+                     :
+                     : "i"(INTERRUPT_VECTOR_BENCHMARK)
+                     : "memory");
+    }
+
+    interrupt_enable();
+}
+
+static bool full_setup(void)
+{
+    interrupt_register_handler(INTERRUPT_VECTOR_BENCHMARK, empty_handler);
+    return true;
+}
+
+static bool bare_setup(void)
+{
+    interrupt_install_stub(INTERRUPT_VECTOR_BENCHMARK, interrupt_null_stub);
+    return true;
+}
+
+static void teardown(void)
+{
+    interrupt_install_stub(INTERRUPT_VECTOR_BENCHMARK, NULL);
+    interrupt_register_handler(INTERRUPT_VECTOR_BENCHMARK, NULL);
+}
+
+static void full(uint64_t iterations)
+{
+    raise_interrupts(iterations);
+}
+
+static void bare(uint64_t iterations)
+{
+    raise_interrupts(iterations);
+}
+
+BENCHMARK("interrupt.full", full, full_setup, teardown);
+BENCHMARK("interrupt.bare", bare, bare_setup, teardown);
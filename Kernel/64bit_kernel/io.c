@@ -9,169 +9,97 @@
 
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
-#include "port.h"
+#include "common/console.h"
+#include "common/format.h"
+#include "clock.h"
+#include "command_line.h"
+#include "io.h"
+#include "serial.h"
 #include "string.h"
 
 /* Constants */
-/* The number of columns. */
-#define SCREEN_COLUMNS                  80
+/* The longest time io_leet_print() may take, regardless of the length of the string, and the longest time it shows each
+   step of the fade-in. */
+#define LEET_PRINT_MAX_MICROSECONDS     250000
+#define LEET_PRINT_STEP_MICROSECONDS    4000
 
-/* The number of rows. */
-#define SCREEN_ROWS                     24
-
-/* The video memory base address (for text-mode). */
-#define VIDEO_MEMORY_BASE               0xB8000
-
-/* The default attribute of a character printed by the kernel.  */
-#define KERNEL_DEFAULT_ATTRIBUTE        0x07
-
-/* Types. */
-typedef struct
-{
-    uint8_t character;
-    uint8_t attribute;
-} console_character_t;
-
-typedef struct
-{
-    int x;
-    int y;
-} cursor_t;
+/* The size of the buffer collecting the output to the serial port, so that it can be handed over a string at a time. */
+#define SERIAL_BUFFER_SIZE              256
 
 /* Variables. */
-/* Pointer to the text video memory. */
-static volatile console_character_t *screen;
-
-/* The cursor. */
-static cursor_t cursor;
-
 /* The current attribute to write text with. */
-static uint8_t current_attribute = KERNEL_DEFAULT_ATTRIBUTE;
+static uint8_t current_attribute = CONSOLE_DEFAULT_ATTRIBUTE;
+
+/* The outputs in use. */
+static bool vga_output = true;
+static bool serial_output;
 
-static void move_cursor(int row, int column);
+/* The output to the serial port that has not been written yet. */
+static char serial_buffer[SERIAL_BUFFER_SIZE];
+static int serial_buffer_length;
 
-/* Clear the screen and initialize the I/O variables. */
+/* Initialize the I/O variables. The screen is left as it is, since it contains the output of the 32-bit loader. */
 void io_init(void)
 {
-    screen = (console_character_t *) VIDEO_MEMORY_BASE;
-    
     // The 32-bit kernel usually prints one line.
-    cursor.x = 0;
-    cursor.y = 1;
-    move_cursor(cursor.y, cursor.x);
-}
-
-static void move_cursor(int row, int column)
-{
-    int position = (row * 80) + column;
- 
-    // Cursor LOW port to vga INDEX register.
-    outb(0x3D4, 0x0F);
-    outb(0x3D5, (uint8_t) (position & 0xFF));
-
-    // Cursor HIGH port to vga INDEX register.
-    outb(0x3D4, 0x0E);
-    outb(0x3D5, (uint8_t) ((position >> 8) & 0xFF));
+    console_init(1, false);
+    serial_output = serial_init();
 }
 
-// Print a newline.
-static void newline()
+/* Select the outputs to use, as given by the console option on the kernel command line: console=vga, console=serial or
+   (the default) both of them. */
+void io_select_outputs(void)
 {
-    cursor.y++;
-    cursor.x = 0;  
-
-    if (cursor.y > SCREEN_ROWS)
+    if (command_line_option_has_value("console", "vga"))
     {
-        // FIXME: implement scrolling please. :-)
+        serial_output = false;
     }
-
-    move_cursor(cursor.y, cursor.x);
-}
-
-// Convert an uint64 to arbitrary base string format. The base can be anything between 2 (binary) and 36, since by then we
-// have reached the end of the alphabet... (26 letters + 10 digits)
-static void number_to_string_uint64(uint64_t value, int base, char *output)
-{
-    char temporary_output[65];  // The maximum length the string can have (when the base is 2)
-    int c = 0;
-
-    // Do some basic argument checking here.
-    if (base < 2 || base > 36)
-    {
-        string_copy(output, "(error)");
-        return;
-    }
-
-    // We can pretty easily get each individual digit in the number by dividing it with the base (2, 10, 16 and so on) -- the
-    // reminder of that operation is the digit. So, the algorithm for this function is pretty simple: take the reminder of a
-    // division of the number with the base, add it to the string, and divide the number with the base. When the result of
-    // that final division is <= 0, we are done.
-    //
-    // Now, the only problem with that algorithm is that if we do it like that, we will get the string backwards. So, either
-    // we store it in the opposite order or we reverse it afterwards. Storing it in the opposite order is actually not
-    // trivial, since we would have to figure out the length the string on beforehand. So, we just reverse it afterwards.
-
-    // We must code this as a do-while loop rather than a while-loop, since we always want to print at least one
-    // digit (think about the number 0).
-    do
+    else if (command_line_option_has_value("console", "serial"))
     {
-        // Get the hexadecimal digit.
-        int digit = value % base;
-
-        // Obviously, you could have a lookup table for the digits. This method is perhaps a little bit slower, but uses
-        // slightly less memory.
-        if (digit < 10)
+        if (serial_output)
         {
-            temporary_output[c] = '0' + digit;
+            vga_output = false;
         }
         else
         {
-            temporary_output[c] = 'A' + (digit - 10);
+            io_print_line("No serial port found, staying on the VGA console.");
         }
-        value /= base;
-        
-        c++;
-    } while (value > 0);
-
-    // Now, let's reverse the string. We do it by looping over it backwards. The -1 and +1 here respectively are pretty
-    // important. After the loop above has run, c will contain the "length" of the string, which is the position of the
-    // highest index in the array PLUS ONE. In other words, if the string contain 5 digits, c will contain 6 -- since the
-    // incrementation takes place at the very end of the loop.
-    //
-    // So... to make the mapping correct (6 => 0, 5 => 1 and so forth), we decrease it by one here. And, to place the NUL
-    // character at the right place, we need to do the opposite -- we add one to the max_position.
-    c--;
-    int max_position = c;
-    for (; c >= 0; c--)
-    {
-        output[max_position - c] = temporary_output[c];
-        //output[max_position - c] = 'x';
     }
-    output[max_position + 1] = '\0';
 }
 
-// Convert an uint32 to "arbitrary base" string format.
-static void number_to_string_uint32(uint32_t value, int base, char *output)
+/* Make everything printed so far visible. */
+static void io_flush(void)
 {
-    // Poor-man's function overloading... :-) Since a uint32 is totally "upward" compatible with a uint64 (but not the other
-    // way around), this is totally possible. The only risk of doing like this is that 'output' could overflow its boundaries
-    // if the value would somehow be larger than UINT32_MAX... but really, that isn't be possible, so it is totally safe to
-    // do like this.
-    number_to_string_uint64(value, base, output);
+    if (vga_output)
+    {
+        console_flush();
+    }
+
+    if (serial_buffer_length > 0)
+    {
+        serial_write(serial_buffer, serial_buffer_length);
+        serial_buffer_length = 0;
+    }
 }
 
-static void io_sleep()
+/* Queue up a character for the serial port. */
+static void io_put_serial_character(char c)
 {
-    // Obviously, this method of generating a delay is quite lousy, it should at least be calibrated somehow... Using I/O
-    // in() is probably a much better way if we want to do it at least a whee bit better :-)
-    //
-    // TODO: Fix a better sleep algorithm. This one is very hardwired to my specific machine...
-    for (int i = 0; i < 100000; i++)
+    if (!serial_output)
+    {
+        return;
+    }
+
+    if (serial_buffer_length == SERIAL_BUFFER_SIZE)
     {
-        asm("inb $0x20");
+        serial_write(serial_buffer, serial_buffer_length);
+        serial_buffer_length = 0;
     }
+
+    serial_buffer[serial_buffer_length++] = c;
 }
 
 /*
@@ -181,29 +109,40 @@ static void io_sleep()
  */
 void io_leet_print(const char *string)
 {
-    for (int i = 0; string[i] != '\0'; i++)
+    // Each character fades in in two steps. Long strings get shorter steps, so that the whole thing is over in bounded
+    // time; we don't want the boot time to depend on the length of a banner.
+    uint64_t step_count = 2 * string_length(string);
+    uint64_t step_microseconds = step_count > 0 ? LEET_PRINT_MAX_MICROSECONDS / step_count : 0;
+    if (step_microseconds > LEET_PRINT_STEP_MICROSECONDS)
     {
-        screen[(cursor.y * SCREEN_COLUMNS) + cursor.x].character = string[i];
-        screen[(cursor.y * SCREEN_COLUMNS) + cursor.x].attribute = 0x03;
+        step_microseconds = LEET_PRINT_STEP_MICROSECONDS;
+    }
 
-        io_sleep();
+    for (int i = 0; string[i] != '\0'; i++)
+    {
+        if (vga_output)
+        {
+            console_set_character(string[i], 0x03);
+            console_flush();
+            udelay(step_microseconds);
 
-        screen[(cursor.y * SCREEN_COLUMNS) + cursor.x].character = string[i];
-        screen[(cursor.y * SCREEN_COLUMNS) + cursor.x].attribute = 0x07;
+            console_set_character(string[i], 0x07);
+            console_flush();
+            udelay(step_microseconds);
 
-        io_sleep();
+            console_put_character(string[i], 0x0F);
+        }
 
-        screen[(cursor.y * SCREEN_COLUMNS) + cursor.x].character = string[i];
-        screen[(cursor.y * SCREEN_COLUMNS) + cursor.x].attribute = 0x0F;
-        cursor.x++;
+        io_put_serial_character(string[i]);
+    }
 
-        if (cursor.x == SCREEN_COLUMNS)
-        {
-            newline();
-        }
+    if (vga_output)
+    {
+        console_put_character('\n', current_attribute);
     }
 
-    newline();
+    io_put_serial_character('\n');
+    io_flush();
 }
 
 /*
@@ -213,40 +152,20 @@ void io_leet_print(const char *string)
  */
 static void io_print_character(char c)
 {
-    switch (c)
+    if (vga_output)
     {
-        case '\n':
-        {
-            newline();
-            break;
-        }
-        
-        default:
-        {
-            screen[(cursor.y * SCREEN_COLUMNS) + cursor.x].character = c;
-            screen[(cursor.y * SCREEN_COLUMNS) + cursor.x].attribute = current_attribute;
-            
-            cursor.x++;
-            
-            if (cursor.x == SCREEN_COLUMNS)
-            {
-                newline();
-            }
-            
-            if (cursor.y > SCREEN_ROWS)
-            {
-                // FIXME: implement scrolling please. :-)
-            }
-        }
+        console_put_character(c, current_attribute);
     }
+
+    io_put_serial_character(c);
 }
 
 /*
- * Print a string to the screen.
+ * Print a string to the screen, without flushing the output.
  *
  * @param string the string to print.
  */
-void io_print(const char *string)
+static void io_write(const char *string)
 {
     for (int i = 0; string[i] != '\0'; i++)
     {
@@ -254,6 +173,17 @@ void io_print(const char *string)
     }
 }
 
+/*
+ * Print a string to the screen.
+ *
+ * @param string the string to print.
+ */
+void io_print(const char *string)
+{
+    io_write(string);
+    io_flush();
+}
+
 /*
  * Print a string to the console, with a terminating newline.
  *
@@ -261,137 +191,40 @@ void io_print(const char *string)
  */
 void io_print_line(const char *string)
 {
-    io_print(string);
+    io_write(string);
 
     // ...and add the final newline.
-    newline();
+    io_print_character('\n');
+    io_flush();
 }
 
 /*
- * Print a string to the screen, using printf()-like formatting specifiers.
+ * The output function used with format_string().
  *
- * @param format_string the format string to use.
+ * @param string the characters to print.
+ * @param length the number of characters.
+ * @param context not used.
  */
-void io_print_formatted(const char *format_string, ...)
+static void io_format_output(const char *string, unsigned int length, void *context)
 {
-    int c = 0;
-    bool previous_was_percent = false;
-
-    // Initialize the variable argument stuff.
-    va_list arguments;
-    va_start(arguments, format_string);
-
-    // Go through the string until we find a NUL byte.
-    while (format_string[c] != '\0')
+    for (unsigned int i = 0; i < length; i++)
     {
-        if (previous_was_percent)
-        {
-            // The previous character was a percent sign. In other words, this character is a specifier for how the data
-            // should be output. The implementation here is a very stripped-down version of the ISO printf() function. We
-            // only implement the stuff that we actually need.
-            switch (format_string[c])
-            {
-                // We differ here a bit from the regular printf(). In printf(), %x means "hexadecimal with lowercase
-                // letters". Here, we treat %x as "hexadecimal 32-bit integer" and %X as "hexadecimal 64-bit integer".
-                case 'x':
-                {
-                    char string[9];             // A 32-bit integer can be no longer than 8 hex characters + a NUL
-                                                // terminator.
-                    number_to_string_uint32(va_arg(arguments, uint32_t), 16, string);
-                    io_print(string);
-                    break;
-                }
-
-                case 'X':
-                {
-                    char string[17];            // A 64-bit integer can be no longer than 16 hex characters + a NUL terminator.
-                    number_to_string_uint64(va_arg(arguments, uint64_t), 16, string);
-                    io_print(string);
-                    break;
-                }
-                
-                // Base 10 (decimal), 32-bit unsigned integer.
-                case 'u':
-                {
-                    char string[11];            // A 32-bit integer can be no longer than 10 decimal characters + a NUL
-                                                // terminator.
-                    number_to_string_uint32(va_arg(arguments, uint32_t), 10, string);
-                    io_print(string);
-                    break;
-                }
-
-                // Base 10 (decimal), 64-bit unsigned integer.
-                case 'U':
-                {
-                    char string[21];            // A 64-bit integer can be no longer than 20 decimal characters + a NUL
-                                                // terminator.
-                    number_to_string_uint64(va_arg(arguments, uint64_t), 10, string);
-                    io_print(string);
-                    break;
-                    break;
-                }
-
-                // Base 2 (binary), 32-bit unsigned integer.
-                case 'b':
-                {
-                    char string[11];            // A 32-bit integer can be no longer than 10 decimal characters + a NUL
-                                                // terminator.
-                    number_to_string_uint32(va_arg(arguments, uint32_t), 2, string);
-                    io_print(string);
-                    break;
-                }
-
-                // Base 2 (binary), 64-bit unsigned integer.
-                case 'B':
-                {
-                    char string[21];            // A 64-bit integer can be no longer than 20 decimal characters + a NUL
-                                                // terminator.
-                    number_to_string_uint64(va_arg(arguments, uint64_t), 2, string);
-                    io_print(string);
-                    break;
-                }
-                
-                default:
-                {
-                    // Just like printf(), if we encounter an unparseable percent specification, we just print it out
-                    // verbatim.
-                    io_print_character('%');
-                    io_print_character(format_string[c]);
-                }
-            }
-
-            previous_was_percent = false;
-        }
-        else 
-        {
-            // The previous character was not a percent sign (%)
-            switch (format_string[c])
-            {
-                case '%':
-                {
-                    if (previous_was_percent)
-                    {
-                        io_print_character(format_string[c]);
-                    }
-                    else // !previous_was_precent
-                    {
-                        previous_was_percent = true;
-                    }
-
-                    break;
-                }
-                
-                default:
-                {
-                    io_print_character(format_string[c]);
-                }
-            }
-        }
-
-        c++;
+        io_print_character(string[i]);
     }
+}
 
+/*
+ * Print a string to the screen, using printf()-like formatting specifiers. See format_string() for the ones supported.
+ *
+ * @param format the format string to use.
+ */
+void io_print_formatted(const char *format, ...)
+{
+    va_list arguments;
+    va_start(arguments, format);
+    format_string(io_format_output, NULL, format, arguments);
     va_end(arguments);
+    io_flush();
 }
 
 /**
@@ -402,8 +235,7 @@ void io_print_formatted(const char *format_string, ...)
  */
 void io_get_cursor(int *row, int *column)
 {
-    *row = cursor.y;
-    *column = cursor.x;
+    console_get_cursor(row, column);
 }
 
 /**
@@ -414,6 +246,25 @@ void io_get_cursor(int *row, int *column)
  */
 void io_move_cursor(int row, int column)
 {
-    cursor.y = row;
-    cursor.x = column;
+    console_move_cursor(row, column);
+}
+
+/**
+ * Print a ratio with two decimals, preceded by a space. We don't have any floating point support in the kernel, so we do
+ * it using fixed-point arithmetic instead.
+ *
+ * @param numerator  The numerator of the ratio.
+ * @param denominator  The denominator of the ratio.
+ */
+void io_print_ratio(uint64_t numerator, uint64_t denominator)
+{
+    uint64_t hundredths = (numerator * 100) / (denominator > 0 ? denominator : 1);
+    io_print_formatted(" %U.", hundredths / 100);
+
+    if (hundredths % 100 < 10)
+    {
+        io_print("0");
+    }
+
+    io_print_formatted("%U", hundredths % 100);
 }
@@ -8,11 +8,15 @@
 #ifndef __IO_H__
 #define __IO_H__ 1
 
+#include <stdint.h>
+
 extern void io_init(void);
+extern void io_select_outputs(void);
 extern void io_leet_print(const char *string);
 extern void io_print(const char *string);
 extern void io_print_line(const char *string);
 extern void io_print_formatted(const char *format_string, ...);
 extern void io_move_cursor(int row, int column);
+extern void io_print_ratio(uint64_t numerator, uint64_t denominator);
 
 #endif /* ! __IO_H__ */
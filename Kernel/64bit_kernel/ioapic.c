@@ -0,0 +1,175 @@
+/*
+ * ioapic.c - The I/O APIC. The registers are accessed indirectly, through a select register and a data window; both are
+ * memory-mapped, at an address given by the MADT. Like the local APIC, it is covered by the uncached part of the identity
+ * mapping.
+ *
+ * The legacy ISA IRQs are normally connected to the I/O APIC input with the same number, except when the MADT says
+ * otherwise (the PIT, IRQ 0, is typically connected to input 2).
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "acpi.h"
+#include "interrupt.h"
+#include "io.h"
+#include "ioapic.h"
+#include "log.h"
+
+// The maximum number of I/O APIC:s we support. Most machines have just one.
+#define IOAPIC_MAX_COUNT                8
+
+// The memory-mapped registers.
+#define IOAPIC_SELECT                   0x00
+#define IOAPIC_WINDOW                   0x10
+
+// The indirectly accessed registers. Each redirection table entry takes up two registers.
+#define IOAPIC_REGISTER_VERSION         0x01
+#define IOAPIC_REGISTER_REDIRECTION     0x10
+
+// The redirection table entry bits. The delivery mode (fixed) and destination mode (physical) we use are both zero.
+#define IOAPIC_REDIRECTION_ACTIVE_LOW   (1 << 13)
+#define IOAPIC_REDIRECTION_LEVEL        (1 << 15)
+#define IOAPIC_REDIRECTION_MASKED       (1 << 16)
+#define IOAPIC_DESTINATION_SHIFT        24
+
+#define ISA_IRQ_COUNT                   16
+
+typedef struct
+{
+    volatile uint8_t *base;
+    uint32_t first_interrupt;
+    uint32_t interrupt_count;
+} ioapic_t;
+
+// The global system interrupt (i.e. I/O APIC input) and polarity/trigger flags of an ISA IRQ.
+typedef struct
+{
+    uint32_t global_system_interrupt;
+    uint16_t flags;
+} isa_irq_t;
+
+static ioapic_t ioapics[IOAPIC_MAX_COUNT];
+static unsigned int ioapic_count;
+
+static isa_irq_t isa_irqs[ISA_IRQ_COUNT];
+
+static uint32_t ioapic_read(const ioapic_t *ioapic, uint8_t reg)
+{
+    *(volatile uint32_t *) (ioapic->base + IOAPIC_SELECT) = reg;
+    return *(volatile uint32_t *) (ioapic->base + IOAPIC_WINDOW);
+}
+
+static void ioapic_write(const ioapic_t *ioapic, uint8_t reg, uint32_t value)
+{
+    *(volatile uint32_t *) (ioapic->base + IOAPIC_SELECT) = reg;
+    *(volatile uint32_t *) (ioapic->base + IOAPIC_WINDOW) = value;
+}
+
+/**
+ * Add an I/O APIC, and mask all its inputs.
+ *
+ * @param entry  The MADT entry of the I/O APIC.
+ */
+static void ioapic_add(const acpi_madt_io_apic_t *entry)
+{
+    if (ioapic_count == IOAPIC_MAX_COUNT)
+    {
+        log_print(log_level_warning, "I/O APIC: only %u I/O APIC:s are supported, ignoring the rest of them.\n",
+                  IOAPIC_MAX_COUNT);
+        return;
+    }
+
+    ioapic_t *ioapic = &ioapics[ioapic_count++];
+    ioapic->base = (volatile uint8_t *) (uint64_t) entry->io_apic_address;
+    ioapic->first_interrupt = entry->global_system_interrupt_base;
+
+    // Bits 16-23 of the version register hold the number of the last redirection table entry.
+    ioapic->interrupt_count = ((ioapic_read(ioapic, IOAPIC_REGISTER_VERSION) >> 16) & 0xFF) + 1;
+
+    for (uint32_t i = 0; i < ioapic->interrupt_count; i++)
+    {
+        ioapic_write(ioapic, IOAPIC_REGISTER_REDIRECTION + i * 2, IOAPIC_REDIRECTION_MASKED);
+    }
+}
+
+void ioapic_init(void)
+{
+    for (int irq = 0; irq < ISA_IRQ_COUNT; irq++)
+    {
+        isa_irqs[irq].global_system_interrupt = irq;
+        isa_irqs[irq].flags = 0;
+    }
+
+    const acpi_madt_t *madt = (const acpi_madt_t *) acpi_find_table(ACPI_MADT_SIGNATURE);
+    if (madt == NULL)
+    {
+        log_print(log_level_warning, "I/O APIC: no MADT found, device interrupts will not be available.\n");
+        return;
+    }
+
+    const uint8_t *entries_end = (const uint8_t *) madt + madt->header.length;
+    const uint8_t *entry = (const uint8_t *) madt + sizeof(acpi_madt_t);
+    while (entry < entries_end && ((const acpi_madt_entry_t *) entry)->length != 0)
+    {
+        if (((const acpi_madt_entry_t *) entry)->type == ACPI_MADT_TYPE_IO_APIC)
+        {
+            ioapic_add((const acpi_madt_io_apic_t *) entry);
+        }
+        else if (((const acpi_madt_entry_t *) entry)->type == ACPI_MADT_TYPE_INTERRUPT_OVERRIDE)
+        {
+            const acpi_madt_interrupt_override_t *override = (const acpi_madt_interrupt_override_t *) entry;
+
+            // Bus 0 is ISA, which is the only bus there can be overrides for.
+            if (override->bus == 0 && override->source < ISA_IRQ_COUNT)
+            {
+                isa_irqs[override->source].global_system_interrupt = override->global_system_interrupt;
+                isa_irqs[override->source].flags = override->flags;
+            }
+        }
+
+        entry += ((const acpi_madt_entry_t *) entry)->length;
+    }
+
+    log_print(log_level_info, "I/O APIC: %u found.\n", ioapic_count);
+}
+
+bool ioapic_route_isa_irq(uint8_t irq, uint32_t apic_id)
+{
+    uint32_t global_system_interrupt = isa_irqs[irq].global_system_interrupt;
+    uint16_t flags = isa_irqs[irq].flags;
+
+    for (unsigned int i = 0; i < ioapic_count; i++)
+    {
+        const ioapic_t *ioapic = &ioapics[i];
+        if (global_system_interrupt < ioapic->first_interrupt ||
+            global_system_interrupt >= ioapic->first_interrupt + ioapic->interrupt_count)
+        {
+            continue;
+        }
+
+        // ISA interrupts are active high and edge triggered, unless the override says otherwise.
+        uint32_t low = INTERRUPT_VECTOR_ISA_BASE + irq;
+        if ((flags & ACPI_MADT_POLARITY_MASK) == ACPI_MADT_POLARITY_ACTIVE_LOW)
+        {
+            low |= IOAPIC_REDIRECTION_ACTIVE_LOW;
+        }
+
+        if ((flags & ACPI_MADT_TRIGGER_MASK) == ACPI_MADT_TRIGGER_LEVEL)
+        {
+            low |= IOAPIC_REDIRECTION_LEVEL;
+        }
+
+        // The high half (the destination) is written first, so the entry is never unmasked with the wrong destination.
+        uint8_t reg = IOAPIC_REGISTER_REDIRECTION + (global_system_interrupt - ioapic->first_interrupt) * 2;
+        ioapic_write(ioapic, reg + 1, apic_id << IOAPIC_DESTINATION_SHIFT);
+        ioapic_write(ioapic, reg, low);
+        return true;
+    }
+
+    return false;
+}
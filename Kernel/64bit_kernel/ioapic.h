@@ -0,0 +1,30 @@
+/*
+ * ioapic.h - The I/O APIC, which routes the interrupts of the devices to the local APIC:s.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#ifndef __IOAPIC_H__
+#define __IOAPIC_H__ 1
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//// Function prototypes
+/**
+ * Find the I/O APIC:s and the ISA interrupt overrides in the ACPI MADT, and mask all the interrupts. acpi_init() must have
+ * been called first.
+ */
+extern void ioapic_init(void);
+
+/**
+ * Route a legacy ISA IRQ to a CPU, and unmask it. The interrupt arrives at vector INTERRUPT_VECTOR_ISA_BASE + irq.
+ *
+ * @param irq  The ISA IRQ number (0-15).
+ * @param apic_id  The local APIC ID of the CPU that should receive the interrupt.
+ * @returns true if the IRQ was routed, false if there is no I/O APIC handling it.
+ */
+extern bool ioapic_route_isa_irq(uint8_t irq, uint32_t apic_id);
+
+#endif // !__IOAPIC_H__
@@ -0,0 +1,300 @@
+/*
+ * log.c - The kernel log. Each CPU has a ring buffer of fixed-size records, holding the format string and raw arguments
+ * of a message along with the TSC value at the time it was logged. Formatting and printing a message takes tens of
+ * thousands of cycles (more with the VGA console under emulation), which is too much for hot paths and interrupt
+ * handlers; storing a record takes around a hundred.
+ *
+ * The ring buffers are multi-producer, single-consumer and lock-free: a producer reserves a slot by bumping the head index
+ * with compare-and-swap, fills in the record and then publishes it by setting its sequence number. Normally the only
+ * producers for a ring buffer are the CPU owning it and the interrupt handlers on that CPU, but nothing breaks if a
+ * thread logging a message would move to another CPU halfway through. The consumer drains the ring buffers in timestamp
+ * order, and only advances the tail past a record once it has been printed.
+ *
+ * The arguments are stored as 64-bit values; the log_print() macro converts them to uint64_t before they are passed on.
+ * Passing them on to io_print_formatted() as such, which reads back just the part the conversion needs, gives the same
+ * result as if they had been printed directly.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common/cpu.h"
+#include "clock.h"
+#include "command_line.h"
+#include "cpu.h"
+#include "io.h"
+#include "log.h"
+#include "monitor.h"
+#include "page_allocator.h"
+#include "spinlock.h"
+
+// The size of each ring buffer, as a page allocator order: 4 KiB << 4 = 64 KiB, or 1024 records.
+#define LOG_RING_ORDER                  4
+#define LOG_RING_RECORDS                (((uint64_t) PAGE_SIZE << LOG_RING_ORDER) / sizeof(log_record_t))
+
+// A log message. The sequence number is the index of the record plus one once the record has been filled in; until then,
+// it is whatever it was when the slot was last used.
+typedef struct
+{
+    volatile uint64_t sequence;
+    uint64_t timestamp;
+    const char *format;
+    log_level_e level;
+    uint64_t arguments[LOG_MAX_ARGUMENTS];
+} __attribute__((aligned(CPU_CACHE_LINE_SIZE))) log_record_t;
+
+_Static_assert(sizeof(log_record_t) == CPU_CACHE_LINE_SIZE, "A log record should take up exactly one cache line");
+
+// The ring buffer of a CPU. The head is written by the producers and the tail by the consumer, so they are kept in
+// separate cache lines.
+typedef struct
+{
+    log_record_t *records;
+    volatile uint64_t head __attribute__((aligned(CPU_CACHE_LINE_SIZE)));
+    volatile uint64_t dropped;
+    volatile uint64_t tail __attribute__((aligned(CPU_CACHE_LINE_SIZE)));
+
+    // The number of dropped records we have told the user about. Only used by the consumer.
+    uint64_t reported_dropped;
+} log_ring_t;
+
+static const char *level_names[] = { "error", "warning", "info", "debug" };
+
+#define LEVEL_COUNT                     (sizeof(level_names) / sizeof(level_names[0]))
+
+volatile log_level_e log_level = log_level_info;
+
+static log_ring_t rings[CPU_MAX_COUNT];
+
+// Held by the CPU draining the log.
+static spinlock_t drain_lock;
+
+void log_init(void)
+{
+    for (int level = 0; level < LEVEL_COUNT; level++)
+    {
+        if (command_line_option_has_value("log_level", level_names[level]))
+        {
+            log_set_level(level);
+        }
+    }
+
+    log_init_cpu();
+}
+
+void log_init_cpu(void)
+{
+    log_ring_t *ring = &rings[cpu_current_id()];
+    log_record_t *records = (log_record_t *) page_allocate(LOG_RING_ORDER);
+    if (records == 0)
+    {
+        io_print_formatted("Log: out of memory when initializing CPU %u, printing messages directly.\n",
+                           cpu_current_id());
+        return;
+    }
+
+    // The sequence numbers must not look like those of published records.
+    for (uint64_t i = 0; i < LOG_RING_RECORDS; i++)
+    {
+        records[i].sequence = 0;
+    }
+
+    ring->head = 0;
+    ring->tail = 0;
+    __atomic_store_n(&ring->records, records, __ATOMIC_RELEASE);
+}
+
+void log_set_level(log_level_e level)
+{
+    log_level = level;
+}
+
+void log_write(log_level_e level, const char *format, unsigned int argument_count, ...)
+{
+    uint64_t timestamp = cpu_read_tsc();
+
+    uint64_t arguments[LOG_MAX_ARGUMENTS] = { 0 };
+    va_list argument_list;
+    va_start(argument_list, argument_count);
+    for (unsigned int i = 0; i < argument_count && i < LOG_MAX_ARGUMENTS; i++)
+    {
+        arguments[i] = va_arg(argument_list, uint64_t);
+    }
+
+    va_end(argument_list);
+
+    log_ring_t *ring = &rings[cpu_current_id()];
+    log_record_t *records = __atomic_load_n(&ring->records, __ATOMIC_ACQUIRE);
+    if (records == NULL)
+    {
+        io_print_formatted(format, arguments[0], arguments[1], arguments[2], arguments[3]);
+        return;
+    }
+
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    do
+    {
+        if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LOG_RING_RECORDS)
+        {
+            __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    } while (!__atomic_compare_exchange_n(&ring->head, &head, head + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    log_record_t *record = &records[head & (LOG_RING_RECORDS - 1)];
+    record->timestamp = timestamp;
+    record->format = format;
+    record->level = level;
+    for (int i = 0; i < LOG_MAX_ARGUMENTS; i++)
+    {
+        record->arguments[i] = arguments[i];
+    }
+
+    __atomic_store_n(&record->sequence, head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Print a log record, preceded by its timestamp in seconds with six decimals.
+ *
+ * @param record  The record.
+ */
+static void log_print_record(const log_record_t *record)
+{
+    uint64_t microseconds = clock_tsc_to_nanoseconds(record->timestamp) / 1000;
+    io_print_formatted("[%U.", microseconds / 1000000);
+    for (uint32_t digit = 100000; digit > 1 && microseconds % 1000000 < digit; digit /= 10)
+    {
+        io_print("0");
+    }
+
+    io_print_formatted("%u] ", (uint32_t) (microseconds % 1000000));
+    if (record->level < log_level_info)
+    {
+        io_print(level_names[record->level]);
+        io_print(": ");
+    }
+
+    io_print_formatted(record->format, record->arguments[0], record->arguments[1], record->arguments[2],
+                       record->arguments[3]);
+}
+
+bool log_drain(void)
+{
+    if (!spinlock_try_lock(&drain_lock))
+    {
+        return false;
+    }
+
+    bool printed = false;
+    while (1 == 1)
+    {
+        // Find the oldest published record among the ring buffers. A record that has been reserved but not yet published
+        // holds up the rest of its ring buffer, since the records must be consumed in order.
+        log_ring_t *oldest_ring = NULL;
+        const log_record_t *oldest_record = NULL;
+        for (unsigned int cpu = 0; cpu < CPU_MAX_COUNT; cpu++)
+        {
+            log_ring_t *ring = &rings[cpu];
+            log_record_t *records = __atomic_load_n(&ring->records, __ATOMIC_ACQUIRE);
+            if (records == NULL)
+            {
+                continue;
+            }
+
+            uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+            if (dropped != ring->reported_dropped)
+            {
+                io_print_formatted("Log: %U message(s) dropped on CPU %u.\n", dropped - ring->reported_dropped, cpu);
+                ring->reported_dropped = dropped;
+                printed = true;
+            }
+
+            uint64_t tail = ring->tail;
+            const log_record_t *record = &records[tail & (LOG_RING_RECORDS - 1)];
+            if (__atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) != tail + 1)
+            {
+                continue;
+            }
+
+            if (oldest_record == NULL || record->timestamp < oldest_record->timestamp)
+            {
+                oldest_ring = ring;
+                oldest_record = record;
+            }
+        }
+
+        if (oldest_record == NULL)
+        {
+            break;
+        }
+
+        log_print_record(oldest_record);
+        printed = true;
+
+        // The slot may be reused as soon as the tail has moved past it.
+        __atomic_store_n(&oldest_ring->tail, oldest_ring->tail + 1, __ATOMIC_RELEASE);
+    }
+
+    spinlock_unlock(&drain_lock);
+    return printed;
+}
+
+uint64_t log_dropped_count(unsigned int cpu_id, uint64_t *reported)
+{
+    *reported = __atomic_load_n(&rings[cpu_id].reported_dropped, __ATOMIC_RELAXED);
+    return __atomic_load_n(&rings[cpu_id].dropped, __ATOMIC_RELAXED);
+}
+
+/**
+ * The log command.
+ */
+static void log_command(const char *arguments)
+{
+    if (monitor_match_word(&arguments, "level"))
+    {
+        if (*arguments != '\0')
+        {
+            int level = 0;
+            while (level < LEVEL_COUNT && !monitor_match_word(&arguments, level_names[level]))
+            {
+                level++;
+            }
+
+            if (level == LEVEL_COUNT)
+            {
+                io_print_formatted("Unknown log level: %s\n", arguments);
+                return;
+            }
+
+            log_set_level(level);
+        }
+
+        io_print_formatted("Log level: %s.\n", level_names[log_level]);
+    }
+    else if (*arguments == '\0')
+    {
+        io_print_formatted("Log level: %s.\n", level_names[log_level]);
+        for (unsigned int cpu = 0; cpu < CPU_MAX_COUNT; cpu++)
+        {
+            if (__atomic_load_n(&rings[cpu].records, __ATOMIC_ACQUIRE) == NULL)
+            {
+                continue;
+            }
+
+            uint64_t reported;
+            uint64_t dropped = log_dropped_count(cpu, &reported);
+            io_print_formatted("CPU %u: %U message(s) dropped, %U of them reported.\n", cpu, dropped, reported);
+        }
+    }
+    else
+    {
+        io_print_formatted("Unknown log command: %s\n", arguments);
+    }
+}
+
+MONITOR_COMMAND("log", log_command, "[level [<level>]] - show the log level and dropped messages (or set the level).");
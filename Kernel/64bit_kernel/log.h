@@ -0,0 +1,129 @@
+/*
+ * log.h - The kernel log. Logging a message only stores the format string, the arguments and a timestamp in a per-CPU
+ * ring buffer; the message is formatted and printed later on, when the bootstrap processor is idle.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#ifndef __LOG_H__
+#define __LOG_H__ 1
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//// Defines.
+// The maximum number of arguments to a log message.
+#define LOG_MAX_ARGUMENTS               4
+
+// Count the number of arguments given to a variadic macro (0 to LOG_MAX_ARGUMENTS). Relies on the GNU extension that
+// swallows the comma before an empty __VA_ARGS__.
+#define LOG_ARGUMENT_COUNT(...)         LOG_ARGUMENT_COUNT_(0, ##__VA_ARGS__, 4, 3, 2, 1, 0)
+#define LOG_ARGUMENT_COUNT_(_0, _1, _2, _3, _4, count, ...) count
+
+// Convert each of the arguments given to a variadic macro to a uint64_t, with a comma in front of each of them. This is
+// how they are stored, and log_write() reads them back as such; passing a narrower value where a uint64_t is read would
+// be undefined behaviour.
+#define LOG_ARGUMENTS(count, ...)       LOG_ARGUMENTS_(count, ##__VA_ARGS__)
+#define LOG_ARGUMENTS_(count, ...)      LOG_ARGUMENTS_##count(__VA_ARGS__)
+#define LOG_ARGUMENTS_0()
+#define LOG_ARGUMENTS_1(a)              , (uint64_t) (a)
+#define LOG_ARGUMENTS_2(a, b)           , (uint64_t) (a), (uint64_t) (b)
+#define LOG_ARGUMENTS_3(a, b, c)        , (uint64_t) (a), (uint64_t) (b), (uint64_t) (c)
+#define LOG_ARGUMENTS_4(a, b, c, d)     , (uint64_t) (a), (uint64_t) (b), (uint64_t) (c), (uint64_t) (d)
+
+#ifdef HOSTED
+// The hosted build (see the hosted folder) has no ring buffers, and prints the messages directly.
+#define log_print(level, format, ...)                                                                                  \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        (void) (level);                                                                                                \
+        io_print_formatted((format), ##__VA_ARGS__);                                                                   \
+    } while (0)
+#else
+/**
+ * Log a message. The format string is the same as for io_print_formatted(), and should normally end with a newline.
+ * Since the message is formatted later on, the format string (and any string arguments) must stay around forever;
+ * string literals are fine, strings on the stack are not. The arguments are not evaluated if the message is filtered
+ * out by the current log level.
+ *
+ * @param level  The log level of the message.
+ * @param format  The format string.
+ */
+#define log_print(level, format, ...)                                                                                  \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        _Static_assert(LOG_ARGUMENT_COUNT(__VA_ARGS__) <= LOG_MAX_ARGUMENTS, "Too many arguments to log_print()");     \
+        if ((level) <= log_level)                                                                                      \
+        {                                                                                                              \
+            log_write((level), (format),                                                                               \
+                      LOG_ARGUMENT_COUNT(__VA_ARGS__) LOG_ARGUMENTS(LOG_ARGUMENT_COUNT(__VA_ARGS__), ##__VA_ARGS__));  \
+        }                                                                                                              \
+    } while (0)
+#endif
+
+//// Type definitions and structures
+// The log levels, from the most to the least important.
+typedef enum
+{
+    log_level_error,
+    log_level_warning,
+    log_level_info,
+    log_level_debug
+} log_level_e;
+
+//// Variables
+// Messages less important than this are thrown away. Use log_set_level() to change it.
+extern volatile log_level_e log_level;
+
+//// Function prototypes
+/**
+ * Initialize the log on the bootstrap processor, and set the log level from the log_level option on the kernel command
+ * line (log_level=error, warning, info or debug). Until then, messages are printed directly.
+ */
+extern void log_init(void);
+
+/**
+ * Initialize the log ring buffer of the current CPU. Must be called once on every application processor. Until then,
+ * messages logged on the CPU are printed directly.
+ */
+extern void log_init_cpu(void);
+
+/**
+ * Change the log level at runtime. Also available as the log level command in the serial monitor.
+ *
+ * @param level  The least important level of the messages to keep.
+ */
+extern void log_set_level(log_level_e level);
+
+/**
+ * Store a log message in the ring buffer of the current CPU. Use the log_print() macro instead of calling this
+ * directly: the arguments must all be uint64_t:s, which is what it converts them to. If the ring buffer is full, the
+ * message is dropped (and counted). May be called from interrupt handlers.
+ *
+ * @param level  The log level of the message.
+ * @param format  The format string.
+ * @param argument_count  The number of arguments following.
+ */
+extern void log_write(log_level_e level, const char *format, unsigned int argument_count, ...);
+
+/**
+ * Format and print all the messages in the ring buffers, in timestamp order. Only one CPU drains the log at a time; if
+ * another CPU is already doing it, this returns right away. Must not be called from interrupt handlers, except for when
+ * the CPU is about to be halted.
+ *
+ * @returns true if any messages were printed, false otherwise.
+ */
+extern bool log_drain(void);
+
+/**
+ * Get the number of messages dropped on a CPU since boot because its ring buffer was full, and the number of them that
+ * have been reported in the log so far. Also available as the log command in the serial monitor (see monitor.h).
+ *
+ * @param cpu_id  The ID of the CPU.
+ * @param reported  Set to the number of dropped messages that have been reported.
+ * @returns the number of messages dropped.
+ */
+extern uint64_t log_dropped_count(unsigned int cpu_id, uint64_t *reported);
+
+#endif // !__LOG_H__
@@ -8,14 +8,65 @@
  * Copyright: © 2008, 2013, 2017 Per Lundberg
  */
 
+#include "common/boot_info.h"
+#include "common/memory.h"
+#include "common/memory_type.h"
 #include "common/misc.h"
+#include "acpi.h"
+#include "apic.h"
+#include "benchmark.h"
+#include "boot_timing.h"
+#include "clock.h"
+#include "command_line.h"
 #include "cpu.h"
+#include "gdt.h"
+#include "heap.h"
+#include "interrupt.h"
 #include "io.h"
+#include "ioapic.h"
+#include "log.h"
 #include "multiboot.h"
+#include "page_allocator.h"
+#include "profile.h"
+#include "qemu.h"
+#include "scheduler.h"
+#include "serial.h"
+#include "smp.h"
+#include "trace.h"
 #include "vm.h"
 
-void main(multiboot_info_t *multiboot_info, uint64_t upper_memory_limit)
+// These symbols are provided by the linker. The kernel is linked as a flat binary, so the BSS section is not part of the
+// image copied into place by the 32-bit loader; we have to clear it ourselves.
+extern uint8_t __bss_start[];
+extern uint8_t _end[];
+
+// The boot information provided by the 32-bit loader. We take a copy of it, so that the memory occupied by the loader can
+// be reclaimed later on.
+static boot_info_t boot_info;
+
+// Note: main() MUST be the first function in this file, since the kernel entry point is the very first byte of the
+// binary.
+void main(multiboot_info_t *multiboot_info, uint64_t upper_memory_limit, const boot_info_t *loader_boot_info)
 {
+    // Read before anything else, since this is where the switch to long mode ends.
+    uint64_t entry_tsc = cpu_read_tsc();
+
+    // The variant is given explicitly here, since the variant selection lives in the BSS which has not been cleared yet.
+    // REP STOSB works on every CPU, and doesn't need memory_init() to have been called. If the kernel has outgrown its
+    // zone, we make sure to not clear anything outside of it, since it could very well be the paging structures (or
+    // something equally important).
+    uint8_t *bss_end = (uint64_t) _end > KERNEL_IMAGE_ZONE_END ? (uint8_t *) KERNEL_IMAGE_ZONE_END : _end;
+    memory_zero_variant(memory_variant_rep_movsb, __bss_start, bss_end - __bss_start);
+    memory_init();
+    boot_timing_init(loader_boot_info, entry_tsc);
+
+    // The per-CPU data area lives in the BSS as well. It must be set up before anything uses cpu_current_id().
+    smp_init_bootstrap_processor();
+
+    // The PAT has already been programmed by the 32-bit loader, but we need to know the PAT layout to be able to set up any
+    // mappings of our own.
+    memory_type_init();
+
     io_init();
     io_leet_print("cocOS64 version 0.1.0 loading...");
 #ifdef CHANGESET
@@ -23,23 +74,75 @@ void main(multiboot_info_t *multiboot_info, uint64_t upper_memory_limit)
 #endif
     io_print("\n");
 
-    // Alright. We are now in 64-bit mode. However, for the moment only the lowest 2 megs of RAM are properly 1-to-1 mapped
-    // (identity mapped), and can be accessed. This is set up in the 64-bit initialization code in the 32-bit
-    // loader. (64bit.S) Now, it is time to create real VM structure (PML4, Page Directory Pointers and Page Tables) for
-    // all the physical memory.
+    // The banner above is printed with the PIT as the time source, since the TSC has not been calibrated yet.
+    clock_init();
+    boot_timing_end_phase(boot_phase_kernel_early);
+
+    if ((uint64_t) _end > KERNEL_IMAGE_ZONE_END)
+    {
+        io_print_formatted("The kernel image ends at %X, outside of the kernel image zone (ends at %X). Halting.\n",
+                           (uint64_t) _end, (uint64_t) KERNEL_IMAGE_ZONE_END);
+        HALT();
+    }
+
+    memory_copy(&boot_info, loader_boot_info, sizeof(boot_info));
+    command_line_init(boot_info.command_line);
+    io_select_outputs();
+    qemu_init();
+    page_allocator_init(&boot_info);
+    boot_timing_end_phase(boot_phase_kernel_memory);
 
-    // There is only one little problem: the physical memory size is located in the Multiboot structure, which can be placed
-    // anywere in RAM, and thus be inaccessible to us. We solve it by having it provided to us as a parameter to this
-    // function: upper_memory_limit. This parameter gives us the total amount of memory in the system. By using this
-    // parameter, we know how much physical memory to map in the lower VM zone (see the cocOS VM Specification for more
-    // information about the VM zones). When this memory is mapped, we can then read the Multiboot memory map once again to
-    // know which pages to flag as usable and which ones that are reserved by hardware.
+    // From here on, exceptions are reported instead of triple-faulting the machine. The GDT must come first, since the TSS
+    // holds the stacks used for double faults and NMI:s; those stacks come from the page allocator.
+    gdt_init_cpu();
+    interrupt_init();
 
+    heap_init();
+    scheduler_init_cpu();
+    log_init();
+    trace_init();
+    boot_timing_end_phase(boot_phase_kernel_interrupts);
+
+    // The application processors need a stack each, so they can only be started once the page allocator is up. The timer
+    // is calibrated (and the profiler, which may change how often it ticks, set up) before they are started, since they
+    // start their own timers as soon as they come online.
+    acpi_init(boot_info.acpi_rsdp_address);
+    apic_init(acpi_local_apic_address());
+    profile_init();
+    apic_timer_calibrate();
+    smp_init();
+    apic_timer_start();
+    boot_timing_end_phase(boot_phase_kernel_cpus);
+
+    // The device interrupts are all delivered to the bootstrap processor, for now.
+    ioapic_init();
+    serial_enable_interrupts();
+    interrupt_enable();
+    boot_timing_end_phase(boot_phase_kernel_devices);
+
+    // All of the physical memory has already been identity mapped by the 32-bit loader (see vm32.c). vm_init() adopts
+    // its PML4 as the kernel address space; from here on, the mappings are changed with the runtime page-table
+    // functions in vm.c.
     vm_init (upper_memory_limit);
+    boot_timing_end_phase(boot_phase_kernel_vm);
+
+    // Print the messages logged while booting, so that they come before the output of the benchmarks.
+    log_drain();
 
     io_print("Kernel command line: ");
-    io_print(KERNEL_COMMAND_LINE);
+    io_print(boot_info.command_line);
     io_print("\n");
 
-    while (1 == 1);
+    boot_timing_report();
+
+    benchmark_run_selected();
+    profile_dump();
+    trace_dump();
+
+    // When running under the test harness, we are done once the benchmarks have run. (If the qemu_exit option was not
+    // given, this does nothing.)
+    qemu_exit(true);
+
+    // We have nothing more to do ourselves, so we become the idle thread of the bootstrap processor.
+    scheduler_idle();
 }
@@ -0,0 +1,226 @@
+/*
+ * memory_benchmark.c - Microbenchmarks of the memory primitives, run with benchmark=memory (see benchmark.h).
+ *
+ * The memory.copy_* and memory.zero_* benchmarks measure memory_copy() and memory_zero() as the rest of the kernel uses
+ * them, i.e. with the variant selected for each size. The memory.<variant>.* benchmarks measure each of the variants the
+ * CPU supports on its own, on blocks of VARIANT_BLOCK_SIZE bytes.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common/memory.h"
+#include "common/misc.h"
+#include "benchmark.h"
+#include "io.h"
+#include "page_allocator.h"
+
+// The largest block size being tested: above MEMORY_LARGE_LIMIT, so that memory_copy() and memory_zero() use the variant
+// selected for large blocks. The buffers are allocated from the page allocator when the benchmarks are set up.
+#define MAX_BLOCK_SIZE                  (1 * MiB)
+#define BUFFER_ORDER                    8
+
+_Static_assert(MAX_BLOCK_SIZE >= MEMORY_LARGE_LIMIT, "The largest block should be in the large size class");
+_Static_assert(MAX_BLOCK_SIZE == (uint64_t) PAGE_SIZE << BUFFER_ORDER, "The buffers should hold the largest block");
+
+// The block size used for comparing the variants: larger than the L1 cache, but small enough to stay in the L2 cache.
+#define VARIANT_BLOCK_SIZE              (64 * KiB)
+
+static uint8_t *source_buffer;
+static uint8_t *target_buffer;
+
+// The variant measured by the memory.<variant>.* benchmark being run.
+static memory_variant_e variant;
+
+// Set once the selected variants have been printed.
+static bool selected_variants_printed;
+
+/**
+ * Free the source and target buffers.
+ */
+static void teardown(void)
+{
+    if (source_buffer != NULL)
+    {
+        page_free((uint64_t) source_buffer, BUFFER_ORDER);
+        source_buffer = NULL;
+    }
+
+    if (target_buffer != NULL)
+    {
+        page_free((uint64_t) target_buffer, BUFFER_ORDER);
+        target_buffer = NULL;
+    }
+}
+
+/**
+ * Allocate the source and target buffers.
+ *
+ * @returns true on success, false if the benchmark should be skipped.
+ */
+static bool setup(void)
+{
+    source_buffer = (uint8_t *) page_allocate(BUFFER_ORDER);
+    target_buffer = (uint8_t *) page_allocate(BUFFER_ORDER);
+    if (source_buffer == NULL || target_buffer == NULL)
+    {
+        io_print_line("Memory benchmark: could not allocate the buffers, skipping.");
+        teardown();
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Set up one of the memory.<variant>.* benchmarks. The variants selected for each size class are printed along with the
+ * first of them, for comparison.
+ *
+ * @param benchmark_variant  The variant to measure.
+ * @returns true on success, false if the CPU doesn't support the variant or the buffers could not be allocated.
+ */
+static bool setup_variant(memory_variant_e benchmark_variant)
+{
+    if (!selected_variants_printed)
+    {
+        io_print_formatted("Memory benchmark: selected variants are %s (small), %s (medium) and %s (large).\n",
+                           memory_variant_name(memory_selected_variant(memory_size_small)),
+                           memory_variant_name(memory_selected_variant(memory_size_medium)),
+                           memory_variant_name(memory_selected_variant(memory_size_large)));
+        selected_variants_printed = true;
+    }
+
+    if (!memory_variant_is_available(benchmark_variant))
+    {
+        io_print_formatted("Memory benchmark: the %s variant is not supported by this CPU, skipping.\n",
+                           memory_variant_name(benchmark_variant));
+        return false;
+    }
+
+    variant = benchmark_variant;
+    return setup();
+}
+
+/**
+ * Copy a block with the variant being measured a number of times.
+ *
+ * @param iterations  The number of times.
+ */
+static void copy_variant(uint64_t iterations)
+{
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        memory_copy_variant(variant, target_buffer, source_buffer, VARIANT_BLOCK_SIZE);
+    }
+}
+
+/**
+ * Zero a block with the variant being measured a number of times.
+ *
+ * @param iterations  The number of times.
+ */
+static void zero_variant(uint64_t iterations)
+{
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        memory_zero_variant(variant, target_buffer, VARIANT_BLOCK_SIZE);
+    }
+}
+
+/**
+ * Declare the memory.<variant>.copy and memory.<variant>.zero benchmarks of a variant.
+ *
+ * @param name  The name of the variant, as in memory_variant_e but without the memory_variant_ prefix.
+ */
+#define VARIANT_BENCHMARKS(name)                                                                                       \
+    static bool setup_##name(void)                                                                                     \
+    {                                                                                                                  \
+        return setup_variant(memory_variant_##name);                                                                   \
+    }                                                                                                                  \
+                                                                                                                       \
+    static void copy_##name(uint64_t iterations)                                                                       \
+    {                                                                                                                  \
+        copy_variant(iterations);                                                                                      \
+    }                                                                                                                  \
+                                                                                                                       \
+    static void zero_##name(uint64_t iterations)                                                                       \
+    {                                                                                                                  \
+        zero_variant(iterations);                                                                                      \
+    }                                                                                                                  \
+                                                                                                                       \
+    BENCHMARK("memory." #name ".copy", copy_##name, setup_##name, teardown);                                           \
+    BENCHMARK("memory." #name ".zero", zero_##name, setup_##name, teardown)
+
+static void copy_64b(uint64_t iterations)
+{
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        memory_copy(target_buffer, source_buffer, 64);
+    }
+}
+
+static void copy_4kib(uint64_t iterations)
+{
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        memory_copy(target_buffer, source_buffer, 4 * KiB);
+    }
+}
+
+static void copy_256kib(uint64_t iterations)
+{
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        memory_copy(target_buffer, source_buffer, 256 * KiB);
+    }
+}
+
+static void copy_1mib(uint64_t iterations)
+{
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        memory_copy(target_buffer, source_buffer, MAX_BLOCK_SIZE);
+    }
+}
+
+static void zero_4kib(uint64_t iterations)
+{
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        memory_zero(target_buffer, 4 * KiB);
+    }
+}
+
+static void zero_256kib(uint64_t iterations)
+{
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        memory_zero(target_buffer, 256 * KiB);
+    }
+}
+
+static void zero_1mib(uint64_t iterations)
+{
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        memory_zero(target_buffer, MAX_BLOCK_SIZE);
+    }
+}
+
+BENCHMARK("memory.copy_64b", copy_64b, setup, teardown);
+BENCHMARK("memory.copy_4kib", copy_4kib, setup, teardown);
+BENCHMARK("memory.copy_256kib", copy_256kib, setup, teardown);
+BENCHMARK("memory.copy_1mib", copy_1mib, setup, teardown);
+BENCHMARK("memory.zero_4kib", zero_4kib, setup, teardown);
+BENCHMARK("memory.zero_256kib", zero_256kib, setup, teardown);
+BENCHMARK("memory.zero_1mib", zero_1mib, setup, teardown);
+
+VARIANT_BENCHMARKS(bytewise);
+VARIANT_BENCHMARKS(rep_movsb);
+VARIANT_BENCHMARKS(rep_movs_word);
+VARIANT_BENCHMARKS(sse2);
+VARIANT_BENCHMARKS(non_temporal);
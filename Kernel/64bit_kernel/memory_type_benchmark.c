@@ -0,0 +1,155 @@
+/*
+ * memory_type_benchmark.c - Store bandwidth benchmarks for the different memory types, run with benchmark=memory_type
+ * (see benchmark.h). Each iteration of the memory_type.<type> benchmarks zeroes a 2 MiB scratch page that has been
+ * remapped with that memory type.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "common/cpu.h"
+#include "common/memory.h"
+#include "common/memory_type.h"
+#include "common/misc.h"
+#include "common/vm.h"
+#include "benchmark.h"
+#include "io.h"
+#include "page_allocator.h"
+
+// The scratch page being remapped is a 2 MiB block from the page allocator. For this to work, it must be mapped using a
+// single PDE in the identity mapping; the page allocator hands out low memory first, which is never mapped using 1 GiB
+// pages, so this is normally the case.
+#define SCRATCH_PAGE_SIZE               VM_2MIB_PAGE_SIZE
+
+// The scratch page, and the PDE mapping it as it was before the memory type was changed.
+static uint64_t scratch_page;
+static pde_t *scratch_pde;
+static pde_t original_pde;
+
+/**
+ * Find the page directory entry for the scratch page, by walking the paging structures that CR3 points at. The paging
+ * structures are located in identity-mapped memory, so their physical addresses can be used as-is.
+ *
+ * @param scratch_page  The address of the scratch page.
+ * @returns the PDE, or NULL if the scratch page is not mapped using a 2 MiB page.
+ */
+static pde_t *find_scratch_pde(uint64_t scratch_page)
+{
+    uint64_t virtual_page = scratch_page / VM_4KIB_PAGE_SIZE;
+    int pml4_index = (virtual_page >> VM_PML4_INDEX_LOW_BIT) & VM_INDEX_MASK;
+    int pdp_index = (virtual_page >> VM_PDP_INDEX_LOW_BIT) & VM_INDEX_MASK;
+    int pd_index = (virtual_page >> VM_PD_INDEX_LOW_BIT) & VM_INDEX_MASK;
+
+    pml4e_t *pml4 = (pml4e_t *) (cpu_get_cr3() & ~((uint64_t) VM_4KIB_PAGE_SIZE - 1));
+    if (!pml4[pml4_index].present)
+    {
+        return 0;
+    }
+
+    pdpe_t *pdp = (pdpe_t *) ((uint64_t) pml4[pml4_index].pdp_base_address * VM_4KIB_PAGE_SIZE);
+    if (!pdp[pdp_index].present || pdp[pdp_index].page_size)
+    {
+        return 0;
+    }
+
+    pde_t *pd = (pde_t *) ((uint64_t) pdp[pdp_index].pd_base_address * VM_4KIB_PAGE_SIZE);
+    if (!pd[pd_index].present || !pd[pd_index].page_size)
+    {
+        return 0;
+    }
+
+    return &pd[pd_index];
+}
+
+/**
+ * Change the memory type of the scratch page. The caches are flushed before the change, since there must not be any
+ * cache lines for the page left around when it changes to a memory type which does not snoop them.
+ */
+static void set_scratch_memory_type(uint64_t scratch_page, pde_t *pde, memory_type_e memory_type)
+{
+    unsigned int pat_index = memory_type_pat_index(memory_type);
+
+    cpu_flush_caches();
+
+    pde->pwt = (pat_index & PAT_INDEX_PWT) != 0;
+    pde->pcd = (pat_index & PAT_INDEX_PCD) != 0;
+
+    // For large pages, the PAT bit is located in the lowest bit of the base address.
+    pde->base_address = (pde->base_address & ~1ULL) | ((pat_index & PAT_INDEX_PAT) != 0);
+
+    cpu_invalidate_page((void *) scratch_page);
+}
+
+/**
+ * Allocate the scratch page, and change its memory type.
+ *
+ * @param memory_type  The memory type.
+ * @returns true on success, false if the benchmark should be skipped.
+ */
+static bool setup(memory_type_e memory_type)
+{
+    scratch_page = page_allocate(PAGE_ALLOCATOR_2MIB_ORDER);
+    if (scratch_page == 0)
+    {
+        io_print_line("Memory type benchmark: could not allocate a scratch page, skipping.");
+        return false;
+    }
+
+    scratch_pde = find_scratch_pde(scratch_page);
+    if (scratch_pde == 0)
+    {
+        io_print_line("Memory type benchmark: the scratch page is not mapped using a 2 MiB page, skipping.");
+        page_free(scratch_page, PAGE_ALLOCATOR_2MIB_ORDER);
+        return false;
+    }
+
+    original_pde = *scratch_pde;
+    set_scratch_memory_type(scratch_page, scratch_pde, memory_type);
+    return true;
+}
+
+/**
+ * Restore the memory type of the scratch page, and free it.
+ */
+static void teardown(void)
+{
+    cpu_flush_caches();
+    *scratch_pde = original_pde;
+    cpu_invalidate_page((void *) scratch_page);
+
+    page_free(scratch_page, PAGE_ALLOCATOR_2MIB_ORDER);
+}
+
+static void zero_scratch_page(uint64_t iterations)
+{
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        memory_zero_variant(memory_variant_rep_movs_word, (void *) scratch_page, SCRATCH_PAGE_SIZE);
+    }
+}
+
+/**
+ * Declare the memory_type.<type> benchmark of a memory type.
+ *
+ * @param name  The name of the memory type, as in memory_type_e but without the memory_type_ prefix.
+ */
+#define MEMORY_TYPE_BENCHMARK(name)                                                                                    \
+    static bool setup_##name(void)                                                                                     \
+    {                                                                                                                  \
+        return setup(memory_type_##name);                                                                              \
+    }                                                                                                                  \
+                                                                                                                       \
+    static void zero_##name(uint64_t iterations)                                                                       \
+    {                                                                                                                  \
+        zero_scratch_page(iterations);                                                                                 \
+    }                                                                                                                  \
+                                                                                                                       \
+    BENCHMARK("memory_type." #name, zero_##name, setup_##name, teardown)
+
+MEMORY_TYPE_BENCHMARK(write_back);
+MEMORY_TYPE_BENCHMARK(write_through);
+MEMORY_TYPE_BENCHMARK(write_combining);
+MEMORY_TYPE_BENCHMARK(uncached);
@@ -0,0 +1,124 @@
+/*
+ * monitor.c - A simple command interpreter on the serial port.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "io.h"
+#include "monitor.h"
+#include "serial.h"
+
+// The commands, as collected by the linker.
+extern const monitor_command_t __start_monitor_commands[];
+extern const monitor_command_t __stop_monitor_commands[];
+
+// The command line being entered. Only the bootstrap processor touches it.
+static char line[MONITOR_LINE_LENGTH];
+static unsigned int line_length;
+
+// The last character received, so that a CR LF only ends one line.
+static char previous;
+
+bool monitor_match_word(const char **arguments, const char *word)
+{
+    const char *text = *arguments;
+    while (*word != '\0' && *text == *word)
+    {
+        text++;
+        word++;
+    }
+
+    if (*word != '\0' || (*text != '\0' && *text != ' '))
+    {
+        return false;
+    }
+
+    while (*text == ' ')
+    {
+        text++;
+    }
+
+    *arguments = text;
+    return true;
+}
+
+/**
+ * Run the command on the command line.
+ */
+static void run_line(void)
+{
+    const char *text = line;
+    while (*text == ' ')
+    {
+        text++;
+    }
+
+    if (*text == '\0')
+    {
+        return;
+    }
+
+    for (const monitor_command_t *command = __start_monitor_commands; command < __stop_monitor_commands; command++)
+    {
+        if (monitor_match_word(&text, command->name))
+        {
+            command->function(text);
+            return;
+        }
+    }
+
+    io_print_formatted("Unknown command: %s. Type help for a list of the commands.\n", text);
+}
+
+bool monitor_poll(void)
+{
+    bool received = false;
+    char c;
+    while (serial_read(&c))
+    {
+        received = true;
+        if (c == '\n' && previous == '\r')
+        {
+            // The end of a line we have already run.
+        }
+        else if (c == '\r' || c == '\n')
+        {
+            serial_write("\n", 1);
+            line[line_length] = '\0';
+            run_line();
+            line_length = 0;
+            serial_write("> ", 2);
+        }
+        else if ((c == '\b' || c == 0x7F) && line_length > 0)
+        {
+            line_length--;
+            serial_write("\b \b", 3);
+        }
+        else if (c >= ' ' && c < 0x7F && line_length < MONITOR_LINE_LENGTH - 1)
+        {
+            line[line_length++] = c;
+            serial_write(&c, 1);
+        }
+
+        previous = c;
+    }
+
+    return received;
+}
+
+/**
+ * The help command.
+ */
+static void help_command(const char *arguments)
+{
+    for (const monitor_command_t *command = __start_monitor_commands; command < __stop_monitor_commands; command++)
+    {
+        io_print_formatted("%s %s\n", command->name, command->help);
+    }
+}
+
+MONITOR_COMMAND("help", help_command, "- list the commands.");
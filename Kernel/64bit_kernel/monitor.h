@@ -0,0 +1,61 @@
+/*
+ * monitor.h - A simple command interpreter on the serial port, for poking at the kernel while it is running. A command
+ * is declared anywhere in the kernel with the MONITOR_COMMAND() macro; help lists the commands there are.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#ifndef __MONITOR_H__
+#define __MONITOR_H__ 1
+
+#include <stdbool.h>
+
+//// Defines.
+// The longest command line that can be entered. Anything beyond this is ignored.
+#define MONITOR_LINE_LENGTH             128
+
+//// Type definitions and structures
+typedef struct
+{
+    // The name of the command, i.e. the first word on the command line.
+    const char *name;
+
+    // Run the command. The arguments are the rest of the command line, with the leading spaces skipped.
+    void (*function)(const char *arguments);
+
+    // A line of help text, listing the arguments and what the command does.
+    const char *help;
+} monitor_command_t;
+
+//// Macros
+/**
+ * Declare a monitor command. The commands are collected in a section of their own by the linker, like the benchmarks.
+ *
+ * @param name  The name of the command, as a string.
+ * @param function  The function running the command.
+ * @param help  The help text, as a string.
+ */
+#define MONITOR_COMMAND(name, function, help)                                                                          \
+    static const monitor_command_t monitor_command_##function                                                          \
+        __attribute__((used, section("monitor_commands"), aligned(sizeof(void *)))) = { name, function, help }
+
+//// Function prototypes
+/**
+ * Handle the input received on the serial port since the last call: echo it, and run the commands entered. Called by
+ * the idle loop of the bootstrap processor.
+ *
+ * @returns true if there was any input, false otherwise.
+ */
+extern bool monitor_poll(void);
+
+/**
+ * Check if the arguments of a command start with a given word, and skip past it (and the spaces after it) if so.
+ *
+ * @param arguments  The arguments [in, out]
+ * @param word  The word.
+ * @returns true if the arguments started with the word, false otherwise.
+ */
+extern bool monitor_match_word(const char **arguments, const char *word);
+
+#endif // !__MONITOR_H__
@@ -0,0 +1,447 @@
+/*
+ * page_allocator.c - The physical page allocator. This is a binary buddy allocator: the free memory is kept in blocks of
+ * 2^order pages, one free list per order. A block is split in two halves ("buddies") when a smaller block is needed, and
+ * the halves are merged back together when both of them have been freed.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common/boot_info.h"
+#include "common/memory.h"
+#include "common/misc.h"
+#include "common/vm.h"
+#include "cpu.h"
+#include "io.h"
+#include "log.h"
+#include "page_allocator.h"
+#include "spinlock.h"
+#include "trace.h"
+
+// All of the physical memory is identity mapped, so the free lists can be kept in the free blocks themselves. This means
+// that the only memory needed for keeping track of the free blocks is the buddy bitmaps (see below).
+typedef struct free_block
+{
+    struct free_block *next;
+    struct free_block *previous;
+} free_block_t;
+
+// The RAM below this address is never handed out. The first page must stay unmapped (to trap NULL pointer references),
+// the GDT lives at 0x1000, and the rest of the low 1 MiB is full of BIOS stuff anyway.
+#define LOWEST_ADDRESS                  (1 * MiB)
+
+// The number of pages kept in each per-CPU cache, and the number of pages moved between a cache and the buddy allocator at
+// a time. Moving pages in batches means that the global lock is only taken for every PAGE_CACHE_BATCH allocations or
+// frees, even in the worst case.
+#define PAGE_CACHE_SIZE                 64
+#define PAGE_CACHE_BATCH                32
+
+// A per-CPU cache of single (order 0) pages. These are only ever accessed by their own CPU, and never from interrupt
+// handlers (see page_allocator.h), so they don't need any locking. They are aligned on cache lines to avoid false
+// sharing between the CPU:s.
+typedef struct
+{
+    uint32_t count;
+    uint64_t pages[PAGE_CACHE_SIZE];
+} __attribute__((aligned(CPU_CACHE_LINE_SIZE))) page_cache_t;
+
+// The lock protecting the free lists, the buddy bitmaps and the free page count.
+static spinlock_t lock;
+
+static free_block_t *free_lists[PAGE_ALLOCATOR_MAX_ORDER + 1];
+
+// The buddy bitmaps, one per order (except for the highest one, since its blocks are never merged). There is one bit per
+// pair of buddies, which is set if exactly one of them is free. In other words, the bit is toggled every time one of the
+// buddies is allocated or freed, and if it is cleared after freeing a block, its buddy is free as well and the two can be
+// merged. This trick (which is as old as the buddy allocator itself) means that we only need half a bit per page.
+static uint64_t *buddy_bitmaps[PAGE_ALLOCATOR_MAX_ORDER];
+
+// The number of free pages in the free lists. The pages in the per-CPU caches are not included.
+static uint64_t free_pages;
+
+static page_cache_t page_caches[CPU_MAX_COUNT];
+
+// The reserved ranges from the boot information, plus the low memory and the buddy bitmaps.
+static boot_info_range_t reserved_ranges[BOOT_INFO_MAX_RESERVED_RANGES + 2];
+static uint32_t reserved_range_count;
+
+/**
+ * Toggle the buddy bit for a given block.
+ *
+ * @returns the new value of the bit.
+ */
+static bool toggle_buddy_bit(uint64_t address, unsigned int order)
+{
+    uint64_t pair = address / ((uint64_t) PAGE_SIZE << (order + 1));
+    uint64_t mask = 1ULL << (pair % 64);
+
+    buddy_bitmaps[order][pair / 64] ^= mask;
+    return (buddy_bitmaps[order][pair / 64] & mask) != 0;
+}
+
+static void free_list_push(uint64_t address, unsigned int order)
+{
+    free_block_t *block = VM_PHYSICAL_TO_POINTER(address);
+
+    block->previous = NULL;
+    block->next = free_lists[order];
+    if (block->next != NULL)
+    {
+        block->next->previous = block;
+    }
+
+    free_lists[order] = block;
+}
+
+static void free_list_remove(free_block_t *block, unsigned int order)
+{
+    if (block->previous != NULL)
+    {
+        block->previous->next = block->next;
+    }
+    else
+    {
+        free_lists[order] = block->next;
+    }
+
+    if (block->next != NULL)
+    {
+        block->next->previous = block->previous;
+    }
+}
+
+/**
+ * Allocate a block from the free lists. The lock must be held by the caller.
+ */
+static uint64_t buddy_allocate(unsigned int order)
+{
+    // Find the smallest free block that is large enough.
+    unsigned int current_order = order;
+    while (current_order <= PAGE_ALLOCATOR_MAX_ORDER && free_lists[current_order] == NULL)
+    {
+        current_order++;
+    }
+
+    if (current_order > PAGE_ALLOCATOR_MAX_ORDER)
+    {
+        return 0;
+    }
+
+    free_block_t *block = free_lists[current_order];
+    free_list_remove(block, current_order);
+
+    uint64_t address = VM_POINTER_TO_PHYSICAL(block);
+    if (current_order < PAGE_ALLOCATOR_MAX_ORDER)
+    {
+        toggle_buddy_bit(address, current_order);
+    }
+
+    // If the block is larger than what we need, split it and put the upper halves back on the free lists.
+    while (current_order > order)
+    {
+        current_order--;
+        free_list_push(address + ((uint64_t) PAGE_SIZE << current_order), current_order);
+        toggle_buddy_bit(address, current_order);
+    }
+
+    free_pages -= 1ULL << order;
+    return address;
+}
+
+/**
+ * Return a block to the free lists, merging it with its buddy for as long as possible. The lock must be held by the
+ * caller.
+ */
+static void buddy_free(uint64_t address, unsigned int order)
+{
+    free_pages += 1ULL << order;
+
+    while (order < PAGE_ALLOCATOR_MAX_ORDER)
+    {
+        // If the bit is set after toggling it, the buddy is in use and we can't merge any further.
+        if (toggle_buddy_bit(address, order))
+        {
+            break;
+        }
+
+        uint64_t buddy_address = address ^ ((uint64_t) PAGE_SIZE << order);
+        free_list_remove(VM_PHYSICAL_TO_POINTER(buddy_address), order);
+
+        if (buddy_address < address)
+        {
+            address = buddy_address;
+        }
+
+        order++;
+    }
+
+    free_list_push(address, order);
+}
+
+/**
+ * Add a range of free memory to the free lists, as the largest naturally aligned blocks possible.
+ */
+static void add_free_range(uint64_t start, uint64_t end)
+{
+    while (start < end)
+    {
+        unsigned int order = PAGE_ALLOCATOR_MAX_ORDER;
+        while (order > 0 &&
+               (start % ((uint64_t) PAGE_SIZE << order) != 0 || start + ((uint64_t) PAGE_SIZE << order) > end))
+        {
+            order--;
+        }
+
+        buddy_free(start, order);
+        start += (uint64_t) PAGE_SIZE << order;
+    }
+}
+
+/**
+ * Add the parts of a range of RAM that don't overlap any reserved range (starting with the given one) to the free lists.
+ * The reserved ranges can overlap each other, so we split the range around the first overlapping reserved range and take
+ * care of the pieces on each side of it recursively.
+ */
+static void add_ram_range(uint64_t start, uint64_t end, uint32_t first_reserved_range)
+{
+    if (start >= end)
+    {
+        return;
+    }
+
+    for (uint32_t i = first_reserved_range; i < reserved_range_count; i++)
+    {
+        const boot_info_range_t *range = &reserved_ranges[i];
+        if (range->start < end && range->end > start)
+        {
+            // The reserved ranges are not necessarily page aligned, so we round them outwards.
+            add_ram_range(start, range->start & ~((uint64_t) PAGE_SIZE - 1), i + 1);
+            add_ram_range((range->end + PAGE_SIZE - 1) & ~((uint64_t) PAGE_SIZE - 1), end, i + 1);
+            return;
+        }
+    }
+
+    add_free_range(start, end);
+}
+
+/**
+ * Get the page aligned start and end of a RAM region. Partial pages at the edges of the region are not usable.
+ *
+ * @returns false if the region is not RAM, or doesn't contain a single full page.
+ */
+static bool get_ram_region(const memory_map_region_t *region, uint64_t *start, uint64_t *end)
+{
+    if (region->type != MEMORY_REGION_TYPE_RAM)
+    {
+        return false;
+    }
+
+    *start = (region->base_address + PAGE_SIZE - 1) & ~((uint64_t) PAGE_SIZE - 1);
+    *end = (region->base_address + region->length) & ~((uint64_t) PAGE_SIZE - 1);
+    return *start < *end;
+}
+
+void page_allocator_init(const boot_info_t *boot_info)
+{
+    const memory_map_t *memory_map = &boot_info->memory_map;
+
+    // Start from scratch. This only matters if the allocator is initialized more than once, which never happens when
+    // booting, but all the time in the hosted build (see the hosted folder).
+    memory_zero(free_lists, sizeof(free_lists));
+    memory_zero(page_caches, sizeof(page_caches));
+    free_pages = 0;
+    reserved_range_count = 0;
+
+    reserved_ranges[reserved_range_count].start = 0;
+    reserved_ranges[reserved_range_count].end = LOWEST_ADDRESS;
+    reserved_range_count++;
+
+    for (uint32_t i = 0; i < boot_info->reserved_range_count; i++)
+    {
+        reserved_ranges[reserved_range_count++] = boot_info->reserved_ranges[i];
+    }
+
+    // Calculate the size of the buddy bitmaps. They need to cover all of the physical memory up to the end of the last RAM
+    // region; holes in the memory map are simply never freed.
+    uint64_t end_address = 0;
+    for (uint32_t i = 0; i < memory_map->count; i++)
+    {
+        uint64_t start, end;
+        if (get_ram_region(&memory_map->regions[i], &start, &end) && end > end_address)
+        {
+            end_address = end;
+        }
+    }
+
+    uint64_t bitmap_words[PAGE_ALLOCATOR_MAX_ORDER];
+    uint64_t bitmap_size = 0;
+    for (unsigned int order = 0; order < PAGE_ALLOCATOR_MAX_ORDER; order++)
+    {
+        uint64_t pairs = end_address / ((uint64_t) PAGE_SIZE << (order + 1)) + 1;
+        bitmap_words[order] = (pairs + 63) / 64;
+        bitmap_size += bitmap_words[order] * sizeof(uint64_t);
+    }
+
+    bitmap_size = (bitmap_size + PAGE_SIZE - 1) & ~((uint64_t) PAGE_SIZE - 1);
+
+    // Place the bitmaps at the start of the first free chunk of RAM that is large enough to hold them. This is a bit of a
+    // chicken-and-egg problem, so we have to look for it "manually".
+    uint64_t bitmap_address = 0;
+    for (uint32_t i = 0; i < memory_map->count && bitmap_address == 0; i++)
+    {
+        uint64_t start, end;
+        if (!get_ram_region(&memory_map->regions[i], &start, &end))
+        {
+            continue;
+        }
+
+        // Move the candidate past any reserved range it overlaps, until it doesn't overlap any of them.
+        uint64_t candidate = start;
+        bool moved = true;
+        while (moved && candidate + bitmap_size <= end)
+        {
+            moved = false;
+            for (uint32_t j = 0; j < reserved_range_count; j++)
+            {
+                if (reserved_ranges[j].start < candidate + bitmap_size && reserved_ranges[j].end > candidate)
+                {
+                    candidate = (reserved_ranges[j].end + PAGE_SIZE - 1) & ~((uint64_t) PAGE_SIZE - 1);
+                    moved = true;
+                }
+            }
+        }
+
+        if (candidate + bitmap_size <= end)
+        {
+            bitmap_address = candidate;
+        }
+    }
+
+    if (bitmap_address == 0)
+    {
+        io_print_formatted("Not enough memory for the page allocator bitmaps (%U KiB needed). Halting.\n",
+                           bitmap_size / KiB);
+        HALT();
+    }
+
+    memory_zero(VM_PHYSICAL_TO_POINTER(bitmap_address), bitmap_size);
+    uint64_t *bitmap = VM_PHYSICAL_TO_POINTER(bitmap_address);
+    for (unsigned int order = 0; order < PAGE_ALLOCATOR_MAX_ORDER; order++)
+    {
+        buddy_bitmaps[order] = bitmap;
+        bitmap += bitmap_words[order];
+    }
+
+    reserved_ranges[reserved_range_count].start = bitmap_address;
+    reserved_ranges[reserved_range_count].end = bitmap_address + bitmap_size;
+    reserved_range_count++;
+
+    // Now, add all the free RAM. This is done from the top down: since the free lists are LIFO, this means that low memory
+    // gets handed out first, and the high memory is kept untouched for as long as possible. (Low memory is mapped using
+    // smaller pages in the identity mapping, and some devices can only do DMA to it.)
+    for (uint32_t i = memory_map->count; i > 0; i--)
+    {
+        uint64_t start, end;
+        if (get_ram_region(&memory_map->regions[i - 1], &start, &end))
+        {
+            add_ram_range(start, end, 0);
+        }
+    }
+
+    log_print(log_level_info, "Page allocator: %U MiB free, %U KiB of buddy bitmaps.\n", free_pages * PAGE_SIZE / MiB,
+              bitmap_size / KiB);
+}
+
+uint64_t page_allocate(unsigned int order)
+{
+    TRACE(trace_event_page_allocate_begin, order, 0);
+
+    uint64_t address = 0;
+    if (order > PAGE_ALLOCATOR_MAX_ORDER)
+    {
+        // There are no blocks this large.
+    }
+    else if (order > 0)
+    {
+        spinlock_lock(&lock);
+        address = buddy_allocate(order);
+        spinlock_unlock(&lock);
+    }
+    else
+    {
+        page_cache_t *cache = &page_caches[cpu_current_id()];
+        if (cache->count == 0)
+        {
+            spinlock_lock(&lock);
+            while (cache->count < PAGE_CACHE_BATCH)
+            {
+                uint64_t page = buddy_allocate(0);
+                if (page == 0)
+                {
+                    break;
+                }
+
+                cache->pages[cache->count++] = page;
+            }
+            spinlock_unlock(&lock);
+        }
+
+        if (cache->count > 0)
+        {
+            address = cache->pages[--cache->count];
+        }
+    }
+
+    TRACE(trace_event_page_allocate_end, order, address);
+    return address;
+}
+
+void page_free(uint64_t address, unsigned int order)
+{
+    TRACE(trace_event_page_free_begin, address, order);
+
+    if (order > 0)
+    {
+        spinlock_lock(&lock);
+        buddy_free(address, order);
+        spinlock_unlock(&lock);
+    }
+    else
+    {
+        page_cache_t *cache = &page_caches[cpu_current_id()];
+        if (cache->count == PAGE_CACHE_SIZE)
+        {
+            // Return the oldest pages to the buddy allocator. The most recently freed ones are the most likely to still
+            // be in the CPU cache, so those are the ones we want to keep.
+            spinlock_lock(&lock);
+            for (int i = 0; i < PAGE_CACHE_BATCH; i++)
+            {
+                buddy_free(cache->pages[i], 0);
+            }
+            spinlock_unlock(&lock);
+
+            memory_copy(&cache->pages[0], &cache->pages[PAGE_CACHE_BATCH],
+                        (PAGE_CACHE_SIZE - PAGE_CACHE_BATCH) * sizeof(uint64_t));
+            cache->count -= PAGE_CACHE_BATCH;
+        }
+
+        cache->pages[cache->count++] = address;
+    }
+
+    TRACE(trace_event_page_free_end, 0, 0);
+}
+
+uint64_t page_allocator_free_memory(void)
+{
+    uint64_t pages = free_pages;
+    for (int i = 0; i < CPU_MAX_COUNT; i++)
+    {
+        pages += page_caches[i].count;
+    }
+
+    return pages * PAGE_SIZE;
+}
@@ -0,0 +1,63 @@
+/*
+ * page_allocator.h - The physical page allocator.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#ifndef __PAGE_ALLOCATOR_H__
+#define __PAGE_ALLOCATOR_H__ 1
+
+#include <stdint.h>
+
+#include "common/boot_info.h"
+
+//// Defines.
+// The size of the smallest block that can be allocated, i.e. a 4 KiB page.
+#define PAGE_SHIFT                      12
+#define PAGE_SIZE                       (1 << PAGE_SHIFT)
+
+// The largest order that can be allocated. The size of a block is PAGE_SIZE << order, so this means 4 KiB << 18 = 1 GiB.
+#define PAGE_ALLOCATOR_MAX_ORDER        18
+
+// The order of a 2 MiB block.
+#define PAGE_ALLOCATOR_2MIB_ORDER       9
+
+//// Function prototypes
+// page_allocate() and page_free() must not be called from interrupt handlers. The per-CPU caches are used without a
+// lock and with interrupts enabled, and the lock of the buddy allocator is a plain spinlock, so an interrupt handler
+// using them could corrupt the cache of the CPU it interrupted or deadlock on the lock.
+
+/**
+ * Initialize the page allocator. All the RAM in the memory map is made available for allocation, except for the reserved
+ * ranges in the boot information and the low 1 MiB.
+ *
+ * @param boot_info  The boot information provided by the 32-bit loader.
+ */
+extern void page_allocator_init(const boot_info_t *boot_info);
+
+/**
+ * Allocate a block of physical memory. The block is naturally aligned, i.e. aligned on its own size. Single pages (order 0)
+ * are allocated from a per-CPU cache, which means that no lock needs to be taken in the common case.
+ *
+ * @param order  The order of the block: 0 for 4 KiB, 1 for 8 KiB and so forth up to PAGE_ALLOCATOR_MAX_ORDER.
+ * @returns the physical address of the block, or 0 if there is no free block large enough.
+ */
+extern uint64_t page_allocate(unsigned int order);
+
+/**
+ * Free a block of physical memory.
+ *
+ * @param address  The address of the block, as returned by page_allocate().
+ * @param order  The order of the block. Must be the same as the one used when allocating it.
+ */
+extern void page_free(uint64_t address, unsigned int order);
+
+/**
+ * Get the amount of free memory, including the pages in the per-CPU caches.
+ *
+ * @returns the number of free bytes.
+ */
+extern uint64_t page_allocator_free_memory(void);
+
+#endif // !__PAGE_ALLOCATOR_H__
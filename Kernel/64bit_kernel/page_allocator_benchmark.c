@@ -0,0 +1,232 @@
+/*
+ * page_allocator_benchmark.c - Allocation throughput benchmarks for the page allocator, run with
+ * benchmark=page_allocator (see benchmark.h).
+ *
+ * The page_allocator.<n>cpu.* benchmarks are run with n CPU:s hitting the page allocator at the same time: the CPU
+ * running the benchmark measures the operation, while the other n - 1 CPU:s keep doing the same thing until it is done.
+ * The ones with more CPU:s than there are online are skipped.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common/cpu.h"
+#include "benchmark.h"
+#include "cpu.h"
+#include "io.h"
+#include "page_allocator.h"
+#include "smp.h"
+
+// The number of blocks being held at the same time in the "batch" benchmarks, each iteration of which allocates a batch
+// and then frees it. This is larger than the per-CPU caches, so the pages have to go through the buddy allocator.
+#define BATCH_SIZE                      1024
+
+// The order of the memory used for holding the addresses of a batch: 1024 * 8 bytes = 8 KiB.
+#define BATCH_ORDER                     1
+
+// An operation being measured, performed a given number of times.
+typedef void (*operation_t)(uint64_t *batch, uint64_t iterations);
+
+// The operation of the benchmark being run, and the batch of each CPU taking part in it.
+static operation_t operation;
+static uint64_t *batches[CPU_MAX_COUNT];
+
+// The other CPU:s taking part, as a bit mask indexed by CPU ID; the number of them that have started; and the flag
+// telling them to stop.
+static uint64_t workers;
+static volatile unsigned int workers_ready;
+static volatile bool workers_stop;
+
+/**
+ * Allocate and immediately free a single page, over and over again. This should be served by the per-CPU cache all the
+ * time.
+ *
+ * @param batch  Not used.
+ * @param iterations  The number of pages.
+ */
+static void single_page(uint64_t *batch, uint64_t iterations)
+{
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        page_free(page_allocate(0), 0);
+    }
+}
+
+/**
+ * Allocate batches of blocks of a given order, freeing each batch before allocating the next one.
+ *
+ * @param batch  The memory holding the addresses of the blocks.
+ * @param iterations  The number of batches.
+ * @param order  The order of the blocks.
+ */
+static void batches_of_order(uint64_t *batch, uint64_t iterations, unsigned int order)
+{
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        for (int j = 0; j < BATCH_SIZE; j++)
+        {
+            batch[j] = page_allocate(order);
+        }
+
+        for (int j = 0; j < BATCH_SIZE; j++)
+        {
+            if (batch[j] != 0)
+            {
+                page_free(batch[j], order);
+            }
+        }
+    }
+}
+
+static void batches_4kib(uint64_t *batch, uint64_t iterations)
+{
+    batches_of_order(batch, iterations, 0);
+}
+
+static void batches_2mib(uint64_t *batch, uint64_t iterations)
+{
+    batches_of_order(batch, iterations, PAGE_ALLOCATOR_2MIB_ORDER);
+}
+
+/**
+ * Keep another CPU busy with the operation until the benchmark is done.
+ *
+ * @param argument  The batch of the CPU.
+ */
+static void worker(void *argument)
+{
+    __atomic_add_fetch(&workers_ready, 1, __ATOMIC_RELEASE);
+    while (!__atomic_load_n(&workers_stop, __ATOMIC_ACQUIRE))
+    {
+        operation(argument, 1);
+    }
+}
+
+/**
+ * Stop the other CPU:s, and free the batches.
+ */
+static void teardown(void)
+{
+    __atomic_store_n(&workers_stop, true, __ATOMIC_RELEASE);
+    for (unsigned int id = 0; id < CPU_MAX_COUNT; id++)
+    {
+        if ((workers & (1ULL << id)) != 0)
+        {
+            smp_wait(id);
+        }
+
+        if (batches[id] != NULL)
+        {
+            page_free((uint64_t) batches[id], BATCH_ORDER);
+            batches[id] = NULL;
+        }
+    }
+
+    workers = 0;
+}
+
+/**
+ * Allocate the batches, and start the other CPU:s.
+ *
+ * @param cpu_count  The number of CPU:s taking part, including the one running the benchmark.
+ * @param benchmark_operation  The operation being measured.
+ * @returns true on success, false if the benchmark should be skipped.
+ */
+static bool setup(unsigned int cpu_count, operation_t benchmark_operation)
+{
+    if (cpu_count > cpu_online_count())
+    {
+        io_print_formatted("Page allocator benchmark: only %u CPU(s) online, skipping the %u CPU one.\n",
+                           cpu_online_count(), cpu_count);
+        return false;
+    }
+
+    operation = benchmark_operation;
+    workers = 0;
+    workers_ready = 0;
+    workers_stop = false;
+
+    unsigned int current_id = cpu_current_id();
+    unsigned int worker_count = 0;
+    for (unsigned int id = 0; id < cpu_online_count(); id++)
+    {
+        if (id != current_id && worker_count == cpu_count - 1)
+        {
+            continue;
+        }
+
+        batches[id] = (uint64_t *) page_allocate(BATCH_ORDER);
+        if (batches[id] == NULL)
+        {
+            io_print_line("Page allocator benchmark: out of memory, skipping.");
+            teardown();
+            return false;
+        }
+
+        if (id != current_id)
+        {
+            smp_run(id, worker, batches[id]);
+            workers |= 1ULL << id;
+            worker_count++;
+        }
+    }
+
+    while (__atomic_load_n(&workers_ready, __ATOMIC_ACQUIRE) < worker_count)
+    {
+        cpu_relax();
+    }
+
+    return true;
+}
+
+/**
+ * Declare the page_allocator.<n>cpu.* benchmarks for a number of CPU:s.
+ *
+ * @param count  The number of CPU:s.
+ */
+#define CPU_COUNT_BENCHMARKS(count)                                                                                    \
+    static bool setup_single_page_##count(void)                                                                        \
+    {                                                                                                                  \
+        return setup(count, single_page);                                                                              \
+    }                                                                                                                  \
+                                                                                                                       \
+    static bool setup_batches_4kib_##count(void)                                                                       \
+    {                                                                                                                  \
+        return setup(count, batches_4kib);                                                                             \
+    }                                                                                                                  \
+                                                                                                                       \
+    static bool setup_batches_2mib_##count(void)                                                                       \
+    {                                                                                                                  \
+        return setup(count, batches_2mib);                                                                             \
+    }                                                                                                                  \
+                                                                                                                       \
+    static void run_single_page_##count(uint64_t iterations)                                                           \
+    {                                                                                                                  \
+        single_page(NULL, iterations);                                                                                 \
+    }                                                                                                                  \
+                                                                                                                       \
+    static void run_batches_4kib_##count(uint64_t iterations)                                                          \
+    {                                                                                                                  \
+        batches_4kib(batches[cpu_current_id()], iterations);                                                           \
+    }                                                                                                                  \
+                                                                                                                       \
+    static void run_batches_2mib_##count(uint64_t iterations)                                                          \
+    {                                                                                                                  \
+        batches_2mib(batches[cpu_current_id()], iterations);                                                           \
+    }                                                                                                                  \
+                                                                                                                       \
+    BENCHMARK("page_allocator." #count "cpu.single_page", run_single_page_##count, setup_single_page_##count,          \
+              teardown);                                                                                               \
+    BENCHMARK("page_allocator." #count "cpu.4kib_batches", run_batches_4kib_##count, setup_batches_4kib_##count,       \
+              teardown);                                                                                               \
+    BENCHMARK("page_allocator." #count "cpu.2mib_batches", run_batches_2mib_##count, setup_batches_2mib_##count,       \
+              teardown)
+
+CPU_COUNT_BENCHMARKS(1);
+CPU_COUNT_BENCHMARKS(2);
+CPU_COUNT_BENCHMARKS(4);
+CPU_COUNT_BENCHMARKS(8);
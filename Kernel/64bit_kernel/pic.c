@@ -0,0 +1,41 @@
+/*
+ * pic.c - The legacy 8259 Programmable Interrupt Controller. The only thing we do with it is to get it out of the way.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#include <stdint.h>
+
+#include "common/port.h"
+#include "pic.h"
+
+// The I/O ports of the master and slave PIC:s.
+#define PIC_MASTER_COMMAND              0x20
+#define PIC_MASTER_DATA                 0x21
+#define PIC_SLAVE_COMMAND               0xA0
+#define PIC_SLAVE_DATA                  0xA1
+
+// Initialization command word 1: start initialization, ICW4 will follow.
+#define PIC_ICW1_INIT                   0x11
+
+// Initialization command word 4: 8086 mode.
+#define PIC_ICW4_8086                   0x01
+
+void pic_disable(uint8_t vector_base)
+{
+    // The initialization sequence: ICW1 to the command port, then ICW2 (the vector base), ICW3 (how the master and slave
+    // are wired together; the slave is on IRQ 2) and ICW4 to the data port.
+    outb(PIC_MASTER_COMMAND, PIC_ICW1_INIT);
+    outb(PIC_SLAVE_COMMAND, PIC_ICW1_INIT);
+    outb(PIC_MASTER_DATA, vector_base);
+    outb(PIC_SLAVE_DATA, vector_base + 8);
+    outb(PIC_MASTER_DATA, 1 << 2);
+    outb(PIC_SLAVE_DATA, 2);
+    outb(PIC_MASTER_DATA, PIC_ICW4_8086);
+    outb(PIC_SLAVE_DATA, PIC_ICW4_8086);
+
+    // Mask all the interrupts.
+    outb(PIC_MASTER_DATA, 0xFF);
+    outb(PIC_SLAVE_DATA, 0xFF);
+}
@@ -0,0 +1,22 @@
+/*
+ * pic.h - The legacy 8259 Programmable Interrupt Controller.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#ifndef __PIC_H__
+#define __PIC_H__ 1
+
+#include <stdint.h>
+
+//// Function prototypes
+/**
+ * Disable the legacy PIC:s, since we use the local APIC (and later on, the I/O APIC) instead. The PIC:s are remapped
+ * before being masked, so that any spurious interrupts they produce end up at harmless vectors.
+ *
+ * @param vector_base  The first of the 16 vectors to remap the PIC:s to.
+ */
+extern void pic_disable(uint8_t vector_base);
+
+#endif // !__PIC_H__
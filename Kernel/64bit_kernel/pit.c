@@ -0,0 +1,57 @@
+/*
+ * pit.c - The Programmable Interval Timer (8253/8254). Only channel 2 is used here; it is the only channel whose output
+ * can be read back (through the keyboard controller's port B), which makes it possible to poll it without interrupts.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#include <stdint.h>
+
+#include "common/port.h"
+#include "cpu.h"
+#include "pit.h"
+
+// The I/O ports of the PIT.
+#define PIT_CHANNEL_2_PORT              0x42
+#define PIT_COMMAND_PORT                0x43
+
+// Port B of the keyboard controller. Bit 0 is the channel 2 gate, bit 1 enables the PC speaker and bit 5 is the channel 2
+// output.
+#define PORT_B                          0x61
+#define PORT_B_GATE                     (1 << 0)
+#define PORT_B_SPEAKER                  (1 << 1)
+#define PORT_B_OUTPUT                   (1 << 5)
+
+// Channel 2, low byte followed by high byte, mode 0 (interrupt on terminal count), binary counting.
+#define PIT_COMMAND_CHANNEL_2_ONE_SHOT  0xB0
+
+// The longest delay we do in a single round. The counter is 16 bits wide, which gives us at most 65535 / 1193182 = 54 ms.
+#define MAX_ROUND_MICROSECONDS          50000
+
+void pit_delay(uint32_t microseconds)
+{
+    while (microseconds > 0)
+    {
+        uint32_t round = microseconds < MAX_ROUND_MICROSECONDS ? microseconds : MAX_ROUND_MICROSECONDS;
+        uint32_t count = (uint64_t) round * PIT_FREQUENCY / 1000000;
+        if (count == 0)
+        {
+            count = 1;
+        }
+
+        // Enable the gate, but keep the speaker quiet. In mode 0, the output goes low when the count is written and goes
+        // high again when the counter reaches zero.
+        outb(PORT_B, (inb(PORT_B) & ~PORT_B_SPEAKER) | PORT_B_GATE);
+        outb(PIT_COMMAND_PORT, PIT_COMMAND_CHANNEL_2_ONE_SHOT);
+        outb(PIT_CHANNEL_2_PORT, count & 0xFF);
+        outb(PIT_CHANNEL_2_PORT, count >> 8);
+
+        while ((inb(PORT_B) & PORT_B_OUTPUT) == 0)
+        {
+            cpu_relax();
+        }
+
+        microseconds -= round;
+    }
+}
@@ -0,0 +1,26 @@
+/*
+ * pit.h - The Programmable Interval Timer (8253/8254), used as a time reference before anything better is available.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#ifndef __PIT_H__
+#define __PIT_H__ 1
+
+#include <stdint.h>
+
+//// Defines.
+// The frequency of the PIT input clock, in Hz.
+#define PIT_FREQUENCY                   1193182
+
+//// Function prototypes
+/**
+ * Busy-wait for a given amount of time, using PIT channel 2. This is slow to set up (each port access takes around a
+ * microsecond), so it is only meant for calibrating the other time sources against. Use udelay() for everything else.
+ *
+ * @param microseconds  The number of microseconds to wait.
+ */
+extern void pit_delay(uint32_t microseconds);
+
+#endif // !__PIT_H__
@@ -0,0 +1,443 @@
+/*
+ * profile.c - A sampling profiler. Each CPU records its samples in a buffer of its own, so taking a sample needs no
+ * locking, and only touches memory that no other CPU writes to.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common/cpu.h"
+#include "common/format.h"
+#include "common/memory.h"
+#include "apic.h"
+#include "backtrace.h"
+#include "clock.h"
+#include "command_line.h"
+#include "cpu.h"
+#include "interrupt.h"
+#include "io.h"
+#include "page_allocator.h"
+#include "profile.h"
+#include "serial.h"
+#include "symbols.h"
+
+// The architectural performance monitoring MSRs (version 2 and later).
+#define MSR_PERFEVTSEL0                 0x186
+#define MSR_PMC0                        0x0C1
+#define MSR_PERF_GLOBAL_STATUS          0x38E
+#define MSR_PERF_GLOBAL_CTRL            0x38F
+#define MSR_PERF_GLOBAL_OVF_CTRL        0x390
+
+// The event counted by the first general-purpose counter: unhalted core cycles, in kernel mode, with an interrupt
+// (which the local APIC turns into an NMI) when the counter overflows.
+#define PERFEVTSEL_UNHALTED_CORE_CYCLES 0x3C
+#define PERFEVTSEL_OS                   (1 << 17)
+#define PERFEVTSEL_INT                  (1 << 20)
+#define PERFEVTSEL_EN                   (1 << 22)
+
+// The counter bit in the global control, status and overflow control MSRs.
+#define PERF_GLOBAL_PMC0                1
+
+// The counter is loaded with minus the sampling period. Only the low 32 bits of the counter can be written (the rest
+// are sign-extended from bit 31), which limits the period to this.
+#define MAX_COUNTER_PERIOD              0x7FFFFFFF
+
+// The longest line written by profile_dump(): a stack line with PROFILE_MAX_DEPTH addresses.
+#define LINE_LENGTH                     (32 + PROFILE_MAX_DEPTH * 17)
+
+typedef enum
+{
+    profile_source_none,
+    profile_source_timer,
+    profile_source_nmi
+} profile_source_e;
+
+static const char *source_names[] =
+{
+    [profile_source_none] = "none",
+    [profile_source_timer] = "timer",
+    [profile_source_nmi] = "nmi"
+};
+
+// The samples of a CPU. Each sample is stored as the number of addresses in it, followed by the addresses: the
+// instruction pointer, and the return addresses from the innermost frame and outwards.
+typedef struct
+{
+    uint64_t *words;
+    uint64_t capacity;
+
+    // The number of words used. It is only advanced once the sample has been written, so profile_dump() can safely read
+    // everything up to it even if the CPU is in the middle of taking another sample.
+    volatile uint64_t used;
+
+    uint64_t dropped;
+
+    // The NMI:s that did not come from the performance monitoring counter.
+    uint64_t other_nmis;
+} __attribute__((aligned(CPU_CACHE_LINE_SIZE))) profile_buffer_t;
+
+// A distinct call stack, as found by profile_dump().
+typedef struct
+{
+    const uint64_t *sample;
+    uint32_t cpu_id;
+    uint32_t count;
+} profile_stack_t;
+
+static profile_buffer_t buffers[CPU_MAX_COUNT];
+
+static profile_source_e source;
+static unsigned int frequency;
+
+// The number of unhalted core cycles between two samples, when sampling with the performance monitoring counter.
+static uint64_t counter_period;
+
+// Cleared by profile_dump(). Samples are only taken while this is set.
+static volatile bool active;
+
+/**
+ * Record a sample in the buffer of the current CPU.
+ *
+ * @param frame  The state of the interrupted code.
+ */
+static void record_sample(const interrupt_frame_t *frame)
+{
+    profile_buffer_t *buffer = &buffers[cpu_current_id()];
+    if (!active || buffer->words == NULL)
+    {
+        return;
+    }
+
+    uint64_t used = buffer->used;
+    if (used + 1 + PROFILE_MAX_DEPTH > buffer->capacity)
+    {
+        buffer->dropped++;
+        return;
+    }
+
+    uint64_t *sample = &buffer->words[used];
+    sample[1] = frame->rip;
+    sample[0] = 1 + backtrace_walk(frame->rbp, frame->rsp, &sample[2], PROFILE_MAX_DEPTH - 1);
+
+    __atomic_store_n(&buffer->used, used + 1 + sample[0], __ATOMIC_RELEASE);
+}
+
+/**
+ * Start the performance monitoring counter of the current CPU, counting down to the next sample.
+ */
+static void start_counter(void)
+{
+    cpu_write_msr(MSR_PMC0, -counter_period);
+    cpu_write_msr(MSR_PERF_GLOBAL_OVF_CTRL, PERF_GLOBAL_PMC0);
+    apic_performance_counter_nmi();
+}
+
+/**
+ * The handler of the NMI:s. Other than the ones coming from the performance monitoring counter, they are only counted.
+ *
+ * @param frame  The state of the interrupted code.
+ */
+static void profile_nmi(interrupt_frame_t *frame)
+{
+    if ((cpu_read_msr(MSR_PERF_GLOBAL_STATUS) & PERF_GLOBAL_PMC0) == 0)
+    {
+        buffers[cpu_current_id()].other_nmis++;
+        return;
+    }
+
+    record_sample(frame);
+
+    // Once the profiler has been stopped, the counter is left alone; the local APIC masks the NMI when it is delivered,
+    // so this was the last one.
+    if (active)
+    {
+        start_counter();
+    }
+}
+
+/**
+ * Check if the performance monitoring counters can be used for sampling.
+ *
+ * @returns true if the CPU has architectural performance monitoring version 2 or later, with at least one
+ * general-purpose counter which can count unhalted core cycles.
+ */
+static bool has_performance_monitoring(void)
+{
+    if (!cpu_has_cpuid_leaf(CPUID_LEAF_PERFORMANCE_MONITORING))
+    {
+        return false;
+    }
+
+    cpuid_registers_t registers;
+    cpu_cpuid(CPUID_LEAF_PERFORMANCE_MONITORING, 0, &registers);
+
+    unsigned int version = registers.eax & 0xFF;
+    unsigned int counters = (registers.eax >> 8) & 0xFF;
+    unsigned int event_count = registers.eax >> 24;
+
+    // A set bit in EBX means that the event is not available; bit 0 is the unhalted core cycles.
+    return version >= 2 && counters >= 1 && event_count >= 1 && (registers.ebx & 1) == 0;
+}
+
+void profile_init(void)
+{
+    if (!command_line_has_option("profile"))
+    {
+        return;
+    }
+
+    frequency = command_line_option_number("profile", PROFILE_DEFAULT_FREQUENCY);
+    if (frequency == 0)
+    {
+        frequency = PROFILE_DEFAULT_FREQUENCY;
+    }
+
+    if (has_performance_monitoring() && !command_line_option_has_value("profile_source", "timer"))
+    {
+        // The core clock is not necessarily running at the TSC frequency, but it is close enough for picking a period.
+        counter_period = clock_tsc_frequency() / frequency;
+        if (counter_period > MAX_COUNTER_PERIOD)
+        {
+            counter_period = MAX_COUNTER_PERIOD;
+        }
+
+        source = profile_source_nmi;
+        interrupt_register_handler(INTERRUPT_VECTOR_NMI, profile_nmi);
+    }
+    else
+    {
+        source = profile_source_timer;
+        apic_timer_set_frequency(frequency);
+    }
+
+    io_print_formatted("Profiler: sampling at %u Hz on each CPU, using the %s.\n", frequency,
+                       source == profile_source_nmi ? "performance monitoring counters" : "local APIC timer");
+
+    active = true;
+    profile_init_cpu();
+}
+
+void profile_init_cpu(void)
+{
+    if (source == profile_source_none)
+    {
+        return;
+    }
+
+    profile_buffer_t *buffer = &buffers[cpu_current_id()];
+    buffer->words = (uint64_t *) page_allocate(PROFILE_BUFFER_ORDER);
+    if (buffer->words == NULL)
+    {
+        io_print_formatted("Profiler: no memory for the samples of CPU %u.\n", cpu_current_id());
+        return;
+    }
+
+    buffer->capacity = ((uint64_t) PAGE_SIZE << PROFILE_BUFFER_ORDER) / sizeof(uint64_t);
+
+    if (source == profile_source_nmi)
+    {
+        cpu_write_msr(MSR_PERF_GLOBAL_CTRL, 0);
+        cpu_write_msr(MSR_PERFEVTSEL0,
+                      PERFEVTSEL_UNHALTED_CORE_CYCLES | PERFEVTSEL_OS | PERFEVTSEL_INT | PERFEVTSEL_EN);
+        start_counter();
+        cpu_write_msr(MSR_PERF_GLOBAL_CTRL, PERF_GLOBAL_PMC0);
+    }
+}
+
+void profile_timer_tick(const interrupt_frame_t *frame)
+{
+    if (source == profile_source_timer)
+    {
+        record_sample(frame);
+    }
+}
+
+/**
+ * Write a line to the serial port.
+ *
+ * @param format  The format string, as for io_print_formatted().
+ */
+static void write_line(const char *format, ...)
+{
+    char line[LINE_LENGTH];
+
+    va_list arguments;
+    va_start(arguments, format);
+    unsigned int length = format_to_buffer_list(line, sizeof(line), format, arguments);
+    va_end(arguments);
+
+    serial_write(line, length);
+}
+
+/**
+ * Hash a sample, for finding identical call stacks.
+ *
+ * @param sample  The sample.
+ * @param cpu_id  The CPU the sample was taken on.
+ * @returns the hash.
+ */
+static uint64_t hash_sample(const uint64_t *sample, unsigned int cpu_id)
+{
+    // FNV-1a, a word at a time.
+    uint64_t hash = 0xCBF29CE484222325ULL ^ cpu_id;
+    for (uint64_t i = 1; i <= sample[0]; i++)
+    {
+        hash = (hash ^ sample[i]) * 0x100000001B3ULL;
+    }
+
+    return hash;
+}
+
+/**
+ * Check if two samples have the same call stack.
+ */
+static bool same_stack(const uint64_t *a, const uint64_t *b)
+{
+    for (uint64_t i = 0; i <= a[0]; i++)
+    {
+        if (a[i] != b[i])
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Write a stack line.
+ *
+ * @param sample  A sample with the call stack.
+ * @param cpu_id  The CPU the samples were taken on.
+ * @param count  The number of samples with this call stack.
+ */
+static void write_stack(const uint64_t *sample, unsigned int cpu_id, uint64_t count)
+{
+    char line[LINE_LENGTH];
+    unsigned int length = format_to_buffer(line, sizeof(line), "@stack %u %U", cpu_id, count);
+    for (uint64_t i = 1; i <= sample[0]; i++)
+    {
+        length += format_to_buffer(line + length, sizeof(line) - length, " %016X", sample[i]);
+    }
+
+    length += format_to_buffer(line + length, sizeof(line) - length, "\n");
+    serial_write(line, length);
+}
+
+/**
+ * Merge the identical call stacks of each CPU, and write them out.
+ *
+ * @param ends  The number of words used in the buffer of each CPU, when the profiler was stopped.
+ * @param stacks  A hash table, with room for at least twice as many stacks as there are samples. Must be zeroed.
+ * @param size  The number of entries in the hash table. Must be a power of two.
+ */
+static void write_merged_stacks(const uint64_t *ends, profile_stack_t *stacks, uint64_t size)
+{
+    for (unsigned int cpu_id = 0; cpu_id < CPU_MAX_COUNT; cpu_id++)
+    {
+        const profile_buffer_t *buffer = &buffers[cpu_id];
+        for (uint64_t used = 0; used < ends[cpu_id]; used += 1 + buffer->words[used])
+        {
+            const uint64_t *sample = &buffer->words[used];
+            uint64_t index = hash_sample(sample, cpu_id) & (size - 1);
+            while (stacks[index].sample != NULL &&
+                   (stacks[index].cpu_id != cpu_id || !same_stack(stacks[index].sample, sample)))
+            {
+                index = (index + 1) & (size - 1);
+            }
+
+            stacks[index].sample = sample;
+            stacks[index].cpu_id = cpu_id;
+            stacks[index].count++;
+        }
+    }
+
+    for (uint64_t index = 0; index < size; index++)
+    {
+        if (stacks[index].sample != NULL)
+        {
+            write_stack(stacks[index].sample, stacks[index].cpu_id, stacks[index].count);
+        }
+    }
+}
+
+void profile_dump(void)
+{
+    if (source == profile_source_none)
+    {
+        return;
+    }
+
+    __atomic_store_n(&active, false, __ATOMIC_SEQ_CST);
+
+    // A CPU which was in the middle of taking a sample when the profiler was stopped may still add it to its buffer, so
+    // we only look at what was there at this point.
+    static uint64_t ends[CPU_MAX_COUNT];
+    uint64_t samples = 0;
+    uint64_t dropped = 0;
+    uint64_t other_nmis = 0;
+    for (unsigned int cpu_id = 0; cpu_id < CPU_MAX_COUNT; cpu_id++)
+    {
+        const profile_buffer_t *buffer = &buffers[cpu_id];
+        ends[cpu_id] = __atomic_load_n(&buffer->used, __ATOMIC_ACQUIRE);
+        for (uint64_t used = 0; used < ends[cpu_id]; used += 1 + buffer->words[used])
+        {
+            samples++;
+        }
+
+        dropped += buffer->dropped;
+        other_nmis += buffer->other_nmis;
+    }
+
+    io_print_formatted("Profiler: %U samples taken, %U dropped since the buffers were full.\n", samples, dropped);
+    if (other_nmis > 0)
+    {
+        io_print_formatted("Profiler: %U NMI:s did not come from the performance monitoring counters.\n", other_nmis);
+    }
+
+    write_line("@profile %s %u %U %U\n", source_names[source], frequency, samples, dropped);
+    for (uint64_t i = 0; i < symbol_count; i++)
+    {
+        write_line("@symbol %016X %s\n", symbol_table[i].address, symbol_table[i].name);
+    }
+
+    // The hash table is sized for a load factor of at most one half. If there is not enough memory for it, the samples
+    // are written out one by one instead.
+    uint64_t size = 64;
+    while (size < samples * 2)
+    {
+        size *= 2;
+    }
+
+    unsigned int order = 0;
+    while (((uint64_t) PAGE_SIZE << order) < size * sizeof(profile_stack_t) && order < PAGE_ALLOCATOR_MAX_ORDER)
+    {
+        order++;
+    }
+
+    uint64_t table = ((uint64_t) PAGE_SIZE << order) >= size * sizeof(profile_stack_t) ? page_allocate(order) : 0;
+    if (table != 0)
+    {
+        memory_zero((void *) table, size * sizeof(profile_stack_t));
+        write_merged_stacks(ends, (profile_stack_t *) table, size);
+        page_free(table, order);
+    }
+    else
+    {
+        for (unsigned int cpu_id = 0; cpu_id < CPU_MAX_COUNT; cpu_id++)
+        {
+            const profile_buffer_t *buffer = &buffers[cpu_id];
+            for (uint64_t used = 0; used < ends[cpu_id]; used += 1 + buffer->words[used])
+            {
+                write_stack(&buffer->words[used], cpu_id, 1);
+            }
+        }
+    }
+
+    write_line("@profile_end\n");
+}
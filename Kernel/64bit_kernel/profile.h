@@ -0,0 +1,71 @@
+/*
+ * profile.h - A sampling profiler. When enabled with the profile option on the kernel command line, each CPU
+ * periodically records where it is executing: the instruction pointer and the call stack leading up to it. The samples
+ * are dumped on the serial port by profile_dump(), together with the kernel symbol table, and turned into a flame graph
+ * on the host by profile_fold.sh; see the README.
+ *
+ * The samples are taken by an NMI from the performance monitoring counters where the CPU has architectural performance
+ * monitoring, since that lets us see into code running with interrupts disabled (and doesn't sample the CPU while it is
+ * halted). Elsewhere, e.g. in QEMU without KVM, the local APIC timer is used.
+ *
+ * The options are:
+ *
+ * profile          Enable the profiler, sampling PROFILE_DEFAULT_FREQUENCY times per second on each CPU.
+ * profile=<Hz>     Enable the profiler, sampling the given number of times per second.
+ * profile_source=timer  Use the local APIC timer even if the performance monitoring counters are available.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#ifndef __PROFILE_H__
+#define __PROFILE_H__ 1
+
+#include "interrupt.h"
+
+//// Defines.
+// The number of samples per second and CPU, unless specified on the command line.
+#define PROFILE_DEFAULT_FREQUENCY       1000
+
+// The maximum number of addresses recorded in a sample: the instruction pointer and the return addresses of the calls
+// leading up to it. Deeper call stacks are cut off at the outermost end.
+#define PROFILE_MAX_DEPTH               32
+
+// The size of the sample buffer of each CPU, as a page allocator order: 4 KiB << 8 = 1 MiB. At a typical depth of about
+// ten, this holds some ten thousand samples; when it is full, further samples are dropped (and counted).
+#define PROFILE_BUFFER_ORDER            8
+
+//// Function prototypes
+/**
+ * Set up the profiler on the bootstrap processor, if enabled on the kernel command line. Must be called after
+ * apic_init(), but before the local APIC timer is calibrated and the application processors are started.
+ */
+extern void profile_init(void);
+
+/**
+ * Set up the profiler on an application processor. Must be called before its local APIC timer is started.
+ */
+extern void profile_init_cpu(void);
+
+/**
+ * Take a sample, if the profiler is driven by the local APIC timer. Called by the timer interrupt handler.
+ *
+ * @param frame  The state of the interrupted code.
+ */
+extern void profile_timer_tick(const interrupt_frame_t *frame);
+
+/**
+ * Stop the profiler, and dump the samples on the serial port. The identical call stacks seen on each CPU are merged
+ * first, which keeps the output down to a manageable size. The output consists of lines of the form
+ *
+ * @profile <source> <frequency> <samples> <dropped samples>
+ * @symbol <address> <name>
+ * @stack <CPU> <count> <instruction pointer> <return address>...
+ * @profile_end
+ *
+ * with all the addresses as 16 hexadecimal digits. The symbols are sorted by address, and the stacks are listed
+ * innermost frame first. Does nothing unless the profiler is enabled.
+ */
+extern void profile_dump(void);
+
+#endif // !__PROFILE_H__
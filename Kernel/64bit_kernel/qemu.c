@@ -0,0 +1,34 @@
+/*
+ * qemu.c - Exiting QEMU with a status code, for running the kernel in automated tests. See run_qemu.sh for how QEMU is
+ * started.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#include <stdbool.h>
+
+#include "common/port.h"
+#include "command_line.h"
+#include "log.h"
+#include "qemu.h"
+#include "serial.h"
+
+static bool exit_enabled;
+
+void qemu_init(void)
+{
+    exit_enabled = command_line_has_option("qemu_exit");
+}
+
+void qemu_exit(bool success)
+{
+    if (!exit_enabled)
+    {
+        return;
+    }
+
+    log_drain();
+    serial_drain();
+    outb(QEMU_DEBUG_EXIT_PORT, success ? 0 : 1);
+}
@@ -0,0 +1,33 @@
+/*
+ * qemu.h - Exiting QEMU with a status code, for running the kernel in automated tests.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#ifndef __QEMU_H__
+#define __QEMU_H__ 1
+
+#include <stdbool.h>
+
+//// Defines.
+// The I/O port of the isa-debug-exit device. QEMU must be started with -device isa-debug-exit,iobase=0xf4,iosize=0x04.
+#define QEMU_DEBUG_EXIT_PORT            0xF4
+
+//// Function prototypes
+/**
+ * Check if qemu_exit was given on the kernel command line. Unless it was, qemu_exit() does nothing; the port of the
+ * isa-debug-exit device could be used by something else on real hardware.
+ */
+extern void qemu_init(void);
+
+/**
+ * Make QEMU exit, after sending everything in the log and the serial output buffer. The exit status of QEMU is 1 for
+ * success and 3 for failure, since the device turns the value written into (value << 1) | 1. Returns if the qemu_exit
+ * option was not given, or if we are not running under QEMU (or the device is missing).
+ *
+ * @param success  true if the kernel ran successfully, false otherwise.
+ */
+extern void qemu_exit(bool success);
+
+#endif // !__QEMU_H__
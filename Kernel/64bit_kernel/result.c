@@ -0,0 +1,44 @@
+/*
+ * result.c - Machine-readable results, sent over the serial port. The results are picked up by run_qemu.sh, which lets
+ * boot time and benchmark numbers be tracked per commit without anyone having to read them off the screen.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#include <stdarg.h>
+#include <stdint.h>
+
+#include "common/format.h"
+#include "result.h"
+#include "serial.h"
+
+// The longest name, and the longest line we write. Longer ones are truncated.
+#define RESULT_NAME_LENGTH              96
+#define RESULT_LINE_LENGTH              160
+
+void result_report(uint64_t numerator, uint64_t denominator, const char *unit, const char *name_format, ...)
+{
+    char name[RESULT_NAME_LENGTH];
+
+    va_list arguments;
+    va_start(arguments, name_format);
+    format_to_buffer_list(name, sizeof(name), name_format, arguments);
+    va_end(arguments);
+
+    for (int i = 0; name[i] != '\0'; i++)
+    {
+        if (name[i] == ' ' || name[i] == '\t')
+        {
+            name[i] = '_';
+        }
+    }
+
+    // The same fixed-point arithmetic as in io_print_ratio().
+    uint64_t hundredths = (numerator * 100) / (denominator > 0 ? denominator : 1);
+
+    char line[RESULT_LINE_LENGTH];
+    unsigned int length = format_to_buffer(line, sizeof(line), "@result %s %U.%02U %s\n", name, hundredths / 100,
+                                           hundredths % 100, unit);
+    serial_write(line, length);
+}
@@ -0,0 +1,30 @@
+/*
+ * result.h - Machine-readable results (benchmark numbers and the like), sent over the serial port.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#ifndef __RESULT_H__
+#define __RESULT_H__ 1
+
+#include <stdint.h>
+
+//// Function prototypes
+/**
+ * Report a result. It is written to the serial port only, as a line of the form
+ *
+ * @result <name> <value> <unit>
+ *
+ * with the value given with two decimals. By convention, the name is the name of the benchmark and the names of the
+ * measurement separated by dots, e.g. console.print_line. Any whitespace in the name is replaced with underscores, so
+ * that things like the names of the memory primitive variants can be used as they are.
+ *
+ * @param numerator  The numerator of the value. The value is given as a ratio, since we have no floating point support.
+ * @param denominator  The denominator of the value.
+ * @param unit  The unit of the value, e.g. cycles or ns. Must not contain any whitespace.
+ * @param name_format  The name of the result, as a format string for io_print_formatted().
+ */
+extern void result_report(uint64_t numerator, uint64_t denominator, const char *unit, const char *name_format, ...);
+
+#endif // !__RESULT_H__
@@ -0,0 +1,326 @@
+/*
+ * scheduler.c - Kernel threads, and the scheduler running them. Each CPU has its own run queue, which is a work-stealing
+ * deque (see work_deque.h): the CPU pushes and takes threads at one end without any locking, and a CPU that runs out of
+ * threads steals from the other end of the run queue of a randomly chosen CPU. This is the scheme used by Cilk and most
+ * fork/join runtimes since; it keeps related threads on the same CPU (and in the same caches) as long as every CPU has
+ * something to do, and spreads them out as soon as one of them has not.
+ *
+ * The threads are not preempted; they run until they yield or exit.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common/misc.h"
+#include "cpu.h"
+#include "io.h"
+#include "log.h"
+#include "monitor.h"
+#include "page_allocator.h"
+#include "scheduler.h"
+#include "slab.h"
+#include "smp.h"
+#include "trace.h"
+#include "vm.h"
+#include "work_deque.h"
+
+// The order of the memory holding the items of a run queue: SCHEDULER_MAX_THREADS pointers of 8 bytes = 32 KiB.
+#define RUN_QUEUE_ORDER                 3
+
+_Static_assert(((uint64_t) PAGE_SIZE << RUN_QUEUE_ORDER) == SCHEDULER_MAX_THREADS * sizeof(void *),
+               "RUN_QUEUE_ORDER does not match SCHEDULER_MAX_THREADS");
+
+// The number of callee-saved registers pushed by context_switch().
+#define CONTEXT_SWITCH_SAVED_REGISTERS  6
+
+// The scheduler state of each CPU.
+typedef struct
+{
+    work_deque_t run_queue;
+
+    // The thread running the code the CPU was started with: main() on the bootstrap processor, and the scheduler idle
+    // loop on the others. It is never put in a run queue, so it never moves to another CPU.
+    thread_t idle_thread;
+
+    // The thread we just switched away from. It can't be put back in the run queue (or freed, if it has exited) until we
+    // are running on another stack, since another CPU could otherwise steal it and start running it on the stack we are
+    // still using.
+    thread_t *previous;
+
+    // The state of the pseudo-random number generator used for picking a CPU to steal from.
+    uint64_t random_state;
+} __attribute__((aligned(CPU_CACHE_LINE_SIZE))) scheduler_cpu_t;
+
+// This function is provided by context_switch.S.
+extern void context_switch(uint64_t *old_rsp, uint64_t new_rsp);
+
+static scheduler_cpu_t scheduler_cpus[CPU_MAX_COUNT];
+
+static slab_cache_t *thread_cache;
+
+// The number of threads that exist, not counting the idle threads.
+static volatile unsigned int thread_count;
+
+// The number of CPU:s taking part in the work stealing. See scheduler_limit_cpus().
+static volatile unsigned int stealing_cpu_count = CPU_MAX_COUNT;
+
+/**
+ * Take care of the thread we just switched away from. Must be called as soon as we are running on the new stack, i.e.
+ * right after context_switch() returns, or first thing in a new thread.
+ */
+static void scheduler_finish_switch(void)
+{
+    scheduler_cpu_t *cpu = &scheduler_cpus[cpu_current_id()];
+    thread_t *previous = cpu->previous;
+    cpu->previous = NULL;
+
+    if (previous == NULL || previous->stack == 0)
+    {
+        // Idle threads stay out of the run queues.
+        return;
+    }
+
+    if (previous->state == thread_state_exited)
+    {
+        page_free(previous->stack, THREAD_STACK_ORDER);
+        slab_free(thread_cache, previous);
+        __atomic_sub_fetch(&thread_count, 1, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        // This can't fail, since the run queue is large enough to hold all the threads there are.
+        work_deque_push(&cpu->run_queue, previous);
+    }
+}
+
+/**
+ * Switch to another thread.
+ *
+ * @param next  The thread to switch to. Must not be in any run queue.
+ */
+static void scheduler_switch_to(thread_t *next)
+{
+    cpu_data_t *data = cpu_current();
+    thread_t *current = data->current_thread;
+
+    TRACE(trace_event_thread_switch, current, next);
+
+    // Threads in the same address space (like all the kernel threads) are switched between without touching CR3.
+    if (next->address_space != current->address_space)
+    {
+        vm_address_space_switch(next->address_space != NULL ? next->address_space : &vm_kernel_address_space);
+    }
+
+    scheduler_cpus[data->id].previous = current;
+    data->current_thread = next;
+    context_switch(&current->rsp, next->rsp);
+
+    // Note that we may very well be running on another CPU now, if the thread has been stolen while it was waiting in the
+    // run queue.
+    scheduler_finish_switch();
+}
+
+/**
+ * Find a thread to run: the most recently queued thread in our own run queue, or if there is none, the least recently
+ * queued one of another CPU.
+ *
+ * @returns the thread, which has been removed from its run queue, or NULL if there was nothing to run.
+ */
+static thread_t *scheduler_find_thread(void)
+{
+    unsigned int id = cpu_current_id();
+    scheduler_cpu_t *cpu = &scheduler_cpus[id];
+
+    thread_t *thread = work_deque_take(&cpu->run_queue);
+    if (thread != NULL)
+    {
+        return thread;
+    }
+
+    unsigned int cpu_count = stealing_cpu_count;
+    if (cpu_count > cpu_online_count())
+    {
+        cpu_count = cpu_online_count();
+    }
+
+    if (id >= cpu_count)
+    {
+        return NULL;
+    }
+
+    // Start at a random CPU, and go round all of them once. Starting at the same CPU every time would make all the idle
+    // CPU:s fight over the same run queue.
+    cpu->random_state ^= cpu->random_state << 13;
+    cpu->random_state ^= cpu->random_state >> 7;
+    cpu->random_state ^= cpu->random_state << 17;
+
+    unsigned int victim = cpu->random_state % cpu_count;
+    for (unsigned int i = 0; i < cpu_count; i++)
+    {
+        if (victim != id)
+        {
+            thread = work_deque_steal(&scheduler_cpus[victim].run_queue);
+            if (thread != NULL)
+            {
+                return thread;
+            }
+        }
+
+        victim = victim + 1 == cpu_count ? 0 : victim + 1;
+    }
+
+    return NULL;
+}
+
+/**
+ * The entry point of all new threads; context_switch() "returns" here the first time a thread is switched to.
+ */
+static void thread_start(void)
+{
+    scheduler_finish_switch();
+
+    thread_t *thread = thread_current();
+    thread->function(thread->argument);
+    thread_exit();
+}
+
+void scheduler_init_cpu(void)
+{
+    unsigned int id = cpu_current_id();
+    scheduler_cpu_t *cpu = &scheduler_cpus[id];
+
+    // The bootstrap processor is initialized first, before any other CPU is started.
+    if (thread_cache == NULL)
+    {
+        thread_cache = slab_cache_create("thread", sizeof(thread_t), 0);
+    }
+
+    void **items = (void **) page_allocate(RUN_QUEUE_ORDER);
+    if (thread_cache == NULL || items == NULL)
+    {
+        io_print_formatted("Scheduler: out of memory when initializing CPU %u. Halting.\n", id);
+        HALT();
+    }
+
+    work_deque_init(&cpu->run_queue, items, SCHEDULER_MAX_THREADS);
+    cpu->idle_thread.stack = 0;
+    cpu->idle_thread.state = thread_state_ready;
+    cpu->random_state = 0x9E3779B97F4A7C15ULL * (id + 1);
+    cpu_current()->current_thread = &cpu->idle_thread;
+}
+
+void scheduler_idle(void)
+{
+    while (1 == 1)
+    {
+        thread_t *thread = scheduler_find_thread();
+        if (thread != NULL)
+        {
+            scheduler_switch_to(thread);
+        }
+        else if (!smp_run_pending_work() && !(cpu_current_id() == 0 && (log_drain() || monitor_poll())))
+        {
+            // The log is only drained (and the monitor commands only run) by the bootstrap processor. The console is not
+            // safe to use from more than one CPU at a time, and the bootstrap processor is the one doing all the other
+            // printing.
+            cpu_relax();
+        }
+    }
+}
+
+void scheduler_limit_cpus(unsigned int cpu_count)
+{
+    stealing_cpu_count = cpu_count;
+}
+
+thread_t *thread_create(thread_function_t function, void *argument)
+{
+    return thread_create_in(NULL, function, argument);
+}
+
+thread_t *thread_create_in(struct address_space *address_space, thread_function_t function, void *argument)
+{
+    if (__atomic_add_fetch(&thread_count, 1, __ATOMIC_RELAXED) > SCHEDULER_MAX_THREADS)
+    {
+        __atomic_sub_fetch(&thread_count, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    thread_t *thread = slab_allocate(thread_cache);
+    uint64_t stack = page_allocate(THREAD_STACK_ORDER);
+    if (thread == NULL || stack == 0)
+    {
+        if (thread != NULL)
+        {
+            slab_free(thread_cache, thread);
+        }
+
+        if (stack != 0)
+        {
+            page_free(stack, THREAD_STACK_ORDER);
+        }
+
+        __atomic_sub_fetch(&thread_count, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    // Make the stack look like the thread has been switched away from by context_switch(), with the return address
+    // pointing at thread_start(). The slot above it stands in for the return address of thread_start() itself, which
+    // gives it the stack alignment the ABI prescribes for a function entry. The saved registers are all zero; a zero RBP
+    // terminates the chain of stack frames.
+    uint64_t *stack_top = (uint64_t *) (stack + ((uint64_t) PAGE_SIZE << THREAD_STACK_ORDER));
+    *--stack_top = 0;
+    *--stack_top = (uint64_t) thread_start;
+    for (int i = 0; i < CONTEXT_SWITCH_SAVED_REGISTERS; i++)
+    {
+        *--stack_top = 0;
+    }
+
+    thread->rsp = (uint64_t) stack_top;
+    thread->stack = stack;
+    thread->state = thread_state_ready;
+    thread->function = function;
+    thread->argument = argument;
+    thread->address_space = address_space;
+
+    work_deque_push(&scheduler_cpus[cpu_current_id()].run_queue, thread);
+
+    TRACE(trace_event_thread_create, thread, 0);
+    return thread;
+}
+
+void thread_yield(void)
+{
+    thread_t *next = scheduler_find_thread();
+    if (next != NULL)
+    {
+        scheduler_switch_to(next);
+    }
+}
+
+void thread_exit(void)
+{
+    TRACE(trace_event_thread_exit, thread_current(), 0);
+
+    thread_current()->state = thread_state_exited;
+
+    thread_t *next = scheduler_find_thread();
+    if (next == NULL)
+    {
+        next = &scheduler_cpus[cpu_current_id()].idle_thread;
+    }
+
+    scheduler_switch_to(next);
+
+    // We will never get here, since nobody ever switches back to an exited thread.
+    HALT();
+}
+
+thread_t *thread_current(void)
+{
+    return cpu_current()->current_thread;
+}
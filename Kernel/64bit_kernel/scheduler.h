@@ -0,0 +1,115 @@
+/*
+ * scheduler.h - Kernel threads, and the scheduler running them.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#ifndef __SCHEDULER_H__
+#define __SCHEDULER_H__ 1
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//// Defines.
+// The maximum number of threads that can exist at the same time, not counting the idle threads. Each run queue is large
+// enough to hold all of them.
+#define SCHEDULER_MAX_THREADS           4096
+
+// The size of the stack of each thread, as a page allocator order: 4 KiB << 2 = 16 KiB.
+#define THREAD_STACK_ORDER              2
+
+//// Type definitions and structures
+typedef void (*thread_function_t)(void *argument);
+
+typedef enum
+{
+    // Waiting in a run queue, or running.
+    thread_state_ready,
+
+    // The thread has exited; it will be freed as soon as we have switched away from it.
+    thread_state_exited
+} thread_state_e;
+
+typedef struct thread
+{
+    // The stack pointer of the thread, saved by context_switch() when the thread is not running.
+    uint64_t rsp;
+
+    // The stack of the thread. Zero for the idle threads, which run on the stacks the CPU:s were started with.
+    uint64_t stack;
+
+    thread_state_e state;
+
+    // The function the thread runs, and its argument.
+    thread_function_t function;
+    void *argument;
+
+    // The address space the thread runs in (see vm.h), or NULL for the kernel address space.
+    struct address_space *address_space;
+} thread_t;
+
+//// Function prototypes
+/**
+ * Initialize the scheduler on the current CPU. The code that is currently running becomes the idle thread of the CPU.
+ * Must be called once on every CPU, before it is counted as online (since the other CPU:s may start stealing threads from
+ * it as soon as it is).
+ */
+extern void scheduler_init_cpu(void);
+
+/**
+ * Run threads on the current CPU forever. When there is nothing to run, the CPU steals threads from the other CPU:s, and
+ * runs any work given to it with smp_run().
+ */
+extern void scheduler_idle(void) __attribute__((noreturn));
+
+/**
+ * Limit the work stealing to the first cpu_count CPU:s. The other CPU:s keep running the threads in their own run queues,
+ * but don't steal anything, and nobody steals from them. This is mostly useful for benchmarking.
+ *
+ * @param cpu_count  The number of CPU:s taking part in the work stealing. Clamped to the number of online CPU:s.
+ */
+extern void scheduler_limit_cpus(unsigned int cpu_count);
+
+/**
+ * Create a new thread. It is put in the run queue of the current CPU, and starts running when the current thread yields
+ * or exits (or when another CPU steals it).
+ *
+ * @param function  The function to run in the thread. When it returns, the thread exits.
+ * @param argument  The argument to pass to the function.
+ * @returns the thread, or NULL if the thread could not be created. The thread is freed when it exits, so the pointer must
+ * not be used after that.
+ */
+extern thread_t *thread_create(thread_function_t function, void *argument);
+
+/**
+ * Create a new thread running in a given address space. Apart from that, this works just like thread_create().
+ *
+ * @param address_space  The address space, or NULL for the kernel address space. The address space must not be destroyed
+ * until the thread has exited.
+ * @param function  The function to run in the thread. When it returns, the thread exits.
+ * @param argument  The argument to pass to the function.
+ * @returns the thread, or NULL if the thread could not be created.
+ */
+extern thread_t *thread_create_in(struct address_space *address_space, thread_function_t function, void *argument);
+
+/**
+ * Let another thread run, if there is one ready to run. The current thread is put in the run queue, and continues
+ * running when it is picked up again -- possibly by another CPU. Threads are never preempted, so a thread that is waiting
+ * for something must call this regularly.
+ */
+extern void thread_yield(void);
+
+/**
+ * Exit the current thread. Must not be called by an idle thread.
+ */
+extern void thread_exit(void) __attribute__((noreturn));
+
+/**
+ * Get the thread running on the current CPU.
+ *
+ * @returns the current thread.
+ */
+extern thread_t *thread_current(void);
+
+#endif // !__SCHEDULER_H__
@@ -0,0 +1,196 @@
+/*
+ * scheduler_benchmark.c - Benchmarks of the scheduler, run with benchmark=scheduler (see benchmark.h).
+ *
+ * scheduler.yield measures a round trip between two threads yielding to each other on the same CPU, i.e. two context
+ * switches. The scheduler.fork_join.<n>cpu benchmarks run a fork/join task tree per iteration, with the work stealing
+ * limited to n CPU:s; the ones with more CPU:s than there are online are skipped.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "benchmark.h"
+#include "cpu.h"
+#include "io.h"
+#include "scheduler.h"
+
+// The depth of the fork/join task tree. Each task (except for the leaves) forks off a thread for one of its two subtrees
+// and runs the other one itself, so there are 2^depth leaves and 2^depth - 1 threads. The tree is run over a hundred
+// times per benchmark, so it is kept fairly small.
+#define TREE_DEPTH                      8
+
+// The number of pseudo-random numbers generated by each leaf task; this is the "useful work" in the task tree. Around 10
+// cycles each, which makes each leaf a few tens of thousands of cycles -- a fairly fine-grained task.
+#define LEAF_ITERATIONS                 2000
+
+// The flag telling the ping-pong thread to stop, and the flag it sets once it has.
+static volatile bool ping_pong_stop;
+static volatile bool ping_pong_finished;
+
+// A task in the fork/join tree. The task descriptor is located on the stack of the parent, which waits for the task to
+// finish before returning.
+typedef struct
+{
+    unsigned int depth;
+    volatile unsigned int *pending;
+} task_t;
+
+// Keeps the compiler from optimizing the leaf work away.
+static volatile uint64_t leaf_result;
+
+static void ping_pong(void *argument)
+{
+    while (!__atomic_load_n(&ping_pong_stop, __ATOMIC_ACQUIRE))
+    {
+        thread_yield();
+    }
+
+    __atomic_store_n(&ping_pong_finished, true, __ATOMIC_RELEASE);
+}
+
+static void run_task(unsigned int depth);
+
+static void task_thread(void *argument)
+{
+    task_t *task = argument;
+    run_task(task->depth);
+    __atomic_sub_fetch(task->pending, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Run a subtree of the fork/join task tree.
+ *
+ * @param depth  The depth of the subtree. 0 means a leaf.
+ */
+static void run_task(unsigned int depth)
+{
+    if (depth == 0)
+    {
+        uint64_t random = 0x2545F4914F6CDD1DULL;
+        for (int i = 0; i < LEAF_ITERATIONS; i++)
+        {
+            random ^= random << 13;
+            random ^= random >> 7;
+            random ^= random << 17;
+        }
+
+        leaf_result = random;
+        return;
+    }
+
+    volatile unsigned int pending = 1;
+    task_t child = { depth - 1, &pending };
+
+    if (thread_create(task_thread, &child) == NULL)
+    {
+        // Out of threads (or memory); run the subtree ourselves instead.
+        run_task(depth - 1);
+        pending = 0;
+    }
+
+    run_task(depth - 1);
+
+    // Join: wait for the forked subtree to finish, running other threads in the meantime. This is typically the thread we
+    // just forked off, unless another CPU has stolen it.
+    while (__atomic_load_n(&pending, __ATOMIC_ACQUIRE) != 0)
+    {
+        thread_yield();
+    }
+}
+
+// Two threads yielding to each other on the same CPU: the one running the benchmark and the ping-pong thread. Nobody may
+// steal them, or we would be measuring something completely different.
+static bool yield_setup(void)
+{
+    scheduler_limit_cpus(1);
+    ping_pong_stop = false;
+    ping_pong_finished = false;
+    if (thread_create(ping_pong, NULL) == NULL)
+    {
+        io_print_line("Scheduler benchmark: could not create the ping-pong thread, skipping.");
+        scheduler_limit_cpus(CPU_MAX_COUNT);
+        return false;
+    }
+
+    return true;
+}
+
+static void yield_teardown(void)
+{
+    __atomic_store_n(&ping_pong_stop, true, __ATOMIC_RELEASE);
+    while (!__atomic_load_n(&ping_pong_finished, __ATOMIC_ACQUIRE))
+    {
+        thread_yield();
+    }
+
+    scheduler_limit_cpus(CPU_MAX_COUNT);
+}
+
+static void yield_round_trip(uint64_t iterations)
+{
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        thread_yield();
+    }
+}
+
+/**
+ * Limit the work stealing to the CPU:s taking part in one of the scheduler.fork_join.<n>cpu benchmarks.
+ *
+ * @param cpu_count  The number of CPU:s.
+ * @returns true if there are that many CPU:s online, false if the benchmark should be skipped.
+ */
+static bool fork_join_setup(unsigned int cpu_count)
+{
+    if (cpu_count > cpu_online_count())
+    {
+        io_print_formatted("Scheduler benchmark: only %u CPU(s) online, skipping the %u CPU fork/join tree.\n",
+                           cpu_online_count(), cpu_count);
+        return false;
+    }
+
+    scheduler_limit_cpus(cpu_count);
+    return true;
+}
+
+static void fork_join_teardown(void)
+{
+    scheduler_limit_cpus(CPU_MAX_COUNT);
+}
+
+static void fork_join(uint64_t iterations)
+{
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        run_task(TREE_DEPTH);
+    }
+}
+
+/**
+ * Declare the scheduler.fork_join.<n>cpu benchmark for a number of CPU:s.
+ *
+ * @param count  The number of CPU:s.
+ */
+#define FORK_JOIN_BENCHMARK(count)                                                                                     \
+    static bool fork_join_setup_##count(void)                                                                          \
+    {                                                                                                                  \
+        return fork_join_setup(count);                                                                                 \
+    }                                                                                                                  \
+                                                                                                                       \
+    static void fork_join_##count(uint64_t iterations)                                                                 \
+    {                                                                                                                  \
+        fork_join(iterations);                                                                                         \
+    }                                                                                                                  \
+                                                                                                                       \
+    BENCHMARK("scheduler.fork_join." #count "cpu", fork_join_##count, fork_join_setup_##count, fork_join_teardown)
+
+BENCHMARK("scheduler.yield", yield_round_trip, yield_setup, yield_teardown);
+
+FORK_JOIN_BENCHMARK(1);
+FORK_JOIN_BENCHMARK(2);
+FORK_JOIN_BENCHMARK(4);
+FORK_JOIN_BENCHMARK(8);
+FORK_JOIN_BENCHMARK(16);
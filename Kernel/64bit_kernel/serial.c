@@ -0,0 +1,348 @@
+/*
+ * serial.c - Input and output on the first serial port (COM1), which is a 16550 compatible UART on all PC:s (and
+ * emulators) that have a serial port at all.
+ *
+ * The output is buffered in a ring buffer, and fed to the UART a FIFO-full at a time: the transmit FIFO of a 16550 holds
+ * 16 bytes, and the UART raises an interrupt when it has become empty. Writing to the port is thus a matter of copying
+ * the data to the ring buffer, and possibly filling the FIFO if the UART is idle; the interrupt handler takes care of the
+ * rest. Under emulation, each port access is a trap to the hypervisor, so doing 16 bytes per interrupt (and never
+ * polling the line status per byte) makes a big difference there as well.
+ *
+ * The input is likewise put in a ring buffer of its own by the interrupt handler, where serial_read() picks it up.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common/port.h"
+#include "apic.h"
+#include "cpu.h"
+#include "interrupt.h"
+#include "io.h"
+#include "ioapic.h"
+#include "serial.h"
+#include "spinlock.h"
+
+#define COM1_PORT                       0x3F8
+#define COM1_IRQ                        4
+
+// The UART registers, as offsets from the base port. The divisor latch overlays the data and interrupt enable registers
+// when the DLAB bit in the line control register is set.
+#define SERIAL_DATA                     0
+#define SERIAL_INTERRUPT_ENABLE         1
+#define SERIAL_DIVISOR_LOW              0
+#define SERIAL_DIVISOR_HIGH             1
+#define SERIAL_INTERRUPT_ID             2
+#define SERIAL_FIFO_CONTROL             2
+#define SERIAL_LINE_CONTROL             3
+#define SERIAL_MODEM_CONTROL            4
+#define SERIAL_LINE_STATUS              5
+#define SERIAL_MODEM_STATUS             6
+#define SERIAL_SCRATCH                  7
+
+#define SERIAL_INTERRUPT_ENABLE_RECEIVED_DATA 0x01
+#define SERIAL_INTERRUPT_ENABLE_THR_EMPTY 0x02
+
+// The interrupt identification register. Bit 0 is clear when an interrupt is pending, and the next three bits tell
+// which one it is (in order of priority).
+#define SERIAL_INTERRUPT_ID_NONE_PENDING 0x01
+#define SERIAL_INTERRUPT_ID_MASK        0x0E
+#define SERIAL_INTERRUPT_ID_MODEM_STATUS 0x00
+#define SERIAL_INTERRUPT_ID_THR_EMPTY   0x02
+#define SERIAL_INTERRUPT_ID_RECEIVED_DATA 0x04
+#define SERIAL_INTERRUPT_ID_LINE_STATUS 0x06
+#define SERIAL_INTERRUPT_ID_TIMEOUT     0x0C
+#define SERIAL_INTERRUPT_ID_FIFO_ENABLED 0xC0
+
+// Enable the FIFOs and clear them. The receive trigger level is left at one byte, since the input is typed by hand.
+#define SERIAL_FIFO_CONTROL_ENABLE      0x07
+
+// 8 data bits, no parity, one stop bit.
+#define SERIAL_LINE_CONTROL_8N1         0x03
+#define SERIAL_LINE_CONTROL_DLAB        0x80
+
+// DTR and RTS, and OUT2 -- which on a PC gates the interrupt line of the UART.
+#define SERIAL_MODEM_CONTROL_DTR_RTS_OUT2 0x0B
+
+#define SERIAL_LINE_STATUS_DATA_READY   0x01
+#define SERIAL_LINE_STATUS_THR_EMPTY    0x20
+
+// The divisor of the 115200 Hz UART clock: 1 gives us 115200 baud.
+#define SERIAL_BAUD_DIVISOR             1
+
+// The size of the transmit FIFO of a 16550A. Older UART:s without a working FIFO can only take a byte at a time.
+#define SERIAL_FIFO_SIZE                16
+
+// The size of the ring buffer. Must be a power of two. 16 KiB is well over a second worth of output at 115200 baud.
+#define RING_BUFFER_SIZE                (16 * 1024)
+
+// The size of the input ring buffer. Must be a power of two.
+#define INPUT_BUFFER_SIZE               256
+
+static bool present;
+
+// Set once the output is interrupt-driven.
+static bool interrupt_driven;
+
+// Set while the UART is busy sending, i.e. when there is a THR empty interrupt to look forward to.
+static bool transmitting;
+
+static unsigned int fifo_size = 1;
+
+// The ring buffer. The indices are free-running; they are masked when used, and their difference is the number of bytes
+// in the buffer.
+static char ring_buffer[RING_BUFFER_SIZE];
+static uint32_t ring_head;
+static uint32_t ring_tail;
+
+// The input ring buffer, indexed like the output one. Input that doesn't fit is thrown away.
+static char input_buffer[INPUT_BUFFER_SIZE];
+static uint32_t input_head;
+static uint32_t input_tail;
+
+// Protects all of the above. Always taken with interrupts disabled, since the interrupt handler takes it as well.
+static spinlock_t lock;
+
+/**
+ * Fill the transmit FIFO from the ring buffer, if the FIFO is empty.
+ *
+ * @returns true if the UART is busy sending, false if it is idle.
+ */
+static bool serial_fill_fifo(void)
+{
+    if ((inb(COM1_PORT + SERIAL_LINE_STATUS) & SERIAL_LINE_STATUS_THR_EMPTY) == 0)
+    {
+        return true;
+    }
+
+    if (ring_head == ring_tail)
+    {
+        return false;
+    }
+
+    for (unsigned int i = 0; i < fifo_size && ring_tail != ring_head; i++)
+    {
+        outb(COM1_PORT + SERIAL_DATA, ring_buffer[ring_tail++ & (RING_BUFFER_SIZE - 1)]);
+    }
+
+    return true;
+}
+
+/**
+ * Wait for the transmit FIFO to become empty, and fill it from the ring buffer.
+ */
+static void serial_fill_fifo_polled(void)
+{
+    while ((inb(COM1_PORT + SERIAL_LINE_STATUS) & SERIAL_LINE_STATUS_THR_EMPTY) == 0)
+    {
+        cpu_relax();
+    }
+
+    serial_fill_fifo();
+}
+
+/**
+ * Put a byte in the ring buffer. If it is full, we wait for the UART to make room; this throttles the caller to the line
+ * rate, rather than throwing output away.
+ *
+ * @param c  The byte.
+ */
+static void serial_put(char c)
+{
+    if (ring_head - ring_tail == RING_BUFFER_SIZE)
+    {
+        serial_fill_fifo_polled();
+    }
+
+    ring_buffer[ring_head++ & (RING_BUFFER_SIZE - 1)] = c;
+}
+
+/**
+ * Move the received data from the UART to the input ring buffer.
+ */
+static void serial_receive(void)
+{
+    while ((inb(COM1_PORT + SERIAL_LINE_STATUS) & SERIAL_LINE_STATUS_DATA_READY) != 0)
+    {
+        char c = inb(COM1_PORT + SERIAL_DATA);
+        if (input_head - input_tail < INPUT_BUFFER_SIZE)
+        {
+            input_buffer[input_head++ & (INPUT_BUFFER_SIZE - 1)] = c;
+        }
+    }
+}
+
+/**
+ * The interrupt handler. The interrupt is edge-triggered, so we must keep going until the UART has nothing more to
+ * report; a condition left pending would never raise another interrupt.
+ */
+static void serial_interrupt(interrupt_frame_t *frame)
+{
+    spinlock_lock(&lock);
+
+    uint8_t id;
+    while (((id = inb(COM1_PORT + SERIAL_INTERRUPT_ID)) & SERIAL_INTERRUPT_ID_NONE_PENDING) == 0)
+    {
+        switch (id & SERIAL_INTERRUPT_ID_MASK)
+        {
+            case SERIAL_INTERRUPT_ID_RECEIVED_DATA:
+            case SERIAL_INTERRUPT_ID_TIMEOUT:
+                serial_receive();
+                break;
+
+            case SERIAL_INTERRUPT_ID_LINE_STATUS:
+                inb(COM1_PORT + SERIAL_LINE_STATUS);
+                break;
+
+            case SERIAL_INTERRUPT_ID_MODEM_STATUS:
+                inb(COM1_PORT + SERIAL_MODEM_STATUS);
+                break;
+
+            default:
+                // Reading the interrupt identification register acknowledges the THR empty interrupt.
+                break;
+        }
+    }
+
+    transmitting = serial_fill_fifo();
+    spinlock_unlock(&lock);
+
+    apic_end_of_interrupt();
+}
+
+bool serial_init(void)
+{
+    // There is no reliable way to tell if a serial port is present, but a missing one will not remember what we write to
+    // its scratch register.
+    outb(COM1_PORT + SERIAL_SCRATCH, 0x5A);
+    if (inb(COM1_PORT + SERIAL_SCRATCH) != 0x5A)
+    {
+        return false;
+    }
+
+    outb(COM1_PORT + SERIAL_INTERRUPT_ENABLE, 0);
+    outb(COM1_PORT + SERIAL_LINE_CONTROL, SERIAL_LINE_CONTROL_DLAB);
+    outb(COM1_PORT + SERIAL_DIVISOR_LOW, SERIAL_BAUD_DIVISOR & 0xFF);
+    outb(COM1_PORT + SERIAL_DIVISOR_HIGH, SERIAL_BAUD_DIVISOR >> 8);
+    outb(COM1_PORT + SERIAL_LINE_CONTROL, SERIAL_LINE_CONTROL_8N1);
+    outb(COM1_PORT + SERIAL_FIFO_CONTROL, SERIAL_FIFO_CONTROL_ENABLE);
+    outb(COM1_PORT + SERIAL_MODEM_CONTROL, SERIAL_MODEM_CONTROL_DTR_RTS_OUT2);
+
+    // The two top bits of the interrupt identification register are only both set if the FIFOs are working (i.e. on a
+    // 16550A or later; the original 16550 had a broken FIFO).
+    if ((inb(COM1_PORT + SERIAL_INTERRUPT_ID) & SERIAL_INTERRUPT_ID_FIFO_ENABLED) == SERIAL_INTERRUPT_ID_FIFO_ENABLED)
+    {
+        fifo_size = SERIAL_FIFO_SIZE;
+    }
+
+    present = true;
+    return true;
+}
+
+void serial_enable_interrupts(void)
+{
+    if (!present)
+    {
+        return;
+    }
+
+    interrupt_register_handler(INTERRUPT_VECTOR_ISA_BASE + COM1_IRQ, serial_interrupt);
+    if (!ioapic_route_isa_irq(COM1_IRQ, apic_get_id()))
+    {
+        io_print_line("Serial: could not route the COM1 interrupt, output stays synchronous.");
+        return;
+    }
+
+    uint64_t flags = interrupt_save_disable();
+    spinlock_lock(&lock);
+
+    // The ring buffer is empty at this point, since the output has been synchronous up until now. Enabling the interrupt
+    // with an empty transmitter gives us an interrupt right away, which the handler will just ignore.
+    interrupt_driven = true;
+    transmitting = false;
+    outb(COM1_PORT + SERIAL_INTERRUPT_ENABLE, SERIAL_INTERRUPT_ENABLE_RECEIVED_DATA | SERIAL_INTERRUPT_ENABLE_THR_EMPTY);
+
+    spinlock_unlock(&lock);
+    interrupt_restore(flags);
+}
+
+void serial_write(const char *data, size_t length)
+{
+    if (!present)
+    {
+        return;
+    }
+
+    uint64_t flags = interrupt_save_disable();
+    spinlock_lock(&lock);
+
+    for (size_t i = 0; i < length; i++)
+    {
+        if (data[i] == '\n')
+        {
+            serial_put('\r');
+        }
+
+        serial_put(data[i]);
+    }
+
+    if (interrupt_driven)
+    {
+        // If the UART is busy, the interrupt handler will pick up the new data when the FIFO has been emptied. Otherwise,
+        // we have to get it going.
+        if (!transmitting)
+        {
+            transmitting = serial_fill_fifo();
+        }
+    }
+    else
+    {
+        while (ring_head != ring_tail)
+        {
+            serial_fill_fifo_polled();
+        }
+    }
+
+    spinlock_unlock(&lock);
+    interrupt_restore(flags);
+}
+
+void serial_drain(void)
+{
+    while (present && ring_head != ring_tail)
+    {
+        serial_fill_fifo_polled();
+    }
+}
+
+bool serial_read(char *c)
+{
+    if (!present)
+    {
+        return false;
+    }
+
+    uint64_t flags = interrupt_save_disable();
+    spinlock_lock(&lock);
+
+    // Until the input is interrupt-driven, we look for it ourselves.
+    if (!interrupt_driven)
+    {
+        serial_receive();
+    }
+
+    bool received = input_head != input_tail;
+    if (received)
+    {
+        *c = input_buffer[input_tail++ & (INPUT_BUFFER_SIZE - 1)];
+    }
+
+    spinlock_unlock(&lock);
+    interrupt_restore(flags);
+
+    return received;
+}
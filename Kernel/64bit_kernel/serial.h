@@ -0,0 +1,53 @@
+/*
+ * serial.h - Input and output on the first serial port (COM1).
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#ifndef __SERIAL_H__
+#define __SERIAL_H__ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+
+//// Function prototypes
+/**
+ * Detect and initialize the serial port. Until serial_enable_interrupts() has been called, the output is written to the
+ * port synchronously.
+ *
+ * @returns true if there is a serial port, false otherwise.
+ */
+extern bool serial_init(void);
+
+/**
+ * Switch to interrupt-driven input and output. The I/O APIC must have been initialized first. If the interrupt can't be
+ * routed, the output stays synchronous (and the input is polled by serial_read()).
+ */
+extern void serial_enable_interrupts(void);
+
+/**
+ * Write data to the serial port. Newlines are translated to CR LF. The data is put in a ring buffer, and sent from there
+ * as the port becomes ready; the call only waits for the port if the ring buffer is full (or if the output is not yet
+ * interrupt-driven).
+ *
+ * @param data  The data to write.
+ * @param length  The length of the data, in bytes.
+ */
+extern void serial_write(const char *data, size_t length);
+
+/**
+ * Read a character received on the serial port, if there is one. Does not wait.
+ *
+ * @param c  The character [out]
+ * @returns true if a character was read, false if there was nothing to read.
+ */
+extern bool serial_read(char *c);
+
+/**
+ * Send everything in the ring buffer synchronously, without taking any locks. Only meant to be used when the CPU is
+ * about to be halted, e.g. after a kernel panic.
+ */
+extern void serial_drain(void);
+
+#endif // !__SERIAL_H__
@@ -0,0 +1,347 @@
+/*
+ * slab.c - The slab allocator, for allocating kernel objects of a fixed size. This is loosely modelled after the Bonwick
+ * slab allocator (as found in Solaris and, in a somewhat different shape, in Linux): objects of the same size are carved
+ * out of "slabs" of one or more pages, and each CPU keeps a magazine of free objects so that the common case does not need
+ * any locking.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common/memory.h"
+#include "cpu.h"
+#include "io.h"
+#include "page_allocator.h"
+#include "slab.h"
+#include "spinlock.h"
+#include "trace.h"
+
+// The header of a slab, placed at the very start of it. Since the slabs are naturally aligned blocks from the page
+// allocator, the slab of an object can be found by simply masking off the low bits of its address.
+struct slab
+{
+    slab_t *next;
+    slab_t *previous;
+
+    // The free objects in this slab. The first word of each free object points at the next one.
+    void *free_objects;
+    uint32_t free_count;
+};
+
+// The objects start at this offset in the slab. The header is padded to a full cache line, so that the first object is
+// cache-line aligned as well.
+#define SLAB_HEADER_SIZE                CPU_CACHE_LINE_SIZE
+
+// The largest slab order we use. Larger slabs waste less memory at the end of the slab for large objects, but makes it
+// harder for the page allocator to find memory for them.
+#define SLAB_MAX_ORDER                  3
+
+// The smallest number of objects we want in each slab. Fewer objects means more trips to the page allocator.
+#define SLAB_MIN_OBJECTS                8
+
+// All the caches that have been created.
+static slab_cache_t *caches;
+static spinlock_t caches_lock;
+
+static void slab_list_push(slab_t **list, slab_t *slab)
+{
+    slab->previous = NULL;
+    slab->next = *list;
+    if (slab->next != NULL)
+    {
+        slab->next->previous = slab;
+    }
+
+    *list = slab;
+}
+
+static void slab_list_remove(slab_t **list, slab_t *slab)
+{
+    if (slab->previous != NULL)
+    {
+        slab->previous->next = slab->next;
+    }
+    else
+    {
+        *list = slab->next;
+    }
+
+    if (slab->next != NULL)
+    {
+        slab->next->previous = slab->previous;
+    }
+}
+
+/**
+ * Allocate a new slab for a cache, and put all of its objects on its free list. The cache lock must be held by the
+ * caller.
+ *
+ * @returns the slab, or NULL if the page allocator is out of memory.
+ */
+static slab_t *slab_create(slab_cache_t *cache)
+{
+    slab_t *slab = (slab_t *) page_allocate(cache->slab_order);
+    if (slab == NULL)
+    {
+        return NULL;
+    }
+
+    slab->free_objects = NULL;
+    slab->free_count = cache->objects_per_slab;
+
+    // Build the free list backwards, so that the objects are handed out in address order.
+    uint8_t *objects = (uint8_t *) slab + SLAB_HEADER_SIZE;
+    for (uint32_t i = cache->objects_per_slab; i > 0; i--)
+    {
+        void **object = (void **) (objects + (i - 1) * cache->object_size);
+        *object = slab->free_objects;
+        slab->free_objects = object;
+    }
+
+    cache->slab_count++;
+    return slab;
+}
+
+/**
+ * Move a number of objects from the slabs into a magazine. The cache lock must be held by the caller.
+ */
+static void slab_refill_magazine(slab_cache_t *cache, slab_magazine_t *magazine)
+{
+    while (magazine->count < SLAB_MAGAZINE_BATCH)
+    {
+        slab_t *slab = cache->partial_slabs;
+        if (slab == NULL)
+        {
+            slab = cache->free_slabs;
+            if (slab != NULL)
+            {
+                slab_list_remove(&cache->free_slabs, slab);
+            }
+            else
+            {
+                slab = slab_create(cache);
+                if (slab == NULL)
+                {
+                    return;
+                }
+            }
+
+            slab_list_push(&cache->partial_slabs, slab);
+        }
+
+        void **object = slab->free_objects;
+        slab->free_objects = *object;
+        slab->free_count--;
+        cache->objects_in_use++;
+        magazine->objects[magazine->count++] = object;
+
+        if (slab->free_count == 0)
+        {
+            slab_list_remove(&cache->partial_slabs, slab);
+            slab_list_push(&cache->full_slabs, slab);
+        }
+    }
+}
+
+/**
+ * Return an object to its slab. The cache lock must be held by the caller.
+ */
+static void slab_return_object(slab_cache_t *cache, void *object)
+{
+    slab_t *slab = (slab_t *) ((uint64_t) object & ~(((uint64_t) PAGE_SIZE << cache->slab_order) - 1));
+
+    *(void **) object = slab->free_objects;
+    slab->free_objects = object;
+    slab->free_count++;
+    cache->objects_in_use--;
+
+    if (slab->free_count == 1)
+    {
+        slab_list_remove(&cache->full_slabs, slab);
+        slab_list_push(&cache->partial_slabs, slab);
+    }
+
+    if (slab->free_count == cache->objects_per_slab)
+    {
+        slab_list_remove(&cache->partial_slabs, slab);
+
+        // Keep one free slab around, to avoid going back and forth to the page allocator when the number of objects in use
+        // hovers around a slab boundary.
+        if (cache->free_slabs == NULL)
+        {
+            slab_list_push(&cache->free_slabs, slab);
+        }
+        else
+        {
+            page_free((uint64_t) slab, cache->slab_order);
+            cache->slab_count--;
+        }
+    }
+}
+
+slab_cache_t *slab_cache_create(const char *name, size_t object_size, size_t alignment)
+{
+    if (alignment == 0)
+    {
+        alignment = CPU_CACHE_LINE_SIZE;
+    }
+
+    // The objects start right after the header, so they can't be aligned on more than the size of it.
+    if ((alignment & (alignment - 1)) != 0 || alignment > SLAB_HEADER_SIZE)
+    {
+        return NULL;
+    }
+
+    // Each free object holds a pointer to the next one, so they can't be smaller than that.
+    if (object_size < sizeof(void *))
+    {
+        object_size = sizeof(void *);
+    }
+
+    object_size = (object_size + alignment - 1) & ~(alignment - 1);
+
+    // Find the smallest slab order that gives us a reasonable number of objects per slab, without wasting more than 1/8 of
+    // the slab. If no order satisfies that, we go with the largest one.
+    unsigned int slab_order = 0;
+    while (slab_order < SLAB_MAX_ORDER)
+    {
+        size_t slab_size = (size_t) PAGE_SIZE << slab_order;
+        size_t objects = (slab_size - SLAB_HEADER_SIZE) / object_size;
+        size_t waste = slab_size - SLAB_HEADER_SIZE - objects * object_size;
+
+        if (objects >= SLAB_MIN_OBJECTS && waste <= slab_size / 8)
+        {
+            break;
+        }
+
+        slab_order++;
+    }
+
+    uint32_t objects_per_slab = (((size_t) PAGE_SIZE << slab_order) - SLAB_HEADER_SIZE) / object_size;
+    if (objects_per_slab == 0)
+    {
+        return NULL;
+    }
+
+    // The cache descriptors themselves are allocated directly from the page allocator. They are pretty large because of
+    // the per-CPU magazines, and there is only a handful of them, so there is no point in using a slab cache for them.
+    unsigned int descriptor_order = 0;
+    while (((size_t) PAGE_SIZE << descriptor_order) < sizeof(slab_cache_t))
+    {
+        descriptor_order++;
+    }
+
+    slab_cache_t *cache = (slab_cache_t *) page_allocate(descriptor_order);
+    if (cache == NULL)
+    {
+        return NULL;
+    }
+
+    memory_zero(cache, sizeof(slab_cache_t));
+
+    int i;
+    for (i = 0; name[i] != '\0' && i < SLAB_CACHE_NAME_SIZE - 1; i++)
+    {
+        cache->name[i] = name[i];
+    }
+
+    cache->name[i] = '\0';
+    cache->object_size = object_size;
+    cache->alignment = alignment;
+    cache->slab_order = slab_order;
+    cache->objects_per_slab = objects_per_slab;
+
+    spinlock_lock(&caches_lock);
+    cache->next = caches;
+    caches = cache;
+    spinlock_unlock(&caches_lock);
+
+    return cache;
+}
+
+void *slab_allocate(slab_cache_t *cache)
+{
+    TRACE(trace_event_slab_allocate_begin, cache, 0);
+
+    slab_magazine_t *magazine = &cache->magazines[cpu_current_id()];
+
+    if (magazine->count > 0)
+    {
+        magazine->hits++;
+    }
+    else
+    {
+        magazine->misses++;
+
+        spinlock_lock(&cache->lock);
+        slab_refill_magazine(cache, magazine);
+        spinlock_unlock(&cache->lock);
+    }
+
+    void *object = magazine->count > 0 ? magazine->objects[--magazine->count] : NULL;
+
+    TRACE(trace_event_slab_allocate_end, cache, object);
+    return object;
+}
+
+void slab_free(slab_cache_t *cache, void *object)
+{
+    TRACE(trace_event_slab_free_begin, cache, object);
+
+    slab_magazine_t *magazine = &cache->magazines[cpu_current_id()];
+
+    if (magazine->count == SLAB_MAGAZINE_SIZE)
+    {
+        // Return the oldest objects; the most recently freed ones are the most likely to still be in the CPU cache.
+        spinlock_lock(&cache->lock);
+        for (int i = 0; i < SLAB_MAGAZINE_BATCH; i++)
+        {
+            slab_return_object(cache, magazine->objects[i]);
+        }
+        spinlock_unlock(&cache->lock);
+
+        memory_copy(&magazine->objects[0], &magazine->objects[SLAB_MAGAZINE_BATCH],
+                    (SLAB_MAGAZINE_SIZE - SLAB_MAGAZINE_BATCH) * sizeof(void *));
+        magazine->count -= SLAB_MAGAZINE_BATCH;
+    }
+
+    magazine->objects[magazine->count++] = object;
+
+    TRACE(trace_event_slab_free_end, 0, 0);
+}
+
+void slab_print_statistics(void)
+{
+    io_print_line("Slab caches (object size, objects in use, slabs, magazine hit rate, fragmentation):");
+
+    spinlock_lock(&caches_lock);
+    for (slab_cache_t *cache = caches; cache != NULL; cache = cache->next)
+    {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t cached_objects = 0;
+        for (int i = 0; i < CPU_MAX_COUNT; i++)
+        {
+            hits += cache->magazines[i].hits;
+            misses += cache->magazines[i].misses;
+            cached_objects += cache->magazines[i].count;
+        }
+
+        // The objects sitting in the magazines are counted as being in use by the slabs, but they are really free.
+        uint64_t objects_in_use = cache->objects_in_use - cached_objects;
+        uint64_t slab_memory = (uint64_t) cache->slab_count * (PAGE_SIZE << cache->slab_order);
+        uint64_t used_memory = objects_in_use * cache->object_size;
+
+        io_print("  ");
+        io_print(cache->name);
+        io_print_formatted(": %U B, %U objects, %u slabs, %U%% hits, %U%% fragmentation\n",
+                           (uint64_t) cache->object_size, objects_in_use, cache->slab_count,
+                           hits + misses > 0 ? hits * 100 / (hits + misses) : 0,
+                           slab_memory > 0 ? (slab_memory - used_memory) * 100 / slab_memory : 0);
+    }
+    spinlock_unlock(&caches_lock);
+}
@@ -0,0 +1,113 @@
+/*
+ * slab.h - The slab allocator, for allocating kernel objects of a fixed size.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#ifndef __SLAB_H__
+#define __SLAB_H__ 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cpu.h"
+#include "spinlock.h"
+
+//// Defines.
+// The number of objects in each per-CPU magazine, and the number of objects moved between a magazine and the slabs at a
+// time when it runs empty or full.
+#define SLAB_MAGAZINE_SIZE              16
+#define SLAB_MAGAZINE_BATCH             8
+
+// The maximum length of a cache name, including the terminating NUL character.
+#define SLAB_CACHE_NAME_SIZE            24
+
+//// Type definitions and structures
+typedef struct slab slab_t;
+
+// A per-CPU magazine: a small stack of free objects that only its own CPU touches, and never from interrupt handlers,
+// so allocating and freeing objects can be done without taking any lock. The statistics are kept here as well, so that
+// the CPU:s don't have to write to any shared cache lines in the fast path.
+typedef struct
+{
+    uint32_t count;
+    void *objects[SLAB_MAGAZINE_SIZE];
+
+    // The number of allocations served directly from the magazine, and the number that had to go to the slabs.
+    uint64_t hits;
+    uint64_t misses;
+} __attribute__((aligned(CPU_CACHE_LINE_SIZE))) slab_magazine_t;
+
+// A cache of objects of a given size. Each cache has its own set of slabs: naturally aligned blocks from the page
+// allocator, with a header followed by the objects.
+typedef struct slab_cache
+{
+    char name[SLAB_CACHE_NAME_SIZE];
+
+    // The size of the objects (including padding for the alignment), and the alignment itself.
+    size_t object_size;
+    size_t alignment;
+
+    // The order of the slabs (as in page_allocate()), and the number of objects in each of them.
+    unsigned int slab_order;
+    uint32_t objects_per_slab;
+
+    // The lock protecting the slab lists and the counters below. It is only taken when a magazine needs to be refilled
+    // or flushed.
+    spinlock_t lock;
+
+    // The slabs that have some free objects, the ones that are completely in use and the completely free ones. We keep at
+    // most one free slab around; the rest are returned to the page allocator.
+    slab_t *partial_slabs;
+    slab_t *full_slabs;
+    slab_t *free_slabs;
+
+    uint32_t slab_count;
+    uint64_t objects_in_use;
+
+    // All the caches are kept in a list, so that we can print statistics about them.
+    struct slab_cache *next;
+
+    slab_magazine_t magazines[CPU_MAX_COUNT];
+} slab_cache_t;
+
+//// Function prototypes
+// slab_allocate() and slab_free() must not be called from interrupt handlers. The per-CPU magazines are used without a
+// lock and with interrupts enabled, and the slabs come from the page allocator, which has the same rule (see
+// page_allocator.h).
+
+/**
+ * Create a new object cache.
+ *
+ * @param name  The name of the cache, used when printing statistics. Longer names are truncated.
+ * @param object_size  The size of the objects, in bytes.
+ * @param alignment  The alignment of the objects. Must be a power of two, no larger than CPU_CACHE_LINE_SIZE. If 0, the
+ * objects are aligned on cache lines, which means that objects being used by different CPU:s never share a cache line.
+ * @returns the cache, or NULL if the alignment is not valid or there is not enough memory for creating it.
+ */
+extern slab_cache_t *slab_cache_create(const char *name, size_t object_size, size_t alignment);
+
+/**
+ * Allocate an object from a cache.
+ *
+ * @param cache  The cache to allocate the object from.
+ * @returns the object, or NULL if we are out of memory. The contents of the object are undefined.
+ */
+extern void *slab_allocate(slab_cache_t *cache);
+
+/**
+ * Return an object to a cache.
+ *
+ * @param cache  The cache that the object was allocated from.
+ * @param object  The object.
+ */
+extern void slab_free(slab_cache_t *cache, void *object);
+
+/**
+ * Print the statistics for all the caches: the number of objects in use, the magazine hit rate, and the fragmentation
+ * (the share of the slab memory that is not used by any object).
+ */
+extern void slab_print_statistics(void);
+
+#endif // !__SLAB_H__
@@ -0,0 +1,279 @@
+/*
+ * slab_benchmark.c - Benchmarks of the kernel heap (and thereby the slab allocator), compared to a naive first-fit heap.
+ * Run with benchmark=slab (see benchmark.h). The statistics of the slab caches are printed after the last of them.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "benchmark.h"
+#include "heap.h"
+#include "io.h"
+#include "page_allocator.h"
+#include "slab.h"
+
+// The number of allocations that can be live at the same time in the mixed-size benchmarks.
+#define SLOTS                           4096
+
+// The size of the allocations in the mixed-size measurement is evenly distributed between these.
+#define MIN_SIZE                        16
+#define MAX_SIZE                        2048
+
+// The size of the memory area used by the first-fit heap: 2 MiB << 3 = 16 MiB, which is enough for all the slots being
+// allocated with the maximum size at the same time.
+#define FIRST_FIT_ARENA_ORDER           (PAGE_ALLOCATOR_2MIB_ORDER + 3)
+
+// The size of the objects in the object cache benchmark.
+#define OBJECT_SIZE                     96
+
+//// The naive first-fit heap that we compare against. The free blocks are kept in a single list, sorted by address so that
+//// adjacent free blocks can be merged. Every allocation and every free walks the list from the start.
+typedef struct first_fit_block
+{
+    size_t size;
+    struct first_fit_block *next;
+} first_fit_block_t;
+
+// Each allocated block is preceded by a header holding its size. It is 16 bytes large, to keep the allocations aligned.
+#define FIRST_FIT_HEADER_SIZE           16
+
+static first_fit_block_t *first_fit_free_list;
+
+static void first_fit_init(void *arena, size_t size)
+{
+    first_fit_free_list = arena;
+    first_fit_free_list->size = size;
+    first_fit_free_list->next = NULL;
+}
+
+static void *first_fit_allocate(size_t size)
+{
+    size = ((size + 15) & ~(size_t) 15) + FIRST_FIT_HEADER_SIZE;
+
+    first_fit_block_t **previous_next = &first_fit_free_list;
+    for (first_fit_block_t *block = first_fit_free_list; block != NULL; block = block->next)
+    {
+        if (block->size >= size)
+        {
+            // Split the block, unless the remainder would be too small to be of any use.
+            if (block->size - size >= 2 * FIRST_FIT_HEADER_SIZE)
+            {
+                first_fit_block_t *remainder = (first_fit_block_t *) ((uint8_t *) block + size);
+                remainder->size = block->size - size;
+                remainder->next = block->next;
+                *previous_next = remainder;
+                block->size = size;
+            }
+            else
+            {
+                *previous_next = block->next;
+            }
+
+            return (uint8_t *) block + FIRST_FIT_HEADER_SIZE;
+        }
+
+        previous_next = &block->next;
+    }
+
+    return NULL;
+}
+
+static void first_fit_free(void *memory)
+{
+    first_fit_block_t *block = (first_fit_block_t *) ((uint8_t *) memory - FIRST_FIT_HEADER_SIZE);
+
+    first_fit_block_t *previous = NULL;
+    first_fit_block_t *next = first_fit_free_list;
+    while (next != NULL && next < block)
+    {
+        previous = next;
+        next = next->next;
+    }
+
+    // Merge with the following block, if it is adjacent...
+    block->next = next;
+    if (next != NULL && (uint8_t *) block + block->size == (uint8_t *) next)
+    {
+        block->size += next->size;
+        block->next = next->next;
+    }
+
+    // ...and with the preceding one.
+    if (previous == NULL)
+    {
+        first_fit_free_list = block;
+    }
+    else if ((uint8_t *) previous + previous->size == (uint8_t *) block)
+    {
+        previous->size += block->size;
+        previous->next = block->next;
+    }
+    else
+    {
+        previous->next = block;
+    }
+}
+
+//// The benchmarks themselves.
+static void *slots[SLOTS];
+static size_t slot_sizes[SLOTS];
+
+// The memory used by the first-fit heap.
+static uint64_t first_fit_arena;
+
+// The caches can't be destroyed, so the object cache is created the first time the benchmark is run and then reused.
+static slab_cache_t *object_cache;
+
+// A simple xorshift pseudo-random number generator. Both heaps are run with the same seed, so they get exactly the same
+// sequence of allocations and frees.
+static uint64_t random_state;
+
+static uint64_t random_next(void)
+{
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return random_state;
+}
+
+/**
+ * Run the mixed-size workload: pick a random slot; if it is in use, free it, otherwise allocate a block of a random size
+ * for it.
+ *
+ * @param iterations  The number of operations (allocations or frees).
+ * @param use_first_fit  true to use the first-fit heap, false to use the kernel heap.
+ */
+static void mixed(uint64_t iterations, bool use_first_fit)
+{
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        uint64_t random = random_next();
+        int slot = random % SLOTS;
+
+        if (slots[slot] != NULL)
+        {
+            if (use_first_fit)
+            {
+                first_fit_free(slots[slot]);
+            }
+            else
+            {
+                heap_free(slots[slot], slot_sizes[slot]);
+            }
+
+            slots[slot] = NULL;
+        }
+        else
+        {
+            size_t size = MIN_SIZE + (random >> 32) % (MAX_SIZE - MIN_SIZE + 1);
+            slots[slot] = use_first_fit ? first_fit_allocate(size) : heap_allocate(size);
+            slot_sizes[slot] = size;
+
+            // Touch the memory, like a real user of it would.
+            if (slots[slot] != NULL)
+            {
+                *(uint8_t *) slots[slot] = 0;
+            }
+        }
+    }
+}
+
+/**
+ * Free whatever is left after one of the mixed-size benchmarks, so that the next one starts from scratch.
+ *
+ * @param use_first_fit  true if the first-fit heap was used, false if the kernel heap was.
+ */
+static void mixed_free_slots(bool use_first_fit)
+{
+    for (int slot = 0; slot < SLOTS; slot++)
+    {
+        if (slots[slot] != NULL)
+        {
+            if (use_first_fit)
+            {
+                first_fit_free(slots[slot]);
+            }
+            else
+            {
+                heap_free(slots[slot], slot_sizes[slot]);
+            }
+
+            slots[slot] = NULL;
+        }
+    }
+}
+
+static bool mixed_heap_setup(void)
+{
+    random_state = 0x2545F4914F6CDD1DULL;
+    return true;
+}
+
+static void mixed_heap_teardown(void)
+{
+    mixed_free_slots(false);
+}
+
+static bool mixed_first_fit_setup(void)
+{
+    first_fit_arena = page_allocate(FIRST_FIT_ARENA_ORDER);
+    if (first_fit_arena == 0)
+    {
+        io_print_line("Slab benchmark: could not allocate the first-fit arena, skipping.");
+        return false;
+    }
+
+    first_fit_init((void *) first_fit_arena, (size_t) PAGE_SIZE << FIRST_FIT_ARENA_ORDER);
+    random_state = 0x2545F4914F6CDD1DULL;
+    return true;
+}
+
+static void mixed_first_fit_teardown(void)
+{
+    mixed_free_slots(true);
+    page_free(first_fit_arena, FIRST_FIT_ARENA_ORDER);
+}
+
+static void mixed_heap(uint64_t iterations)
+{
+    mixed(iterations, false);
+}
+
+static void mixed_first_fit(uint64_t iterations)
+{
+    mixed(iterations, true);
+}
+
+// A named object cache, with allocations and frees of the same size. This is the case the slab allocator is designed
+// for; it should pretty much always be served from the per-CPU magazine.
+static bool object_cache_setup(void)
+{
+    if (object_cache == NULL)
+    {
+        object_cache = slab_cache_create("benchmark-object", OBJECT_SIZE, 0);
+    }
+
+    if (object_cache == NULL)
+    {
+        io_print_line("Slab benchmark: could not create the object cache, skipping.");
+        return false;
+    }
+
+    return true;
+}
+
+static void object_cache_allocate_free(uint64_t iterations)
+{
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        slab_free(object_cache, slab_allocate(object_cache));
+    }
+}
+
+BENCHMARK("slab.mixed.heap", mixed_heap, mixed_heap_setup, mixed_heap_teardown);
+BENCHMARK("slab.mixed.first_fit", mixed_first_fit, mixed_first_fit_setup, mixed_first_fit_teardown);
+BENCHMARK("slab.object_cache", object_cache_allocate_free, object_cache_setup, slab_print_statistics);
@@ -0,0 +1,298 @@
+/*
+ * smp.c - Symmetric multiprocessing. The CPU:s are found by looking at the local APIC entries in the ACPI MADT, and
+ * started using the INIT-SIPI-SIPI sequence described in the Intel MultiProcessor Specification. Each application
+ * processor (AP) starts in real mode in the trampoline (smp_trampoline.S), which takes it to 64-bit mode and calls
+ * smp_ap_main().
+ *
+ * Once started, the AP:s run the scheduler, picking up (or stealing) threads to run. Work can also be given to a specific
+ * CPU with smp_run(), for the cases where it matters which CPU it runs on.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common/cpu.h"
+#include "common/memory.h"
+#include "common/memory_type.h"
+#include "acpi.h"
+#include "apic.h"
+#include "clock.h"
+#include "cpu.h"
+#include "gdt.h"
+#include "interrupt.h"
+#include "log.h"
+#include "page_allocator.h"
+#include "profile.h"
+#include "scheduler.h"
+#include "smp.h"
+#include "smp_trampoline.h"
+#include "trace.h"
+#include "vm.h"
+
+// The size of the stack each AP gets, as a page allocator order: 4 KiB << 2 = 16 KiB.
+#define AP_STACK_ORDER                  2
+
+// The delays used when starting an AP. The INIT and STARTUP delays are the ones prescribed by the MultiProcessor
+// Specification; the time we wait for the AP to come online is just a generous upper bound.
+#define INIT_DELAY_MICROSECONDS         10000
+#define STARTUP_DELAY_MICROSECONDS      200
+#define ONLINE_TIMEOUT_MILLISECONDS     100
+
+// The GDT pointer as stored by the SGDT instruction in 64-bit mode.
+typedef struct
+{
+    uint16_t limit;
+    uint64_t base;
+} __attribute__((packed)) gdt_pointer_t;
+
+// The work given to each CPU by smp_run(). The function pointer is cleared by the CPU when the function has returned.
+typedef struct
+{
+    volatile smp_function_t function;
+    void *volatile argument;
+} __attribute__((aligned(CPU_CACHE_LINE_SIZE))) smp_work_t;
+
+cpu_data_t cpu_data[CPU_MAX_COUNT];
+
+static smp_work_t work[CPU_MAX_COUNT];
+
+// The number of CPU:s that are online. The bootstrap processor is always online.
+static volatile unsigned int online_count = 1;
+
+_Static_assert(offsetof(smp_trampoline_data_t, gdt_limit) == SMP_TRAMPOLINE_GDT_LIMIT, "Trampoline data mismatch");
+_Static_assert(offsetof(smp_trampoline_data_t, gdt_base) == SMP_TRAMPOLINE_GDT_BASE, "Trampoline data mismatch");
+_Static_assert(offsetof(smp_trampoline_data_t, cr0) == SMP_TRAMPOLINE_CR0, "Trampoline data mismatch");
+_Static_assert(offsetof(smp_trampoline_data_t, cr3) == SMP_TRAMPOLINE_CR3, "Trampoline data mismatch");
+_Static_assert(offsetof(smp_trampoline_data_t, cr4) == SMP_TRAMPOLINE_CR4, "Trampoline data mismatch");
+_Static_assert(offsetof(smp_trampoline_data_t, cpu_id) == SMP_TRAMPOLINE_CPU_ID, "Trampoline data mismatch");
+_Static_assert(offsetof(smp_trampoline_data_t, stack_top) == SMP_TRAMPOLINE_STACK_TOP, "Trampoline data mismatch");
+_Static_assert(offsetof(smp_trampoline_data_t, entry_point) == SMP_TRAMPOLINE_ENTRY_POINT, "Trampoline data mismatch");
+_Static_assert(sizeof(smp_trampoline_data_t) == SMP_TRAMPOLINE_DATA_SIZE, "Trampoline data mismatch");
+
+/**
+ * The C entry point of the AP:s, called by the trampoline.
+ *
+ * @param id  The ID of this CPU.
+ */
+static void smp_ap_main(uint32_t id)
+{
+    // The PAT is per-CPU, and must match the one of the bootstrap processor since the paging structures are shared.
+    memory_type_init();
+    cpu_data_init(id);
+    vm_init_cpu();
+    gdt_init_cpu();
+    interrupt_init_cpu();
+    apic_init_cpu();
+    profile_init_cpu();
+    trace_init_cpu();
+    apic_timer_start();
+    scheduler_init_cpu();
+    log_init_cpu();
+
+    __atomic_add_fetch(&online_count, 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&cpu_data[id].online, true, __ATOMIC_RELEASE);
+
+    interrupt_enable();
+    scheduler_idle();
+}
+
+/**
+ * Copy the trampoline into place, and fill in the parts of the trampoline data that are the same for all the AP:s.
+ *
+ * @returns the trampoline data.
+ */
+static volatile smp_trampoline_data_t *smp_install_trampoline(void)
+{
+    memory_copy((void *) SMP_TRAMPOLINE_ADDRESS, smp_trampoline_start, smp_trampoline_end - smp_trampoline_start);
+
+    volatile smp_trampoline_data_t *data =
+        (volatile smp_trampoline_data_t *) (SMP_TRAMPOLINE_ADDRESS + (smp_trampoline_data - smp_trampoline_start));
+
+    gdt_pointer_t gdt_pointer;
+    asm volatile("sgdt %0"
+                 : "=m"(gdt_pointer));
+
+    data->gdt_limit = gdt_pointer.limit;
+    data->gdt_base = gdt_pointer.base;
+    data->cr0 = cpu_get_cr0();
+    data->cr3 = cpu_get_cr3();
+    // CR4.PCIDE can only be set in 64-bit mode. The AP:s set it on their own, in vm_init_cpu().
+    data->cr4 = cpu_get_cr4() & ~CR4_PCIDE;
+    data->entry_point = (uint64_t) smp_ap_main;
+
+    return data;
+}
+
+/**
+ * Start an AP, and wait for it to come online.
+ *
+ * @param trampoline  The trampoline data.
+ * @param id  The ID to give to the CPU.
+ * @param apic_id  The APIC ID of the CPU.
+ * @returns true if the CPU came online, false otherwise.
+ */
+static bool smp_start_ap(volatile smp_trampoline_data_t *trampoline, unsigned int id, uint32_t apic_id)
+{
+    uint64_t stack = page_allocate(AP_STACK_ORDER);
+    if (stack == 0)
+    {
+        return false;
+    }
+
+    cpu_data[id].apic_id = apic_id;
+    trampoline->cpu_id = id;
+    trampoline->stack_top = stack + ((uint64_t) PAGE_SIZE << AP_STACK_ORDER);
+
+    apic_send_init(apic_id);
+    udelay(INIT_DELAY_MICROSECONDS);
+
+    // Older CPU:s may miss the first STARTUP IPI, so the specification tells us to send it twice. A CPU that has already
+    // started ignores the second one.
+    for (int i = 0; i < 2 && !__atomic_load_n(&cpu_data[id].online, __ATOMIC_ACQUIRE); i++)
+    {
+        apic_send_startup(apic_id, SMP_TRAMPOLINE_ADDRESS >> PAGE_SHIFT);
+        udelay(STARTUP_DELAY_MICROSECONDS);
+    }
+
+    for (int i = 0; i < ONLINE_TIMEOUT_MILLISECONDS && !__atomic_load_n(&cpu_data[id].online, __ATOMIC_ACQUIRE); i++)
+    {
+        udelay(1000);
+    }
+
+    if (!__atomic_load_n(&cpu_data[id].online, __ATOMIC_ACQUIRE))
+    {
+        // Put the CPU back in the wait-for-SIPI state, so that it doesn't wake up later on and start using the ID (and the
+        // stack) that we are about to give to the next CPU.
+        apic_send_init(apic_id);
+        page_free(stack, AP_STACK_ORDER);
+        return false;
+    }
+
+    return true;
+}
+
+void smp_init_bootstrap_processor(void)
+{
+    cpu_data_init(0);
+    cpu_data[0].online = true;
+}
+
+void smp_init(void)
+{
+    const acpi_madt_t *madt = (const acpi_madt_t *) acpi_find_table(ACPI_MADT_SIGNATURE);
+    if (madt == NULL)
+    {
+        log_print(log_level_warning, "SMP: no MADT found, running on the bootstrap processor only.\n");
+        return;
+    }
+
+    const uint8_t *entries = (const uint8_t *) madt + sizeof(acpi_madt_t);
+    const uint8_t *entries_end = (const uint8_t *) madt + madt->header.length;
+
+    for (const uint8_t *entry = entries; entry < entries_end; entry += ((const acpi_madt_entry_t *) entry)->length)
+    {
+        // A zero-length entry would get us stuck in the loop below forever.
+        if (((const acpi_madt_entry_t *) entry)->length == 0)
+        {
+            log_print(log_level_warning, "SMP: invalid MADT entry, running on the bootstrap processor only.\n");
+            return;
+        }
+    }
+
+    cpu_data[0].apic_id = apic_get_id();
+
+    volatile smp_trampoline_data_t *trampoline = smp_install_trampoline();
+
+    unsigned int cpu_count = 1;
+    for (const uint8_t *entry = entries; entry < entries_end; entry += ((const acpi_madt_entry_t *) entry)->length)
+    {
+        uint32_t apic_id;
+        uint32_t flags;
+
+        if (((const acpi_madt_entry_t *) entry)->type == ACPI_MADT_TYPE_LOCAL_APIC)
+        {
+            apic_id = ((const acpi_madt_local_apic_t *) entry)->apic_id;
+            flags = ((const acpi_madt_local_apic_t *) entry)->flags;
+        }
+        else if (((const acpi_madt_entry_t *) entry)->type == ACPI_MADT_TYPE_LOCAL_X2APIC)
+        {
+            apic_id = ((const acpi_madt_local_x2apic_t *) entry)->x2apic_id;
+            flags = ((const acpi_madt_local_x2apic_t *) entry)->flags;
+        }
+        else
+        {
+            continue;
+        }
+
+        if ((flags & ACPI_MADT_LOCAL_APIC_ENABLED) == 0 || apic_id == cpu_data[0].apic_id)
+        {
+            continue;
+        }
+
+        if (apic_id > APIC_MAX_XAPIC_ID)
+        {
+            log_print(log_level_warning,
+                      "SMP: CPU with APIC ID %u requires x2APIC mode, which is not supported. Skipping it.\n", apic_id);
+            continue;
+        }
+
+        if (cpu_count == CPU_MAX_COUNT)
+        {
+            log_print(log_level_warning, "SMP: only %u CPU:s are supported, ignoring the rest of them.\n",
+                      CPU_MAX_COUNT);
+            break;
+        }
+
+        if (smp_start_ap(trampoline, cpu_count, apic_id))
+        {
+            cpu_count++;
+        }
+        else
+        {
+            log_print(log_level_warning, "SMP: CPU with APIC ID %u did not come online.\n", apic_id);
+        }
+    }
+
+    log_print(log_level_info, "SMP: %u CPU(s) online.\n", cpu_online_count());
+    for (unsigned int i = 0; i < cpu_online_count(); i++)
+    {
+        log_print(log_level_debug, "SMP: CPU %u has APIC ID %u.\n", i, cpu_data[i].apic_id);
+    }
+}
+
+unsigned int cpu_online_count(void)
+{
+    return __atomic_load_n(&online_count, __ATOMIC_ACQUIRE);
+}
+
+void smp_run(unsigned int cpu_id, smp_function_t function, void *argument)
+{
+    work[cpu_id].argument = argument;
+    __atomic_store_n(&work[cpu_id].function, function, __ATOMIC_RELEASE);
+}
+
+void smp_wait(unsigned int cpu_id)
+{
+    while (__atomic_load_n(&work[cpu_id].function, __ATOMIC_ACQUIRE) != NULL)
+    {
+        cpu_relax();
+    }
+}
+
+bool smp_run_pending_work(void)
+{
+    unsigned int id = cpu_current_id();
+    smp_function_t function = __atomic_load_n(&work[id].function, __ATOMIC_ACQUIRE);
+    if (function == NULL)
+    {
+        return false;
+    }
+
+    function(work[id].argument);
+    __atomic_store_n(&work[id].function, NULL, __ATOMIC_RELEASE);
+    return true;
+}
@@ -0,0 +1,54 @@
+/*
+ * smp.h - Symmetric multiprocessing: starting up the application processors, and running work on them.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#ifndef __SMP_H__
+#define __SMP_H__ 1
+
+#include <stdbool.h>
+
+//// Type definitions and structures
+// A function to run on another CPU.
+typedef void (*smp_function_t)(void *argument);
+
+//// Function prototypes
+/**
+ * Set up the per-CPU data area of the bootstrap processor. This must be done as early as possible, since everything that
+ * uses per-CPU state (like the page allocator) depends on it.
+ */
+extern void smp_init_bootstrap_processor(void);
+
+/**
+ * Find the application processors in the ACPI MADT and start all of them. acpi_init() must have been called first. If no
+ * MADT can be found, we just keep running on the bootstrap processor.
+ */
+extern void smp_init(void);
+
+/**
+ * Run a function on another CPU. The CPU must be online and not already running a function. The function is run by the
+ * idle thread of the CPU, the next time it has no other threads to run; it must return when done.
+ *
+ * @param cpu_id  The ID of the CPU to run the function on. Must not be the current CPU.
+ * @param function  The function to run.
+ * @param argument  The argument to pass to the function.
+ */
+extern void smp_run(unsigned int cpu_id, smp_function_t function, void *argument);
+
+/**
+ * Wait until a CPU has finished running the function given to it by smp_run().
+ *
+ * @param cpu_id  The ID of the CPU to wait for.
+ */
+extern void smp_wait(unsigned int cpu_id);
+
+/**
+ * Run the function given to the current CPU by smp_run(), if any. Called by the scheduler when the CPU is idle.
+ *
+ * @returns true if a function was run, false if there was nothing to do.
+ */
+extern bool smp_run_pending_work(void);
+
+#endif // !__SMP_H__
@@ -0,0 +1,59 @@
+/*
+ * smp_trampoline.h - Definitions for smp_trampoline.S, the code that takes the application processors from real mode to
+ * 64-bit mode.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#ifndef __SMP_TRAMPOLINE_H__
+#define __SMP_TRAMPOLINE_H__ 1
+
+// The physical address the trampoline is copied to. The STARTUP IPI gives the start address as a page number below 1
+// MiB, so it must be page-aligned and located in low memory. The page allocator never hands out anything below 1 MiB, so
+// nobody else uses this page.
+#define SMP_TRAMPOLINE_ADDRESS          0x8000
+
+// The offsets of the fields in the trampoline data, which is filled in by smp.c before starting each CPU. These must match
+// smp_trampoline_data_t below.
+#define SMP_TRAMPOLINE_GDT_LIMIT        0
+#define SMP_TRAMPOLINE_GDT_BASE         2
+#define SMP_TRAMPOLINE_CR0              8
+#define SMP_TRAMPOLINE_CR3              12
+#define SMP_TRAMPOLINE_CR4              16
+#define SMP_TRAMPOLINE_CPU_ID           20
+#define SMP_TRAMPOLINE_STACK_TOP        24
+#define SMP_TRAMPOLINE_ENTRY_POINT      32
+#define SMP_TRAMPOLINE_DATA_SIZE        40
+
+/* This is to make sure that the assembly files can still include this file without getting compilation errors. */
+#ifndef __ASSEMBLER__
+#include <stdint.h>
+
+typedef struct
+{
+    // The GDT pointer (as used by the LGDT instruction) of the bootstrap processor. The GDT is shared by all the CPU:s.
+    uint16_t gdt_limit;
+    uint32_t gdt_base;
+    uint16_t padding;
+
+    // The control register values to use. CR3 is the PML4 of the identity mapping, so it is always below 4 GiB; the
+    // upper halves of CR0 and CR4 are reserved.
+    uint32_t cr0;
+    uint32_t cr3;
+    uint32_t cr4;
+
+    // The ID of the CPU being started, the stack it should use and the C function it should call. The function gets the
+    // CPU ID as its only parameter.
+    uint32_t cpu_id;
+    uint64_t stack_top;
+    uint64_t entry_point;
+} __attribute__((packed)) smp_trampoline_data_t;
+
+// These symbols are provided by smp_trampoline.S.
+extern uint8_t smp_trampoline_start[];
+extern uint8_t smp_trampoline_data[];
+extern uint8_t smp_trampoline_end[];
+#endif
+
+#endif // !__SMP_TRAMPOLINE_H__
@@ -0,0 +1,61 @@
+/*
+ * spinlock.h - Spinlocks, for protecting data structures that are shared between CPU:s.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#ifndef __SPINLOCK_H__
+#define __SPINLOCK_H__ 1
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "cpu.h"
+
+// A spinlock. Zero means unlocked, so a zeroed-out (e.g. static) spinlock is ready to be used.
+typedef struct
+{
+    volatile uint32_t locked;
+} spinlock_t;
+
+/**
+ * Acquire a spinlock, waiting for as long as needed.
+ *
+ * @param lock  The lock to acquire.
+ */
+static inline void spinlock_lock(spinlock_t *lock)
+{
+    while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE) != 0)
+    {
+        // Wait until the lock looks free before trying again. Spinning on a plain read keeps the cache line in the shared
+        // state, instead of bouncing it between the waiting CPU:s.
+        while (lock->locked != 0)
+        {
+            cpu_relax();
+        }
+    }
+}
+
+/**
+ * Try to acquire a spinlock, without waiting.
+ *
+ * @param lock  The lock to acquire.
+ * @returns true if the lock was acquired, false if it was already taken.
+ */
+static inline bool spinlock_try_lock(spinlock_t *lock)
+{
+    return lock->locked == 0 && __atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE) == 0;
+}
+
+/**
+ * Release a spinlock.
+ *
+ * @param lock  The lock to release. Must have been acquired by the current CPU.
+ */
+static inline void spinlock_unlock(spinlock_t *lock)
+{
+    __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
+
+#endif // !__SPINLOCK_H__
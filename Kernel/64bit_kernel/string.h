@@ -28,4 +28,20 @@ static inline void string_copy(char *target, const char *source)
     target[i] = '\0';
 }
 
+/**
+ * Get the length of a zero-terminated string.
+ *
+ * @param string the string.
+ * @return the number of characters in the string, not counting the terminating zero.
+ */
+static inline int string_length(const char *string)
+{
+    int i;
+    for (i = 0; string[i] != '\0'; i++)
+    {
+    }
+
+    return i;
+}
+
 #endif /* !__STRING_H__ */
@@ -0,0 +1,42 @@
+#!/bin/sh
+#
+# Generate the kernel symbol table (see symbols.h) from the output of nm -n, read from standard input. The table is
+# written to standard output as assembly source. With no input, an empty table is generated; this is what the first
+# link of the kernel is done with (see the Makefile).
+#
+# Only the code symbols are included, since the table is used for telling which function an address in the code belongs
+# to. The table is placed in .rodata, which comes after .text: adding it to the kernel does not move any of the code, so
+# the addresses in it stay valid.
+#
+# Author: Per Lundberg <per@halleluja.nu>
+# Copyright: © 2017 Per Lundberg
+#
+
+awk '
+BEGIN {
+    print "// Generated by symbol_table.sh. Do not edit."
+    print ""
+    print "        .section .rodata"
+    print "        .globl symbol_table"
+    print "        .globl symbol_count"
+    print ""
+    print "        .balign 8"
+    print "symbol_table:"
+}
+
+$2 ~ /^[tT]$/ {
+    printf "        .quad   0x%s, .Lname%d\n", $1, count
+    names[count++] = $3
+}
+
+END {
+    print ""
+    print "symbol_count:"
+    printf "        .quad   %d\n", count
+    print ""
+    for (i = 0; i < count; i++) {
+        printf ".Lname%d:\n", i
+        printf "        .asciz  \"%s\"\n", names[i]
+    }
+}
+'
@@ -0,0 +1,47 @@
+/*
+ * symbols.c - Looking up addresses in the kernel symbol table.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "symbols.h"
+
+// The end of the code, as provided by the linker. The code starts with the first symbol in the table, main().
+extern uint8_t etext[];
+
+bool symbol_is_code(uint64_t address)
+{
+    return symbol_count > 0 && address >= symbol_table[0].address && address < (uint64_t) etext;
+}
+
+const char *symbol_lookup(uint64_t address, uint64_t *offset)
+{
+    if (!symbol_is_code(address))
+    {
+        return NULL;
+    }
+
+    // Find the last symbol at or below the address.
+    uint64_t low = 0;
+    uint64_t high = symbol_count;
+    while (high - low > 1)
+    {
+        uint64_t middle = low + (high - low) / 2;
+        if (symbol_table[middle].address <= address)
+        {
+            low = middle;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    *offset = address - symbol_table[low].address;
+    return symbol_table[low].name;
+}
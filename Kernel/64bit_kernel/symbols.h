@@ -0,0 +1,48 @@
+/*
+ * symbols.h - The kernel symbol table: the names and addresses of all the functions in the kernel. The table itself is
+ * generated at build time by symbol_table.sh, and linked into the kernel.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#ifndef __SYMBOLS_H__
+#define __SYMBOLS_H__ 1
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//// Type definitions and structures
+typedef struct
+{
+    // The address of the function.
+    uint64_t address;
+
+    // The name of the function.
+    const char *name;
+} symbol_t;
+
+//// Variables
+// The symbols, sorted by address.
+extern const symbol_t symbol_table[];
+extern const uint64_t symbol_count;
+
+//// Function prototypes
+/**
+ * Check if an address is inside the code of the kernel.
+ *
+ * @param address  The address.
+ * @returns true if the address points at kernel code, false otherwise.
+ */
+extern bool symbol_is_code(uint64_t address);
+
+/**
+ * Find the function that a code address belongs to.
+ *
+ * @param address  The address.
+ * @param offset  The offset of the address from the start of the function [out]
+ * @returns the name of the function, or NULL if the address is not inside the code of the kernel.
+ */
+extern const char *symbol_lookup(uint64_t address, uint64_t *offset);
+
+#endif // !__SYMBOLS_H__
@@ -0,0 +1,250 @@
+/*
+ * tlb.c - Invalidating the TLB entries of changed mappings. The CPU:s don't keep their TLB:s coherent with the paging
+ * structures, or with each other: after a mapping has been changed, every CPU that may have cached it must be told to
+ * invalidate it. The changes are collected in batches, which merge adjacent pages into ranges, so that a whole batch of
+ * changes costs one IPI per CPU rather than one per page. Only the CPU:s running the address space get an IPI; the
+ * others flush the TLB entries of it the next time they switch to it (see vm_address_space_switch()).
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "apic.h"
+#include "cpu.h"
+#include "interrupt.h"
+#include "io.h"
+#include "monitor.h"
+#include "spinlock.h"
+#include "tlb.h"
+#include "trace.h"
+
+// The counters of each CPU. They are only changed by the CPU itself, but an IPI can come in between reading and writing
+// one of them; hence the atomic additions.
+typedef struct
+{
+    tlb_statistics_t statistics;
+} __attribute__((aligned(CPU_CACHE_LINE_SIZE))) tlb_cpu_t;
+
+static tlb_cpu_t tlb_cpus[CPU_MAX_COUNT];
+
+// The batch being shot down, and the number of CPU:s that have yet to invalidate it.
+static const tlb_batch_t *volatile shootdown_batch;
+static volatile unsigned int shootdown_pending;
+
+// Held while shooting down a batch, since there can only be one of them at a time.
+static spinlock_t lock;
+
+/**
+ * Add to one of the counters of the current CPU.
+ *
+ * @param counter  The counter.
+ * @param value  The value to add.
+ */
+static void count(uint64_t *counter, uint64_t value)
+{
+    __atomic_add_fetch(counter, value, __ATOMIC_RELAXED);
+}
+
+/**
+ * The handler of the TLB shootdown IPI.
+ *
+ * @param frame  The state of the interrupted code.
+ */
+static void shootdown_handler(interrupt_frame_t *frame)
+{
+    tlb_invalidate(shootdown_batch);
+    __atomic_sub_fetch(&shootdown_pending, 1, __ATOMIC_RELEASE);
+    apic_end_of_interrupt();
+}
+
+void tlb_init(void)
+{
+    interrupt_register_handler(INTERRUPT_VECTOR_TLB_SHOOTDOWN, shootdown_handler);
+}
+
+void tlb_batch_add(tlb_batch_t *batch, uint64_t address, unsigned int page_shift)
+{
+    if (batch->flush_all)
+    {
+        return;
+    }
+
+    uint64_t page_size = 1ULL << page_shift;
+    tlb_range_t *range = batch->ranges;
+    tlb_range_t *end = batch->ranges + batch->range_count;
+    while (range < end)
+    {
+        uint64_t range_end = range->address + (range->page_count << range->page_shift);
+        if (range->page_shift == page_shift && address + page_size >= range->address && address <= range_end)
+        {
+            break;
+        }
+
+        range++;
+    }
+
+    if (range == end)
+    {
+        if (batch->range_count == TLB_BATCH_RANGES)
+        {
+            batch->flush_all = true;
+            return;
+        }
+
+        *range = (tlb_range_t) { .address = address, .page_count = 0, .page_shift = page_shift };
+        batch->range_count++;
+    }
+    else if (address != range->address + (range->page_count << page_shift) && address + page_size != range->address)
+    {
+        // Already in the range, e.g. a large page that is invalidated both for being split and for being replaced.
+        return;
+    }
+
+    if (address < range->address)
+    {
+        range->address = address;
+    }
+
+    range->page_count++;
+    batch->page_count++;
+
+    // The page may have closed the gap between two ranges, in which case they become one.
+    for (tlb_range_t *other = batch->ranges; other < batch->ranges + batch->range_count; other++)
+    {
+        if (other != range && other->page_shift == page_shift &&
+            (other->address == range->address + (range->page_count << page_shift) ||
+             other->address + (other->page_count << page_shift) == range->address))
+        {
+            if (other->address < range->address)
+            {
+                range->address = other->address;
+            }
+
+            range->page_count += other->page_count;
+            *other = batch->ranges[--batch->range_count];
+            break;
+        }
+    }
+    if (batch->page_count > TLB_INVALIDATE_PAGES_MAX)
+    {
+        batch->flush_all = true;
+    }
+}
+
+void tlb_invalidate(const tlb_batch_t *batch)
+{
+    tlb_statistics_t *statistics = &tlb_cpus[cpu_current_id()].statistics;
+    if (batch->flush_all)
+    {
+        // Reloading CR3 only flushes the TLB entries of the current PCID, which are the only ones asked for.
+        cpu_set_cr3(cpu_get_cr3());
+        count(&statistics->full_flushes, 1);
+        return;
+    }
+
+    if (batch->range_count == 0)
+    {
+        return;
+    }
+
+    for (const tlb_range_t *range = batch->ranges; range < batch->ranges + batch->range_count; range++)
+    {
+        for (uint64_t i = 0; i < range->page_count; i++)
+        {
+            cpu_invalidate_page((void *) (range->address + (i << range->page_shift)));
+        }
+    }
+
+    count(&statistics->page_invalidations, 1);
+    count(&statistics->pages, batch->page_count);
+}
+
+void tlb_shootdown(const tlb_batch_t *batch, uint64_t cpus)
+{
+    unsigned int current_id = cpu_current_id();
+    unsigned int cpu_count = cpu_online_count();
+    uint64_t others = (cpu_count == CPU_MAX_COUNT ? ~0ULL : (1ULL << cpu_count) - 1) & ~(1ULL << current_id);
+    tlb_statistics_t *statistics = &tlb_cpus[current_id].statistics;
+
+    uint64_t lazy_cpus = 0;
+    for (uint64_t spared = others & ~cpus; spared != 0; spared &= spared - 1)
+    {
+        lazy_cpus++;
+    }
+
+    count(&statistics->lazy_cpus, lazy_cpus);
+
+    cpus &= others;
+    if (cpus == 0)
+    {
+        return;
+    }
+
+    TRACE(trace_event_tlb_shootdown_begin, cpus, batch->page_count);
+
+    spinlock_lock(&lock);
+
+    unsigned int pending = 0;
+    for (uint64_t remaining = cpus; remaining != 0; remaining &= remaining - 1)
+    {
+        pending++;
+    }
+
+    // The batch must be visible to the other CPU:s before the IPI:s are. (Sending an IPI is just an MSR write with the
+    // x2APIC, which doesn't wait for the earlier stores to be done.)
+    shootdown_batch = batch;
+    __atomic_store_n(&shootdown_pending, pending, __ATOMIC_SEQ_CST);
+
+    for (uint64_t remaining = cpus; remaining != 0; remaining &= remaining - 1)
+    {
+        apic_send_fixed(cpu_data[__builtin_ctzll(remaining)].apic_id, INTERRUPT_VECTOR_TLB_SHOOTDOWN);
+    }
+
+    while (__atomic_load_n(&shootdown_pending, __ATOMIC_ACQUIRE) != 0)
+    {
+        cpu_relax();
+    }
+
+    shootdown_batch = NULL;
+    spinlock_unlock(&lock);
+
+    count(&statistics->shootdowns, 1);
+    count(&statistics->ipis, pending);
+
+    TRACE(trace_event_tlb_shootdown_end, pending, 0);
+}
+
+void tlb_get_statistics(tlb_statistics_t *statistics)
+{
+    *statistics = (tlb_statistics_t) { 0 };
+    for (unsigned int id = 0; id < CPU_MAX_COUNT; id++)
+    {
+        const tlb_statistics_t *cpu = &tlb_cpus[id].statistics;
+        statistics->shootdowns += cpu->shootdowns;
+        statistics->ipis += cpu->ipis;
+        statistics->lazy_cpus += cpu->lazy_cpus;
+        statistics->page_invalidations += cpu->page_invalidations;
+        statistics->pages += cpu->pages;
+        statistics->full_flushes += cpu->full_flushes;
+    }
+}
+
+/**
+ * The tlb command.
+ */
+static void tlb_command(const char *arguments)
+{
+    tlb_statistics_t statistics;
+    tlb_get_statistics(&statistics);
+
+    io_print_formatted("Shootdowns: %U, with %U IPIs sent and %U CPU:s spared for not running the address space.\n",
+                       statistics.shootdowns, statistics.ipis, statistics.lazy_cpus);
+    io_print_formatted("Invalidations: %U page by page (%U pages in all) and %U full flushes.\n",
+                       statistics.page_invalidations, statistics.pages, statistics.full_flushes);
+}
+
+MONITOR_COMMAND("tlb", tlb_command, "- show the TLB shootdown and invalidation counters.");
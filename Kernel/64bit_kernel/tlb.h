@@ -0,0 +1,134 @@
+/*
+ * tlb.h - Invalidating the TLB entries of changed mappings, on the current CPU and on the other CPU:s running the same
+ * address space (TLB shootdown).
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#ifndef __TLB_H__
+#define __TLB_H__ 1
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//// Defines.
+// The number of ranges of pages a batch can hold. Pages next to a range already in the batch are merged into it; when a
+// page can't be merged and the ranges are all taken, the batch falls back to a full flush.
+#define TLB_BATCH_RANGES                16
+
+// The number of pages that are invalidated one at a time with invlpg. Beyond this, it is cheaper to flush all the TLB
+// entries of the address space by reloading CR3 than to invalidate them one by one.
+#define TLB_INVALIDATE_PAGES_MAX        32
+
+//// Type definitions and structures
+// A range of pages of the same size.
+typedef struct
+{
+    uint64_t address;
+    uint64_t page_count;
+    unsigned int page_shift;
+} tlb_range_t;
+
+// The TLB entries to invalidate after a number of mappings have been changed.
+typedef struct
+{
+    tlb_range_t ranges[TLB_BATCH_RANGES];
+    unsigned int range_count;
+
+    // The total number of pages in the ranges.
+    uint64_t page_count;
+
+    // Set when there are too many pages to invalidate one by one. The ranges are then no longer kept up to date.
+    bool flush_all;
+} tlb_batch_t;
+
+// The TLB counters, summed over all the CPU:s.
+typedef struct
+{
+    // The batches that had to be sent to at least one other CPU, and the IPI:s sent for them: one per CPU and batch.
+    uint64_t shootdowns;
+    uint64_t ipis;
+
+    // The CPU:s that were spared an IPI, since they were not running the address space (they flush the TLB entries of
+    // it when they switch to it instead).
+    uint64_t lazy_cpus;
+
+    // The batches invalidated page by page, and the pages invalidated by them; and the batches that flushed all the TLB
+    // entries of the address space instead. Both count the invalidations made on the current CPU as well as the ones
+    // made by the other CPU:s on receiving an IPI.
+    uint64_t page_invalidations;
+    uint64_t pages;
+    uint64_t full_flushes;
+} tlb_statistics_t;
+
+//// Inlined functions
+/**
+ * Empty a batch.
+ *
+ * @param batch  The batch.
+ */
+static inline void tlb_batch_reset(tlb_batch_t *batch)
+{
+    batch->range_count = 0;
+    batch->page_count = 0;
+    batch->flush_all = false;
+}
+
+/**
+ * Check whether a batch has anything to invalidate.
+ *
+ * @param batch  The batch.
+ * @returns true if the batch is empty.
+ */
+static inline bool tlb_batch_is_empty(const tlb_batch_t *batch)
+{
+    return batch->range_count == 0 && !batch->flush_all;
+}
+
+//// Function prototypes
+/**
+ * Register the handler of the TLB shootdown IPI. Must be called before any mapping is changed with the application
+ * processors running.
+ */
+extern void tlb_init(void);
+
+/**
+ * Add a page to a batch, merging it with a range already in the batch if it is next to one (or already in one). Once
+ * the batch holds more than TLB_INVALIDATE_PAGES_MAX pages, it is turned into a full flush.
+ *
+ * @param batch  The batch.
+ * @param address  The start of the page.
+ * @param page_shift  The base 2 logarithm of the page size: 12 for a 4 KiB page, 21 for a 2 MiB page and 30 for a 1 GiB
+ * page.
+ */
+extern void tlb_batch_add(tlb_batch_t *batch, uint64_t address, unsigned int page_shift);
+
+/**
+ * Invalidate the TLB entries in a batch on the current CPU. With PCID:s, only the entries tagged with the current PCID
+ * are affected.
+ *
+ * @param batch  The batch.
+ */
+extern void tlb_invalidate(const tlb_batch_t *batch);
+
+/**
+ * Make the other CPU:s in a set invalidate the TLB entries in a batch, with one IPI per CPU, and wait for all of them to
+ * do so. Only one batch is shot down at a time, so this must be called with interrupts enabled: a CPU waiting for its
+ * turn must still be able to handle the IPI:s of the one before it.
+ *
+ * @param batch  The batch.
+ * @param cpus  The CPU:s running the address space the batch was made for, as a bit mask indexed by CPU ID. The current
+ * CPU and the CPU:s that are not online are left out. The ones that are online but not in the set are counted as spared
+ * by the lazy TLB tracking.
+ */
+extern void tlb_shootdown(const tlb_batch_t *batch, uint64_t cpus);
+
+/**
+ * Get the TLB counters. Also available as the tlb command in the serial monitor (see monitor.h).
+ *
+ * @param statistics  Set to the counters, summed over all the CPU:s.
+ */
+extern void tlb_get_statistics(tlb_statistics_t *statistics);
+
+#endif // !__TLB_H__
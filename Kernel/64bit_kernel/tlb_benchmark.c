@@ -0,0 +1,236 @@
+/*
+ * tlb_benchmark.c - Benchmarks of unmapping memory in an address space that other CPU:s are running, which is what TLB
+ * shootdowns are for. They are meant to be run with 8 CPU:s, e.g. SMP=8 ./run_qemu.sh benchmark=tlb; with fewer, all the
+ * CPU:s there are take part.
+ *
+ * Each iteration maps a number of pages, and then unmaps them one at a time, like a process freeing small allocations.
+ * Meanwhile, the other CPU:s keep reading a page of their own in the same address space. tlb.unmap sends them an IPI for
+ * every page unmapped. tlb.unmap_batched unmaps the pages between vm_batch_begin() and vm_batch_end(), so that the
+ * other CPU:s get one IPI each per iteration. In tlb.unmap_lazy, the other CPU:s are running the kernel address space
+ * instead, and are spared the IPI:s altogether; the difference between it and tlb.unmap is the cost of the shootdowns.
+ * The number of IPI:s sent per page unmapped is printed after each of them, and reported as tlb.<name>.ipis.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common/memory.h"
+#include "common/memory_type.h"
+#include "common/vm.h"
+#include "benchmark.h"
+#include "cpu.h"
+#include "io.h"
+#include "result.h"
+#include "smp.h"
+#include "tlb.h"
+#include "vm.h"
+
+// The number of CPU:s taking part, including the one running the benchmark.
+#define CPU_COUNT                       8
+
+// The page read by the other CPU:s, followed by the pages mapped and unmapped in each iteration. They all share a page
+// table, which is kept by the page read, so that no paging structures are allocated or freed along the way.
+#define READ_ADDRESS                    VM_UPPER_HALF_START
+#define UNMAP_ADDRESS                   (VM_UPPER_HALF_START + VM_4KIB_PAGE_SIZE)
+#define UNMAP_PAGES                     16
+
+// The memory mapped there. It is only ever read, so the kernel image will do.
+#define PHYSICAL_ADDRESS                (2 * MiB)
+
+static address_space_t *space;
+
+// The benchmark being run, and the number of pages unmapped by it so far.
+static const char *benchmark_name;
+static uint64_t pages_unmapped;
+static tlb_statistics_t statistics_before;
+
+// The other CPU:s taking part, as a bit mask indexed by CPU ID; the number of them, and of the ones that have switched
+// to their address space; and the flag telling them to stop.
+static uint64_t workers;
+static unsigned int worker_count;
+static volatile unsigned int workers_ready;
+static volatile bool workers_stop;
+
+/**
+ * Keep a CPU busy in an address space until the benchmark is done.
+ *
+ * @param argument  The address space. If it is the kernel address space, nothing is read.
+ */
+static void worker(void *argument)
+{
+    address_space_t *worker_space = argument;
+    vm_address_space_switch(worker_space);
+    __atomic_add_fetch(&workers_ready, 1, __ATOMIC_RELEASE);
+
+    while (!__atomic_load_n(&workers_stop, __ATOMIC_ACQUIRE))
+    {
+        if (worker_space != &vm_kernel_address_space)
+        {
+            BENCHMARK_USE(*(volatile uint64_t *) READ_ADDRESS);
+        }
+
+        cpu_relax();
+    }
+
+    vm_address_space_switch(&vm_kernel_address_space);
+}
+
+/**
+ * Stop the other CPU:s, and destroy the address space.
+ */
+static void cleanup(void)
+{
+    __atomic_store_n(&workers_stop, true, __ATOMIC_RELEASE);
+    for (unsigned int id = 0; id < CPU_MAX_COUNT; id++)
+    {
+        if ((workers & (1ULL << id)) != 0)
+        {
+            smp_wait(id);
+        }
+    }
+
+    vm_address_space_switch(&vm_kernel_address_space);
+    if (space != NULL)
+    {
+        vm_address_space_destroy(space);
+        space = NULL;
+    }
+}
+
+static void teardown(void)
+{
+    cleanup();
+
+    tlb_statistics_t statistics;
+    tlb_get_statistics(&statistics);
+    uint64_t ipis = statistics.ipis - statistics_before.ipis;
+
+    io_print_formatted("TLB benchmark: %U IPIs sent to %u other CPU(s) for %U pages unmapped,", ipis, worker_count,
+                       pages_unmapped);
+    io_print_ratio(ipis, pages_unmapped);
+    io_print_line(" per page.");
+    result_report(ipis, pages_unmapped, "IPIs", "%s.ipis", benchmark_name);
+}
+
+/**
+ * Set up the address space, and start the other CPU:s.
+ *
+ * @param name  The name of the benchmark.
+ * @param lazy  true to have the other CPU:s run the kernel address space, false to have them run the one being
+ * unmapped in.
+ * @returns true on success, false if the benchmark should be skipped.
+ */
+static bool setup(const char *name, bool lazy)
+{
+    benchmark_name = name;
+    pages_unmapped = 0;
+    workers = 0;
+    worker_count = 0;
+    workers_ready = 0;
+    workers_stop = false;
+
+    space = vm_address_space_create();
+    if (space == NULL ||
+        !vm_map_range(space, READ_ADDRESS, PHYSICAL_ADDRESS, VM_4KIB_PAGE_SIZE, 0, memory_type_write_back))
+    {
+        io_print_line("TLB benchmark: could not set up the address space, skipping.");
+        cleanup();
+        return false;
+    }
+
+    if (cpu_online_count() < CPU_COUNT)
+    {
+        io_print_formatted("TLB benchmark: only %u CPU(s) online, rather than %u.\n", cpu_online_count(), CPU_COUNT);
+    }
+
+    // The CPU running the benchmark is the one unmapping, like a thread of the process freeing memory.
+    vm_address_space_switch(space);
+
+    for (unsigned int id = 0; id < cpu_online_count() && worker_count < CPU_COUNT - 1; id++)
+    {
+        if (id != cpu_current_id())
+        {
+            smp_run(id, worker, lazy ? &vm_kernel_address_space : space);
+            workers |= 1ULL << id;
+            worker_count++;
+        }
+    }
+
+    while (__atomic_load_n(&workers_ready, __ATOMIC_ACQUIRE) < worker_count)
+    {
+        cpu_relax();
+    }
+
+    tlb_get_statistics(&statistics_before);
+    return true;
+}
+
+static bool setup_unmap(void)
+{
+    return setup("tlb.unmap", false);
+}
+
+static bool setup_unmap_batched(void)
+{
+    return setup("tlb.unmap_batched", false);
+}
+
+static bool setup_unmap_lazy(void)
+{
+    return setup("tlb.unmap_lazy", true);
+}
+
+/**
+ * Map the pages, and unmap them one at a time.
+ *
+ * @param iterations  The number of times to do it.
+ * @param batched  true to unmap the pages in a batch.
+ */
+static void map_and_unmap(uint64_t iterations, bool batched)
+{
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        vm_map_range(space, UNMAP_ADDRESS, PHYSICAL_ADDRESS, UNMAP_PAGES * VM_4KIB_PAGE_SIZE, 0,
+                     memory_type_write_back);
+
+        if (batched)
+        {
+            vm_batch_begin(space);
+        }
+
+        for (uint64_t page = 0; page < UNMAP_PAGES; page++)
+        {
+            vm_unmap_range(space, UNMAP_ADDRESS + page * VM_4KIB_PAGE_SIZE, VM_4KIB_PAGE_SIZE);
+        }
+
+        if (batched)
+        {
+            vm_batch_end(space);
+        }
+    }
+
+    pages_unmapped += iterations * UNMAP_PAGES;
+}
+
+static void unmap(uint64_t iterations)
+{
+    map_and_unmap(iterations, false);
+}
+
+static void unmap_batched(uint64_t iterations)
+{
+    map_and_unmap(iterations, true);
+}
+
+static void unmap_lazy(uint64_t iterations)
+{
+    map_and_unmap(iterations, false);
+}
+
+BENCHMARK("tlb.unmap", unmap, setup_unmap, teardown);
+BENCHMARK("tlb.unmap_batched", unmap_batched, setup_unmap_batched, teardown);
+BENCHMARK("tlb.unmap_lazy", unmap_lazy, setup_unmap_lazy, teardown);
@@ -0,0 +1,403 @@
+/*
+ * trace.c - Static tracepoints. Each CPU writes its records to a buffer of its own, so writing a record needs no
+ * locking, and only touches memory that no other CPU writes to.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common/cpu.h"
+#include "common/format.h"
+#include "clock.h"
+#include "code_patch.h"
+#include "command_line.h"
+#include "cpu.h"
+#include "interrupt.h"
+#include "io.h"
+#include "monitor.h"
+#include "page_allocator.h"
+#include "serial.h"
+#include "spinlock.h"
+#include "trace.h"
+
+// The length of the NOP instruction placed by TRACE(), and of the jump it is patched into.
+#define SITE_LENGTH                     5
+
+#define JMP_REL32                       0xE9
+
+// The longest line written by trace_dump().
+#define LINE_LENGTH                     128
+
+// An event, as described in the dump.
+typedef struct
+{
+    const char *name;
+
+    // B or E for the beginning or end of something that takes time, i for an instant event.
+    const char *phase;
+
+    // What the two values recorded with the event are, or - if unused.
+    const char *value_names[2];
+} trace_event_info_t;
+
+// The records of a CPU.
+typedef struct
+{
+    trace_record_t *records;
+    uint64_t capacity;
+
+    // The number of records written. It is only advanced once the record has been written, so trace_dump() can safely
+    // read everything up to it.
+    volatile uint64_t used;
+
+    uint64_t dropped;
+} __attribute__((aligned(CPU_CACHE_LINE_SIZE))) trace_buffer_t;
+
+static const trace_event_info_t events[trace_event_count] =
+{
+    [trace_event_interrupt_begin] = { "interrupt", "B", { "vector", "rip" } },
+    [trace_event_interrupt_end] = { "interrupt", "E", { "vector", "-" } },
+    [trace_event_page_allocate_begin] = { "page.allocate", "B", { "order", "-" } },
+    [trace_event_page_allocate_end] = { "page.allocate", "E", { "order", "address" } },
+    [trace_event_page_free_begin] = { "page.free", "B", { "address", "order" } },
+    [trace_event_page_free_end] = { "page.free", "E", { "-", "-" } },
+    [trace_event_slab_allocate_begin] = { "slab.allocate", "B", { "cache", "-" } },
+    [trace_event_slab_allocate_end] = { "slab.allocate", "E", { "cache", "object" } },
+    [trace_event_slab_free_begin] = { "slab.free", "B", { "cache", "object" } },
+    [trace_event_slab_free_end] = { "slab.free", "E", { "-", "-" } },
+    [trace_event_thread_create] = { "thread.create", "i", { "thread", "-" } },
+    [trace_event_thread_switch] = { "thread.switch", "i", { "from", "to" } },
+    [trace_event_thread_exit] = { "thread.exit", "i", { "thread", "-" } },
+    [trace_event_vm_map_begin] = { "vm.map", "B", { "address", "size" } },
+    [trace_event_vm_map_end] = { "vm.map", "E", { "success", "-" } },
+    [trace_event_vm_unmap_begin] = { "vm.unmap", "B", { "address", "size" } },
+    [trace_event_vm_unmap_end] = { "vm.unmap", "E", { "success", "-" } },
+    [trace_event_vm_protect_begin] = { "vm.protect", "B", { "address", "size" } },
+    [trace_event_vm_protect_end] = { "vm.protect", "E", { "success", "-" } },
+    [trace_event_tlb_shootdown_begin] = { "tlb.shootdown", "B", { "cpus", "pages" } },
+    [trace_event_tlb_shootdown_end] = { "tlb.shootdown", "E", { "ipis", "-" } }
+};
+
+// The tracepoints, as collected by the linker.
+extern trace_site_t __start_tracepoints[];
+extern trace_site_t __stop_tracepoints[];
+
+static trace_buffer_t buffers[CPU_MAX_COUNT];
+
+// The events that are enabled.
+static bool enabled[trace_event_count];
+
+// Set once an event has been enabled. The buffers are only allocated from then on.
+static bool buffers_allocated;
+
+// Cleared by trace_dump() while the buffers are being dumped. Records are only written while this is set.
+static volatile bool active;
+
+// Protects the above, and the enabled field of the tracepoints.
+static spinlock_t lock;
+
+/**
+ * Allocate the trace buffer of a CPU, unless it already has one.
+ *
+ * @param cpu_id  The CPU.
+ */
+static void allocate_buffer(unsigned int cpu_id)
+{
+    trace_buffer_t *buffer = &buffers[cpu_id];
+    if (buffer->records != NULL)
+    {
+        return;
+    }
+
+    buffer->records = (trace_record_t *) page_allocate(TRACE_BUFFER_ORDER);
+    if (buffer->records == NULL)
+    {
+        io_print_formatted("Trace: no memory for the records of CPU %u.\n", cpu_id);
+        return;
+    }
+
+    buffer->capacity = ((uint64_t) PAGE_SIZE << TRACE_BUFFER_ORDER) / sizeof(trace_record_t);
+}
+
+/**
+ * Patch the tracepoints of the enabled events into jumps, and the rest back into NOP:s. Must be called with the lock
+ * held.
+ */
+static void patch_sites(void)
+{
+    static const uint8_t nop[SITE_LENGTH] = { 0x0F, 0x1F, 0x44, 0x00, 0x00 };
+
+    for (trace_site_t *site = __start_tracepoints; site < __stop_tracepoints; site++)
+    {
+        bool enable = site->event < trace_event_count && enabled[site->event];
+        if (enable == (site->enabled != 0))
+        {
+            continue;
+        }
+
+        if (enable)
+        {
+            int32_t offset = site->target - (site->address + SITE_LENGTH);
+            uint8_t jump[SITE_LENGTH] = { JMP_REL32, offset & 0xFF, (offset >> 8) & 0xFF, (offset >> 16) & 0xFF,
+                                          (offset >> 24) & 0xFF };
+            code_patch(site->address, jump, SITE_LENGTH);
+        }
+        else
+        {
+            code_patch(site->address, nop, SITE_LENGTH);
+        }
+
+        site->enabled = enable;
+    }
+}
+
+/**
+ * Enable or disable the events selected by a list. Must be called with the lock held.
+ *
+ * @param list  The events, as a comma-separated list of names.
+ * @param enable  true to enable the events, false to disable them.
+ * @returns the number of events selected by the list.
+ */
+static unsigned int select_events(const char *list, bool enable)
+{
+    bool all = command_line_list_selects(list, "all");
+    unsigned int selected = 0;
+    for (unsigned int event = trace_event_none + 1; event < trace_event_count; event++)
+    {
+        if (all || command_line_list_selects(list, events[event].name))
+        {
+            enabled[event] = enable;
+            selected++;
+        }
+    }
+
+    if (enable && selected > 0 && !buffers_allocated)
+    {
+        for (unsigned int cpu_id = 0; cpu_id < cpu_online_count(); cpu_id++)
+        {
+            allocate_buffer(cpu_id);
+        }
+
+        buffers_allocated = true;
+        active = true;
+    }
+
+    return selected;
+}
+
+void trace_init(void)
+{
+    if (!command_line_has_option("trace"))
+    {
+        return;
+    }
+
+    const char *list = command_line_option_value("trace");
+    if (list == NULL)
+    {
+        list = "all";
+    }
+
+    spinlock_lock(&lock);
+    unsigned int selected = select_events(list, true);
+    patch_sites();
+    spinlock_unlock(&lock);
+
+    io_print_formatted("Trace: %u events enabled, %U tracepoints in the kernel.\n", selected,
+                       (uint64_t) (__stop_tracepoints - __start_tracepoints));
+}
+
+void trace_init_cpu(void)
+{
+    spinlock_lock(&lock);
+    if (buffers_allocated)
+    {
+        allocate_buffer(cpu_current_id());
+    }
+    spinlock_unlock(&lock);
+}
+
+unsigned int trace_set_enabled(const char *list, bool enable)
+{
+    spinlock_lock(&lock);
+    unsigned int selected = select_events(list, enable);
+    patch_sites();
+    spinlock_unlock(&lock);
+
+    return selected;
+}
+
+void trace_write(trace_event_e event, uint64_t a, uint64_t b)
+{
+    // Interrupts are disabled while the record is written, so that an interrupt handler writing a record of its own
+    // can't get in between. The NMI handlers have no tracepoints.
+    uint64_t flags = interrupt_save_disable();
+
+    unsigned int cpu_id = cpu_current_id();
+    trace_buffer_t *buffer = &buffers[cpu_id];
+    if (active && buffer->records != NULL)
+    {
+        uint64_t index = buffer->used;
+        if (index == buffer->capacity)
+        {
+            buffer->dropped++;
+        }
+        else
+        {
+            trace_record_t *record = &buffer->records[index];
+            record->tsc = cpu_read_tsc();
+            record->event = event;
+            record->cpu_id = cpu_id;
+            record->reserved = 0;
+            record->values[0] = a;
+            record->values[1] = b;
+
+            __atomic_store_n(&buffer->used, index + 1, __ATOMIC_RELEASE);
+        }
+    }
+
+    interrupt_restore(flags);
+}
+
+/**
+ * Write a line to the serial port.
+ *
+ * @param format  The format string, as for io_print_formatted().
+ */
+static void write_line(const char *format, ...)
+{
+    char line[LINE_LENGTH];
+
+    va_list arguments;
+    va_start(arguments, format);
+    unsigned int length = format_to_buffer_list(line, sizeof(line), format, arguments);
+    va_end(arguments);
+
+    serial_write(line, length);
+}
+
+void trace_dump(void)
+{
+    spinlock_lock(&lock);
+    if (!buffers_allocated)
+    {
+        spinlock_unlock(&lock);
+        return;
+    }
+
+    // Stop the writing of records before the tracepoints are disabled. Patching the code makes every CPU take an
+    // interrupt, which it can only do once it is done with any record it was in the middle of writing.
+    bool was_enabled[trace_event_count];
+    for (unsigned int event = 0; event < trace_event_count; event++)
+    {
+        was_enabled[event] = enabled[event];
+        enabled[event] = false;
+    }
+
+    __atomic_store_n(&active, false, __ATOMIC_SEQ_CST);
+    patch_sites();
+
+    uint64_t records = 0;
+    uint64_t dropped = 0;
+    uint64_t first_tsc = UINT64_MAX;
+    for (unsigned int cpu_id = 0; cpu_id < CPU_MAX_COUNT; cpu_id++)
+    {
+        const trace_buffer_t *buffer = &buffers[cpu_id];
+        if (buffer->used > 0 && buffer->records[0].tsc < first_tsc)
+        {
+            first_tsc = buffer->records[0].tsc;
+        }
+
+        records += buffer->used;
+        dropped += buffer->dropped;
+    }
+
+    io_print_formatted("Trace: %U records written, %U dropped since the buffers were full.\n", records, dropped);
+
+    write_line("@trace %U %U %U\n", clock_tsc_frequency(), records, dropped);
+    for (unsigned int event = trace_event_none + 1; event < trace_event_count; event++)
+    {
+        write_line("@trace_event %u %s %s %s %s\n", event, events[event].phase, events[event].name,
+                   events[event].value_names[0], events[event].value_names[1]);
+    }
+
+    for (unsigned int cpu_id = 0; cpu_id < CPU_MAX_COUNT; cpu_id++)
+    {
+        trace_buffer_t *buffer = &buffers[cpu_id];
+        for (uint64_t i = 0; i < buffer->used; i++)
+        {
+            const trace_record_t *record = &buffer->records[i];
+            write_line("@trace_record %u %U %u %X %X\n", record->cpu_id, record->tsc - first_tsc,
+                       (uint32_t) record->event, record->values[0], record->values[1]);
+        }
+
+        buffer->used = 0;
+        buffer->dropped = 0;
+    }
+
+    write_line("@trace_end\n");
+
+    for (unsigned int event = 0; event < trace_event_count; event++)
+    {
+        enabled[event] = was_enabled[event];
+    }
+
+    __atomic_store_n(&active, true, __ATOMIC_SEQ_CST);
+    patch_sites();
+    spinlock_unlock(&lock);
+}
+
+/**
+ * List the events, and whether they are enabled.
+ */
+static void list_events(void)
+{
+    for (unsigned int event = trace_event_none + 1; event < trace_event_count; event++)
+    {
+        // The beginning and end of an event are enabled together, so there is no need to list them both.
+        if (event > trace_event_none + 1 && events[event].name == events[event - 1].name)
+        {
+            continue;
+        }
+
+        io_print_formatted("%s %s\n", events[event].name, enabled[event] ? "on" : "off");
+    }
+
+    io_print_formatted("%U tracepoints in the kernel.\n", (uint64_t) (__stop_tracepoints - __start_tracepoints));
+}
+
+/**
+ * The trace command.
+ */
+static void trace_command(const char *arguments)
+{
+    if (*arguments == '\0' || monitor_match_word(&arguments, "list"))
+    {
+        list_events();
+    }
+    else if (monitor_match_word(&arguments, "on"))
+    {
+        unsigned int selected = trace_set_enabled(*arguments != '\0' ? arguments : "all", true);
+        io_print_formatted("%u events enabled.\n", selected);
+    }
+    else if (monitor_match_word(&arguments, "off"))
+    {
+        unsigned int selected = trace_set_enabled(*arguments != '\0' ? arguments : "all", false);
+        io_print_formatted("%u events disabled.\n", selected);
+    }
+    else if (monitor_match_word(&arguments, "dump"))
+    {
+        trace_dump();
+    }
+    else
+    {
+        io_print_formatted("Unknown trace command: %s\n", arguments);
+    }
+}
+
+MONITOR_COMMAND("trace", trace_command, "[list | on <events> | off <events> | dump] - control the tracepoints.");
@@ -0,0 +1,159 @@
+/*
+ * trace.h - Static tracepoints. A tracepoint is placed anywhere in the kernel with the TRACE() macro. While disabled,
+ * it is nothing but a five-byte NOP instruction; enabling it patches the NOP into a jump to the code that writes a
+ * record to the trace buffer of the current CPU. The records are dumped on the serial port by trace_dump(), and turned
+ * into a timeline that can be opened in Perfetto (or chrome://tracing) by trace_decode.sh on the host; see the README.
+ *
+ * The events are enabled with trace=<events> on the kernel command line, or with the trace command in the serial
+ * monitor (see monitor.h). Like for the benchmarks, the events are given as a comma-separated list of names; each name
+ * selects the events with that name, as well as all the events whose names start with it followed by a dot. trace=all
+ * (or just trace) enables all of them.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__ 1
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//// Defines.
+// The size of the trace buffer of each CPU, as a page allocator order: 4 KiB << 8 = 1 MiB, or 32768 records. When it is
+// full, further records are dropped (and counted).
+#define TRACE_BUFFER_ORDER              8
+
+//// Type definitions and structures
+// The events. The names, and what the two values recorded with each of them mean, are listed in trace.c.
+typedef enum
+{
+    trace_event_none,
+    trace_event_interrupt_begin,
+    trace_event_interrupt_end,
+    trace_event_page_allocate_begin,
+    trace_event_page_allocate_end,
+    trace_event_page_free_begin,
+    trace_event_page_free_end,
+    trace_event_slab_allocate_begin,
+    trace_event_slab_allocate_end,
+    trace_event_slab_free_begin,
+    trace_event_slab_free_end,
+    trace_event_thread_create,
+    trace_event_thread_switch,
+    trace_event_thread_exit,
+    trace_event_vm_map_begin,
+    trace_event_vm_map_end,
+    trace_event_vm_unmap_begin,
+    trace_event_vm_unmap_end,
+    trace_event_vm_protect_begin,
+    trace_event_vm_protect_end,
+    trace_event_tlb_shootdown_begin,
+    trace_event_tlb_shootdown_end,
+    trace_event_count
+} trace_event_e;
+
+// A trace record, as stored in the trace buffers.
+typedef struct
+{
+    uint64_t tsc;
+    uint16_t event;
+    uint16_t cpu_id;
+    uint32_t reserved;
+    uint64_t values[2];
+} trace_record_t;
+
+// A tracepoint, as described by the TRACE() macro in the tracepoints section.
+typedef struct
+{
+    // The NOP instruction, and the code writing the record that it is patched to jump to.
+    uint8_t *address;
+    uint8_t *target;
+
+    uint64_t event;
+    uint64_t enabled;
+} trace_site_t;
+
+//// Macros
+#ifdef HOSTED
+// The hosted build (see the hosted folder) has nothing to patch, and nowhere to write the records.
+#define TRACE(event, a, b)                                                                                             \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        (void) (event);                                                                                                \
+    } while (0)
+#else
+/**
+ * Place a tracepoint. The values are only evaluated when the tracepoint is enabled.
+ *
+ * @param event  The event, from trace_event_e. Must be a constant.
+ * @param a  The first value recorded with the event.
+ * @param b  The second value recorded with the event.
+ */
+#define TRACE(event, a, b)                                                                                             \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        __label__ enabled;                                                                                             \
+        asm goto("1: .byte 0x0F, 0x1F, 0x44, 0x00, 0x00\n\t"                                                           \
+                 ".pushsection tracepoints, \"aw\"\n\t"                                                                \
+                 ".balign 8\n\t"                                                                                       \
+                 ".quad 1b, %l[enabled], %c0, 0\n\t"                                                                   \
+                 ".popsection"                                                                                         \
+                 :                                                                                                     \
+                 : "i"(event)                                                                                          \
+                 :                                                                                                     \
+                 : enabled);                                                                                           \
+        break;                                                                                                         \
+    enabled:                                                                                                           \
+        trace_write((event), (uint64_t) (a), (uint64_t) (b));                                                          \
+    } while (0)
+#endif
+
+//// Function prototypes
+/**
+ * Set up the trace buffer of the bootstrap processor, and enable the events given on the kernel command line. Must be
+ * called after interrupt_init(), and before the application processors are started.
+ */
+extern void trace_init(void);
+
+/**
+ * Set up the trace buffer of an application processor.
+ */
+extern void trace_init_cpu(void);
+
+/**
+ * Enable or disable events. Must be called with interrupts enabled, once the application processors have been started.
+ *
+ * @param list  The events, as a comma-separated list of names.
+ * @param enable  true to enable the events, false to disable them.
+ * @returns the number of events selected by the list.
+ */
+extern unsigned int trace_set_enabled(const char *list, bool enable);
+
+/**
+ * Write a record to the trace buffer of the current CPU. Use the TRACE() macro instead of calling this directly. May be
+ * called from interrupt handlers.
+ *
+ * @param event  The event.
+ * @param a  The first value.
+ * @param b  The second value.
+ */
+extern void trace_write(trace_event_e event, uint64_t a, uint64_t b);
+
+/**
+ * Dump the trace records on the serial port, and empty the trace buffers. The events are disabled while the records
+ * are dumped. The output consists of lines of the form
+ *
+ * @trace <TSC frequency> <records> <dropped records>
+ * @trace_event <event> <phase> <name> <name of the first value> <name of the second value>
+ * @trace_record <CPU> <TSC> <event> <first value> <second value>
+ * @trace_end
+ *
+ * The phase is B or E for the beginning and end of something that takes time, and i for an instant event; a value
+ * name of - means that the value is unused. The TSC is given in decimal, relative to the oldest record; the values in
+ * hexadecimal. The records of each CPU are listed in the order they were written. Does nothing if no event has ever
+ * been enabled.
+ */
+extern void trace_dump(void);
+
+#endif // !__TRACE_H__
@@ -1,60 +1,1251 @@
-/* 
+/*
  * $Id$
  *
  * vm.c - Virtual Memory routines.
  *
  * Author: Per Lundberg <per@halleluja.nu>
- * Copyright: (C) 2008-2009 Per Lundberg
+ * Copyright: (C) 2008-2009, 2017 Per Lundberg
  */
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common/cpu.h"
+#include "common/memory.h"
+#include "common/memory_type.h"
+#include "common/vm.h"
+#include "cpu.h"
+#include "interrupt.h"
 #include "io.h"
+#include "monitor.h"
+#include "page_allocator.h"
+#include "slab.h"
+#include "spinlock.h"
+#include "tlb.h"
+#include "trace.h"
 #include "vm.h"
 
-/*static*/ void vm_init_physical_zone(uint64_t upper_memory_limit)
+typedef enum
+{
+    operation_map,
+    operation_unmap,
+    operation_protect,
+
+    // Allocate the tables that mapping the range would need, splitting the large pages in the way, without changing how
+    // anything is mapped. The tables are not collapsed, so that the mapping that follows finds them all in place.
+    operation_prepare,
+
+    // Collapse the tables in the range, without changing how anything is mapped. Used for cleaning up after a failed
+    // operation_prepare.
+    operation_tidy
+} operation_e;
+
+// A change being made to a range of mappings.
+typedef struct
+{
+    operation_e operation;
+
+    // The address space being changed. The TLB entries to invalidate and the tables to free are collected there, since
+    // they may have to wait for the end of a batch (see vm_batch_begin()).
+    address_space_t *space;
+
+    // When mapping or preparing to: what to add to a virtual address to get the physical address it is mapped to.
+    uint64_t physical_offset;
+
+    // When mapping: the bits of the entries mapping the pages, in the PT entry layout and without the address. When
+    // changing the access rights: the new rights, as VM_ENTRY_WRITABLE and VM_ENTRY_USER.
+    uint64_t attributes;
+
+    // The entries in the lower half of the PML4 that have been changed, as a bit mask indexed by entry. In the kernel
+    // address space, these must be copied to the other address spaces.
+    uint64_t pml4_changed[VM_ENTRIES_PER_PAGE / 2 / 64];
+} update_t;
+
+// The state of the address spaces on each CPU.
+typedef struct
+{
+    // The address space loaded into CR3, or NULL for the kernel address space, and the PCID it was loaded with.
+    address_space_t *current;
+    unsigned int current_pcid;
+
+    // For each PCID: the ID of the address space the CPU has given it to (0 if none), and the generation of the address
+    // space when the TLB entries of the PCID were last flushed.
+    uint64_t ids[VM_PCIDS_PER_CPU];
+    uint64_t generations[VM_PCIDS_PER_CPU];
+
+    // The next PCID to hand out when they are all taken, minus 1. (PCID 0 is never handed out.)
+    unsigned int next_pcid;
+
+    // The value of shared_generation when the CPU last forgot about the PCID:s it had handed out.
+    uint64_t shared_generation;
+} __attribute__((aligned(CPU_CACHE_LINE_SIZE))) vm_cpu_t;
+
+address_space_t vm_kernel_address_space;
+
+// All the address spaces but the kernel one. Protected by the lock of the kernel address space.
+static address_space_t *address_spaces;
+
+static slab_cache_t *address_space_cache;
+
+// The ID most recently given to an address space.
+static uint64_t last_id;
+
+static vm_cpu_t vm_cpus[CPU_MAX_COUNT];
+
+// Set when CR4.PCIDE is set, and the PCID:s are to be used when switching between the address spaces.
+static bool has_pcid;
+static bool use_pcid;
+
+// Incremented every time a mapping is changed in the lower half, which is shared by all the address spaces. The TLB
+// entries of it may be tagged with any of the PCID:s, so the CPU:s flush all of them when this changes.
+static volatile uint64_t shared_generation;
+
+static bool has_1gib_pages;
+
+// The number of data TLB entries for each page size, or 0 if unknown. Used to estimate the TLB reach.
+static uint64_t tlb_entries[_1gib + 1];
+
+// The order of the memory holding the mappings found by vm_report(): 16 KiB, or 409 ranges.
+#define REPORT_RANGES_ORDER     2
+#define REPORT_RANGES_COUNT     ((VM_4KIB_PAGE_SIZE << REPORT_RANGES_ORDER) / sizeof(range_t))
+
+// A range of pages of the same size, mapped contiguously with the same attributes.
+typedef struct
+{
+    uint64_t virtual_address;
+    uint64_t physical_address;
+    uint64_t size;
+    uint64_t attributes;
+    int level;
+} range_t;
+
+// The state of a walk through the paging structures, made by vm_report().
+typedef struct
+{
+    uint64_t pages[_1gib + 1];
+    uint64_t structures[VM_LEVEL_PML4 + 1];
+
+    // The mappings found, coalesced into ranges, or NULL if they are not being collected. The last range is the one
+    // being coalesced. The pages that did not fit are only counted.
+    range_t *ranges;
+    unsigned int range_count;
+    uint64_t pages_dropped;
+} walk_t;
+
+static const char *page_size_names[_1gib + 1] =
+{
+    [_4kib] = "4 KiB",
+    [_2mib] = "2 MiB",
+    [_1gib] = "1 GiB"
+};
+
+/**
+ * Find out how many data TLB entries the CPU has for each page size. Intel CPU:s describe their TLBs in CPUID leaf 18h,
+ * AMD ones in the extended leaves. When a CPU has more than one level of TLB, the largest one is what counts.
+ */
+static void detect_tlb_entries(void)
+{
+    cpuid_registers_t registers;
+    if (cpu_has_cpuid_leaf(CPUID_LEAF_ADDRESS_TRANSLATION))
+    {
+        cpu_cpuid(CPUID_LEAF_ADDRESS_TRANSLATION, 0, &registers);
+        uint32_t subleaf_count = registers.eax + 1;
+        for (uint32_t subleaf = 0; subleaf < subleaf_count; subleaf++)
+        {
+            cpu_cpuid(CPUID_LEAF_ADDRESS_TRANSLATION, subleaf, &registers);
+
+            // The type of the TLB: 1 for data, 3 for unified and 4 for load-only TLBs. 0 means that the subleaf is
+            // unused, and 2 and 5 are the instruction and store-only TLBs.
+            uint32_t type = registers.edx & 0x1F;
+            if (type != 1 && type != 3 && type != 4)
+            {
+                continue;
+            }
+
+            uint64_t entries = (uint64_t) (registers.ebx >> 16) * registers.ecx;
+            uint32_t page_sizes[_1gib + 1] = { [_4kib] = 1 << 0, [_2mib] = 1 << 1, [_1gib] = 1 << 3 };
+            for (int page_size = _4kib; page_size <= _1gib; page_size++)
+            {
+                if ((registers.ebx & page_sizes[page_size]) != 0 && entries > tlb_entries[page_size])
+                {
+                    tlb_entries[page_size] = entries;
+                }
+            }
+        }
+    }
+
+    // The L1 and L2 data TLBs, with the number of entries in bits 16-23 and 16-27 respectively.
+    if (cpu_has_cpuid_leaf(CPUID_LEAF_L1_CACHE_TLB))
+    {
+        cpu_cpuid(CPUID_LEAF_L1_CACHE_TLB, 0, &registers);
+        uint64_t l1_4kib = (registers.ebx >> 16) & 0xFF;
+        uint64_t l1_2mib = (registers.eax >> 16) & 0xFF;
+        tlb_entries[_4kib] = l1_4kib > tlb_entries[_4kib] ? l1_4kib : tlb_entries[_4kib];
+        tlb_entries[_2mib] = l1_2mib > tlb_entries[_2mib] ? l1_2mib : tlb_entries[_2mib];
+    }
+
+    if (cpu_has_cpuid_leaf(CPUID_LEAF_L2_CACHE_TLB))
+    {
+        cpu_cpuid(CPUID_LEAF_L2_CACHE_TLB, 0, &registers);
+        uint64_t l2_4kib = (registers.ebx >> 16) & 0xFFF;
+        uint64_t l2_2mib = (registers.eax >> 16) & 0xFFF;
+        tlb_entries[_4kib] = l2_4kib > tlb_entries[_4kib] ? l2_4kib : tlb_entries[_4kib];
+        tlb_entries[_2mib] = l2_2mib > tlb_entries[_2mib] ? l2_2mib : tlb_entries[_2mib];
+    }
+
+    // The L1 and L2 data TLBs for 1 GiB pages, in EAX and EBX.
+    if (cpu_has_cpuid_leaf(CPUID_LEAF_1GIB_TLB))
+    {
+        cpu_cpuid(CPUID_LEAF_1GIB_TLB, 0, &registers);
+        uint64_t l1_1gib = (registers.eax >> 16) & 0xFFF;
+        uint64_t l2_1gib = (registers.ebx >> 16) & 0xFFF;
+        uint64_t entries = l2_1gib > l1_1gib ? l2_1gib : l1_1gib;
+        tlb_entries[_1gib] = entries > tlb_entries[_1gib] ? entries : tlb_entries[_1gib];
+    }
+}
+
+void vm_init(uint64_t upper_memory_limit)
+{
+    // The identity mapping of the physical memory has already been set up by the 32-bit loader (see vm32.c), and CR3
+    // points at its PML4. From here on, the paging structures are maintained by the functions below.
+    vm_kernel_address_space.pml4 = VM_PHYSICAL_TO_POINTER(cpu_get_cr3() & VM_ENTRY_ADDRESS_MASK);
+    vm_kernel_address_space.id = ++last_id;
+
+    // All the CPU:s are running the kernel address space, including the ones that are not online. (They are never sent
+    // any IPI:s.)
+    vm_kernel_address_space.cpus = ~0ULL;
+    tlb_init();
+
+    address_space_cache = slab_cache_create("address_space", sizeof(address_space_t), 0);
+    if (address_space_cache == NULL)
+    {
+        io_print_line("VM: out of memory when creating the address space cache. Halting.");
+        HALT();
+    }
+
+    vm_init_cpu();
+    has_pcid = (cpu_get_cr4() & CR4_PCIDE) != 0;
+    use_pcid = has_pcid;
+
+    if (cpu_has_cpuid_leaf(CPUID_LEAF_EXTENDED_INFO))
+    {
+        cpuid_registers_t extended_info;
+        cpu_cpuid(CPUID_LEAF_EXTENDED_INFO, 0, &extended_info);
+        has_1gib_pages = (extended_info.edx & CPUID_EXTENDED_INFO_EDX_PAGE_1GB) != 0;
+    }
+
+    detect_tlb_entries();
+}
+
+void vm_init_cpu(void)
+{
+    // CR4.PCIDE can only be set while CR3 holds PCID 0, which is what the kernel address space uses.
+    cpuid_registers_t features;
+    cpu_cpuid(CPUID_LEAF_FEATURES, 0, &features);
+    if ((features.ecx & CPUID_FEATURES_ECX_PCID) != 0)
+    {
+        cpu_set_cr4(cpu_get_cr4() | CR4_PCIDE);
+    }
+}
+
+/**
+ * Check whether an entry references a page, rather than a table.
+ *
+ * @param entry  The entry. Must be present.
+ * @param level  The level of the entry.
+ */
+static bool is_page(uint64_t entry, int level)
+{
+    return level == VM_LEVEL_PT || (level != VM_LEVEL_PML4 && (entry & VM_ENTRY_PAGE_SIZE) != 0);
+}
+
+/**
+ * Check whether the entries at a given level can reference pages.
+ */
+static bool can_be_page(int level)
+{
+    return level == VM_LEVEL_PT || level == VM_LEVEL_PD || (level == VM_LEVEL_PDP && has_1gib_pages);
+}
+
+/**
+ * Get the address of the page referenced by an entry.
+ */
+static uint64_t page_address(uint64_t entry, int level)
+{
+    return entry & VM_ENTRY_ADDRESS_MASK & ~(VM_LEVEL_ENTRY_SIZE(level) - 1);
+}
+
+/**
+ * Get the bits of an entry referencing a page, converted to the PT entry layout. The accessed and dirty flags are left
+ * out, since they are set by the CPU and say nothing about how the page is mapped.
+ */
+static uint64_t page_attributes(uint64_t entry, int level)
+{
+    uint64_t attributes = entry & ~VM_ENTRY_ADDRESS_MASK & ~(VM_ENTRY_ACCESSED | VM_ENTRY_DIRTY);
+    if (level == VM_LEVEL_PT)
+    {
+        return attributes;
+    }
+
+    attributes &= ~VM_ENTRY_PAGE_SIZE;
+    return (entry & VM_ENTRY_LARGE_PAT) != 0 ? attributes | VM_ENTRY_PAT : attributes;
+}
+
+/**
+ * Get the table referenced by an entry.
+ */
+static uint64_t *table_of(uint64_t entry)
+{
+    return VM_PHYSICAL_TO_POINTER(entry & VM_ENTRY_ADDRESS_MASK);
+}
+
+/**
+ * Queue the invalidation of the TLB entry of a page.
+ *
+ * @param update  The update that changed the mapping of the page.
+ * @param virtual_address  The start of the page.
+ * @param level  The level of the entry that mapped the page.
+ */
+static void invalidate(update_t *update, uint64_t virtual_address, int level)
+{
+    tlb_batch_add(&update->space->batch, virtual_address, VM_LEVEL_SHIFT(level));
+}
+
+/**
+ * Queue a table that is no longer referenced to be freed, if it was allocated by us.
+ *
+ * @param update  The update that removed the last reference to the table.
+ * @param entry  The entry that used to reference the table.
+ */
+static void discard_table(update_t *update, uint64_t entry)
+{
+    if ((entry & VM_ENTRY_ALLOCATED) == 0)
+    {
+        // Set up by the 32-bit loader. The memory stays reserved, so there is nothing we can do with it.
+        return;
+    }
+
+    // The tables that are no longer used are linked through their first entry. They are only given back to the page
+    // allocator once the TLB:s have been invalidated, since the CPU:s may have cached references to them until then.
+    uint64_t *table = table_of(entry);
+    table[0] = update->space->free_tables;
+    update->space->free_tables = entry & VM_ENTRY_ADDRESS_MASK;
+}
+
+/**
+ * Discard a table along with all the tables below it, and queue the invalidation of every page they map.
+ *
+ * @param update  The update that removed the last reference to the table.
+ * @param entry  The entry that used to reference the table.
+ * @param level  The level of the entry.
+ * @param virtual_address  The start of the memory mapped by the entry.
+ */
+static void release_table(update_t *update, uint64_t entry, int level, uint64_t virtual_address)
+{
+    uint64_t *table = table_of(entry);
+    for (int i = 0; i < VM_ENTRIES_PER_PAGE; i++)
+    {
+        uint64_t address = virtual_address + i * VM_LEVEL_ENTRY_SIZE(level - 1);
+        if ((table[i] & VM_ENTRY_PRESENT) == 0)
+        {
+            continue;
+        }
+
+        if (is_page(table[i], level - 1))
+        {
+            invalidate(update, address, level - 1);
+        }
+        else
+        {
+            release_table(update, table[i], level - 1, address);
+        }
+    }
+
+    discard_table(update, entry);
+}
+
+/**
+ * Replace an entry, invalidating whatever it used to map.
+ *
+ * @param update  The update being made.
+ * @param entry  The entry.
+ * @param level  The level of the entry.
+ * @param virtual_address  The start of the memory mapped by the entry.
+ * @param new_entry  The new value of the entry.
+ */
+static void replace_entry(update_t *update, uint64_t *entry, int level, uint64_t virtual_address, uint64_t new_entry)
 {
-    // Physical memory VM zone initialization.
-    //
-    // Because we want to trap NULL pointer references, we MUST make sure to not map page 0 (0-4 KiB). I had initially
-    // thought about making this page mapped "above" all the rest of the RAM, but really, I think it will be hard to make
-    // that work in a good way... If you have 4 GiB of RAM in the machine, mapping one extra page from 4 GiB to 4 GiB + 4 KiB
-    // will require at least one extra page table (in this specific case, it will also require an extra page directory...).
-    //
-    // However, what we could do is to try and map this page in some of the "memory" holes in the low 2 meg area. Still, it
-    // will be a bit bad because we cannot do normal 1-to-1-translations of addresses in this area if we do it like that.  We
-    // try to find a suitable one-page memory need as we go along with the development instead, and use this memory for that
-    // if we find it.
+    uint64_t old_entry = *entry;
+    if ((old_entry & ~(VM_ENTRY_ACCESSED | VM_ENTRY_DIRTY)) == new_entry)
+    {
+        return;
+    }
+
+    *entry = new_entry;
+
+    if ((old_entry & VM_ENTRY_PRESENT) == 0)
+    {
+        return;
+    }
 
-    uint64_t current_page_size = VM_SMALL_PAGE_SIZE;
-    int row = 0, column = 0;
-    for (uint64_t index = VM_SMALL_PAGE_SIZE; 
-         index < upper_memory_limit + VM_SMALL_PAGE_SIZE;
-         index += current_page_size)
+    if (is_page(old_entry, level))
+    {
+        invalidate(update, virtual_address, level);
+    }
+    else
     {
-        if (index % VM_LARGE_PAGE_SIZE == 0)
+        release_table(update, old_entry, level, virtual_address);
+    }
+}
+
+/**
+ * Get the table referenced by an entry, allocating it if the entry is not present. If the entry references a large page,
+ * the page is split: the new table maps the same memory, with the same attributes, using pages of the next size down.
+ *
+ * @param update  The update being made.
+ * @param entry  The entry.
+ * @param level  The level of the entry.
+ * @returns the table, or NULL if there was not enough memory to allocate it.
+ */
+static uint64_t *next_table(update_t *update, uint64_t *entry, int level)
+{
+    uint64_t old_entry = *entry;
+
+    // The access rights of the tables are as permissive as needed for the pages below them; it is up to the entries
+    // referencing the pages to restrict them.
+    uint64_t user = update->operation != operation_unmap ? update->attributes & VM_ENTRY_USER : 0;
+
+    if ((old_entry & VM_ENTRY_PRESENT) != 0 && !is_page(old_entry, level))
+    {
+        *entry = old_entry | user;
+        return table_of(old_entry);
+    }
+
+    uint64_t address = page_allocate(0);
+    if (address == 0)
+    {
+        return NULL;
+    }
+
+    uint64_t *table = VM_PHYSICAL_TO_POINTER(address);
+    if ((old_entry & VM_ENTRY_PRESENT) != 0)
+    {
+        // The TLB entry of the large page stays valid, since the memory is still mapped the same way. It is invalidated
+        // along with the pages being changed, which are all part of it.
+        uint64_t page = page_address(old_entry, level);
+        uint64_t attributes = page_attributes(old_entry, level);
+        for (int i = 0; i < VM_ENTRIES_PER_PAGE; i++)
         {
-            current_page_size = VM_LARGE_PAGE_SIZE;
+            table[i] = vm_page_entry(page + i * VM_LEVEL_ENTRY_SIZE(level - 1), attributes, level - 1);
         }
 
-        io_move_cursor(row, column);
-        io_print_formatted("Page: %X-%X", index, index + current_page_size - 1);
+        user |= attributes & VM_ENTRY_USER;
+    }
+    else
+    {
+        memory_zero(table, VM_4KIB_PAGE_SIZE);
+    }
+
+    *entry = vm_structure_entry(address) | VM_ENTRY_ALLOCATED | user;
+    return table;
+}
+
+/**
+ * Collapse the table referenced by an entry, if possible: an empty table is freed, and a table mapping a contiguous
+ * range of pages, all with the same attributes, is replaced by a large page.
+ *
+ * @param update  The update being made.
+ * @param entry  The entry.
+ * @param level  The level of the entry.
+ * @param virtual_address  The start of the memory mapped by the entry.
+ */
+static void collapse_table(update_t *update, uint64_t *entry, int level, uint64_t virtual_address)
+{
+    // The PDPs are kept even when they end up empty. There are only a few of them, since each of them maps 512 GiB.
+    uint64_t old_entry = *entry;
+    if (level == VM_LEVEL_PML4 || (old_entry & VM_ENTRY_PRESENT) == 0 || is_page(old_entry, level))
+    {
+        return;
+    }
+
+    uint64_t *table = table_of(old_entry);
+    if ((table[0] & VM_ENTRY_PRESENT) == 0)
+    {
+        for (int i = 1; i < VM_ENTRIES_PER_PAGE; i++)
+        {
+            if ((table[i] & VM_ENTRY_PRESENT) != 0)
+            {
+                return;
+            }
+        }
+
+        *entry = 0;
+    }
+    else
+    {
+        if (!can_be_page(level) || !is_page(table[0], level - 1))
+        {
+            return;
+        }
 
-        row++;
+        uint64_t page = page_address(table[0], level - 1);
+        uint64_t attributes = page_attributes(table[0], level - 1);
+        if ((page & (VM_LEVEL_ENTRY_SIZE(level) - 1)) != 0)
+        {
+            return;
+        }
 
-        // Extremely evil and hardwired but hey, we're talking about debug code anyway...
-        if (row == 25)
+        for (int i = 1; i < VM_ENTRIES_PER_PAGE; i++)
         {
-            row = 2;
-            column = column + 30;
-            
-            if (column > 80)
+            if ((table[i] & VM_ENTRY_PRESENT) == 0 ||
+                !is_page(table[i], level - 1) ||
+                page_address(table[i], level - 1) != page + i * VM_LEVEL_ENTRY_SIZE(level - 1) ||
+                page_attributes(table[i], level - 1) != attributes)
             {
-                break;
+                return;
             }
         }
+
+        *entry = vm_page_entry(page, attributes, level);
     }
+
+    // The TLB entries of the pages in the table map the memory the same way as before, but the CPU may have cached the
+    // reference to the table itself. Invalidating any page takes care of that.
+    invalidate(update, virtual_address, level);
+    discard_table(update, old_entry);
 }
 
-void vm_init(uint64_t upper_memory_limit)
+static bool update_table(update_t *update, uint64_t *table, int level, uint64_t virtual_address, uint64_t size);
+
+/**
+ * Make an update to the part of a range that is mapped by a given entry.
+ *
+ * @param update  The update being made.
+ * @param entry  The entry.
+ * @param level  The level of the entry.
+ * @param virtual_address  The start of the part of the range.
+ * @param size  The size of the part of the range. The part is within the memory mapped by the entry.
+ * @returns true on success, false if there was not enough memory for the paging structures.
+ */
+static bool update_entry(update_t *update, uint64_t *entry, int level, uint64_t virtual_address, uint64_t size)
+{
+    uint64_t physical_address = virtual_address + update->physical_offset;
+    bool whole = size == VM_LEVEL_ENTRY_SIZE(level);
+    bool present = (*entry & VM_ENTRY_PRESENT) != 0;
+
+    switch (update->operation)
+    {
+        case operation_map:
+        case operation_prepare:
+        {
+            if (whole && can_be_page(level) && (physical_address & (size - 1)) == 0)
+            {
+                if (update->operation == operation_map)
+                {
+                    uint64_t new_entry = vm_page_entry(physical_address, update->attributes, level);
+                    replace_entry(update, entry, level, virtual_address, new_entry);
+                }
+
+                return true;
+            }
+
+            break;
+        }
+
+        case operation_unmap:
+        {
+            if (!present)
+            {
+                return true;
+            }
+
+            if (whole && level != VM_LEVEL_PML4)
+            {
+                replace_entry(update, entry, level, virtual_address, 0);
+                return true;
+            }
+
+            break;
+        }
+
+        case operation_protect:
+        {
+            if (!present)
+            {
+                return true;
+            }
+
+            if (whole && is_page(*entry, level))
+            {
+                uint64_t attributes = page_attributes(*entry, level) & ~(VM_ENTRY_WRITABLE | VM_ENTRY_USER);
+                replace_entry(update, entry, level, virtual_address,
+                              vm_page_entry(page_address(*entry, level), attributes | update->attributes, level));
+                return true;
+            }
+
+            break;
+        }
+
+        case operation_tidy:
+        {
+            if (!present || is_page(*entry, level))
+            {
+                return true;
+            }
+
+            break;
+        }
+    }
+
+    // The entry can't be changed as a whole, so we need to go one level down.
+    uint64_t old_entry = *entry;
+    uint64_t *table = next_table(update, entry, level);
+    unsigned int index = VM_LEVEL_INDEX(virtual_address, level);
+    if (*entry != old_entry && level == VM_LEVEL_PML4 && index < VM_ENTRIES_PER_PAGE / 2)
+    {
+        update->pml4_changed[index / 64] |= 1ULL << (index % 64);
+    }
+
+    if (table == NULL)
+    {
+        return false;
+    }
+
+    bool success = update_table(update, table, level - 1, virtual_address, size);
+    if (update->operation != operation_prepare)
+    {
+        collapse_table(update, entry, level, virtual_address & ~(VM_LEVEL_ENTRY_SIZE(level) - 1));
+    }
+
+    return success;
+}
+
+/**
+ * Make an update to the part of a range that is mapped by a given table.
+ *
+ * @param update  The update being made.
+ * @param table  The table.
+ * @param level  The level of the entries in the table.
+ * @param virtual_address  The start of the part of the range.
+ * @param size  The size of the part of the range. The part is within the memory mapped by the table.
+ * @returns true on success, false if there was not enough memory for the paging structures.
+ */
+static bool update_table(update_t *update, uint64_t *table, int level, uint64_t virtual_address, uint64_t size)
+{
+    uint64_t entry_size = VM_LEVEL_ENTRY_SIZE(level);
+    while (size > 0)
+    {
+        uint64_t part_size = entry_size - (virtual_address & (entry_size - 1));
+        if (part_size > size)
+        {
+            part_size = size;
+        }
+
+        if (!update_entry(update, &table[VM_LEVEL_INDEX(virtual_address, level)], level, virtual_address, part_size))
+        {
+            return false;
+        }
+
+        virtual_address += part_size;
+        size -= part_size;
+    }
+
+    return true;
+}
+
+/**
+ * Forget about the PCID:s the current CPU has handed out, apart from the one currently loaded, so that their TLB entries
+ * are flushed when they are next used.
+ */
+static void forget_pcids(vm_cpu_t *cpu)
 {
-    // Alright; new page tables have been set up. We can now set CR3 to point at the newly created PML4 structure.
+    for (unsigned int pcid = 0; pcid < VM_PCIDS_PER_CPU; pcid++)
+    {
+        if (pcid != cpu->current_pcid)
+        {
+            cpu->ids[pcid] = 0;
+        }
+    }
+}
+
+/**
+ * Give the tables discarded by the updates of an address space back to the page allocator.
+ */
+static void free_tables(address_space_t *space)
+{
+    while (space->free_tables != 0)
+    {
+        uint64_t address = space->free_tables;
+        space->free_tables = *(uint64_t *) VM_PHYSICAL_TO_POINTER(address);
+        page_free(address, 0);
+    }
+}
+
+/**
+ * Invalidate the TLB entries of the pages whose mappings have been changed in an address space, and free the tables that
+ * are no longer used. The current CPU invalidates them right away if it has the address space loaded, and so do the
+ * other CPU:s running it, on receiving an IPI. The rest see that the generation of the address space has changed, and
+ * flush the TLB entries of it the next time they switch to it. Must be called with the lock of the address space held.
+ *
+ * @param space  The address space.
+ */
+static void flush_batch(address_space_t *space)
+{
+    if (!tlb_batch_is_empty(&space->batch))
+    {
+        vm_cpu_t *cpu = &vm_cpus[cpu_current_id()];
+        bool current = vm_address_space_current() == space;
+
+        // A CPU switching to the address space adds itself to the CPU:s running it before reading the generation, while
+        // we do it the other way around: either it gets an IPI, or it sees the new generation.
+        uint64_t generation = __atomic_add_fetch(&space->generation, 1, __ATOMIC_SEQ_CST);
+        uint64_t cpus = __atomic_load_n(&space->cpus, __ATOMIC_SEQ_CST);
+
+        if (space->batch_shared)
+        {
+            // The changes are serialized by the lock of the kernel address space, so nobody else can have changed the
+            // shared generation since we last caught up with it, unless we have yet to catch up.
+            uint64_t new_shared_generation = __atomic_add_fetch(&shared_generation, 1, __ATOMIC_RELEASE);
+            if (cpu->shared_generation + 1 == new_shared_generation)
+            {
+                cpu->shared_generation = new_shared_generation;
+            }
+
+            forget_pcids(cpu);
+
+            // Every CPU has the lower half loaded, whatever address space it is running.
+            cpus = ~0ULL;
+        }
+
+        if (space->batch_shared || current)
+        {
+            tlb_invalidate(&space->batch);
+        }
+
+        if (current)
+        {
+            cpu->generations[cpu->current_pcid] = generation;
+        }
+
+        tlb_shootdown(&space->batch, cpus);
+        tlb_batch_reset(&space->batch);
+    }
+
+    space->batch_shared = false;
+    free_tables(space);
+}
+
+/**
+ * Make an update to a range, and invalidate the TLB entries of the pages whose mappings were changed, unless a batch is
+ * in effect. Must be called with the lock of the address space held.
+ *
+ * @param space  The address space.
+ * @param update  The update.
+ * @param virtual_address  The start of the range.
+ * @param size  The size of the range.
+ * @returns true on success, false if there was not enough memory for the paging structures.
+ */
+static bool update_range(address_space_t *space, update_t *update, uint64_t virtual_address, uint64_t size)
+{
+    bool success = update_table(update, space->pml4, VM_LEVEL_PML4, virtual_address, size);
+
+    // Only the changed entries are copied, each with a single store, since the CPU:s may be walking the other PML4:s
+    // (and setting the accessed bits of their entries) at the same time.
+    bool shared = space == &vm_kernel_address_space && virtual_address < VM_UPPER_HALF_START;
+    for (unsigned int i = 0; shared && i < VM_ENTRIES_PER_PAGE / 2; i++)
+    {
+        if ((update->pml4_changed[i / 64] & (1ULL << (i % 64))) == 0)
+        {
+            continue;
+        }
+
+        for (address_space_t *other = address_spaces; other != NULL; other = other->next)
+        {
+            __atomic_store_n(&other->pml4[i], space->pml4[i], __ATOMIC_RELAXED);
+        }
+    }
+
+    space->batch_shared = space->batch_shared || shared;
+    if (space->batch_depth == 0)
+    {
+        flush_batch(space);
+    }
+
+    return success;
+}
+
+/**
+ * Get the bits of the entries mapping pages with the given access rights, in the PT entry layout.
+ */
+static uint64_t access_rights(unsigned int flags)
+{
+    return ((flags & VM_WRITABLE) != 0 ? VM_ENTRY_WRITABLE : 0) | ((flags & VM_USER) != 0 ? VM_ENTRY_USER : 0);
+}
+
+bool vm_map_range(address_space_t *space, uint64_t virtual_address, uint64_t physical_address, uint64_t size,
+                  unsigned int flags, memory_type_e memory_type)
+{
+    TRACE(trace_event_vm_map_begin, virtual_address, size);
+
+    update_t update =
+    {
+        .operation = operation_map,
+        .space = space,
+        .physical_offset = physical_address - virtual_address,
+        .attributes = VM_ENTRY_PRESENT | access_rights(flags) | vm_memory_type_bits(memory_type)
+    };
+
+    // The kernel's own mappings in the lower half are global, just like the identity mapping. (This has no effect as
+    // long as CR4.PGE is not set, but keeps the attributes of the pages the same as their neighbours', so that they can
+    // be merged.) The upper half differs between the address spaces, so nothing there can be global.
+    if ((flags & VM_USER) == 0 && virtual_address < VM_UPPER_HALF_START)
+    {
+        update.attributes |= VM_ENTRY_GLOBAL;
+    }
+
+    // All the tables needed are allocated before anything is mapped, so that running out of memory leaves the mappings
+    // as they were. Once they are in place, mapping the range can't fail.
+    update_t prepare = { .operation = operation_prepare, .space = space, .physical_offset = update.physical_offset };
+    spinlock_lock(&space->lock);
+    bool success = update_range(space, &prepare, virtual_address, size);
+    if (success)
+    {
+        success = update_range(space, &update, virtual_address, size);
+    }
+    else
+    {
+        update_t tidy = { .operation = operation_tidy, .space = space };
+        update_range(space, &tidy, virtual_address, size);
+    }
+    spinlock_unlock(&space->lock);
+
+    TRACE(trace_event_vm_map_end, success, 0);
+    return success;
+}
+
+bool vm_unmap_range(address_space_t *space, uint64_t virtual_address, uint64_t size)
+{
+    TRACE(trace_event_vm_unmap_begin, virtual_address, size);
+
+    update_t update = { .operation = operation_unmap, .space = space };
+    spinlock_lock(&space->lock);
+    bool success = update_range(space, &update, virtual_address, size);
+    spinlock_unlock(&space->lock);
+
+    TRACE(trace_event_vm_unmap_end, success, 0);
+    return success;
+}
+
+bool vm_protect_range(address_space_t *space, uint64_t virtual_address, uint64_t size, unsigned int flags)
+{
+    TRACE(trace_event_vm_protect_begin, virtual_address, size);
+
+    update_t update = { .operation = operation_protect, .space = space, .attributes = access_rights(flags) };
+    spinlock_lock(&space->lock);
+    bool success = update_range(space, &update, virtual_address, size);
+    spinlock_unlock(&space->lock);
+
+    TRACE(trace_event_vm_protect_end, success, 0);
+    return success;
+}
+
+void vm_batch_begin(address_space_t *space)
+{
+    spinlock_lock(&space->lock);
+    space->batch_depth++;
+    spinlock_unlock(&space->lock);
+}
+
+void vm_batch_end(address_space_t *space)
+{
+    spinlock_lock(&space->lock);
+    space->batch_depth--;
+    if (space->batch_depth == 0)
+    {
+        flush_batch(space);
+    }
+    spinlock_unlock(&space->lock);
+}
+
+bool vm_translate(address_space_t *space, uint64_t virtual_address, uint64_t *physical_address)
+{
+    bool mapped = false;
+
+    spinlock_lock(&space->lock);
+    uint64_t *table = space->pml4;
+    for (int level = VM_LEVEL_PML4; level >= VM_LEVEL_PT; level--)
+    {
+        uint64_t entry = table[VM_LEVEL_INDEX(virtual_address, level)];
+        if ((entry & VM_ENTRY_PRESENT) == 0)
+        {
+            break;
+        }
+
+        if (is_page(entry, level))
+        {
+            *physical_address = page_address(entry, level) + (virtual_address & (VM_LEVEL_ENTRY_SIZE(level) - 1));
+            mapped = true;
+            break;
+        }
+
+        table = table_of(entry);
+    }
+    spinlock_unlock(&space->lock);
+
+    return mapped;
+}
+
+address_space_t *vm_address_space_create(void)
+{
+    address_space_t *space = slab_allocate(address_space_cache);
+    uint64_t pml4_address = page_allocate(0);
+    if (space == NULL || pml4_address == 0)
+    {
+        if (space != NULL)
+        {
+            slab_free(address_space_cache, space);
+        }
+
+        if (pml4_address != 0)
+        {
+            page_free(pml4_address, 0);
+        }
+
+        return NULL;
+    }
+
+    memory_zero(space, sizeof(address_space_t));
+    space->pml4 = VM_PHYSICAL_TO_POINTER(pml4_address);
+    space->id = __atomic_add_fetch(&last_id, 1, __ATOMIC_RELAXED);
+
+    // The PML4 entries of the lower half are copied from the kernel address space, which makes the tables below them
+    // shared. The entries themselves are kept up to date by update_range(), should the kernel ever add any.
+    memory_zero(space->pml4 + VM_ENTRIES_PER_PAGE / 2, VM_4KIB_PAGE_SIZE / 2);
+
+    spinlock_lock(&vm_kernel_address_space.lock);
+    memory_copy(space->pml4, vm_kernel_address_space.pml4, VM_4KIB_PAGE_SIZE / 2);
+    space->next = address_spaces;
+    address_spaces = space;
+    spinlock_unlock(&vm_kernel_address_space.lock);
+
+    return space;
+}
+
+void vm_address_space_destroy(address_space_t *space)
+{
+    spinlock_lock(&vm_kernel_address_space.lock);
+    address_space_t **link = &address_spaces;
+    while (*link != space)
+    {
+        link = &(*link)->next;
+    }
+
+    *link = space->next;
+    spinlock_unlock(&vm_kernel_address_space.lock);
+
+    // The address space is not loaded anywhere, so the tables can be freed without invalidating any TLB entries. The
+    // CPU:s that have given it a PCID flush the TLB entries of it when they hand out the PCID to someone else, since the
+    // ID of the address space is never reused.
+    update_t update = { .operation = operation_unmap, .space = space };
+    for (int i = VM_ENTRIES_PER_PAGE / 2; i < VM_ENTRIES_PER_PAGE; i++)
+    {
+        if ((space->pml4[i] & VM_ENTRY_PRESENT) != 0)
+        {
+            uint64_t address = VM_UPPER_HALF_START + (i - VM_ENTRIES_PER_PAGE / 2) * VM_LEVEL_ENTRY_SIZE(VM_LEVEL_PML4);
+            release_table(&update, space->pml4[i], VM_LEVEL_PML4, address);
+        }
+    }
+
+    free_tables(space);
+    page_free(VM_POINTER_TO_PHYSICAL(space->pml4), 0);
+    slab_free(address_space_cache, space);
 }
+
+/**
+ * Choose the PCID to load an address space with on the current CPU, and whether the TLB entries of it must be flushed.
+ *
+ * @param cpu  The state of the address spaces on the current CPU.
+ * @param space  The address space.
+ * @returns the bits to set in CR3: the PCID, and CR3_NO_FLUSH unless the TLB entries must be flushed.
+ */
+static uint64_t choose_pcid(vm_cpu_t *cpu, address_space_t *space)
+{
+    uint64_t new_shared_generation = __atomic_load_n(&shared_generation, __ATOMIC_ACQUIRE);
+    if (cpu->shared_generation != new_shared_generation)
+    {
+        forget_pcids(cpu);
+        cpu->ids[cpu->current_pcid] = 0;
+        cpu->shared_generation = new_shared_generation;
+    }
+
+    // The kernel address space always has PCID 0. The others keep the PCID they were given the last time, unless it has
+    // been handed out to another address space since; otherwise, they get the next one in turn. Without PCID:s, every
+    // address space gets PCID 0, which means a flush for every switch.
+    unsigned int pcid = 0;
+    if (use_pcid && space != &vm_kernel_address_space)
+    {
+        pcid = 1;
+        while (pcid < VM_PCIDS_PER_CPU && cpu->ids[pcid] != space->id)
+        {
+            pcid++;
+        }
+
+        if (pcid == VM_PCIDS_PER_CPU)
+        {
+            pcid = cpu->next_pcid + 1;
+            cpu->next_pcid = pcid == VM_PCIDS_PER_CPU - 1 ? 0 : pcid;
+        }
+    }
+
+    // The CPU already counts as running the address space, so a mapping changed after the generation has been read is
+    // no different from one changed while the CPU runs the address space: see flush_batch().
+    uint64_t generation = __atomic_load_n(&space->generation, __ATOMIC_SEQ_CST);
+    bool flush = cpu->ids[pcid] != space->id || cpu->generations[pcid] != generation;
+    cpu->ids[pcid] = space->id;
+    cpu->generations[pcid] = generation;
+    cpu->current_pcid = pcid;
+
+    return pcid | (flush ? 0 : CR3_NO_FLUSH);
+}
+
+void vm_address_space_switch(address_space_t *space)
+{
+    unsigned int id = cpu_current_id();
+    vm_cpu_t *cpu = &vm_cpus[id];
+    address_space_t *previous = vm_address_space_current();
+    if (space == previous)
+    {
+        return;
+    }
+
+    // A TLB shootdown IPI must not come in between adding the CPU to the ones running the address space and loading
+    // CR3, or the TLB entries of the previous address space would be invalidated instead. For the same reason, the CPU
+    // is only taken out of the ones running the previous address space once CR3 has been loaded.
+    uint64_t flags = interrupt_save_disable();
+    __atomic_or_fetch(&space->cpus, 1ULL << id, __ATOMIC_SEQ_CST);
+
+    cpu->current = space;
+    uint64_t cr3 = VM_POINTER_TO_PHYSICAL(space->pml4);
+    cpu_set_cr3(has_pcid ? cr3 | choose_pcid(cpu, space) : cr3);
+
+    __atomic_and_fetch(&previous->cpus, ~(1ULL << id), __ATOMIC_RELEASE);
+    interrupt_restore(flags);
+}
+
+address_space_t *vm_address_space_current(void)
+{
+    address_space_t *current = vm_cpus[cpu_current_id()].current;
+    return current != NULL ? current : &vm_kernel_address_space;
+}
+
+bool vm_use_pcid(bool enable)
+{
+    use_pcid = has_pcid && enable;
+    return has_pcid;
+}
+
+/**
+ * Get the name of the memory type selected by the bits of an entry mapping a page.
+ *
+ * @param attributes  The bits of the entry, in the PT entry layout.
+ */
+static const char *memory_type_name_of(uint64_t attributes)
+{
+    uint64_t bits = attributes & (VM_ENTRY_PWT | VM_ENTRY_PCD | VM_ENTRY_PAT);
+    for (memory_type_e memory_type = 0; memory_type < MEMORY_TYPE_COUNT; memory_type++)
+    {
+        if (vm_memory_type_bits(memory_type) == bits)
+        {
+            return memory_type_name(memory_type);
+        }
+    }
+
+    return "unknown memory type";
+}
+
+/**
+ * Print a range of mappings found by a walk.
+ */
+static void print_range(const range_t *range)
+{
+    uint64_t attributes = range->attributes;
+    io_print_formatted("%016X-%016X -> %016X %s %s %s, %U x %s\n", range->virtual_address,
+                       range->virtual_address + range->size - 1, range->physical_address,
+                       (attributes & VM_ENTRY_WRITABLE) != 0 ? "rw" : "ro",
+                       (attributes & VM_ENTRY_USER) != 0 ? "user" : "kernel", memory_type_name_of(attributes),
+                       range->size >> VM_LEVEL_SHIFT(range->level), page_size_names[range->level]);
+}
+
+/**
+ * Count a page found by a walk, and add it to the range being coalesced if the mappings are being collected. The range
+ * only grows as long as the pages are of the same size, and mapped contiguously with the same attributes.
+ *
+ * @param walk  The walk.
+ * @param virtual_address  The virtual address of the page.
+ * @param entry  The entry mapping the page.
+ * @param level  The level of the entry.
+ */
+static void walk_page(walk_t *walk, uint64_t virtual_address, uint64_t entry, int level)
+{
+    walk->pages[level]++;
+    if (walk->ranges == NULL)
+    {
+        return;
+    }
+
+    uint64_t physical_address = page_address(entry, level);
+    uint64_t attributes = page_attributes(entry, level);
+    range_t *range = walk->range_count > 0 ? &walk->ranges[walk->range_count - 1] : NULL;
+    if (range != NULL &&
+        range->level == level &&
+        range->attributes == attributes &&
+        range->virtual_address + range->size == virtual_address &&
+        range->physical_address + range->size == physical_address)
+    {
+        range->size += VM_LEVEL_ENTRY_SIZE(level);
+        return;
+    }
+
+    if (walk->range_count == REPORT_RANGES_COUNT)
+    {
+        walk->pages_dropped++;
+        return;
+    }
+
+    range = &walk->ranges[walk->range_count++];
+    range->virtual_address = virtual_address;
+    range->physical_address = physical_address;
+    range->size = VM_LEVEL_ENTRY_SIZE(level);
+    range->attributes = attributes;
+    range->level = level;
+}
+
+/**
+ * Walk through a paging structure and everything below it.
+ *
+ * @param walk  The walk.
+ * @param structure  The paging structure.
+ * @param level  The level of the entries in the structure.
+ * @param virtual_address  The start of the memory covered by the structure.
+ * @param first_entry  The index of the first entry to walk through. The ones before it are skipped.
+ */
+static void walk_structure(walk_t *walk, const uint64_t *structure, int level, uint64_t virtual_address,
+                           int first_entry)
+{
+    walk->structures[level]++;
+    for (int i = first_entry; i < VM_ENTRIES_PER_PAGE; i++)
+    {
+        uint64_t entry = structure[i];
+        if ((entry & VM_ENTRY_PRESENT) == 0)
+        {
+            continue;
+        }
+
+        // The upper half of the PML4 covers the upper half of the address space, where the addresses are sign-extended.
+        uint64_t address = virtual_address + i * VM_LEVEL_ENTRY_SIZE(level);
+        if (level == VM_LEVEL_PML4 && i >= VM_ENTRIES_PER_PAGE / 2)
+        {
+            address |= 0xFFFF000000000000ULL;
+        }
+
+        if (is_page(entry, level))
+        {
+            walk_page(walk, address, entry, level);
+        }
+        else
+        {
+            walk_structure(walk, table_of(entry), level - 1, address, 0);
+        }
+    }
+}
+
+void vm_report(address_space_t *space, bool print_ranges)
+{
+    walk_t walk = { 0 };
+    uint64_t ranges_address = print_ranges ? page_allocate(REPORT_RANGES_ORDER) : 0;
+    if (ranges_address != 0)
+    {
+        walk.ranges = VM_PHYSICAL_TO_POINTER(ranges_address);
+    }
+    else if (print_ranges)
+    {
+        io_print_line("Not enough memory for collecting the mappings, only counting them.");
+    }
+
+    // The lower half of the other address spaces is the kernel's, protected by the lock of the kernel address space, so
+    // only their upper half is walked. The mappings are collected under the lock and printed once it has been released,
+    // since printing them is slow.
+    int first_entry = space == &vm_kernel_address_space ? 0 : VM_ENTRIES_PER_PAGE / 2;
+    spinlock_lock(&space->lock);
+    walk_structure(&walk, space->pml4, VM_LEVEL_PML4, 0, first_entry);
+    spinlock_unlock(&space->lock);
+
+    if (ranges_address != 0)
+    {
+        for (unsigned int i = 0; i < walk.range_count; i++)
+        {
+            print_range(&walk.ranges[i]);
+        }
+
+        if (walk.pages_dropped > 0)
+        {
+            io_print_formatted("... and %U more pages, which did not fit in the list.\n", walk.pages_dropped);
+        }
+
+        page_free(ranges_address, REPORT_RANGES_ORDER);
+    }
+
+    uint64_t structures = 0;
+    for (int level = VM_LEVEL_PT; level <= VM_LEVEL_PML4; level++)
+    {
+        structures += walk.structures[level];
+    }
+
+    io_print_formatted("Mapped: %U x 1 GiB, %U x 2 MiB and %U x 4 KiB pages.\n", walk.pages[_1gib], walk.pages[_2mib],
+                       walk.pages[_4kib]);
+    io_print_formatted("Paging structures: %U KiB (%U PML4, %U PDP:s, %U PD:s and %U PT:s).\n",
+                       structures * VM_4KIB_PAGE_SIZE / KiB, walk.structures[VM_LEVEL_PML4],
+                       walk.structures[VM_LEVEL_PDP], walk.structures[VM_LEVEL_PD], walk.structures[VM_LEVEL_PT]);
+
+    // The TLB reach is how much memory the TLB can cover without missing. For each page size, that is the memory mapped
+    // with the pages of that size, up to the number of TLB entries there are for them. Many CPU:s share some of their
+    // entries between the page sizes, so this is an upper bound.
+    uint64_t reach = 0;
+    for (int page_size = _4kib; page_size <= _1gib; page_size++)
+    {
+        uint64_t pages = walk.pages[page_size] < tlb_entries[page_size] ? walk.pages[page_size] : tlb_entries[page_size];
+        reach += pages << VM_LEVEL_SHIFT(page_size);
+    }
+
+    if (tlb_entries[_4kib] == 0)
+    {
+        io_print_line("TLB reach: unknown, the CPU does not describe its TLBs.");
+    }
+    else
+    {
+        io_print_formatted("TLB reach: %U MiB, with %U/%U/%U data TLB entries for 4 KiB/2 MiB/1 GiB pages.\n",
+                           reach / MiB, tlb_entries[_4kib], tlb_entries[_2mib], tlb_entries[_1gib]);
+    }
+}
+
+/**
+ * The vm command.
+ */
+static void vm_command(const char *arguments)
+{
+    if (*arguments == '\0')
+    {
+        vm_report(&vm_kernel_address_space, false);
+    }
+    else if (monitor_match_word(&arguments, "map"))
+    {
+        vm_report(&vm_kernel_address_space, true);
+    }
+    else
+    {
+        io_print_formatted("Unknown vm command: %s\n", arguments);
+    }
+}
+
+MONITOR_COMMAND("vm", vm_command, "[map] - show the page sizes, paging structures and TLB reach (and the mappings).");
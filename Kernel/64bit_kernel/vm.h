@@ -1,16 +1,21 @@
-/* 
+/*
  * $Id$
  *
  * vm.h - Virtual Memory prototypes and data structures.
  *
  * Author: Per Lundberg <per@halleluja.nu>
- * Copyright: (C) 2008 Per Lundberg
+ * Copyright: (C) 2008, 2017 Per Lundberg
  */
 
 #ifndef __VM_H__
 #define __VM_H__
 
-#include "stdint.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "common/memory_type.h"
+#include "spinlock.h"
+#include "tlb.h"
 
 // The size of a "small" page.
 #define VM_SMALL_PAGE_SIZE      4096
@@ -18,11 +23,200 @@
 // The size of a "large" page.
 #define VM_LARGE_PAGE_SIZE      (2 * 1024 * 1024)
 
+// The access rights of a mapping, as given to vm_map_range() and vm_protect_range(). A mapping without any of them can
+// only be read, and only by the kernel. (The pages can always be executed, since the kernel does not enable
+// EFER.NXE.)
+#define VM_WRITABLE             (1 << 0)
+#define VM_USER                 (1 << 1)
+
+// The start of the upper half of the address space, which is where the processes live (see MemoryMap.txt). The lower
+// half, holding the identity mapping of the physical memory, is shared by all the address spaces.
+#define VM_UPPER_HALF_START     0xFFFF800000000000ULL
+
+// The number of PCID:s each CPU juggles between the address spaces. PCID 0 is always used by the kernel address space;
+// the others are handed out to the address spaces the CPU switches to, recycling the least recently handed out one when
+// they are all taken.
+#define VM_PCIDS_PER_CPU        8
+
+// An address space: a PML4 of its own, with the upper half private to it and the lower half shared with the kernel.
+typedef struct address_space
+{
+    // The PML4.
+    uint64_t *pml4;
+
+    // Protects the upper half of the paging structures. The lower half is protected by the lock of the kernel address
+    // space.
+    spinlock_t lock;
+
+    // Identifies the address space to the CPU:s, which keep track of the PCID:s they have given to it by this, rather
+    // than by its address. The address of an address space can be reused, but the ID never is.
+    uint64_t id;
+
+    // Incremented every time a mapping is changed. A CPU that has given the address space a PCID can keep its TLB
+    // entries when switching back to it, as long as the generation is the same as the last time it flushed them.
+    volatile uint64_t generation;
+
+    // The CPU:s that have the address space loaded, as a bit mask indexed by CPU ID. Only these are sent an IPI when a
+    // mapping is changed; the others catch up by the generation when they switch to it.
+    volatile uint64_t cpus;
+
+    // The TLB entries to invalidate and the tables to free once the mappings being changed are done, and whether they
+    // are in the lower half. While vm_batch_begin() is in effect, they are held until vm_batch_end(). Protected by the
+    // lock.
+    tlb_batch_t batch;
+    bool batch_shared;
+    uint64_t free_tables;
+    unsigned int batch_depth;
+
+    // The next address space, in the list of all the address spaces but the kernel one.
+    struct address_space *next;
+} address_space_t;
+
+// The address space set up by the 32-bit loader, which the kernel threads run in.
+extern address_space_t vm_kernel_address_space;
+
 /**
- * Initialize the virtual memory subsystem.
+ * Initialize the virtual memory subsystem. The identity mapping set up by the 32-bit loader, which CR3 points at,
+ * becomes the kernel address space.
  *
  * @param upper_memory_limit  The upper memory limit. The highest accessible memory address is upper_memory_limit - 1.
  */
 extern void vm_init(uint64_t upper_memory_limit);
 
+/**
+ * Initialize the virtual memory subsystem on an application processor: enable the PCID:s, if the CPU supports them.
+ */
+extern void vm_init_cpu(void);
+
+/**
+ * Create an address space. The upper half is empty, and the lower half shares the paging structures of the kernel.
+ *
+ * @returns the address space, or NULL if there was not enough memory.
+ */
+extern address_space_t *vm_address_space_create(void);
+
+/**
+ * Destroy an address space, freeing the paging structures of its upper half. The memory it mapped is left alone.
+ *
+ * @param space  The address space. Must not be used by any thread, nor be loaded on any CPU.
+ */
+extern void vm_address_space_destroy(address_space_t *space);
+
+/**
+ * Switch the current CPU to an address space. With PCID:s, the TLB entries of the address space are kept from the last
+ * time the CPU ran it, as long as none of its mappings have been changed since then. Without them, the whole TLB is
+ * flushed.
+ *
+ * @param space  The address space.
+ */
+extern void vm_address_space_switch(address_space_t *space);
+
+/**
+ * Get the address space loaded on the current CPU.
+ *
+ * @returns the address space.
+ */
+extern address_space_t *vm_address_space_current(void);
+
+/**
+ * Choose whether vm_address_space_switch() uses the PCID:s or flushes the TLB every time, when the CPU supports them.
+ * This is mostly useful for benchmarking.
+ *
+ * @param enable  true to use the PCID:s, false to flush.
+ * @returns true if the CPU supports PCID:s, false otherwise.
+ */
+extern bool vm_use_pcid(bool enable);
+
+/**
+ * Map a range of virtual memory to a range of physical memory in an address space, replacing any mappings already in the
+ * range. The range is mapped using the largest pages that the alignment of the virtual and physical addresses allows;
+ * large pages that are only partly covered by the range are split, and page tables that end up mapping a contiguous,
+ * uniform range are merged into a large page. The paging structures needed are allocated on demand.
+ *
+ * The TLB entries of the pages whose mappings were changed are invalidated before returning, on all the CPU:s running
+ * the address space (see tlb.h); the other CPU:s flush their TLB entries of it the next time they switch to it. This
+ * means interrupts must be enabled. Between vm_batch_begin() and vm_batch_end(), the invalidation is deferred.
+ *
+ * @param space  The address space. Must be the kernel address space if the range is in the lower half, which is shared
+ * by all of them.
+ * @param virtual_address  The start of the virtual range. Must be page aligned.
+ * @param physical_address  The start of the physical range. Must be page aligned.
+ * @param size  The size of the range, in bytes. Must be a multiple of the page size.
+ * @param flags  The access rights, a combination of the VM_* flags above.
+ * @param memory_type  The memory type (caching policy) of the range.
+ * @returns true if the range was mapped, false if there was not enough memory for the paging structures. In that case,
+ * the range is mapped just as it was before the call, including any mappings that were already in it.
+ */
+extern bool vm_map_range(address_space_t *space, uint64_t virtual_address, uint64_t physical_address, uint64_t size,
+                         unsigned int flags, memory_type_e memory_type);
+
+/**
+ * Unmap a range of virtual memory in an address space. Parts of the range that are not mapped are skipped, and paging
+ * structures that end up empty are freed. The TLB:s are invalidated as by vm_map_range().
+ *
+ * @param space  The address space.
+ * @param virtual_address  The start of the range. Must be page aligned.
+ * @param size  The size of the range, in bytes. Must be a multiple of the page size.
+ * @returns true if the range was unmapped, false if a large page partly covered by the range had to be split and there
+ * was not enough memory to do it. In that case, the range may be partly unmapped.
+ */
+extern bool vm_unmap_range(address_space_t *space, uint64_t virtual_address, uint64_t size);
+
+/**
+ * Change the access rights of the mappings in a range of virtual memory in an address space. The physical addresses and
+ * memory types are left as they are, and parts of the range that are not mapped are skipped. The TLB:s are invalidated
+ * as by vm_map_range().
+ *
+ * @param space  The address space.
+ * @param virtual_address  The start of the range. Must be page aligned.
+ * @param size  The size of the range, in bytes. Must be a multiple of the page size.
+ * @param flags  The new access rights, a combination of the VM_* flags above.
+ * @returns true if the access rights were changed, false if a large page partly covered by the range had to be split
+ * and there was not enough memory to do it. In that case, the rights may only have been changed for a part of the range.
+ */
+extern bool vm_protect_range(address_space_t *space, uint64_t virtual_address, uint64_t size, unsigned int flags);
+
+/**
+ * Start deferring the TLB invalidations of an address space, so that a number of changes to its mappings can be made
+ * with one round of IPI:s rather than one per change. Batches can be nested; the invalidations are made when the
+ * outermost one ends.
+ *
+ * Until then, the other CPU:s running the address space may still use the old mappings, and so may the current CPU.
+ * The memory unmapped in the meantime must not be reused, and access rights that were taken away can't be relied on,
+ * until vm_batch_end() has returned.
+ *
+ * @param space  The address space.
+ */
+extern void vm_batch_begin(address_space_t *space);
+
+/**
+ * End a batch started with vm_batch_begin(). If it is the outermost one, the TLB entries of all the pages whose
+ * mappings were changed since it began are invalidated, on all the CPU:s running the address space.
+ *
+ * @param space  The address space.
+ */
+extern void vm_batch_end(address_space_t *space);
+
+/**
+ * Translate a virtual address to a physical one, by walking the paging structures of an address space.
+ *
+ * @param space  The address space.
+ * @param virtual_address  The virtual address.
+ * @param physical_address  Set to the physical address, if the virtual address is mapped.
+ * @returns true if the virtual address is mapped, false otherwise.
+ */
+extern bool vm_translate(address_space_t *space, uint64_t virtual_address, uint64_t *physical_address);
+
+/**
+ * Walk through the paging structures of an address space, and print the number of pages of each size, the memory used
+ * by the paging structures and the estimated TLB reach. Also available as the vm command in the serial monitor (see
+ * monitor.h), for the kernel address space. For the other address spaces, only the upper half is walked, since the
+ * lower half is the kernel's.
+ *
+ * @param space  The address space.
+ * @param print_ranges  true to also print the mappings. Pages that are mapped contiguously, with the same size and
+ * attributes, are printed as one range.
+ */
+extern void vm_report(address_space_t *space, bool print_ranges);
+
 #endif // !__VM_H__
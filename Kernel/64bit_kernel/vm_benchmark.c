@@ -0,0 +1,370 @@
+/*
+ * vm_benchmark.c - Benchmarks of setting up page mappings. The identity mapping of the physical memory is set up by the
+ * 32-bit loader, which can't be benchmarked in place: it runs before there is a clock to measure it with, and it only
+ * ever touches the live paging structures. The mapping code is benchmarked here instead, working on a scratch hierarchy
+ * of paging structures that is never loaded into CR3.
+ *
+ * The loader used to map one page at a time, walking the hierarchy from the PML4 and setting the fields of the entries
+ * one by one. That code is mirrored here as a baseline for the paging structure builder (see vm_builder_map() in
+ * common/vm.h) that it uses nowadays. The vm.identity benchmarks map a GiB per iteration with 2 MiB pages, the way
+ * machines without 1 GiB pages are mapped, both ways. The first batch allocates the paging structures; after that, the
+ * mappings only rewrite existing entries, which is where the bulk of the time goes when mapping a large machine.
+ *
+ * The runtime mapping functions in vm.c are benchmarked on the live paging structures, in a part of the address space
+ * that is not used for anything else. Each iteration maps a range and unmaps it again, which includes allocating and
+ * freeing the tables needed and invalidating the TLB entries.
+ *
+ * The vm.switch benchmarks switch back and forth between two address spaces, the way the scheduler does when switching
+ * between threads of different processes, with PCID:s and with a TLB flush for every switch. The vm.switch_touch ones
+ * also read a word from each of a number of pages after every switch, like a process getting back to work; subtracting
+ * the plain switch from them gives the cost of the TLB misses that follow the switch.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common/memory.h"
+#include "common/memory_type.h"
+#include "common/vm.h"
+#include "benchmark.h"
+#include "io.h"
+#include "page_allocator.h"
+#include "vm.h"
+
+// The pool the scratch paging structures are allocated from: 4 KiB << 7 = 128 pages, which is enough for a PML4, a PDP,
+// the page directories of the identity mappings and the page tables of the 4 KiB mappings.
+#define POOL_ORDER                      7
+#define POOL_PAGES                      (1 << POOL_ORDER)
+
+// The number of 4 KiB pages mapped before starting over from the first one: 16 page tables' worth, or 32 MiB.
+#define MAPPED_4KIB_PAGES               (16 * VM_ENTRIES_PER_PAGE)
+
+// The 2 MiB pages are mapped from 1 GiB and up, so that they get a page directory of their own.
+#define FIRST_2MIB_PAGE                 (VM_1GIB_PAGE_SIZE / VM_2MIB_PAGE_SIZE)
+
+// The identity mappings cover this many GiB, one at a time, before starting over from the first one.
+#define IDENTITY_GIBS                   64
+
+// Where the runtime mapping functions are benchmarked: the start of the upper half of the address space, which is
+// reserved for the processes (see MemoryMap.txt) and not used by the kernel.
+#define SCRATCH_ADDRESS                 0xFFFF800000000000ULL
+
+// The memory mapped there. It is never accessed, so it doesn't matter what it is; the kernel image will do.
+#define SCRATCH_PHYSICAL_ADDRESS        (2 * MiB)
+
+// The number of 4 KiB pages mapped and unmapped per iteration.
+#define RANGE_4KIB_PAGES                16
+
+// The pages read after each switch by the vm.switch_touch benchmarks: 4 KiB << 6 = 64 pages, mapped at SCRATCH_ADDRESS
+// in both address spaces.
+#define TOUCH_ORDER                     6
+#define TOUCH_PAGES                     (1 << TOUCH_ORDER)
+
+static uint64_t pool;
+static unsigned int pool_pages_used;
+static pml4e_t *scratch_pml4;
+
+// The next page to map.
+static uint64_t next_page;
+
+// The address spaces being switched between, and the pages mapped in them.
+static address_space_t *switch_spaces[2];
+static uint64_t touch_pages;
+
+/**
+ * Allocate a zeroed page for a scratch paging structure.
+ *
+ * @returns the page. The pool is large enough for all the structures the benchmarks need.
+ */
+static void *allocate_structure(void)
+{
+    void *structure = (void *) (pool + (uint64_t) pool_pages_used * VM_4KIB_PAGE_SIZE);
+    pool_pages_used++;
+
+    memory_zero(structure, VM_4KIB_PAGE_SIZE);
+    return structure;
+}
+
+/**
+ * Map a page in the scratch hierarchy, the same way as vm_map_physical_memory() in vm32.c used to do it. Only 4 KiB and
+ * 2 MiB pages are supported.
+ *
+ * @param virtual_page  The number of the page that should be mapped (in the virtual address space).
+ * @param physical_page  The number of the page that should be mapped (in the physical address space)
+ * @param page_size  The size of the page that should be mapped.
+ * @param memory_type  The memory type (caching policy) of the page.
+ */
+static void scratch_map(uint64_t virtual_page, uint64_t physical_page, page_size_e page_size, memory_type_e memory_type)
+{
+    unsigned int pat_index = memory_type_pat_index(memory_type);
+    bool pwt = (pat_index & PAT_INDEX_PWT) != 0;
+    bool pcd = (pat_index & PAT_INDEX_PCD) != 0;
+    bool pat = (pat_index & PAT_INDEX_PAT) != 0;
+
+    if (page_size == _2mib)
+    {
+        virtual_page = virtual_page * (VM_2MIB_PAGE_SIZE / VM_4KIB_PAGE_SIZE);
+        physical_page = physical_page * (VM_2MIB_PAGE_SIZE / VM_4KIB_PAGE_SIZE);
+    }
+
+    int pml4_index = (virtual_page >> VM_PML4_INDEX_LOW_BIT) & VM_INDEX_MASK;
+    int pdp_index = (virtual_page >> VM_PDP_INDEX_LOW_BIT) & VM_INDEX_MASK;
+    int pd_index = (virtual_page >> VM_PD_INDEX_LOW_BIT) & VM_INDEX_MASK;
+    int pt_index = (virtual_page >> VM_PT_INDEX_LOW_BIT) & VM_INDEX_MASK;
+
+    if (!scratch_pml4[pml4_index].present)
+    {
+        scratch_pml4[pml4_index].pdp_base_address = (uint64_t) allocate_structure() / VM_4KIB_PAGE_SIZE;
+        scratch_pml4[pml4_index].writable = 1;
+        scratch_pml4[pml4_index].present = 1;
+    }
+
+    pdpe_t *pdp = (pdpe_t *) ((uint64_t) scratch_pml4[pml4_index].pdp_base_address * VM_4KIB_PAGE_SIZE);
+
+    if (!pdp[pdp_index].present)
+    {
+        pdp[pdp_index].pd_base_address = (uint64_t) allocate_structure() / VM_4KIB_PAGE_SIZE;
+        pdp[pdp_index].writable = 1;
+        pdp[pdp_index].present = 1;
+    }
+
+    pde_t *pd = (pde_t *) ((uint64_t) pdp[pdp_index].pd_base_address * VM_4KIB_PAGE_SIZE);
+
+    if (page_size == _4kib)
+    {
+        if (!pd[pd_index].present)
+        {
+            pd[pd_index].base_address = (uint64_t) allocate_structure() / VM_4KIB_PAGE_SIZE;
+            pd[pd_index].writable = 1;
+            pd[pd_index].present = 1;
+        }
+
+        pte_t *pt = (pte_t *) ((uint64_t) pd[pd_index].base_address * VM_4KIB_PAGE_SIZE);
+        pt[pt_index].present = 1;
+        pt[pt_index].writable = 1;
+        pt[pt_index].pwt = pwt;
+        pt[pt_index].pcd = pcd;
+        pt[pt_index].page_attribute_table = pat;
+        pt[pt_index].global = 1;
+        pt[pt_index].page_base_address = physical_page;
+    }
+    else
+    {
+        pd[pd_index].present = 1;
+        pd[pd_index].writable = 1;
+        pd[pd_index].pwt = pwt;
+        pd[pd_index].pcd = pcd;
+        pd[pd_index].global = 1;
+        pd[pd_index].page_size = 1;
+        pd[pd_index].base_address = physical_page | pat;
+    }
+}
+
+static bool setup(void)
+{
+    pool = page_allocate(POOL_ORDER);
+    if (pool == 0)
+    {
+        io_print_line("VM benchmark: could not allocate the scratch paging structures, skipping.");
+        return false;
+    }
+
+    pool_pages_used = 0;
+    scratch_pml4 = allocate_structure();
+    next_page = 0;
+    return true;
+}
+
+static void teardown(void)
+{
+    page_free(pool, POOL_ORDER);
+}
+
+static void map_4kib(uint64_t iterations)
+{
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        scratch_map(next_page, next_page, _4kib, memory_type_write_back);
+        next_page = next_page + 1 == MAPPED_4KIB_PAGES ? 0 : next_page + 1;
+    }
+}
+
+static void map_2mib(uint64_t iterations)
+{
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        scratch_map(FIRST_2MIB_PAGE + next_page, next_page, _2mib, memory_type_write_back);
+        next_page = next_page + 1 == VM_ENTRIES_PER_PAGE ? 0 : next_page + 1;
+    }
+}
+
+static void identity_per_page(uint64_t iterations)
+{
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        uint64_t first_page = next_page * VM_ENTRIES_PER_PAGE;
+        for (uint64_t page = first_page; page < first_page + VM_ENTRIES_PER_PAGE; page++)
+        {
+            scratch_map(page, page, _2mib, memory_type_write_back);
+        }
+
+        next_page = next_page + 1 == IDENTITY_GIBS ? 0 : next_page + 1;
+    }
+}
+
+static void identity_bulk(uint64_t iterations)
+{
+    vm_builder_t builder =
+    {
+        .pml4 = (uint64_t *) scratch_pml4,
+        .allocate_structure = allocate_structure
+    };
+
+    uint64_t attributes = VM_ENTRY_PRESENT | VM_ENTRY_WRITABLE | VM_ENTRY_GLOBAL |
+                          vm_memory_type_bits(memory_type_write_back);
+
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        uint64_t address = next_page * VM_1GIB_PAGE_SIZE;
+        vm_builder_map(&builder, address, address, VM_1GIB_PAGE_SIZE, attributes);
+        next_page = next_page + 1 == IDENTITY_GIBS ? 0 : next_page + 1;
+    }
+}
+
+static void map_range_4kib(uint64_t iterations)
+{
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        vm_map_range(&vm_kernel_address_space, SCRATCH_ADDRESS, SCRATCH_PHYSICAL_ADDRESS,
+                     RANGE_4KIB_PAGES * VM_4KIB_PAGE_SIZE, VM_WRITABLE, memory_type_write_back);
+        vm_unmap_range(&vm_kernel_address_space, SCRATCH_ADDRESS, RANGE_4KIB_PAGES * VM_4KIB_PAGE_SIZE);
+    }
+}
+
+static void map_range_2mib(uint64_t iterations)
+{
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        vm_map_range(&vm_kernel_address_space, SCRATCH_ADDRESS, SCRATCH_PHYSICAL_ADDRESS, VM_2MIB_PAGE_SIZE, VM_WRITABLE,
+                     memory_type_write_back);
+        vm_unmap_range(&vm_kernel_address_space, SCRATCH_ADDRESS, VM_2MIB_PAGE_SIZE);
+    }
+}
+
+static void switch_teardown(void)
+{
+    vm_address_space_switch(&vm_kernel_address_space);
+    vm_use_pcid(true);
+
+    for (int i = 0; i < 2; i++)
+    {
+        if (switch_spaces[i] != NULL)
+        {
+            vm_address_space_destroy(switch_spaces[i]);
+            switch_spaces[i] = NULL;
+        }
+    }
+
+    if (touch_pages != 0)
+    {
+        page_free(touch_pages, TOUCH_ORDER);
+        touch_pages = 0;
+    }
+}
+
+/**
+ * Set up the address spaces for the vm.switch benchmarks.
+ *
+ * @param use_pcid  true to switch between them using PCID:s, false to flush the TLB on every switch.
+ * @returns true on success, false if the benchmark should be skipped.
+ */
+static bool switch_setup(bool use_pcid)
+{
+    if (!vm_use_pcid(use_pcid) && use_pcid)
+    {
+        io_print_line("VM benchmark: the CPU does not support PCID:s, skipping.");
+        return false;
+    }
+
+    touch_pages = page_allocate(TOUCH_ORDER);
+    for (int i = 0; i < 2; i++)
+    {
+        switch_spaces[i] = vm_address_space_create();
+        if (touch_pages == 0 || switch_spaces[i] == NULL ||
+            !vm_map_range(switch_spaces[i], SCRATCH_ADDRESS, touch_pages, TOUCH_PAGES * VM_4KIB_PAGE_SIZE, VM_WRITABLE,
+                          memory_type_write_back))
+        {
+            io_print_line("VM benchmark: could not set up the address spaces, skipping.");
+            switch_teardown();
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool switch_setup_flush(void)
+{
+    return switch_setup(false);
+}
+
+static bool switch_setup_pcid(void)
+{
+    return switch_setup(true);
+}
+
+static void switch_address_spaces(uint64_t iterations)
+{
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        vm_address_space_switch(switch_spaces[i & 1]);
+    }
+}
+
+static void switch_and_touch(uint64_t iterations)
+{
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        vm_address_space_switch(switch_spaces[i & 1]);
+
+        for (uint64_t page = 0; page < TOUCH_PAGES; page++)
+        {
+            BENCHMARK_USE(*(volatile uint64_t *) (SCRATCH_ADDRESS + page * VM_4KIB_PAGE_SIZE));
+        }
+    }
+}
+
+static void switch_flush(uint64_t iterations)
+{
+    switch_address_spaces(iterations);
+}
+
+static void switch_pcid(uint64_t iterations)
+{
+    switch_address_spaces(iterations);
+}
+
+static void switch_touch_flush(uint64_t iterations)
+{
+    switch_and_touch(iterations);
+}
+
+static void switch_touch_pcid(uint64_t iterations)
+{
+    switch_and_touch(iterations);
+}
+
+BENCHMARK("vm.map_4kib", map_4kib, setup, teardown);
+BENCHMARK("vm.map_2mib", map_2mib, setup, teardown);
+BENCHMARK("vm.identity_per_page", identity_per_page, setup, teardown);
+BENCHMARK("vm.identity_bulk", identity_bulk, setup, teardown);
+BENCHMARK("vm.map_range_4kib", map_range_4kib, NULL, NULL);
+BENCHMARK("vm.map_range_2mib", map_range_2mib, NULL, NULL);
+BENCHMARK("vm.switch_flush", switch_flush, switch_setup_flush, switch_teardown);
+BENCHMARK("vm.switch_pcid", switch_pcid, switch_setup_pcid, switch_teardown);
+BENCHMARK("vm.switch_touch_flush", switch_touch_flush, switch_setup_flush, switch_teardown);
+BENCHMARK("vm.switch_touch_pcid", switch_touch_pcid, switch_setup_pcid, switch_teardown);
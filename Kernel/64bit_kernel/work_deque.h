@@ -0,0 +1,139 @@
+/*
+ * work_deque.h - A work-stealing deque, as described by Chase and Lev in "Dynamic Circular Work-Stealing Deque" (SPAA
+ * 2005). The memory ordering follows Lê, Pop, Cohen and Zappa Nardelli, "Correct and Efficient Work-Stealing for Weak
+ * Memory Models" (PPoPP 2013).
+ *
+ * The deque is owned by one CPU, which pushes and takes items at the bottom end without taking any lock. Other CPU:s may
+ * steal items from the top end at the same time; the only atomic read-modify-write operation is the compare-and-swap
+ * used when two CPU:s go for the same (last) item.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#ifndef __WORK_DEQUE_H__
+#define __WORK_DEQUE_H__ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cpu.h"
+
+// A work-stealing deque. The array is not grown when it becomes full; it must be large enough to hold all the items that
+// can ever be in the deque at the same time. The top and bottom indices are kept in separate cache lines, since the top is
+// written by the thieves and the bottom by the owner.
+typedef struct
+{
+    volatile int64_t top __attribute__((aligned(CPU_CACHE_LINE_SIZE)));
+    volatile int64_t bottom __attribute__((aligned(CPU_CACHE_LINE_SIZE)));
+
+    // The items, and the number of them (which must be a power of two) minus one.
+    void **items;
+    uint64_t mask;
+} work_deque_t;
+
+/**
+ * Initialize a deque.
+ *
+ * @param deque  The deque to initialize.
+ * @param items  The array holding the items.
+ * @param capacity  The number of items in the array. Must be a power of two.
+ */
+static inline void work_deque_init(work_deque_t *deque, void **items, uint64_t capacity)
+{
+    deque->top = 0;
+    deque->bottom = 0;
+    deque->items = items;
+    deque->mask = capacity - 1;
+}
+
+/**
+ * Push an item at the bottom of the deque. May only be called by the owner.
+ *
+ * @param deque  The deque.
+ * @param item  The item. Must not be NULL.
+ * @returns true if the item was pushed, false if the deque is full.
+ */
+static inline bool work_deque_push(work_deque_t *deque, void *item)
+{
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    if ((uint64_t) (bottom - top) > deque->mask)
+    {
+        return false;
+    }
+
+    __atomic_store_n(&deque->items[bottom & deque->mask], item, __ATOMIC_RELAXED);
+
+    // The item must be visible before the new bottom is, or a thief could steal garbage.
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+/**
+ * Take the item at the bottom of the deque, i.e. the one pushed most recently. May only be called by the owner.
+ *
+ * @param deque  The deque.
+ * @returns the item, or NULL if the deque is empty.
+ */
+static inline void *work_deque_take(work_deque_t *deque)
+{
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+
+    // The new bottom must be visible to the thieves before we look at the top. This is the one place where a full fence
+    // is needed; without it, we and a thief could both take the last item.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+    if (top > bottom)
+    {
+        // The deque was empty.
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    void *item = __atomic_load_n(&deque->items[bottom & deque->mask], __ATOMIC_RELAXED);
+    if (top == bottom)
+    {
+        // This is the last item, so we might be racing with a thief for it. Whoever manages to bump the top wins.
+        if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        {
+            item = NULL;
+        }
+
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+
+    return item;
+}
+
+/**
+ * Steal the item at the top of the deque, i.e. the oldest one. May be called by any CPU.
+ *
+ * @param deque  The deque.
+ * @returns the item, or NULL if the deque is empty or we lost a race with another CPU for the item.
+ */
+static inline void *work_deque_steal(work_deque_t *deque)
+{
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+
+    if (top >= bottom)
+    {
+        return NULL;
+    }
+
+    void *item = __atomic_load_n(&deque->items[top & deque->mask], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+    {
+        return NULL;
+    }
+
+    return item;
+}
+
+#endif // !__WORK_DEQUE_H__
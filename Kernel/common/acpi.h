@@ -0,0 +1,152 @@
+/*
+ * acpi.h - ACPI table definitions, shared by the 32-bit loader (which finds the RSDP) and the 64-bit kernel (which parses
+ * the tables). Only the tables and fields that we actually use are defined here; see the ACPI specification for the rest.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#ifndef __COMMON_ACPI_H__
+#define __COMMON_ACPI_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//// Defines.
+// The signature of the Root System Description Pointer. Note that it is not NUL-terminated in memory.
+#define ACPI_RSDP_SIGNATURE             "RSD PTR "
+#define ACPI_RSDP_SIGNATURE_LENGTH      8
+
+// The signature of the Multiple APIC Description Table.
+#define ACPI_MADT_SIGNATURE             "APIC"
+
+// The types of the MADT entries we care about.
+#define ACPI_MADT_TYPE_LOCAL_APIC       0
+#define ACPI_MADT_TYPE_IO_APIC          1
+#define ACPI_MADT_TYPE_INTERRUPT_OVERRIDE 2
+#define ACPI_MADT_TYPE_LOCAL_APIC_OVERRIDE 5
+#define ACPI_MADT_TYPE_LOCAL_X2APIC     9
+
+// Set in the flags of a local APIC entry if the processor is usable. If not set, the processor is either disabled or (if
+// the "online capable" flag is set) can be hot-plugged later on.
+#define ACPI_MADT_LOCAL_APIC_ENABLED    (1 << 0)
+
+// The flags of an interrupt source override entry (and a few other entries): the polarity and trigger mode of the
+// interrupt. "Conforming" means the default of the bus, which for ISA is active high, edge triggered.
+#define ACPI_MADT_POLARITY_MASK         0x3
+#define ACPI_MADT_POLARITY_ACTIVE_LOW   0x3
+#define ACPI_MADT_TRIGGER_MASK          0xC
+#define ACPI_MADT_TRIGGER_LEVEL         0xC
+
+//// Type definitions and structures
+// The Root System Description Pointer. The fields from length and onwards are only present in ACPI 2.0 and later
+// (revision >= 2).
+typedef struct
+{
+    char signature[ACPI_RSDP_SIGNATURE_LENGTH];
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_address;
+
+    uint32_t length;
+    uint64_t xsdt_address;
+    uint8_t extended_checksum;
+    uint8_t reserved[3];
+} __attribute__((packed)) acpi_rsdp_t;
+
+// The size of the ACPI 1.0 part of the RSDP, which is covered by the (non-extended) checksum.
+#define ACPI_RSDP_V1_SIZE               20
+
+// The header common to all the system description tables.
+typedef struct
+{
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed)) acpi_table_header_t;
+
+// The Multiple APIC Description Table. The header is followed by a variable number of entries of varying size, all of
+// them starting with a type and a length.
+typedef struct
+{
+    acpi_table_header_t header;
+    uint32_t local_apic_address;
+    uint32_t flags;
+} __attribute__((packed)) acpi_madt_t;
+
+typedef struct
+{
+    uint8_t type;
+    uint8_t length;
+} __attribute__((packed)) acpi_madt_entry_t;
+
+typedef struct
+{
+    acpi_madt_entry_t entry;
+    uint8_t processor_id;
+    uint8_t apic_id;
+    uint32_t flags;
+} __attribute__((packed)) acpi_madt_local_apic_t;
+
+typedef struct
+{
+    acpi_madt_entry_t entry;
+    uint8_t io_apic_id;
+    uint8_t reserved;
+    uint32_t io_apic_address;
+    uint32_t global_system_interrupt_base;
+} __attribute__((packed)) acpi_madt_io_apic_t;
+
+// Tells us that an ISA IRQ is not connected to the I/O APIC input with the same number, or that it does not use the
+// default ISA polarity and trigger mode.
+typedef struct
+{
+    acpi_madt_entry_t entry;
+    uint8_t bus;
+    uint8_t source;
+    uint32_t global_system_interrupt;
+    uint16_t flags;
+} __attribute__((packed)) acpi_madt_interrupt_override_t;
+
+typedef struct
+{
+    acpi_madt_entry_t entry;
+    uint16_t reserved;
+    uint64_t local_apic_address;
+} __attribute__((packed)) acpi_madt_local_apic_override_t;
+
+typedef struct
+{
+    acpi_madt_entry_t entry;
+    uint16_t reserved;
+    uint32_t x2apic_id;
+    uint32_t flags;
+    uint32_t processor_uid;
+} __attribute__((packed)) acpi_madt_local_x2apic_t;
+
+/**
+ * Validate the checksum of an ACPI structure: all the bytes, including the checksum field, should add up to zero.
+ *
+ * @param data  The structure to validate.
+ * @param length  The length of the structure, in bytes.
+ * @returns true if the checksum is valid, false otherwise.
+ */
+static inline bool acpi_checksum_valid(const void *data, uint32_t length)
+{
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < length; i++)
+    {
+        sum += ((const uint8_t *) data)[i];
+    }
+
+    return sum == 0;
+}
+
+#endif // !__COMMON_ACPI_H__
@@ -0,0 +1,128 @@
+/*
+ * boot_info.h - The information the 32-bit loader passes on to the 64-bit kernel. Everything the kernel needs to know about
+ * the machine and the boot environment is copied into this structure, so that the kernel never has to go looking for
+ * anything at hardwired addresses.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#ifndef __COMMON_BOOT_INFO_H__
+#define __COMMON_BOOT_INFO_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "common/memory_map.h"
+#include "common/misc.h"
+
+//// Defines.
+// The zone reserved for the 64-bit kernel image, including its BSS. The kernel is copied to the start of the zone by the
+// 32-bit loader, and checks at startup that its BSS does not extend beyond the end of it.
+#define KERNEL_IMAGE_ZONE_START         (2 * MiB)
+#define KERNEL_IMAGE_ZONE_END           (4 * MiB)
+
+// The maximum length of the kernel command line, including the terminating NUL character. Longer command lines are
+// truncated.
+#define BOOT_INFO_COMMAND_LINE_SIZE     256
+
+// The maximum number of reserved ranges.
+#define BOOT_INFO_MAX_RESERVED_RANGES   16
+
+//// Type definitions and structures
+// The phases of the boot, in order. The time-stamp counter is recorded at the end of each phase: by the 32-bit loader
+// for its own phases (in the boot information), and by the kernel for the rest. See boot_timing.h in the kernel.
+typedef enum
+{
+    // Everything before the 32-bit loader was entered: the firmware and the boot loader.
+    boot_phase_firmware,
+
+    // Copying the 64-bit kernel into place.
+    boot_phase_loader_kernel_copy,
+
+    // Converting the memory map from the boot loader.
+    boot_phase_loader_memory_map,
+
+    // Filling in the rest of the boot information, like the command line and the ACPI RSDP address.
+    boot_phase_loader_boot_info,
+
+    // Setting up the paging structures of the identity mapping (vm_setup_paging_structures()).
+    boot_phase_loader_paging,
+
+    // Entering long mode, up until the first instruction of the kernel. Recorded by the kernel.
+    boot_phase_loader_long_mode,
+
+    // Clearing the BSS, setting up the console and calibrating the clock.
+    boot_phase_kernel_early,
+
+    // Setting up the page allocator.
+    boot_phase_kernel_memory,
+
+    // Setting up the GDT, the interrupts, the heap, the scheduler and the log.
+    boot_phase_kernel_interrupts,
+
+    // Setting up the local APIC and starting the application processors.
+    boot_phase_kernel_cpus,
+
+    // Setting up the I/O APIC and the device interrupts.
+    boot_phase_kernel_devices,
+
+    // Setting up the kernel's own virtual memory.
+    boot_phase_kernel_vm,
+
+    boot_phase_count
+} boot_phase_e;
+
+// A range of physical memory. Just like for the memory map, the layout is identical in 32-bit and 64-bit code.
+typedef struct
+{
+    uint64_t start;
+    uint64_t end;
+} boot_info_range_t;
+
+typedef struct
+{
+    // The physical memory map, as reported by the boot loader.
+    memory_map_t memory_map;
+
+    // Ranges of RAM that are in use and must not be handed out by any memory allocator: the 32-bit loader, the kernel image
+    // and the paging structures. Note that these can overlap each other.
+    uint32_t reserved_range_count;
+    uint32_t reserved;
+    boot_info_range_t reserved_ranges[BOOT_INFO_MAX_RESERVED_RANGES];
+
+    // The physical address of the PML4 being used for the identity mapping.
+    uint64_t pml4_address;
+
+    // The physical address of the ACPI Root System Description Pointer, or 0 if it could not be found.
+    uint64_t acpi_rsdp_address;
+
+    // The kernel command line, as given to the boot loader.
+    char command_line[BOOT_INFO_COMMAND_LINE_SIZE];
+
+    // The time-stamp counter at the end of each of the phases of the 32-bit loader. The rest are left at zero.
+    uint64_t phase_end_tsc[boot_phase_count];
+} boot_info_t;
+
+/**
+ * Add a reserved range to the boot information.
+ *
+ * @param boot_info  The boot information to add the range to.
+ * @param start  The start of the range.
+ * @param end  The end of the range (exclusive).
+ * @returns true if the range could be added, false if there is no room left for it.
+ */
+static inline bool boot_info_add_reserved_range(boot_info_t *boot_info, uint64_t start, uint64_t end)
+{
+    if (boot_info->reserved_range_count == BOOT_INFO_MAX_RESERVED_RANGES)
+    {
+        return false;
+    }
+
+    boot_info->reserved_ranges[boot_info->reserved_range_count].start = start;
+    boot_info->reserved_ranges[boot_info->reserved_range_count].end = end;
+    boot_info->reserved_range_count++;
+    return true;
+}
+
+#endif // !__COMMON_BOOT_INFO_H__
@@ -0,0 +1,174 @@
+/*
+ * console.c - The VGA text mode console, shared by the 32-bit loader and the 64-bit kernel.
+ *
+ * Everything is printed to a shadow copy of the screen in regular RAM, and copied to the video memory in one go when the
+ * console is flushed. Video memory is slow to access on real hardware (it is uncached, and sits behind the PCI bus), and
+ * even slower when running under emulation, where every access traps to the hypervisor. Only the rows that have actually
+ * changed are copied, eight bytes at a time; the hardware cursor (four port writes, i.e. four more traps) is only moved
+ * if it has moved since the last flush.
+ *
+ * The code here must not use memory_copy() or memory_zero(), since the 64-bit kernel uses SSE variants of those which
+ * must not be called from interrupt handlers -- and an interrupt handler printing a panic message is exactly the case
+ * where we most want the console to work.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2008, 2013, 2017 Per Lundberg
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "common/console.h"
+#include "common/port.h"
+
+// The video memory base address (for text mode).
+#define VIDEO_MEMORY_BASE               0xB8000
+
+// The CRT controller registers holding the cursor location.
+#define CRTC_INDEX_PORT                 0x3D4
+#define CRTC_DATA_PORT                  0x3D5
+#define CRTC_CURSOR_LOCATION_HIGH       0x0E
+#define CRTC_CURSOR_LOCATION_LOW        0x0F
+
+// The number of 64-bit words in a row. Each character takes up two bytes: the character itself and its attribute.
+#define ROW_WORDS                       (CONSOLE_COLUMNS * sizeof(uint16_t) / sizeof(uint64_t))
+
+// A blank character, four times over.
+#define BLANK_WORD                      (0x0001000100010001ULL * (' ' | (CONSOLE_DEFAULT_ATTRIBUTE << 8)))
+
+// A row on the screen, accessible either one character at a time or a word at a time.
+typedef union
+{
+    uint16_t characters[CONSOLE_COLUMNS];
+    uint64_t words[ROW_WORDS];
+} console_row_t;
+
+static volatile console_row_t *const video_memory = (volatile console_row_t *) VIDEO_MEMORY_BASE;
+
+static console_row_t shadow[CONSOLE_ROWS];
+
+// One bit for each row that has changed since the last flush.
+static uint32_t dirty_rows;
+
+static int cursor_row;
+static int cursor_column;
+
+// The position of the hardware cursor, as of the last flush. -1 if unknown.
+static int hardware_cursor_position = -1;
+
+_Static_assert(CONSOLE_ROWS <= sizeof(dirty_rows) * 8, "Too many rows for the dirty row mask");
+
+/**
+ * Scroll the screen up by one row.
+ */
+static void console_scroll(void)
+{
+    for (int row = 0; row < CONSOLE_ROWS - 1; row++)
+    {
+        for (int word = 0; word < ROW_WORDS; word++)
+        {
+            shadow[row].words[word] = shadow[row + 1].words[word];
+        }
+    }
+
+    for (int word = 0; word < ROW_WORDS; word++)
+    {
+        shadow[CONSOLE_ROWS - 1].words[word] = BLANK_WORD;
+    }
+
+    dirty_rows = (1U << CONSOLE_ROWS) - 1;
+}
+
+/**
+ * Move the cursor to the beginning of the next row, scrolling the screen if needed.
+ */
+static void console_newline(void)
+{
+    cursor_column = 0;
+    cursor_row++;
+
+    if (cursor_row == CONSOLE_ROWS)
+    {
+        console_scroll();
+        cursor_row = CONSOLE_ROWS - 1;
+    }
+}
+
+void console_init(int row, bool clear)
+{
+    for (int i = 0; i < CONSOLE_ROWS; i++)
+    {
+        for (int word = 0; word < ROW_WORDS; word++)
+        {
+            shadow[i].words[word] = clear ? BLANK_WORD : video_memory[i].words[word];
+        }
+    }
+
+    dirty_rows = clear ? (1U << CONSOLE_ROWS) - 1 : 0;
+    hardware_cursor_position = -1;
+    console_move_cursor(row, 0);
+    console_flush();
+}
+
+void console_put_character(char c, uint8_t attribute)
+{
+    if (c == '\n')
+    {
+        console_newline();
+        return;
+    }
+
+    console_set_character(c, attribute);
+    cursor_column++;
+
+    if (cursor_column == CONSOLE_COLUMNS)
+    {
+        console_newline();
+    }
+}
+
+void console_set_character(char c, uint8_t attribute)
+{
+    shadow[cursor_row].characters[cursor_column] = (uint8_t) c | (attribute << 8);
+    dirty_rows |= 1U << cursor_row;
+}
+
+void console_move_cursor(int row, int column)
+{
+    cursor_row = row < 0 ? 0 : (row >= CONSOLE_ROWS ? CONSOLE_ROWS - 1 : row);
+    cursor_column = column < 0 ? 0 : (column >= CONSOLE_COLUMNS ? CONSOLE_COLUMNS - 1 : column);
+}
+
+void console_get_cursor(int *row, int *column)
+{
+    *row = cursor_row;
+    *column = cursor_column;
+}
+
+void console_flush(void)
+{
+    for (int row = 0; dirty_rows != 0; row++)
+    {
+        if ((dirty_rows & (1U << row)) == 0)
+        {
+            continue;
+        }
+
+        for (int word = 0; word < ROW_WORDS; word++)
+        {
+            video_memory[row].words[word] = shadow[row].words[word];
+        }
+
+        dirty_rows &= ~(1U << row);
+    }
+
+    int position = cursor_row * CONSOLE_COLUMNS + cursor_column;
+    if (position != hardware_cursor_position)
+    {
+        outb(CRTC_INDEX_PORT, CRTC_CURSOR_LOCATION_LOW);
+        outb(CRTC_DATA_PORT, position & 0xFF);
+        outb(CRTC_INDEX_PORT, CRTC_CURSOR_LOCATION_HIGH);
+        outb(CRTC_DATA_PORT, (position >> 8) & 0xFF);
+        hardware_cursor_position = position;
+    }
+}
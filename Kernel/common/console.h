@@ -0,0 +1,71 @@
+/*
+ * console.h - The VGA text mode console, shared by the 32-bit loader and the 64-bit kernel.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2008, 2013, 2017 Per Lundberg
+ */
+
+#ifndef __COMMON_CONSOLE_H__
+#define __COMMON_CONSOLE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//// Defines.
+// The size of the screen, in characters.
+#define CONSOLE_COLUMNS                 80
+#define CONSOLE_ROWS                    25
+
+// The default attribute of a character printed by the kernel: light grey on black.
+#define CONSOLE_DEFAULT_ATTRIBUTE       0x07
+
+//// Function prototypes
+/**
+ * Initialize the console.
+ *
+ * @param row  The row to put the cursor on.
+ * @param clear  If true, the screen is cleared. Otherwise, whatever is already on the screen is kept.
+ */
+extern void console_init(int row, bool clear);
+
+/**
+ * Print a character at the cursor position, and move the cursor forward. A newline moves the cursor to the beginning of
+ * the next row. The screen is scrolled when the cursor moves past the last row. Nothing is visible until the next call to
+ * console_flush().
+ *
+ * @param c  The character.
+ * @param attribute  The attribute (colors) of the character.
+ */
+extern void console_put_character(char c, uint8_t attribute);
+
+/**
+ * Set the character at the cursor position, without moving the cursor. Nothing is visible until the next call to
+ * console_flush().
+ *
+ * @param c  The character.
+ * @param attribute  The attribute (colors) of the character.
+ */
+extern void console_set_character(char c, uint8_t attribute);
+
+/**
+ * Move the cursor. Positions outside of the screen are clamped to its edges.
+ *
+ * @param row  The row to move the cursor to.
+ * @param column  The column to move the cursor to.
+ */
+extern void console_move_cursor(int row, int column);
+
+/**
+ * Get the cursor position.
+ *
+ * @param row  The current row [out]
+ * @param column  The current column [out]
+ */
+extern void console_get_cursor(int *row, int *column);
+
+/**
+ * Copy the rows that have changed since the last flush to the video memory, and move the hardware cursor if needed.
+ */
+extern void console_flush(void);
+
+#endif // !__COMMON_CONSOLE_H__
@@ -0,0 +1,263 @@
+/*
+ * cpu.h - CPU feature detection and register access, shared by the 32-bit loader and the 64-bit kernel.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#ifndef __COMMON_CPU_H__
+#define __COMMON_CPU_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//// Defines.
+// CPUID leaves that we care about.
+#define CPUID_LEAF_BASIC                0x00000000
+#define CPUID_LEAF_FEATURES             0x00000001
+#define CPUID_LEAF_EXTENDED_FEATURES    0x00000007
+#define CPUID_LEAF_PERFORMANCE_MONITORING 0x0000000A
+#define CPUID_LEAF_ADDRESS_TRANSLATION  0x00000018
+#define CPUID_LEAF_EXTENDED_BASIC       0x80000000
+#define CPUID_LEAF_EXTENDED_INFO        0x80000001
+#define CPUID_LEAF_L1_CACHE_TLB         0x80000005
+#define CPUID_LEAF_L2_CACHE_TLB         0x80000006
+#define CPUID_LEAF_POWER_MANAGEMENT     0x80000007
+#define CPUID_LEAF_1GIB_TLB             0x80000019
+
+// Feature bits, named after the leaf and register they are reported in.
+#define CPUID_FEATURES_EDX_TSC          (1 << 4)
+#define CPUID_FEATURES_EDX_PAT          (1 << 16)
+#define CPUID_FEATURES_EDX_SSE2         (1 << 26)
+#define CPUID_FEATURES_ECX_PCID         (1 << 17)
+#define CPUID_EXTENDED_FEATURES_EBX_ERMS (1 << 9)
+#define CPUID_EXTENDED_INFO_EDX_PAGE_1GB (1 << 26)
+#define CPUID_EXTENDED_INFO_EDX_RDTSCP  (1 << 27)
+#define CPUID_POWER_MANAGEMENT_EDX_INVARIANT_TSC (1 << 8)
+
+// Control register bits.
+#define CR0_MP                          (1 << 1)
+#define CR0_EM                          (1 << 2)
+#define CR4_OSFXSR                      (1 << 9)
+#define CR4_OSXMMEXCPT                  (1 << 10)
+#define CR4_PCIDE                       (1 << 17)
+
+// With CR4.PCIDE set, the low 12 bits of CR3 hold the PCID (process-context identifier) that the TLB entries created
+// from then on are tagged with. Setting bit 63 when writing CR3 keeps the TLB entries of the new PCID, instead of
+// flushing them; the bit is never set when reading CR3.
+#define CR3_NO_FLUSH                    (1ULL << 63)
+
+// RFLAGS bits.
+#define RFLAGS_IF                       (1 << 9)
+
+//// Type definitions and structures
+// The registers returned by the CPUID instruction.
+typedef struct
+{
+    uint32_t eax;
+    uint32_t ebx;
+    uint32_t ecx;
+    uint32_t edx;
+} cpuid_registers_t;
+
+#ifdef HOSTED
+// The hosted build (see the hosted folder) runs parts of the kernel as a Linux program. The CPU features are simulated
+// there, so that the code can be exercised with any combination of them, and the privileged instructions are replaced by
+// functions that keep track of what the code tried to do.
+extern void hosted_cpuid(uint32_t leaf, uint32_t subleaf, cpuid_registers_t *registers);
+extern uint64_t hosted_read_msr(uint32_t msr);
+extern void hosted_write_msr(uint32_t msr, uint64_t value);
+#endif
+
+/**
+ * Execute the CPUID instruction.
+ *
+ * @param leaf  The leaf (EAX input value) to query.
+ * @param subleaf  The subleaf (ECX input value) to query. Ignored by most leaves.
+ * @param registers  The registers returned by the CPU [out]
+ */
+static inline void cpu_cpuid(uint32_t leaf, uint32_t subleaf, cpuid_registers_t *registers)
+{
+#ifdef HOSTED
+    hosted_cpuid(leaf, subleaf, registers);
+#else
+    asm volatile("cpuid"
+                 : "=a"(registers->eax), "=b"(registers->ebx), "=c"(registers->ecx), "=d"(registers->edx)
+                 : "a"(leaf), "c"(subleaf));
+#endif
+}
+
+/**
+ * Check if a given CPUID leaf is supported by this CPU. The basic and extended leaves each have their own maximum value,
+ * reported by the first leaf in each range.
+ *
+ * @param leaf  The leaf to check for.
+ * @returns true if the leaf can be queried, false otherwise.
+ */
+static inline bool cpu_has_cpuid_leaf(uint32_t leaf)
+{
+    cpuid_registers_t registers;
+    cpu_cpuid(leaf & CPUID_LEAF_EXTENDED_BASIC, 0, &registers);
+    return registers.eax >= leaf;
+}
+
+/**
+ * Read the time-stamp counter. Note that this instruction is not serializing; the CPU is free to execute it before
+ * preceding instructions have completed. Always inlined, since it is the first thing done in the main() of the kernel,
+ * and an out-of-line copy would end up in front of it.
+ *
+ * @returns the number of cycles since the CPU was reset.
+ */
+static inline __attribute__((always_inline)) uint64_t cpu_read_tsc(void)
+{
+    uint32_t low, high;
+    asm volatile("rdtsc"
+                 : "=a"(low), "=d"(high));
+    return ((uint64_t) high << 32) | low;
+}
+
+/**
+ * Read the time-stamp counter once all preceding instructions have completed, and before any following instructions
+ * have started. Used at the start of a timed region.
+ *
+ * @returns the number of cycles since the CPU was reset.
+ */
+static inline uint64_t cpu_read_tsc_serialized(void)
+{
+    uint32_t low, high;
+    asm volatile("lfence\n\t"
+                 "rdtsc\n\t"
+                 "lfence"
+                 : "=a"(low), "=d"(high)
+                 :
+                 : "memory");
+    return ((uint64_t) high << 32) | low;
+}
+
+/**
+ * Read the time-stamp counter with the RDTSCP instruction, which waits for all preceding instructions to complete. The
+ * following instructions are held back until it has completed. Used at the end of a timed region. The CPU must support
+ * RDTSCP; check CPUID.80000001h:EDX.RDTSCP before using this.
+ *
+ * @returns the number of cycles since the CPU was reset.
+ */
+static inline uint64_t cpu_read_tscp(void)
+{
+    uint32_t low, high, aux;
+    asm volatile("rdtscp\n\t"
+                 "lfence"
+                 : "=a"(low), "=d"(high), "=c"(aux)
+                 :
+                 : "memory");
+    return ((uint64_t) high << 32) | low;
+}
+
+/**
+ * Read a model-specific register.
+ *
+ * @param msr  The number of the MSR to read.
+ * @returns the value of the MSR.
+ */
+static inline uint64_t cpu_read_msr(uint32_t msr)
+{
+#ifdef HOSTED
+    return hosted_read_msr(msr);
+#else
+    uint32_t low, high;
+    asm volatile("rdmsr"
+                 : "=a"(low), "=d"(high)
+                 : "c"(msr));
+    return ((uint64_t) high << 32) | low;
+#endif
+}
+
+/**
+ * Write a model-specific register.
+ *
+ * @param msr  The number of the MSR to write.
+ * @param value  The value to write.
+ */
+static inline void cpu_write_msr(uint32_t msr, uint64_t value)
+{
+#ifdef HOSTED
+    hosted_write_msr(msr, value);
+#else
+    asm volatile("wrmsr"
+                 :
+                 : "c"(msr), "a"((uint32_t) value), "d"((uint32_t) (value >> 32)));
+#endif
+}
+
+// The control registers are 32 bits wide in the loader and 64 bits wide in the kernel, which is exactly what "unsigned
+// long" gives us for the -m32 and -m64 targets respectively.
+static inline unsigned long cpu_get_cr0(void)
+{
+    unsigned long cr0;
+    asm volatile("mov %%cr0, %0"
+                 : "=r"(cr0));
+    return cr0;
+}
+
+static inline void cpu_set_cr0(unsigned long cr0)
+{
+    asm volatile("mov %0, %%cr0"
+                 :
+                 : "r"(cr0));
+}
+
+static inline unsigned long cpu_get_cr4(void)
+{
+    unsigned long cr4;
+    asm volatile("mov %%cr4, %0"
+                 : "=r"(cr4));
+    return cr4;
+}
+
+static inline void cpu_set_cr4(unsigned long cr4)
+{
+    asm volatile("mov %0, %%cr4"
+                 :
+                 : "r"(cr4));
+}
+
+static inline unsigned long cpu_get_cr3(void)
+{
+    unsigned long cr3;
+    asm volatile("mov %%cr3, %0"
+                 : "=r"(cr3));
+    return cr3;
+}
+
+static inline void cpu_set_cr3(unsigned long cr3)
+{
+    asm volatile("mov %0, %%cr3"
+                 :
+                 : "r"(cr3)
+                 : "memory");
+}
+
+/**
+ * Invalidate the TLB entry for the page containing the given address. This must be done after a paging structure entry
+ * for a present page has been changed.
+ *
+ * @param address  An address in the page whose TLB entry should be invalidated.
+ */
+static inline void cpu_invalidate_page(void *address)
+{
+    asm volatile("invlpg (%0)"
+                 :
+                 : "r"(address)
+                 : "memory");
+}
+
+/**
+ * Write back and invalidate all the caches.
+ */
+static inline void cpu_flush_caches(void)
+{
+#ifndef HOSTED
+    asm volatile("wbinvd" : : : "memory");
+#endif
+}
+
+#endif // !__COMMON_CPU_H__
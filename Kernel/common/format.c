@@ -0,0 +1,499 @@
+/*
+ * format.c - printf()-like formatting, shared by the 32-bit loader and the 64-bit kernel.
+ *
+ * The digits of a number used to be produced one at a time, dividing by the base at run time -- two 64-bit divisions per
+ * digit, which is around 40 cycles each on a modern CPU and many times that in the 32-bit loader, where they are calls
+ * to __udivdi3 and __umoddi3. Here, the bases are compile-time constants, so the compiler turns the divisions into
+ * multiplications. Decimal numbers are produced two digits at a time using a lookup table, and 64-bit numbers are split
+ * into chunks of eight digits so that the bulk of the work is done with 32-bit arithmetic; in the 32-bit loader, this
+ * means a 20-digit number costs two __udivdi3 calls rather than forty library calls. Hexadecimal and binary numbers need
+ * no division at all.
+ *
+ * The literal parts of the format string are handed to the output function a run at a time, rather than a character at
+ * a time.
+ *
+ * The code here must not use memory_copy() or memory_zero(), for the same reason as the console: the 64-bit kernel uses
+ * SSE variants of those, which must not be called from interrupt handlers.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2008, 2013, 2017 Per Lundberg
+ */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common/format.h"
+
+// The flags of a conversion specification.
+#define FLAG_LEFT_JUSTIFY               (1 << 0)
+#define FLAG_ZERO_PAD                   (1 << 1)
+#define FLAG_PLUS_SIGN                  (1 << 2)
+#define FLAG_SPACE_SIGN                 (1 << 3)
+
+// The chunks 64-bit decimal numbers are split into. 10^8 is the largest power of ten whose remainders fit in 32 bits with
+// an even number of digits.
+#define DECIMAL_CHUNK                   100000000
+#define DECIMAL_CHUNK_DIGITS            8
+
+// The padding is output a chunk at a time from these.
+#define PADDING_LENGTH                  16
+
+static const char spaces[PADDING_LENGTH] = "                ";
+static const char zeroes[PADDING_LENGTH] = "0000000000000000";
+
+static const char hexadecimal_digits[16] = "0123456789ABCDEF";
+
+// All the numbers from 00 to 99, as pairs of digits.
+static const char decimal_pairs[200] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+// The state of format_to_buffer().
+typedef struct
+{
+    char *buffer;
+    unsigned int size;
+    unsigned int length;
+} buffer_context_t;
+
+/**
+ * Convert a 32-bit number to decimal, two digits at a time.
+ *
+ * @param value  The number.
+ * @param buffer_end  The end of the buffer. The digits are written backwards from here.
+ * @returns the first digit.
+ */
+static char *format_decimal32(uint32_t value, char *buffer_end)
+{
+    char *digit = buffer_end;
+
+    while (value >= 100)
+    {
+        uint32_t pair = value % 100;
+        value /= 100;
+
+        digit -= 2;
+        digit[0] = decimal_pairs[pair * 2];
+        digit[1] = decimal_pairs[pair * 2 + 1];
+    }
+
+    if (value >= 10)
+    {
+        digit -= 2;
+        digit[0] = decimal_pairs[value * 2];
+        digit[1] = decimal_pairs[value * 2 + 1];
+    }
+    else
+    {
+        *--digit = '0' + value;
+    }
+
+    return digit;
+}
+
+char *format_number(uint64_t value, unsigned int base, char *buffer_end)
+{
+    char *digit = buffer_end;
+
+    if (base == 16)
+    {
+        // A byte (two digits) at a time, with the leading zero of the last byte dropped.
+        do
+        {
+            uint8_t byte = value & 0xFF;
+            value >>= 8;
+
+            *--digit = hexadecimal_digits[byte & 0x0F];
+            if (value != 0 || byte >= 0x10)
+            {
+                *--digit = hexadecimal_digits[byte >> 4];
+            }
+        } while (value != 0);
+    }
+    else if (base == 2)
+    {
+        do
+        {
+            *--digit = '0' + (value & 1);
+            value >>= 1;
+        } while (value != 0);
+    }
+    else
+    {
+        // Chunks of eight digits are split off the end until the rest fits in 32 bits. All but the first chunk must be
+        // zero-padded to the full eight digits.
+        while (value > UINT32_MAX)
+        {
+            uint64_t quotient = value / DECIMAL_CHUNK;
+            char *chunk_end = digit;
+
+            digit = format_decimal32(value - quotient * DECIMAL_CHUNK, digit);
+            while (chunk_end - digit < DECIMAL_CHUNK_DIGITS)
+            {
+                *--digit = '0';
+            }
+
+            value = quotient;
+        }
+
+        digit = format_decimal32(value, digit);
+    }
+
+    return digit;
+}
+
+/**
+ * Output a number of padding characters.
+ *
+ * @param output  The output function.
+ * @param context  The context of the output function.
+ * @param padding  The padding characters: spaces or zeroes.
+ * @param count  The number of characters to output. May be zero or negative, in which case nothing is output.
+ */
+static void format_pad(format_output_t output, void *context, const char *padding, int count)
+{
+    while (count > 0)
+    {
+        unsigned int length = count < PADDING_LENGTH ? count : PADDING_LENGTH;
+        output(padding, length, context);
+        count -= length;
+    }
+}
+
+/**
+ * Output a field: a prefix (a sign, or 0x), the characters of the field, and whatever padding the width and precision
+ * call for.
+ *
+ * @param output  The output function.
+ * @param context  The context of the output function.
+ * @param prefix  The prefix.
+ * @param prefix_length  The length of the prefix.
+ * @param string  The characters of the field.
+ * @param length  The number of characters.
+ * @param zero_count  The number of zeroes to put between the prefix and the characters.
+ * @param flags  The flags of the conversion specification.
+ * @param width  The field width.
+ */
+static void format_field(format_output_t output, void *context, const char *prefix, unsigned int prefix_length,
+                         const char *string, unsigned int length, int zero_count, unsigned int flags, int width)
+{
+    int padding = width - (int) (prefix_length + zero_count + length);
+
+    if ((flags & FLAG_LEFT_JUSTIFY) == 0)
+    {
+        if ((flags & FLAG_ZERO_PAD) != 0)
+        {
+            zero_count += padding;
+        }
+        else
+        {
+            format_pad(output, context, spaces, padding);
+        }
+    }
+
+    if (prefix_length > 0)
+    {
+        output(prefix, prefix_length, context);
+    }
+
+    format_pad(output, context, zeroes, zero_count);
+
+    if (length > 0)
+    {
+        output(string, length, context);
+    }
+
+    if ((flags & FLAG_LEFT_JUSTIFY) != 0)
+    {
+        format_pad(output, context, spaces, padding);
+    }
+}
+
+void format_string(format_output_t output, void *context, const char *format, va_list arguments)
+{
+    const char *c = format;
+
+    while (*c != '\0')
+    {
+        // The literal text up to the next conversion specification goes out in one piece.
+        const char *literal = c;
+        while (*c != '\0' && *c != '%')
+        {
+            c++;
+        }
+
+        if (c > literal)
+        {
+            output(literal, c - literal, context);
+        }
+
+        if (*c == '\0')
+        {
+            break;
+        }
+
+        const char *specification = c++;
+
+        unsigned int flags = 0;
+        while (1 == 1)
+        {
+            if (*c == '-')
+            {
+                flags |= FLAG_LEFT_JUSTIFY;
+            }
+            else if (*c == '0')
+            {
+                flags |= FLAG_ZERO_PAD;
+            }
+            else if (*c == '+')
+            {
+                flags |= FLAG_PLUS_SIGN;
+            }
+            else if (*c == ' ')
+            {
+                flags |= FLAG_SPACE_SIGN;
+            }
+            else
+            {
+                break;
+            }
+
+            c++;
+        }
+
+        int width = 0;
+        if (*c == '*')
+        {
+            width = va_arg(arguments, int);
+            if (width < 0)
+            {
+                flags |= FLAG_LEFT_JUSTIFY;
+                width = -width;
+            }
+
+            c++;
+        }
+        else
+        {
+            while (*c >= '0' && *c <= '9')
+            {
+                width = width * 10 + (*c++ - '0');
+            }
+        }
+
+        // A negative precision means that none was given.
+        int precision = -1;
+        if (*c == '.')
+        {
+            c++;
+            precision = 0;
+            if (*c == '*')
+            {
+                precision = va_arg(arguments, int);
+                c++;
+            }
+            else
+            {
+                while (*c >= '0' && *c <= '9')
+                {
+                    precision = precision * 10 + (*c++ - '0');
+                }
+            }
+        }
+
+        uint64_t value;
+        unsigned int base = 10;
+        bool negative = false;
+        char conversion = *c;
+
+        switch (conversion)
+        {
+            case 'u':
+                value = va_arg(arguments, uint32_t);
+                break;
+
+            case 'U':
+                value = va_arg(arguments, uint64_t);
+                break;
+
+            case 'd':
+            {
+                int32_t signed_value = va_arg(arguments, int32_t);
+                negative = signed_value < 0;
+
+                // Negating in unsigned arithmetic works for the most negative value as well.
+                value = negative ? -(uint64_t) signed_value : (uint64_t) signed_value;
+                break;
+            }
+
+            case 'D':
+            {
+                int64_t signed_value = va_arg(arguments, int64_t);
+                negative = signed_value < 0;
+                value = negative ? -(uint64_t) signed_value : (uint64_t) signed_value;
+                break;
+            }
+
+            case 'x':
+                value = va_arg(arguments, uint32_t);
+                base = 16;
+                break;
+
+            case 'X':
+                value = va_arg(arguments, uint64_t);
+                base = 16;
+                break;
+
+            case 'b':
+                value = va_arg(arguments, uint32_t);
+                base = 2;
+                break;
+
+            case 'B':
+                value = va_arg(arguments, uint64_t);
+                base = 2;
+                break;
+
+            case 'p':
+                value = (uintptr_t) va_arg(arguments, void *);
+                base = 16;
+                precision = sizeof(void *) * 2;
+                break;
+
+            case 's':
+            {
+                const char *string = va_arg(arguments, const char *);
+                if (string == NULL)
+                {
+                    string = "(null)";
+                }
+
+                unsigned int length = 0;
+                while (string[length] != '\0' && (precision < 0 || length < (unsigned int) precision))
+                {
+                    length++;
+                }
+
+                format_field(output, context, NULL, 0, string, length, 0, flags & ~FLAG_ZERO_PAD, width);
+                c++;
+                continue;
+            }
+
+            case 'c':
+            {
+                char character = va_arg(arguments, int);
+                format_field(output, context, NULL, 0, &character, 1, 0, flags & ~FLAG_ZERO_PAD, width);
+                c++;
+                continue;
+            }
+
+            case '%':
+                output("%", 1, context);
+                c++;
+                continue;
+
+            default:
+                // Just like printf(), if we encounter an unparseable specification, we just print it out verbatim. (A
+                // specification cut short by the end of the string is printed without the NUL, of course.)
+                if (*c != '\0')
+                {
+                    c++;
+                }
+
+                output(specification, c - specification, context);
+                continue;
+        }
+
+        c++;
+
+        char buffer[FORMAT_NUMBER_BUFFER_SIZE];
+        char *buffer_end = buffer + FORMAT_NUMBER_BUFFER_SIZE;
+        char *digits = format_number(value, base, buffer_end);
+
+        // As with printf(), a zero with a precision of zero has no digits at all, and the 0 flag is ignored when a
+        // precision is given.
+        if (value == 0 && precision == 0)
+        {
+            digits = buffer_end;
+        }
+
+        if (precision >= 0)
+        {
+            flags &= ~FLAG_ZERO_PAD;
+        }
+
+        unsigned int length = buffer_end - digits;
+        int zero_count = precision > (int) length ? precision - (int) length : 0;
+
+        const char *prefix = NULL;
+        unsigned int prefix_length = 0;
+        if (conversion == 'p')
+        {
+            prefix = "0x";
+            prefix_length = 2;
+        }
+        else if (negative)
+        {
+            prefix = "-";
+            prefix_length = 1;
+        }
+        else if ((flags & FLAG_PLUS_SIGN) != 0 && (conversion == 'd' || conversion == 'D'))
+        {
+            prefix = "+";
+            prefix_length = 1;
+        }
+        else if ((flags & FLAG_SPACE_SIGN) != 0 && (conversion == 'd' || conversion == 'D'))
+        {
+            prefix = " ";
+            prefix_length = 1;
+        }
+
+        format_field(output, context, prefix, prefix_length, digits, length, zero_count, flags, width);
+    }
+}
+
+/**
+ * The output function of format_to_buffer(). Copies as much of the output as fits, leaving room for the NUL terminator.
+ */
+static void format_buffer_output(const char *string, unsigned int length, void *context)
+{
+    buffer_context_t *buffer = (buffer_context_t *) context;
+
+    for (unsigned int i = 0; i < length && buffer->length + 1 < buffer->size; i++)
+    {
+        buffer->buffer[buffer->length++] = string[i];
+    }
+}
+
+unsigned int format_to_buffer(char *buffer, unsigned int size, const char *format, ...)
+{
+    va_list arguments;
+    va_start(arguments, format);
+    unsigned int length = format_to_buffer_list(buffer, size, format, arguments);
+    va_end(arguments);
+
+    return length;
+}
+
+unsigned int format_to_buffer_list(char *buffer, unsigned int size, const char *format, va_list arguments)
+{
+    buffer_context_t context = { buffer, size, 0 };
+    format_string(format_buffer_output, &context, format, arguments);
+
+    if (size > 0)
+    {
+        buffer[context.length] = '\0';
+    }
+
+    return context.length;
+}
@@ -0,0 +1,88 @@
+/*
+ * format.h - printf()-like formatting, shared by the 32-bit loader and the 64-bit kernel.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2008, 2013, 2017 Per Lundberg
+ */
+
+#ifndef __COMMON_FORMAT_H__
+#define __COMMON_FORMAT_H__
+
+#include <stdarg.h>
+#include <stdint.h>
+
+//// Defines.
+// The size of a buffer large enough to hold any number formatted by format_number(): 64 binary digits.
+#define FORMAT_NUMBER_BUFFER_SIZE       64
+
+//// Type definitions and structures
+/**
+ * The function receiving the output of format_string(). The output is handed over in runs of characters, which are not
+ * NUL-terminated.
+ *
+ * @param string  The characters.
+ * @param length  The number of characters.
+ * @param context  The context given to format_string().
+ */
+typedef void (*format_output_t)(const char *string, unsigned int length, void *context);
+
+//// Function prototypes
+/**
+ * Format a string using printf()-like conversion specifications. The ones supported are:
+ *
+ * %u, %U  Unsigned decimal, 32-bit and 64-bit.
+ * %d, %D  Signed decimal, 32-bit and 64-bit.
+ * %x, %X  Hexadecimal, 32-bit and 64-bit. Note that this differs from printf(), where %X means upper case letters; here,
+ *         the letters are always upper case.
+ * %b, %B  Binary, 32-bit and 64-bit.
+ * %p      A pointer, as 0x followed by 16 hexadecimal digits.
+ * %s      A string. NULL is printed as (null).
+ * %c      A character.
+ * %%      A literal percent sign.
+ *
+ * Each specification may have the flags - (left-justify), 0 (pad numbers with zeroes), + and space (sign of positive
+ * numbers), a field width and a precision (the minimum number of digits of a number, or the maximum number of characters
+ * of a string). The width and precision may be given as *, in which case they are taken from the arguments as ints.
+ * Unsupported specifications are output verbatim.
+ *
+ * @param output  The function receiving the output.
+ * @param context  Passed on to the output function.
+ * @param format  The format string.
+ * @param arguments  The arguments.
+ */
+extern void format_string(format_output_t output, void *context, const char *format, va_list arguments);
+
+/**
+ * Format a string into a buffer, like snprintf(). The output is truncated if it doesn't fit.
+ *
+ * @param buffer  The buffer. Always NUL-terminated, unless size is 0.
+ * @param size  The size of the buffer, in bytes.
+ * @param format  The format string, as described for format_string().
+ * @returns the length of the string, not counting the NUL terminator (and not counting what was truncated).
+ */
+extern unsigned int format_to_buffer(char *buffer, unsigned int size, const char *format, ...);
+
+/**
+ * Format a string into a buffer, like vsnprintf(). This is format_to_buffer() for callers that are variadic themselves.
+ *
+ * @param buffer  The buffer. Always NUL-terminated, unless size is 0.
+ * @param size  The size of the buffer, in bytes.
+ * @param format  The format string, as described for format_string().
+ * @param arguments  The arguments.
+ * @returns the length of the string, not counting the NUL terminator (and not counting what was truncated).
+ */
+extern unsigned int format_to_buffer_list(char *buffer, unsigned int size, const char *format, va_list arguments);
+
+/**
+ * Convert an unsigned number to a string of digits. The digits are written backwards from the end of the buffer, which
+ * saves us from having to reverse them or to count them in advance.
+ *
+ * @param value  The number.
+ * @param base  The base: 2, 10 or 16.
+ * @param buffer_end  The end of the buffer, which must have room for at least FORMAT_NUMBER_BUFFER_SIZE characters before
+ * it. No NUL terminator is written.
+ * @returns the first digit.
+ */
+extern char *format_number(uint64_t value, unsigned int base, char *buffer_end);
+
+#endif // !__COMMON_FORMAT_H__
@@ -0,0 +1,388 @@
+/*
+ * memory.c - CPU-dispatched memory primitives, shared by the 32-bit loader and the 64-bit kernel.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2008, 2013, 2017 Per Lundberg
+ */
+
+#include "common/cpu.h"
+#include "common/memory.h"
+
+// The string instructions operate on the native word size: 8 bytes in the 64-bit kernel, 4 bytes in the 32-bit loader.
+#define WORD_SIZE                       (sizeof(unsigned long))
+
+// The number of bytes processed per iteration in the SSE2 loops (four 16-byte registers).
+#define SSE2_BLOCK_SIZE                 64
+
+typedef struct
+{
+    const char *name;
+    void (*zero)(void *memory, size_t length);
+    void (*copy)(void *target, const void *source, size_t length);
+} memory_variant_t;
+
+// The variant to use for each size class. Since memory_variant_bytewise is zero, this is also correct before
+// memory_init() has been called (or, in the 64-bit kernel, before the BSS has been cleared).
+static memory_variant_e selected_variants[MEMORY_SIZE_CLASS_COUNT];
+
+// Which variants the CPU can run. The bytewise and REP MOVSB variants work everywhere.
+static bool available_variants[MEMORY_VARIANT_COUNT];
+
+////
+//// Bytewise variant
+////
+static void memory_zero_bytewise(void *memory, size_t length)
+{
+    uint8_t *memory_uint8 = (uint8_t *) memory;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        memory_uint8[i] = 0;
+    }
+}
+
+static void memory_copy_bytewise(void *target, const void *source, size_t length)
+{
+    // Of course, doing it like this (copying one single byte at a time) is extremely inefficient, but it works and is
+    // fool-proof.
+    uint8_t *target_uint8 = (uint8_t *) target;
+    const uint8_t *source_uint8 = (const uint8_t *) source;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        target_uint8[i] = source_uint8[i];
+    }
+}
+
+////
+//// REP MOVSB/STOSB variant
+////
+static void memory_zero_rep_movsb(void *memory, size_t length)
+{
+    asm volatile("rep stosb"
+                 : "+D"(memory), "+c"(length)
+                 : "a"(0)
+                 : "memory");
+}
+
+static void memory_copy_rep_movsb(void *target, const void *source, size_t length)
+{
+    asm volatile("rep movsb"
+                 : "+D"(target), "+S"(source), "+c"(length)
+                 :
+                 : "memory");
+}
+
+////
+//// REP MOVSQ/STOSQ (or MOVSD/STOSD) variant
+////
+static void memory_zero_rep_movs_word(void *memory, size_t length)
+{
+    size_t words = length / WORD_SIZE;
+    size_t bytes = length % WORD_SIZE;
+
+#ifdef __x86_64__
+    asm volatile("rep stosq"
+                 : "+D"(memory), "+c"(words)
+                 : "a"(0UL)
+                 : "memory");
+#else
+    asm volatile("rep stosl"
+                 : "+D"(memory), "+c"(words)
+                 : "a"(0UL)
+                 : "memory");
+#endif
+
+    // The EDI/RDI register has been advanced past the words by now, so we can just continue with the remaining bytes.
+    asm volatile("rep stosb"
+                 : "+D"(memory), "+c"(bytes)
+                 : "a"(0)
+                 : "memory");
+}
+
+static void memory_copy_rep_movs_word(void *target, const void *source, size_t length)
+{
+    size_t words = length / WORD_SIZE;
+    size_t bytes = length % WORD_SIZE;
+
+#ifdef __x86_64__
+    asm volatile("rep movsq"
+                 : "+D"(target), "+S"(source), "+c"(words)
+                 :
+                 : "memory");
+#else
+    asm volatile("rep movsl"
+                 : "+D"(target), "+S"(source), "+c"(words)
+                 :
+                 : "memory");
+#endif
+
+    asm volatile("rep movsb"
+                 : "+D"(target), "+S"(source), "+c"(bytes)
+                 :
+                 : "memory");
+}
+
+////
+//// SSE2 and non-temporal variants
+////
+// The kernel and loader are not compiled with SSE enabled, so we have to tell gcc explicitly that these functions are
+// allowed to use the XMM registers. They must never be called unless memory_init() has found SSE2 and enabled it.
+//
+// The target is first aligned to 16 bytes (so that we can use aligned stores, which is a requirement for MOVNTDQ), then
+// the bulk of the data is processed 64 bytes at a time and finally, the tail is handled using REP MOVSB/STOSB.
+static inline size_t alignment_head(const void *target, size_t length)
+{
+    size_t head = (-(uintptr_t) target) & 15;
+    return head < length ? head : length;
+}
+
+__attribute__((target("sse2")))
+static void memory_zero_sse2(void *memory, size_t length)
+{
+    size_t head = alignment_head(memory, length);
+    memory_zero_rep_movsb(memory, head);
+    memory += head;
+    length -= head;
+
+    size_t blocks = length / SSE2_BLOCK_SIZE;
+    if (blocks > 0)
+    {
+        asm volatile("pxor %%xmm0, %%xmm0\n\t"
+                     "1:\n\t"
+                     "movdqa %%xmm0, 0(%0)\n\t"
+                     "movdqa %%xmm0, 16(%0)\n\t"
+                     "movdqa %%xmm0, 32(%0)\n\t"
+                     "movdqa %%xmm0, 48(%0)\n\t"
+                     "add $64, %0\n\t"
+                     "dec %1\n\t"
+                     "jnz 1b"
+                     : "+r"(memory), "+r"(blocks)
+                     :
+                     : "memory", "xmm0");
+    }
+
+    memory_zero_rep_movsb(memory, length % SSE2_BLOCK_SIZE);
+}
+
+__attribute__((target("sse2")))
+static void memory_copy_sse2(void *target, const void *source, size_t length)
+{
+    size_t head = alignment_head(target, length);
+    memory_copy_rep_movsb(target, source, head);
+    target += head;
+    source += head;
+    length -= head;
+
+    size_t blocks = length / SSE2_BLOCK_SIZE;
+    if (blocks > 0)
+    {
+        // Unaligned loads are cheap on all SSE2-capable CPU:s that matter, so we don't bother aligning the source.
+        asm volatile("1:\n\t"
+                     "movdqu 0(%1), %%xmm0\n\t"
+                     "movdqu 16(%1), %%xmm1\n\t"
+                     "movdqu 32(%1), %%xmm2\n\t"
+                     "movdqu 48(%1), %%xmm3\n\t"
+                     "movdqa %%xmm0, 0(%0)\n\t"
+                     "movdqa %%xmm1, 16(%0)\n\t"
+                     "movdqa %%xmm2, 32(%0)\n\t"
+                     "movdqa %%xmm3, 48(%0)\n\t"
+                     "add $64, %0\n\t"
+                     "add $64, %1\n\t"
+                     "dec %2\n\t"
+                     "jnz 1b"
+                     : "+r"(target), "+r"(source), "+r"(blocks)
+                     :
+                     : "memory", "xmm0", "xmm1", "xmm2", "xmm3");
+    }
+
+    memory_copy_rep_movsb(target, source, length % SSE2_BLOCK_SIZE);
+}
+
+__attribute__((target("sse2")))
+static void memory_zero_non_temporal(void *memory, size_t length)
+{
+    size_t head = alignment_head(memory, length);
+    memory_zero_rep_movsb(memory, head);
+    memory += head;
+    length -= head;
+
+    size_t blocks = length / SSE2_BLOCK_SIZE;
+    if (blocks > 0)
+    {
+        // The SFENCE at the end is important: non-temporal stores are weakly ordered, so without it, a subsequent
+        // (ordinary) store could become visible before the zeroes.
+        asm volatile("pxor %%xmm0, %%xmm0\n\t"
+                     "1:\n\t"
+                     "movntdq %%xmm0, 0(%0)\n\t"
+                     "movntdq %%xmm0, 16(%0)\n\t"
+                     "movntdq %%xmm0, 32(%0)\n\t"
+                     "movntdq %%xmm0, 48(%0)\n\t"
+                     "add $64, %0\n\t"
+                     "dec %1\n\t"
+                     "jnz 1b\n\t"
+                     "sfence"
+                     : "+r"(memory), "+r"(blocks)
+                     :
+                     : "memory", "xmm0");
+    }
+
+    memory_zero_rep_movsb(memory, length % SSE2_BLOCK_SIZE);
+}
+
+__attribute__((target("sse2")))
+static void memory_copy_non_temporal(void *target, const void *source, size_t length)
+{
+    size_t head = alignment_head(target, length);
+    memory_copy_rep_movsb(target, source, head);
+    target += head;
+    source += head;
+    length -= head;
+
+    size_t blocks = length / SSE2_BLOCK_SIZE;
+    if (blocks > 0)
+    {
+        asm volatile("1:\n\t"
+                     "prefetchnta 256(%1)\n\t"
+                     "movdqu 0(%1), %%xmm0\n\t"
+                     "movdqu 16(%1), %%xmm1\n\t"
+                     "movdqu 32(%1), %%xmm2\n\t"
+                     "movdqu 48(%1), %%xmm3\n\t"
+                     "movntdq %%xmm0, 0(%0)\n\t"
+                     "movntdq %%xmm1, 16(%0)\n\t"
+                     "movntdq %%xmm2, 32(%0)\n\t"
+                     "movntdq %%xmm3, 48(%0)\n\t"
+                     "add $64, %0\n\t"
+                     "add $64, %1\n\t"
+                     "dec %2\n\t"
+                     "jnz 1b\n\t"
+                     "sfence"
+                     : "+r"(target), "+r"(source), "+r"(blocks)
+                     :
+                     : "memory", "xmm0", "xmm1", "xmm2", "xmm3");
+    }
+
+    memory_copy_rep_movsb(target, source, length % SSE2_BLOCK_SIZE);
+}
+
+static const memory_variant_t variants[MEMORY_VARIANT_COUNT] =
+{
+    [memory_variant_bytewise] = { "bytewise", memory_zero_bytewise, memory_copy_bytewise },
+    [memory_variant_rep_movsb] = { "rep movsb/stosb", memory_zero_rep_movsb, memory_copy_rep_movsb },
+#ifdef __x86_64__
+    [memory_variant_rep_movs_word] = { "rep movsq/stosq", memory_zero_rep_movs_word, memory_copy_rep_movs_word },
+#else
+    [memory_variant_rep_movs_word] = { "rep movsd/stosd", memory_zero_rep_movs_word, memory_copy_rep_movs_word },
+#endif
+    [memory_variant_sse2] = { "sse2", memory_zero_sse2, memory_copy_sse2 },
+    [memory_variant_non_temporal] = { "sse2 non-temporal", memory_zero_non_temporal, memory_copy_non_temporal }
+};
+
+void memory_init(void)
+{
+    cpuid_registers_t features;
+    cpu_cpuid(CPUID_LEAF_FEATURES, 0, &features);
+
+    bool has_erms = false;
+    if (cpu_has_cpuid_leaf(CPUID_LEAF_EXTENDED_FEATURES))
+    {
+        cpuid_registers_t extended_features;
+        cpu_cpuid(CPUID_LEAF_EXTENDED_FEATURES, 0, &extended_features);
+        has_erms = (extended_features.ebx & CPUID_EXTENDED_FEATURES_EBX_ERMS) != 0;
+    }
+
+    available_variants[memory_variant_bytewise] = true;
+    available_variants[memory_variant_rep_movsb] = true;
+    available_variants[memory_variant_rep_movs_word] = true;
+
+    if (features.edx & CPUID_FEATURES_EDX_SSE2)
+    {
+        // The CPU supports SSE2, but we must also tell it that the OS is aware of the SSE state. Otherwise, every SSE
+        // instruction raises an #UD exception. This is a no-op in the 64-bit kernel, since the loader has already done it.
+        cpu_set_cr0((cpu_get_cr0() & ~CR0_EM) | CR0_MP);
+        cpu_set_cr4(cpu_get_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+
+        available_variants[memory_variant_sse2] = true;
+        available_variants[memory_variant_non_temporal] = true;
+    }
+
+    // Small blocks: the string instructions on whole words have the least overhead. (REP MOVSB only gets its "fast string"
+    // microcode for larger blocks, even on ERMS-capable CPU:s)
+    selected_variants[memory_size_small] = memory_variant_rep_movs_word;
+
+    // Medium blocks: ERMS is the fastest if we have it, since the microcode can use the full cache line width. Otherwise,
+    // SSE2 is the next best thing.
+    if (has_erms)
+    {
+        selected_variants[memory_size_medium] = memory_variant_rep_movsb;
+    }
+    else if (available_variants[memory_variant_sse2])
+    {
+        selected_variants[memory_size_medium] = memory_variant_sse2;
+    }
+    else
+    {
+        selected_variants[memory_size_medium] = memory_variant_rep_movs_word;
+    }
+
+    // Large blocks: bypass the cache when we can.
+    if (available_variants[memory_variant_non_temporal])
+    {
+        selected_variants[memory_size_large] = memory_variant_non_temporal;
+    }
+    else
+    {
+        selected_variants[memory_size_large] = selected_variants[memory_size_medium];
+    }
+}
+
+static inline memory_size_class_e size_class(size_t length)
+{
+    if (length <= MEMORY_SMALL_LIMIT)
+    {
+        return memory_size_small;
+    }
+    else if (length < MEMORY_LARGE_LIMIT)
+    {
+        return memory_size_medium;
+    }
+    else
+    {
+        return memory_size_large;
+    }
+}
+
+void memory_zero(void *memory, size_t length)
+{
+    variants[selected_variants[size_class(length)]].zero(memory, length);
+}
+
+void memory_copy(void *target, const void *source, size_t length)
+{
+    variants[selected_variants[size_class(length)]].copy(target, source, length);
+}
+
+bool memory_variant_is_available(memory_variant_e variant)
+{
+    return available_variants[variant];
+}
+
+const char *memory_variant_name(memory_variant_e variant)
+{
+    return variants[variant].name;
+}
+
+memory_variant_e memory_selected_variant(memory_size_class_e size_class)
+{
+    return selected_variants[size_class];
+}
+
+void memory_zero_variant(memory_variant_e variant, void *memory, size_t length)
+{
+    variants[variant].zero(memory, length);
+}
+
+void memory_copy_variant(memory_variant_e variant, void *target, const void *source, size_t length)
+{
+    variants[variant].copy(target, source, length);
+}
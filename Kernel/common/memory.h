@@ -0,0 +1,94 @@
+/*
+ * memory.h - functions for operating on memory ranges. This library is shared by the 32-bit loader and the 64-bit kernel;
+ * there are a number of different implementations (variants) of each primitive, and the best one for each size class is
+ * selected at boot time, based on what the CPU supports.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2008, 2013, 2017 Per Lundberg
+ */
+
+#ifndef __COMMON_MEMORY_H__
+#define __COMMON_MEMORY_H__ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common/misc.h"
+
+//// Defines.
+// Operations up to this size (in bytes) are considered "small". The string instructions have a startup cost of a few dozen
+// cycles, which dominates for tiny blocks.
+#define MEMORY_SMALL_LIMIT              256
+
+// Operations of this size and above are considered "large". At this point, we are pretty much guaranteed to blow the L1
+// and L2 caches anyway, so using non-temporal stores (which bypass the cache hierarchy) is a win; we avoid evicting data
+// that is actually going to be used again.
+#define MEMORY_LARGE_LIMIT              (512 * KiB)
+
+//// Enumerations
+// The different implementations of the memory primitives. The order is significant in one way: the bytewise variant must be
+// the first one, since that is what a zeroed-out variant selection means.
+typedef enum
+{
+    // The original, fool-proof, byte-at-a-time loops.
+    memory_variant_bytewise,
+
+    // REP MOVSB/STOSB. Works on all CPU:s, but is only really fast on CPU:s with "Enhanced REP MOVSB/STOSB" (ERMS).
+    memory_variant_rep_movsb,
+
+    // REP MOVSQ/STOSQ in the 64-bit kernel, REP MOVSD/STOSD in the 32-bit loader (since that's the native word size there).
+    memory_variant_rep_movs_word,
+
+    // 16 bytes at a time, using SSE2 registers.
+    memory_variant_sse2,
+
+    // Like the SSE2 variant, but with non-temporal (cache-bypassing) stores.
+    memory_variant_non_temporal
+} memory_variant_e;
+
+#define MEMORY_VARIANT_COUNT            (memory_variant_non_temporal + 1)
+
+typedef enum
+{
+    memory_size_small,
+    memory_size_medium,
+    memory_size_large
+} memory_size_class_e;
+
+#define MEMORY_SIZE_CLASS_COUNT         (memory_size_large + 1)
+
+//// Function prototypes
+/**
+ * Initialize the memory primitives. This detects the CPU features, enables SSE if it is available and selects the best
+ * variant for each size class. Until this has been called, all operations are performed using the bytewise variant.
+ */
+extern void memory_init(void);
+
+/**
+ * Zero a given memory region.
+ *
+ * @param memory  The memory to zero.
+ * @param length  The number of bytes to zero.
+ */
+extern void memory_zero(void *memory, size_t length);
+
+/**
+ * Copy an area of memory. The areas may only overlap if the target is located below the source, since all variants copy
+ * "forwards".
+ *
+ * @param target  The target of the copying.
+ * @param source  The source of the copying.
+ * @param length  The number of bytes that should be copied.
+ */
+extern void memory_copy(void *target, const void *source, size_t length);
+
+// Access to the individual variants. Mostly useful for benchmarking; normal code should use memory_zero() and
+// memory_copy(), which picks the right variant automatically.
+extern bool memory_variant_is_available(memory_variant_e variant);
+extern const char *memory_variant_name(memory_variant_e variant);
+extern memory_variant_e memory_selected_variant(memory_size_class_e size_class);
+extern void memory_zero_variant(memory_variant_e variant, void *memory, size_t length);
+extern void memory_copy_variant(memory_variant_e variant, void *target, const void *source, size_t length);
+
+#endif /* !__COMMON_MEMORY_H__ */
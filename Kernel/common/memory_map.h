@@ -0,0 +1,44 @@
+/*
+ * memory_map.h - The physical memory map, as reported by the boot loader. The 32-bit loader converts the Multiboot memory
+ * map into this (sorted, normalized) format.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#ifndef __COMMON_MEMORY_MAP_H__
+#define __COMMON_MEMORY_MAP_H__
+
+#include <stdint.h>
+
+//// Defines.
+// The region types. These are the same as the ones used by the BIOS E820 call (and hence, by Multiboot).
+#define MEMORY_REGION_TYPE_RAM          1
+#define MEMORY_REGION_TYPE_RESERVED     2
+#define MEMORY_REGION_TYPE_ACPI         3
+#define MEMORY_REGION_TYPE_ACPI_NVS     4
+#define MEMORY_REGION_TYPE_BAD          5
+
+// The maximum number of regions we keep track of. Real machines typically report somewhere between 5 and 20 regions.
+#define MEMORY_MAP_MAX_REGIONS          64
+
+//// Type definitions and structures
+// Note: these structures are shared between 32-bit and 64-bit code, where uint64_t has different alignment requirements.
+// The reserved fields make sure that the layout is identical in both cases.
+typedef struct
+{
+    uint64_t base_address;
+    uint64_t length;
+    uint32_t type;
+    uint32_t reserved;
+} memory_map_region_t;
+
+typedef struct
+{
+    // The regions, sorted by base address. Adjacent regions of the same type are merged.
+    uint32_t count;
+    uint32_t reserved;
+    memory_map_region_t regions[MEMORY_MAP_MAX_REGIONS];
+} memory_map_t;
+
+#endif // !__COMMON_MEMORY_MAP_H__
@@ -0,0 +1,70 @@
+/*
+ * memory_type.c - Memory types (caching policies) and the Page Attribute Table (PAT).
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#include <stdint.h>
+
+#include "common/cpu.h"
+#include "common/memory_type.h"
+
+// Is the PAT supported (and programmed with our layout)? All 64-bit CPU:s from both AMD and Intel support it, so the
+// fallback is mostly a theoretical exercise.
+static bool has_pat;
+
+// The PAT index of each memory type, with our PAT layout.
+static const unsigned int pat_indices[MEMORY_TYPE_COUNT] =
+{
+    [memory_type_write_back] = 0,
+    [memory_type_write_through] = PAT_INDEX_PAT | PAT_INDEX_PWT,
+    [memory_type_write_combining] = PAT_INDEX_PWT,
+    [memory_type_uncached] = PAT_INDEX_PCD | PAT_INDEX_PWT
+};
+
+// The PAT index of each memory type, with the power-on default layout. There is no write-combining in that layout, so we
+// fall back to uncached there.
+static const unsigned int default_pat_indices[MEMORY_TYPE_COUNT] =
+{
+    [memory_type_write_back] = 0,
+    [memory_type_write_through] = PAT_INDEX_PWT,
+    [memory_type_write_combining] = PAT_INDEX_PCD | PAT_INDEX_PWT,
+    [memory_type_uncached] = PAT_INDEX_PCD | PAT_INDEX_PWT
+};
+
+static const char *names[MEMORY_TYPE_COUNT] =
+{
+    [memory_type_write_back] = "write-back",
+    [memory_type_write_through] = "write-through",
+    [memory_type_write_combining] = "write-combining",
+    [memory_type_uncached] = "uncached"
+};
+
+bool memory_type_init(void)
+{
+    cpuid_registers_t features;
+    cpu_cpuid(CPUID_LEAF_FEATURES, 0, &features);
+
+    has_pat = (features.edx & CPUID_FEATURES_EDX_PAT) != 0;
+    if (has_pat)
+    {
+        // Flush the caches before and after changing the PAT, as prescribed by the Intel SDM. Strictly speaking, this is
+        // only needed if paging is already enabled, but it's cheap enough to not be worth the special case.
+        cpu_flush_caches();
+        cpu_write_msr(MSR_IA32_PAT, PAT_LAYOUT);
+        cpu_flush_caches();
+    }
+
+    return has_pat;
+}
+
+unsigned int memory_type_pat_index(memory_type_e type)
+{
+    return has_pat ? pat_indices[type] : default_pat_indices[type];
+}
+
+const char *memory_type_name(memory_type_e type)
+{
+    return names[type];
+}
@@ -0,0 +1,87 @@
+/*
+ * memory_type.h - Memory types (caching policies) and the Page Attribute Table (PAT).
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#ifndef __COMMON_MEMORY_TYPE_H__
+#define __COMMON_MEMORY_TYPE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//// Defines.
+// The IA32_PAT model-specific register.
+#define MSR_IA32_PAT                    0x277
+
+// The memory type encodings used in the PAT entries.
+#define PAT_UNCACHEABLE                 0x00
+#define PAT_WRITE_COMBINING             0x01
+#define PAT_WRITE_THROUGH               0x04
+#define PAT_WRITE_PROTECTED             0x05
+#define PAT_WRITE_BACK                  0x06
+#define PAT_UNCACHED_MINUS              0x07
+
+// Our PAT layout. The PAT index of a page is formed by its PAT, PCD and PWT bits (in that order, PAT being the most
+// significant one). Entries 0, 2, 3 and 4-7 are the same as the power-on defaults, which means that page table entries with
+// the PAT bit clear mean the same thing before and after the PAT has been programmed, except for PWT-only entries: we use
+// those for write-combining (the default is write-through, which we instead put at PAT index 5).
+#define PAT_LAYOUT                      ((uint64_t) PAT_WRITE_BACK              | \
+                                         (uint64_t) PAT_WRITE_COMBINING << 8    | \
+                                         (uint64_t) PAT_UNCACHED_MINUS << 16    | \
+                                         (uint64_t) PAT_UNCACHEABLE << 24       | \
+                                         (uint64_t) PAT_WRITE_BACK << 32        | \
+                                         (uint64_t) PAT_WRITE_THROUGH << 40     | \
+                                         (uint64_t) PAT_UNCACHED_MINUS << 48    | \
+                                         (uint64_t) PAT_UNCACHEABLE << 56)
+
+// The bits in a PAT index.
+#define PAT_INDEX_PWT                   (1 << 0)
+#define PAT_INDEX_PCD                   (1 << 1)
+#define PAT_INDEX_PAT                   (1 << 2)
+
+//// Enumerations
+typedef enum
+{
+    // Normal RAM: reads and writes are cached.
+    memory_type_write_back,
+
+    // Reads are cached, but every write goes straight to memory. This is what all of RAM was mapped as before the PAT was
+    // being programmed.
+    memory_type_write_through,
+
+    // Writes are collected in the write-combining buffers and sent to memory in bursts; reads are not cached. Ideal for
+    // framebuffers.
+    memory_type_write_combining,
+
+    // No caching whatsoever. Used for memory-mapped I/O.
+    memory_type_uncached
+} memory_type_e;
+
+#define MEMORY_TYPE_COUNT               (memory_type_uncached + 1)
+
+//// Function prototypes
+/**
+ * Program the PAT of the current CPU with our layout. This must be done on every CPU in the system, and should be done
+ * before paging is enabled (or, if paging is already enabled, with the caches flushed).
+ *
+ * @returns true if the CPU supports the PAT, false otherwise.
+ */
+extern bool memory_type_init(void);
+
+/**
+ * Get the PAT index to use for a given memory type. If the CPU does not support the PAT, the closest approximation
+ * available with the power-on default PWT/PCD semantics is returned.
+ *
+ * @param type  The memory type.
+ * @returns the PAT index, a combination of the PAT_INDEX_* bits.
+ */
+extern unsigned int memory_type_pat_index(memory_type_e type);
+
+/**
+ * Get a human-readable name of a memory type.
+ */
+extern const char *memory_type_name(memory_type_e type);
+
+#endif // !__COMMON_MEMORY_TYPE_H__
@@ -15,11 +15,12 @@
 #define MiB     (KiB * 1024)
 #define GiB     (MiB * 1024)
 
+#ifdef HOSTED
+// In the hosted build (see the hosted folder), halting means giving up on the current test case.
+extern void hosted_halt(void) __attribute__((noreturn));
+#define HALT()    hosted_halt()
+#else
 #define HALT()    while (1 == 1)
-
-// TODO: Horribly hardwired for small-memory configurations at the moment. Will overwrite the VM structures if we go above 1024
-// MiB of RAM... vm32.c should be patched to calculate this and return it. I did an attempt but managed to screw up the code
-// completely, making the CPU reset every time you go to long mode... :)
-#define KERNEL_COMMAND_LINE (char *) 0x6000
+#endif
 
 #endif // !__MISC_H__
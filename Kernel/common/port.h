@@ -1,12 +1,14 @@
 /* 
- * port.h - basic I/O support. (really only output, no input is supported. :-)
+ * port.h - I/O port access, shared by the 32-bit loader and the 64-bit kernel.
  *
  * Author: Per Lundberg <per@halleluja.nu>
- * Copyright: © 2013 Per Lundberg
+ * Copyright: © 2013, 2017 Per Lundberg
  */
 
-#ifndef __PORT_H__
-#define __PORT_H__ 1
+#ifndef __COMMON_PORT_H__
+#define __COMMON_PORT_H__
+
+#include <stdint.h>
 
 static inline uint8_t inb(uint16_t port)
 {
@@ -25,4 +27,4 @@ static inline void outb(uint16_t port, uint8_t value)
                     "Nd"(port));
 }
 
-#endif /* !__PORT_H__ */
\ No newline at end of file
+#endif /* !__COMMON_PORT_H__ */
\ No newline at end of file
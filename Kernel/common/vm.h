@@ -9,7 +9,9 @@
 #define __COMMON_VM_H__
 
 #ifndef __ASSEMBLER__
+#include <stdbool.h>
 #include <stdint.h>
+#include "common/memory_type.h"
 #include "common/misc.h"
 #endif
 
@@ -27,44 +29,36 @@
 // The size of a 2 MiB page.
 #define VM_2MIB_PAGE_SIZE               (2 * MiB)
 
+// The size of a 1 GiB page. Not all CPU:s support these; check CPUID.80000001h:EDX.Page1GB before using them.
+#define VM_1GIB_PAGE_SIZE               (1 * GiB)
+
 // For the full specification/definition of the amd64 paging architecture, please read AMD64 Architecture Programmers Manual,
 // Volume 2: System Programing.
 
-// We place the VM structures for the kernel process at this memory address and upwards. For more information about the
-// details about the reserved physical memory zones, please see the MemoryMap.txt file in the Documentation & Specifications
-// folder.
-//
-// Something very important to note here is that since we place the PML4 at the very first page in memory (0x0-0xFFF). This
-// memory will be "unmapped" in the paging structures being set up here (to be able to trap NULL-pointer references). This
-// means that the kernel PML4 will not be accessible when paging has been turned on. This shouldn't really be a huge
-// problem. Each process will have its own PML4 anyway, and the kernel will set up mapping for the full amount of physical
-// memory available in the system -- in essence, each 512 GiB block of RAM will have its own PDP table. 
+// The paging structures (PML4, PDPs, PDs and PTs) used for the identity mapping of the physical memory are not placed at any
+// fixed address. Instead, the 32-bit loader allocates them from the top of the RAM below 4 GiB, one 4 KiB page at a time,
+// using the memory map provided by the boot loader. The ranges being used are handed over to the kernel in the boot_info_t
+// structure (see boot_info.h), so that it knows not to hand them out to anyone else. For more information about the
+// reserved physical memory zones, please see the MemoryMap.txt file in the Documentation & Specifications folder.
 //
-// The kernel PML4 is set up before paging has been activated, so the initial setup won't be a problem.
-#define VM_STRUCTURES_BASE_ADDRESS      0x2000
-
-// The PML4 is placed first in the paging structures zone. There is always only one PML4 table. It handles bit 39-47 in the
-// virtual address space. A PML4, just like a PDP, PD or PT is always 4 KiB large.
-#define VM_STRUCTURES_PML4_ADDRESS      (VM_STRUCTURES_BASE_ADDRESS)
-
-// After the PML4, we place the "first page table". This page table maps the very first 2 MiB of RAM in the machine. It would
-// be more logical, in one sense, to place the PDP(s) and PD(s) (since the layout goes PML4 -> PDP table -> PD -> PT,
-// but... Those other tables (PDP and PD) can have a variable size, depending on the RAM installed in the machine, but there
-// will only always be exactly one page table here. So, in accordance with the KISS principle, we Keep It Simple by placing
-// as many structures as possible here on fixed locations.
-#define VM_STRUCTURES_LOW_PAGE_TABLE_ADDRESS \
-                                        (VM_STRUCTURES_PML4_ADDRESS + VM_4KIB_PAGE_SIZE)
-
-// After that comes the PDP (Page Directory Pointer) table. One PDP table can handle up to 2^39 bytes of RAM = 512 GiB. So,
-// when the physical memory in the machine goes above this number, there will be multiple PDPs.
-#define VM_STRUCTURES_PDP_ADDRESS       (VM_STRUCTURES_LOW_PAGE_TABLE_ADDRESS + VM_4KIB_PAGE_SIZE)
-
-// Then, we have page directories. One page directory maps 1 gigabyte of RAM, in amd64 mode. So, there will be one of those
-// for each gigabyte of RAM in the machine. The location of this structure is variable; it will be placed immediately after
-// the PDP(s). The number of 4 KiB pages necessary to hold the page directories will also vary.
+// How many of them are needed depends on the amount of RAM in the machine and on whether the CPU supports 1 GiB pages:
 //
-// Since the number of PDP tables can vary, the base address of the page directories is not a constant but is computed at
-// runtime.
+// - There is always exactly one PML4. It handles bit 39-47 in the virtual address space.
+// - One PDP table can handle up to 2^39 bytes of RAM = 512 GiB. So, when the physical memory in the machine goes above this
+//   number, there will be multiple PDPs.
+// - One page directory maps 1 GiB of RAM. If the CPU supports 1 GiB pages, we only need page directories for the gigabytes
+//   that are not uniformly RAM (or MMIO). Otherwise, there will be one of those for each gigabyte of RAM in the machine,
+//   which means 4 MiB of page directories per TiB.
+// - One page table maps 2 MiB of RAM. There is always one for the first 2 MiB (which holds the NULL-pointer trap region),
+//   and one for each 2 MiB block where the memory type changes on a non-2 MiB boundary.
+
+// The paging structures are never placed below this address. The low 1 MiB is full of BIOS data structures, option ROMs
+// and similar stuff that it's best to stay away from.
+#define VM_STRUCTURES_LOWEST_ADDRESS    (1 * MiB)
+
+// ...nor above this one. The 32-bit loader must be able to access them, and CR3 must be loaded with the address of the PML4
+// before we enter long mode.
+#define VM_STRUCTURES_HIGHEST_ADDRESS   (4 * GiB)
 
 // The number of entries in the PML4, PDP, PD and PT tables, per page.
 #define VM_ENTRIES_PER_PAGE             (4096 / 8)      // That's 512, for those of us who can't count. :-)
@@ -82,13 +76,64 @@
 // The rest of the code is not interesting for assembly code. (and perhaps even more importantly, the GNU assembler barfs at it.)
 #ifndef __ASSEMBLER__
 
+// All of the physical memory is identity mapped (and in the 32-bit loader, paging is not even enabled yet), so a physical
+// address can be used as a pointer as it is. These macros are used by the code that is also part of the hosted build (see
+// the hosted folder), where the physical memory is simulated by an "arena" located wherever Linux decided to put it.
+#ifdef HOSTED
+extern uint8_t *hosted_arena;
+#define VM_PHYSICAL_TO_POINTER(address) ((void *) (hosted_arena + (address)))
+#define VM_POINTER_TO_PHYSICAL(pointer) ((uint64_t) ((uint8_t *) (pointer) - hosted_arena))
+#else
+#define VM_PHYSICAL_TO_POINTER(address) ((void *) (uintptr_t) (address))
+#define VM_POINTER_TO_PHYSICAL(pointer) ((uint64_t) (uintptr_t) (pointer))
+#endif
+
+// The bits of a paging structure entry, for working with the entries as plain 64-bit values. The bitfield types below
+// describe the same thing, but building an entry with them means one read-modify-write per field; with these, an entry
+// is a couple of OR:s of constants, and the same code can handle all four levels of the hierarchy.
+#define VM_ENTRY_PRESENT                (1ULL << 0)
+#define VM_ENTRY_WRITABLE               (1ULL << 1)
+#define VM_ENTRY_USER                   (1ULL << 2)
+#define VM_ENTRY_PWT                    (1ULL << 3)
+#define VM_ENTRY_PCD                    (1ULL << 4)
+#define VM_ENTRY_ACCESSED               (1ULL << 5)
+#define VM_ENTRY_DIRTY                  (1ULL << 6)
+#define VM_ENTRY_GLOBAL                 (1ULL << 8)
+#define VM_ENTRY_ADDRESS_MASK           0x000FFFFFFFFFF000ULL
+
+// In PDP and PD entries, bit 7 tells whether the entry references a large page rather than a table. In PT entries, the
+// same bit is the PAT bit; for the large pages, that one is moved to bit 12 instead (the lowest bit of the address,
+// which is always zero because of the alignment).
+#define VM_ENTRY_PAGE_SIZE              (1ULL << 7)
+#define VM_ENTRY_PAT                    (1ULL << 7)
+#define VM_ENTRY_LARGE_PAT              (1ULL << 12)
+
+// One of the bits available to the OS. The 64-bit kernel sets it in the entries referencing tables it has allocated
+// itself, as opposed to the ones set up by the 32-bit loader. Only the former came from the page allocator and can be
+// given back to it.
+#define VM_ENTRY_ALLOCATED              (1ULL << 9)
+
+// The levels of the hierarchy, numbered after the number of levels below them. The level of the entries mapping a page
+// of a given size is the same as its page_size_e value.
+#define VM_LEVEL_PT                     0
+#define VM_LEVEL_PD                     1
+#define VM_LEVEL_PDP                    2
+#define VM_LEVEL_PML4                   3
+
+// The amount of memory mapped by an entry at a given level, as a number of bits and in bytes, and the index of the entry
+// mapping a given address.
+#define VM_LEVEL_SHIFT(level)           (VM_4KIB_PAGE_BITS + 9 * (level))
+#define VM_LEVEL_ENTRY_SIZE(level)      (1ULL << VM_LEVEL_SHIFT(level))
+#define VM_LEVEL_INDEX(address, level)  ((unsigned int) ((address) >> VM_LEVEL_SHIFT(level)) & VM_INDEX_MASK)
+
 ////
 //// Enumerations
 ////
 typedef enum
 {
     _4kib,
-    _2mib
+    _2mib,
+    _1gib
 } page_size_e;
 
 ////
@@ -154,13 +199,25 @@ typedef struct
     // swapping, a feature we hope we will never need. :-)
     uint64_t accessed: 1;
 
-    // The following bits should be set to zero.
-    uint64_t reserved: 3;
+    // The following three fields are only used when this PDPE references a 1 GiB page. Otherwise, they should be set
+    // to zero.
+    //
+    // The dirty flag is set by the CPU when the page has been written to.
+    uint64_t dirty: 1;
+
+    // Page size. 0 means that this entry references a page directory, 1 means that it references a 1 GiB page. If
+    // this flag is set to 1, the pd_base_address below refers to the actual 30-bit (1 GiB) page.
+    uint64_t page_size: 1;
+
+    // Is this page "global" (shared in all threads)?
+    uint64_t global: 1;
+
+    // End of 1 GiB fields.
 
     // Available to the OS.
     uint64_t available2: 3;
     
-    // The base-address of the PD, left-shifted 12 bits.
+    // The base-address of the PD (or the 1 GiB page), left-shifted 12 bits.
     uint64_t pd_base_address: 40;
 
     // Available to the OS.
@@ -265,6 +322,82 @@ typedef struct
     uint64_t no_execute: 1;
 } pte_t;
 
+// Builds paging structures for large ranges of memory, e.g. the identity mapping of the physical memory.
+typedef struct
+{
+    // The PML4 of the hierarchy being built.
+    uint64_t *pml4;
+
+    // Allocates a zeroed page for a paging structure, or returns NULL if there is no memory left.
+    void *(*allocate_structure)(void);
+
+    // Whether the CPU supports 1 GiB pages.
+    bool has_1gib_pages;
+
+    // The number of pages of each size mapped so far.
+    uint64_t pages[_1gib + 1];
+} vm_builder_t;
+
+////
+//// Inline functions
+////
+/**
+ * Make an entry that references a paging structure. The access rights are as permissive as possible; it is up to the
+ * entries referencing the pages to restrict them.
+ *
+ * @param structure_address  The physical address of the structure.
+ */
+static inline uint64_t vm_structure_entry(uint64_t structure_address)
+{
+    return structure_address | VM_ENTRY_WRITABLE | VM_ENTRY_PRESENT;
+}
+
+/**
+ * Make an entry that references a page.
+ *
+ * @param physical_address  The address of the page. Must be aligned on the page size of the level.
+ * @param attributes  The bits of the entry, in the PT entry layout (i.e. with the PAT bit as VM_ENTRY_PAT).
+ * @param level  The level of the entry.
+ */
+static inline uint64_t vm_page_entry(uint64_t physical_address, uint64_t attributes, int level)
+{
+    if (level == VM_LEVEL_PT)
+    {
+        return physical_address | attributes;
+    }
+
+    uint64_t pat = (attributes & VM_ENTRY_PAT) != 0 ? VM_ENTRY_LARGE_PAT : 0;
+    return physical_address | (attributes & ~VM_ENTRY_PAT) | pat | VM_ENTRY_PAGE_SIZE;
+}
+
+////
+//// Function prototypes
+////
+/**
+ * Get the bits selecting a memory type in the entries mapping pages, in the PT entry layout.
+ *
+ * @param memory_type  The memory type.
+ * @returns a combination of VM_ENTRY_PWT, VM_ENTRY_PCD and VM_ENTRY_PAT.
+ */
+extern uint64_t vm_memory_type_bits(memory_type_e memory_type);
+
+/**
+ * Map a range of memory, using the largest pages that the alignment of the virtual and physical addresses allows. Each
+ * paging structure is filled from start to end in one go, with every entry computed by adding the page size to the
+ * previous one, rather than walking the hierarchy from the top for every page.
+ *
+ * The range must not be mapped already, but the paging structures covering it may exist; they are reused.
+ *
+ * @param builder  The builder.
+ * @param virtual_address  The start of the virtual range. Must be page aligned.
+ * @param physical_address  The start of the physical range. Must be page aligned.
+ * @param size  The size of the range, in bytes. Must be a multiple of the page size.
+ * @param attributes  The bits of the entries mapping the pages, in the PT entry layout.
+ * @returns true if the range was mapped, false if the builder ran out of memory for the paging structures.
+ */
+extern bool vm_builder_map(vm_builder_t *builder, uint64_t virtual_address, uint64_t physical_address, uint64_t size,
+                           uint64_t attributes);
+
 #endif // !__ASSEMBLER__
 
 #endif // !__COMMON_VM_H__
@@ -0,0 +1,111 @@
+/*
+ * vm_builder.c - Building of paging structures for large ranges of memory. Used by the 32-bit loader for the identity
+ * mapping of the physical memory.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common/memory_type.h"
+#include "common/vm.h"
+
+uint64_t vm_memory_type_bits(memory_type_e memory_type)
+{
+    unsigned int pat_index = memory_type_pat_index(memory_type);
+    return ((pat_index & PAT_INDEX_PWT) != 0 ? VM_ENTRY_PWT : 0) |
+           ((pat_index & PAT_INDEX_PCD) != 0 ? VM_ENTRY_PCD : 0) |
+           ((pat_index & PAT_INDEX_PAT) != 0 ? VM_ENTRY_PAT : 0);
+}
+
+/**
+ * Map the part of a range that is covered by a given paging structure.
+ *
+ * @param builder  The builder.
+ * @param structure  The paging structure.
+ * @param level  The level of the entries in the structure.
+ * @param virtual_address  The start of the virtual range.
+ * @param physical_address  The start of the physical range.
+ * @param size  The size of the range. The range is within the memory covered by the structure.
+ * @param attributes  The bits of the entries mapping the pages, in the PT entry layout.
+ * @returns true on success, false if the builder ran out of memory for the paging structures.
+ */
+static bool map_structure(vm_builder_t *builder, uint64_t *structure, int level, uint64_t virtual_address,
+                          uint64_t physical_address, uint64_t size, uint64_t attributes)
+{
+    const uint64_t entry_size = VM_LEVEL_ENTRY_SIZE(level);
+    const bool can_map_pages = level <= VM_LEVEL_PD || (level == VM_LEVEL_PDP && builder->has_1gib_pages);
+    unsigned int index = VM_LEVEL_INDEX(virtual_address, level);
+
+    while (size > 0)
+    {
+        if (can_map_pages && ((virtual_address | physical_address) & (entry_size - 1)) == 0 && size >= entry_size)
+        {
+            // Map as many pages as possible in one go. (The shift is used rather than a division, since the 32-bit
+            // loader has no 64-bit division instruction to do it with.)
+            uint64_t count = size >> VM_LEVEL_SHIFT(level);
+            if (count > VM_ENTRIES_PER_PAGE - index)
+            {
+                count = VM_ENTRIES_PER_PAGE - index;
+            }
+
+            uint64_t entry = vm_page_entry(physical_address, attributes, level);
+            uint64_t *next_entry = &structure[index];
+            for (uint64_t *end = next_entry + count; next_entry < end; next_entry++)
+            {
+                *next_entry = entry;
+                entry += entry_size;
+            }
+
+            builder->pages[level] += count;
+            index += count;
+
+            uint64_t mapped = count << VM_LEVEL_SHIFT(level);
+            virtual_address += mapped;
+            physical_address += mapped;
+            size -= mapped;
+            continue;
+        }
+
+        // This entry is only partly covered by the range (or can't reference a page), so the range continues in the
+        // structure below it.
+        if ((structure[index] & VM_ENTRY_PRESENT) == 0)
+        {
+            void *next_structure = builder->allocate_structure();
+            if (next_structure == NULL)
+            {
+                return false;
+            }
+
+            structure[index] = vm_structure_entry(VM_POINTER_TO_PHYSICAL(next_structure));
+        }
+
+        uint64_t part_size = entry_size - (virtual_address & (entry_size - 1));
+        if (part_size > size)
+        {
+            part_size = size;
+        }
+
+        if (!map_structure(builder, VM_PHYSICAL_TO_POINTER(structure[index] & VM_ENTRY_ADDRESS_MASK), level - 1,
+                           virtual_address, physical_address, part_size, attributes))
+        {
+            return false;
+        }
+
+        index++;
+        virtual_address += part_size;
+        physical_address += part_size;
+        size -= part_size;
+    }
+
+    return true;
+}
+
+bool vm_builder_map(vm_builder_t *builder, uint64_t virtual_address, uint64_t physical_address, uint64_t size,
+                    uint64_t attributes)
+{
+    return map_structure(builder, builder->pml4, VM_LEVEL_PML4, virtual_address, physical_address, size, attributes);
+}
@@ -0,0 +1,855 @@
+/*
+ * check.c - Checks of the invariants of the kernel code run by the hosted build. See check.h for what is being checked.
+ *
+ * The models in here are deliberately written from the specification rather than copied from the code being checked:
+ * the memory types, for instance, are worked out as a list of intervals instead of page by page.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common/boot_info.h"
+#include "common/format.h"
+#include "common/memory_map.h"
+#include "common/memory_type.h"
+#include "common/misc.h"
+#include "common/vm.h"
+#include "64bit_kernel/page_allocator.h"
+#include "check.h"
+
+#define PAGE_MASK                       ((uint64_t) VM_4KIB_PAGE_SIZE - 1)
+
+// The text mode video memory, which is always mapped write-combining.
+#define VGA_TEXT_MEMORY_START           0xB8000
+#define VGA_TEXT_MEMORY_END             0xC0000
+
+// The maximum number of intervals with the same memory type: each region and write-combining range can add at most two.
+#define MAX_INTERVALS                   (2 * MEMORY_MAP_MAX_REGIONS + 8)
+
+// The maximum number of blocks allocated at the same time by check_page_allocator().
+#define MAX_BLOCKS                      4096
+
+// Written to the start and end of every allocated block, to check that the page allocator doesn't touch them while they
+// are allocated.
+#define BLOCK_TAG                       0xC0C05A11C0C05A11ULL
+
+typedef struct
+{
+    uint64_t start;
+    uint64_t end;
+    memory_type_e type;
+} interval_t;
+
+typedef struct
+{
+    uint64_t address;
+    unsigned int order;
+} block_t;
+
+// The state of check_paging_structures().
+static const hosted_machine_t *machine;
+static uint32_t first_structure_range;
+static interval_t intervals[MAX_INTERVALS];
+static unsigned int interval_count;
+static uint64_t end_address;
+static uint8_t *seen_structures;
+static check_paging_summary_t found;
+static bool failed;
+
+static block_t blocks[MAX_BLOCKS];
+
+#define FAIL(...)                                                                                                      \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        printf("Check failed: " __VA_ARGS__);                                                                          \
+        printf("\n");                                                                                                  \
+        failed = true;                                                                                                 \
+    } while (0)
+
+static int compare_addresses(const void *a, const void *b)
+{
+    uint64_t first = *(const uint64_t *) a;
+    uint64_t second = *(const uint64_t *) b;
+    return first < second ? -1 : first > second;
+}
+
+/**
+ * Work out the memory type a page should have, straight from the definition: a page is write-back if it is completely
+ * covered by a region of RAM (or ACPI tables), write-combining if any part of it is video memory, and uncached
+ * otherwise.
+ */
+static memory_type_e expected_type_of_page(uint64_t address)
+{
+    if ((address < VGA_TEXT_MEMORY_END && address + VM_4KIB_PAGE_SIZE > VGA_TEXT_MEMORY_START) ||
+        (address < machine->framebuffer_address + machine->framebuffer_size &&
+         address + VM_4KIB_PAGE_SIZE > machine->framebuffer_address))
+    {
+        return memory_type_write_combining;
+    }
+
+    const memory_map_t *memory_map = &machine->boot_info.memory_map;
+    for (uint32_t i = 0; i < memory_map->count; i++)
+    {
+        const memory_map_region_t *region = &memory_map->regions[i];
+        if ((region->type == MEMORY_REGION_TYPE_RAM || region->type == MEMORY_REGION_TYPE_ACPI ||
+             region->type == MEMORY_REGION_TYPE_ACPI_NVS) &&
+            region->base_address <= address && address + VM_4KIB_PAGE_SIZE <= region->base_address + region->length)
+        {
+            return memory_type_write_back;
+        }
+    }
+
+    return memory_type_uncached;
+}
+
+/**
+ * Split the mapped memory into intervals with the same memory type. The type can only change at the page boundaries
+ * closest to the edges of the regions and write-combining ranges, so the type of each interval is that of its first
+ * page.
+ */
+static void build_intervals(void)
+{
+    uint64_t boundaries[2 * MEMORY_MAP_MAX_REGIONS + 6];
+    unsigned int count = 0;
+
+    boundaries[count++] = 0;
+    boundaries[count++] = end_address;
+    boundaries[count++] = VGA_TEXT_MEMORY_START & ~PAGE_MASK;
+    boundaries[count++] = (VGA_TEXT_MEMORY_END + PAGE_MASK) & ~PAGE_MASK;
+    if (machine->framebuffer_size > 0)
+    {
+        boundaries[count++] = machine->framebuffer_address & ~PAGE_MASK;
+        boundaries[count++] = (machine->framebuffer_address + machine->framebuffer_size + PAGE_MASK) & ~PAGE_MASK;
+    }
+
+    const memory_map_t *memory_map = &machine->boot_info.memory_map;
+    for (uint32_t i = 0; i < memory_map->count; i++)
+    {
+        boundaries[count++] = (memory_map->regions[i].base_address + PAGE_MASK) & ~PAGE_MASK;
+        boundaries[count++] = (memory_map->regions[i].base_address + memory_map->regions[i].length) & ~PAGE_MASK;
+    }
+
+    qsort(boundaries, count, sizeof(uint64_t), compare_addresses);
+
+    interval_count = 0;
+    for (unsigned int i = 0; i + 1 < count && boundaries[i] < end_address; i++)
+    {
+        if (boundaries[i] == boundaries[i + 1])
+        {
+            continue;
+        }
+
+        uint64_t interval_end = boundaries[i + 1] < end_address ? boundaries[i + 1] : end_address;
+        memory_type_e type = expected_type_of_page(boundaries[i]);
+        if (interval_count > 0 && intervals[interval_count - 1].type == type)
+        {
+            intervals[interval_count - 1].end = interval_end;
+        }
+        else
+        {
+            intervals[interval_count].start = boundaries[i];
+            intervals[interval_count].end = interval_end;
+            intervals[interval_count].type = type;
+            interval_count++;
+        }
+    }
+}
+
+/**
+ * Check if a range of memory has a single memory type.
+ *
+ * @param type  The memory type [out]
+ * @returns true if the whole range has the same memory type, false otherwise.
+ */
+static bool expected_type_of_range(uint64_t start, uint64_t end, memory_type_e *type)
+{
+    unsigned int low = 0;
+    unsigned int high = interval_count;
+    while (high - low > 1)
+    {
+        unsigned int middle = (low + high) / 2;
+        if (intervals[middle].start <= start)
+        {
+            low = middle;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    *type = intervals[low].type;
+    return end <= intervals[low].end;
+}
+
+/**
+ * Check that the memory type selected by the PAT, PCD and PWT bits of an entry is the expected one.
+ */
+static void check_memory_type(uint64_t address, memory_type_e expected, bool pat, bool pcd, bool pwt)
+{
+    // Without the PAT, the power-on default layout is in effect; it has no write-combining, which means uncached is the
+    // best we can do.
+    uint64_t layout = machine->cpu.has_pat ? PAT_LAYOUT : 0x0007040600070406ULL;
+    unsigned int index = (pat ? PAT_INDEX_PAT : 0) | (pcd ? PAT_INDEX_PCD : 0) | (pwt ? PAT_INDEX_PWT : 0);
+    unsigned int encoding = (layout >> (8 * index)) & 0xFF;
+
+    bool correct;
+    switch (expected)
+    {
+        case memory_type_write_back:
+            correct = encoding == PAT_WRITE_BACK;
+            break;
+
+        case memory_type_write_combining:
+            correct = machine->cpu.has_pat ? encoding == PAT_WRITE_COMBINING
+                                           : encoding == PAT_UNCACHEABLE || encoding == PAT_UNCACHED_MINUS;
+            break;
+
+        default:
+            correct = encoding == PAT_UNCACHEABLE || encoding == PAT_UNCACHED_MINUS;
+            break;
+    }
+
+    if (!correct)
+    {
+        FAIL("the page at %llX has PAT encoding %u, but should be %s", (unsigned long long) address, encoding,
+             memory_type_name(expected));
+    }
+}
+
+/**
+ * Check a page mapped by a PDP, PD or PT entry.
+ */
+static void check_page(uint64_t virtual_address, uint64_t physical_address, page_size_e page_size, bool writable,
+                       bool global, bool pat, bool pcd, bool pwt)
+{
+    static const uint64_t sizes[] = { VM_4KIB_PAGE_SIZE, VM_2MIB_PAGE_SIZE, VM_1GIB_PAGE_SIZE };
+    uint64_t size = sizes[page_size];
+
+    if (physical_address != virtual_address)
+    {
+        FAIL("the page at %llX is mapped to %llX", (unsigned long long) virtual_address,
+             (unsigned long long) physical_address);
+    }
+
+    if (virtual_address < VM_4KIB_PAGE_SIZE)
+    {
+        FAIL("the first page is mapped, so NULL pointer references won't be caught");
+    }
+
+    if (virtual_address + size > end_address)
+    {
+        FAIL("the page at %llX is mapped, but the mapping should end at %llX", (unsigned long long) virtual_address,
+             (unsigned long long) end_address);
+    }
+
+    if (!writable || !global)
+    {
+        FAIL("the page at %llX is not writable and global", (unsigned long long) virtual_address);
+    }
+
+    memory_type_e type;
+    if (!expected_type_of_range(virtual_address, virtual_address + size, &type))
+    {
+        FAIL("the page at %llX spans more than one memory type", (unsigned long long) virtual_address);
+    }
+
+    check_memory_type(virtual_address, type, pat, pcd, pwt);
+
+    found.pages[page_size]++;
+    found.mapped_bytes += size;
+}
+
+/**
+ * Check that a range covered by a page directory or page table could not have been mapped by a single large page.
+ */
+static void check_page_size(uint64_t virtual_address, uint64_t size, const char *structure)
+{
+    memory_type_e type;
+    if (virtual_address >= VM_4KIB_PAGE_SIZE && virtual_address + size <= end_address &&
+        expected_type_of_range(virtual_address, virtual_address + size, &type))
+    {
+        FAIL("the %s at %llX could have been replaced by a large page", structure,
+             (unsigned long long) virtual_address);
+    }
+}
+
+/**
+ * Check a paging structure referenced by an entry, and get a pointer to it.
+ */
+static void *check_structure(uint64_t page, bool writable, bool user_level_accessible)
+{
+    uint64_t address = page * VM_4KIB_PAGE_SIZE;
+
+    if (!writable || user_level_accessible)
+    {
+        FAIL("the entry referencing the paging structure at %llX is not writable and supervisor-only",
+             (unsigned long long) address);
+    }
+
+    if (address < VM_STRUCTURES_LOWEST_ADDRESS || address >= VM_STRUCTURES_HIGHEST_ADDRESS)
+    {
+        FAIL("the paging structure at %llX is outside of the allowed range", (unsigned long long) address);
+        return NULL;
+    }
+
+    bool reserved = false;
+    const boot_info_t *boot_info = &machine->boot_info;
+    for (uint32_t i = first_structure_range; i < boot_info->reserved_range_count; i++)
+    {
+        if (boot_info->reserved_ranges[i].start <= address && address < boot_info->reserved_ranges[i].end)
+        {
+            reserved = true;
+        }
+    }
+
+    if (!reserved)
+    {
+        FAIL("the paging structure at %llX is not reserved in the boot information", (unsigned long long) address);
+        return NULL;
+    }
+
+    uint64_t index = (address - VM_STRUCTURES_LOWEST_ADDRESS) / VM_4KIB_PAGE_SIZE;
+    if ((seen_structures[index / 8] & (1 << (index % 8))) != 0)
+    {
+        FAIL("the paging structure at %llX is referenced more than once", (unsigned long long) address);
+        return NULL;
+    }
+
+    seen_structures[index / 8] |= 1 << (index % 8);
+    found.structure_pages++;
+    return VM_PHYSICAL_TO_POINTER(address);
+}
+
+static void check_page_table(const pte_t *pt, uint64_t virtual_address)
+{
+    for (int i = 0; i < VM_ENTRIES_PER_PAGE; i++)
+    {
+        uint64_t page_address = virtual_address + (uint64_t) i * VM_4KIB_PAGE_SIZE;
+        if (pt[i].present)
+        {
+            check_page(page_address, (uint64_t) pt[i].page_base_address * VM_4KIB_PAGE_SIZE, _4kib, pt[i].writable,
+                       pt[i].global, pt[i].page_attribute_table, pt[i].pcd, pt[i].pwt);
+        }
+    }
+}
+
+static void check_page_directory(const pde_t *pd, uint64_t virtual_address)
+{
+    for (int i = 0; i < VM_ENTRIES_PER_PAGE; i++)
+    {
+        uint64_t entry_address = virtual_address + (uint64_t) i * VM_2MIB_PAGE_SIZE;
+        if (!pd[i].present)
+        {
+            continue;
+        }
+
+        if (pd[i].page_size)
+        {
+            // The PAT bit of a large page is the lowest bit of the base address.
+            uint64_t base = pd[i].base_address;
+            if ((base & ~1ULL) % (VM_2MIB_PAGE_SIZE / VM_4KIB_PAGE_SIZE) != 0)
+            {
+                FAIL("the 2 MiB page at %llX is not aligned", (unsigned long long) entry_address);
+            }
+
+            check_page(entry_address, (base & ~1ULL) * VM_4KIB_PAGE_SIZE, _2mib, pd[i].writable, pd[i].global, base & 1,
+                       pd[i].pcd, pd[i].pwt);
+            continue;
+        }
+
+        const pte_t *pt = check_structure(pd[i].base_address, pd[i].writable, pd[i].user_level_accessible);
+        if (pt != NULL)
+        {
+            check_page_size(entry_address, VM_2MIB_PAGE_SIZE, "page table");
+            check_page_table(pt, entry_address);
+        }
+    }
+}
+
+static void check_page_directory_pointer_table(const pdpe_t *pdp, uint64_t virtual_address)
+{
+    for (int i = 0; i < VM_ENTRIES_PER_PAGE; i++)
+    {
+        uint64_t entry_address = virtual_address + (uint64_t) i * VM_1GIB_PAGE_SIZE;
+        if (!pdp[i].present)
+        {
+            continue;
+        }
+
+        if (pdp[i].page_size)
+        {
+            if (!machine->cpu.has_1gib_pages)
+            {
+                FAIL("a 1 GiB page is used at %llX, but the CPU doesn't support them",
+                     (unsigned long long) entry_address);
+            }
+
+            uint64_t base = pdp[i].pd_base_address;
+            if ((base & ~1ULL) % (VM_1GIB_PAGE_SIZE / VM_4KIB_PAGE_SIZE) != 0)
+            {
+                FAIL("the 1 GiB page at %llX is not aligned", (unsigned long long) entry_address);
+            }
+
+            check_page(entry_address, (base & ~1ULL) * VM_4KIB_PAGE_SIZE, _1gib, pdp[i].writable, pdp[i].global,
+                       base & 1, pdp[i].pcd, pdp[i].pwt);
+            continue;
+        }
+
+        const pde_t *pd = check_structure(pdp[i].pd_base_address, pdp[i].writable, pdp[i].user_level_accessible);
+        if (pd != NULL)
+        {
+            if (machine->cpu.has_1gib_pages)
+            {
+                check_page_size(entry_address, VM_1GIB_PAGE_SIZE, "page directory");
+            }
+
+            check_page_directory(pd, entry_address);
+        }
+    }
+}
+
+/**
+ * Check that the ranges reserved for the paging structures are in RAM, and don't overlap the ones reserved before.
+ *
+ * @returns the number of pages in them.
+ */
+static uint64_t check_structure_ranges(void)
+{
+    const boot_info_t *boot_info = &machine->boot_info;
+    const memory_map_t *memory_map = &boot_info->memory_map;
+    uint64_t pages = 0;
+
+    for (uint32_t i = first_structure_range; i < boot_info->reserved_range_count; i++)
+    {
+        const boot_info_range_t *range = &boot_info->reserved_ranges[i];
+        if ((range->start & PAGE_MASK) != 0 || (range->end & PAGE_MASK) != 0 || range->start >= range->end)
+        {
+            FAIL("the paging structure range %llX-%llX is not page aligned", (unsigned long long) range->start,
+                 (unsigned long long) range->end);
+            continue;
+        }
+
+        pages += (range->end - range->start) / VM_4KIB_PAGE_SIZE;
+
+        for (uint32_t j = 0; j < first_structure_range; j++)
+        {
+            if (boot_info->reserved_ranges[j].start < range->end && boot_info->reserved_ranges[j].end > range->start)
+            {
+                FAIL("the paging structure range %llX-%llX overlaps a reserved range",
+                     (unsigned long long) range->start, (unsigned long long) range->end);
+            }
+        }
+
+        bool in_ram = false;
+        for (uint32_t j = 0; j < memory_map->count; j++)
+        {
+            const memory_map_region_t *region = &memory_map->regions[j];
+            if (region->type == MEMORY_REGION_TYPE_RAM && region->base_address <= range->start &&
+                range->end <= region->base_address + region->length)
+            {
+                in_ram = true;
+            }
+        }
+
+        if (!in_ram)
+        {
+            FAIL("the paging structure range %llX-%llX is not in RAM", (unsigned long long) range->start,
+                 (unsigned long long) range->end);
+        }
+    }
+
+    return pages;
+}
+
+bool check_paging_structures(const hosted_machine_t *checked_machine, uint32_t reserved_ranges_before,
+                             check_paging_summary_t *summary)
+{
+    machine = checked_machine;
+    first_structure_range = reserved_ranges_before;
+    failed = false;
+    memset(&found, 0, sizeof(found));
+
+    end_address = machine->available_memory & ~PAGE_MASK;
+    if (end_address < 4 * GiB)
+    {
+        end_address = 4 * GiB;
+    }
+
+    uint64_t framebuffer_end = (machine->framebuffer_address + machine->framebuffer_size + PAGE_MASK) & ~PAGE_MASK;
+    if (machine->framebuffer_size > 0 && framebuffer_end > end_address)
+    {
+        end_address = framebuffer_end;
+    }
+
+    build_intervals();
+
+    if (machine->cpu.has_pat && hosted_pat != PAT_LAYOUT)
+    {
+        FAIL("the PAT was programmed with %llX", (unsigned long long) hosted_pat);
+    }
+
+    uint64_t reserved_pages = check_structure_ranges();
+
+    seen_structures = calloc((VM_STRUCTURES_HIGHEST_ADDRESS - VM_STRUCTURES_LOWEST_ADDRESS) / VM_4KIB_PAGE_SIZE / 8, 1);
+    const pml4e_t *pml4 = check_structure(machine->boot_info.pml4_address / VM_4KIB_PAGE_SIZE, true, false);
+    if (pml4 != NULL)
+    {
+        for (int i = 0; i < VM_ENTRIES_PER_PAGE; i++)
+        {
+            if (!pml4[i].present)
+            {
+                continue;
+            }
+
+            if (pml4[i].reserved != 0)
+            {
+                FAIL("PML4 entry %d has reserved bits set", i);
+            }
+
+            const pdpe_t *pdp = check_structure(pml4[i].pdp_base_address, pml4[i].writable,
+                                                pml4[i].user_level_accessible);
+            if (pdp != NULL)
+            {
+                check_page_directory_pointer_table(pdp, (uint64_t) i << 39);
+            }
+        }
+    }
+
+    free(seen_structures);
+
+    if (found.mapped_bytes != end_address - VM_4KIB_PAGE_SIZE)
+    {
+        FAIL("%llu KiB are mapped, but %llu KiB should be", (unsigned long long) (found.mapped_bytes / KiB),
+             (unsigned long long) ((end_address - VM_4KIB_PAGE_SIZE) / KiB));
+    }
+
+    if (found.structure_pages != reserved_pages)
+    {
+        FAIL("%llu pages are reserved for the paging structures, but %llu are used",
+             (unsigned long long) reserved_pages, (unsigned long long) found.structure_pages);
+    }
+
+    if (summary != NULL)
+    {
+        *summary = found;
+    }
+
+    return !failed;
+}
+
+/**
+ * Work out the amount of memory the page allocator should consider free: all the RAM from 1 MiB and up, except for the
+ * reserved ranges. Partial pages are not usable.
+ */
+static uint64_t expected_free_memory(const boot_info_t *boot_info)
+{
+    // Merge the reserved ranges (rounded outwards to whole pages) into a sorted list of non-overlapping ones.
+    boot_info_range_t reserved[BOOT_INFO_MAX_RESERVED_RANGES + 1];
+    uint32_t count = 0;
+
+    reserved[count].start = 0;
+    reserved[count].end = 1 * MiB;
+    count++;
+
+    for (uint32_t i = 0; i < boot_info->reserved_range_count; i++)
+    {
+        reserved[count].start = boot_info->reserved_ranges[i].start & ~PAGE_MASK;
+        reserved[count].end = (boot_info->reserved_ranges[i].end + PAGE_MASK) & ~PAGE_MASK;
+        count++;
+    }
+
+    qsort(reserved, count, sizeof(boot_info_range_t), compare_addresses);
+
+    uint32_t merged = 0;
+    for (uint32_t i = 1; i < count; i++)
+    {
+        if (reserved[i].start <= reserved[merged].end)
+        {
+            if (reserved[i].end > reserved[merged].end)
+            {
+                reserved[merged].end = reserved[i].end;
+            }
+        }
+        else
+        {
+            reserved[++merged] = reserved[i];
+        }
+    }
+
+    count = merged + 1;
+
+    uint64_t free_memory = 0;
+    const memory_map_t *memory_map = &boot_info->memory_map;
+    for (uint32_t i = 0; i < memory_map->count; i++)
+    {
+        const memory_map_region_t *region = &memory_map->regions[i];
+        uint64_t start = (region->base_address + PAGE_MASK) & ~PAGE_MASK;
+        uint64_t end = (region->base_address + region->length) & ~PAGE_MASK;
+        if (region->type != MEMORY_REGION_TYPE_RAM || start >= end)
+        {
+            continue;
+        }
+
+        free_memory += end - start;
+        for (uint32_t j = 0; j < count; j++)
+        {
+            uint64_t overlap_start = reserved[j].start > start ? reserved[j].start : start;
+            uint64_t overlap_end = reserved[j].end < end ? reserved[j].end : end;
+            if (overlap_start < overlap_end)
+            {
+                free_memory -= overlap_end - overlap_start;
+            }
+        }
+    }
+
+    return free_memory;
+}
+
+/**
+ * Check that a newly allocated block is free RAM, and doesn't overlap any of the other allocated blocks.
+ */
+static void check_block(const boot_info_t *boot_info, uint64_t address, unsigned int order, unsigned int block_count)
+{
+    uint64_t size = (uint64_t) PAGE_SIZE << order;
+    uint64_t end = address + size;
+
+    if (address % size != 0)
+    {
+        FAIL("the order %u block at %llX is not naturally aligned", order, (unsigned long long) address);
+    }
+
+    if (address < 1 * MiB)
+    {
+        FAIL("the block at %llX is in the low memory", (unsigned long long) address);
+    }
+
+    bool in_ram = false;
+    const memory_map_t *memory_map = &boot_info->memory_map;
+    for (uint32_t i = 0; i < memory_map->count; i++)
+    {
+        const memory_map_region_t *region = &memory_map->regions[i];
+        if (region->type == MEMORY_REGION_TYPE_RAM && region->base_address <= address &&
+            end <= region->base_address + region->length)
+        {
+            in_ram = true;
+        }
+    }
+
+    if (!in_ram)
+    {
+        FAIL("the order %u block at %llX is not in RAM", order, (unsigned long long) address);
+    }
+
+    for (uint32_t i = 0; i < boot_info->reserved_range_count; i++)
+    {
+        if (boot_info->reserved_ranges[i].start < end && boot_info->reserved_ranges[i].end > address)
+        {
+            FAIL("the order %u block at %llX overlaps the reserved range %llX-%llX", order,
+                 (unsigned long long) address, (unsigned long long) boot_info->reserved_ranges[i].start,
+                 (unsigned long long) boot_info->reserved_ranges[i].end);
+        }
+    }
+
+    for (unsigned int i = 0; i < block_count; i++)
+    {
+        if (blocks[i].address < end && blocks[i].address + ((uint64_t) PAGE_SIZE << blocks[i].order) > address)
+        {
+            FAIL("the order %u block at %llX overlaps the order %u block at %llX", order, (unsigned long long) address,
+                 blocks[i].order, (unsigned long long) blocks[i].address);
+        }
+    }
+}
+
+static uint64_t *first_tag(const block_t *block)
+{
+    return VM_PHYSICAL_TO_POINTER(block->address);
+}
+
+static uint64_t *last_tag(const block_t *block)
+{
+    return VM_PHYSICAL_TO_POINTER(block->address + ((uint64_t) PAGE_SIZE << block->order) - sizeof(uint64_t));
+}
+
+static void free_block(unsigned int index, unsigned int *block_count)
+{
+    const block_t *block = &blocks[index];
+    if (*first_tag(block) != (BLOCK_TAG ^ block->address) || *last_tag(block) != (BLOCK_TAG ^ block->address))
+    {
+        FAIL("the order %u block at %llX was written to while it was allocated", block->order,
+             (unsigned long long) block->address);
+    }
+
+    page_free(block->address, block->order);
+    blocks[index] = blocks[--*block_count];
+}
+
+bool check_page_allocator(const hosted_machine_t *checked_machine, const uint8_t *operations, size_t size)
+{
+    const boot_info_t *boot_info = &checked_machine->boot_info;
+    failed = false;
+
+    // The buddy bitmaps are taken from the free memory as well. They need less than a bit per page of the physical address
+    // space, up to the end of the RAM.
+    uint64_t expected = expected_free_memory(boot_info);
+    uint64_t initial = page_allocator_free_memory();
+    uint64_t bitmap_limit = checked_machine->available_memory / PAGE_SIZE / 8 + 2 * PAGE_SIZE;
+    if (initial > expected || expected - initial > bitmap_limit)
+    {
+        FAIL("%llu KiB of memory is free, but it should be %llu KiB minus the buddy bitmaps",
+             (unsigned long long) (initial / KiB), (unsigned long long) (expected / KiB));
+    }
+
+    unsigned int block_count = 0;
+    for (size_t i = 0; i < size && !failed; i++)
+    {
+        if ((operations[i] & 0x80) != 0)
+        {
+            if (block_count > 0)
+            {
+                free_block(operations[i] % block_count, &block_count);
+            }
+
+            continue;
+        }
+
+        if (block_count == MAX_BLOCKS)
+        {
+            continue;
+        }
+
+        unsigned int order = (operations[i] & 0x7F) % (PAGE_ALLOCATOR_MAX_ORDER + 1);
+        uint64_t address = page_allocate(order);
+        if (address == 0)
+        {
+            continue;
+        }
+
+        check_block(boot_info, address, order, block_count);
+
+        block_t *block = &blocks[block_count++];
+        block->address = address;
+        block->order = order;
+        *first_tag(block) = BLOCK_TAG ^ address;
+        *last_tag(block) = BLOCK_TAG ^ address;
+    }
+
+    while (block_count > 0)
+    {
+        free_block(block_count - 1, &block_count);
+    }
+
+    uint64_t final = page_allocator_free_memory();
+    if (final != initial)
+    {
+        FAIL("%llu KiB of memory was free to begin with, but %llu KiB after freeing everything",
+             (unsigned long long) (initial / KiB), (unsigned long long) (final / KiB));
+    }
+
+    return !failed;
+}
+
+bool check_format(const uint8_t *data, size_t size)
+{
+    // The conversions, as format_string() and printf() spell them.
+    static const char *conversions[][2] =
+    {
+        { "U", "llu" }, { "D", "lld" }, { "X", "llX" }, { "u", "u" }, { "d", "d" }, { "x", "X" }, { "s", "s" }
+    };
+    static const char *strings[] = { "", "cocOS", "(null) is not NULL", "A somewhat longer string, for truncation" };
+
+    uint8_t bytes[12] = { 0 };
+    memcpy(bytes, data, size < sizeof(bytes) ? size : sizeof(bytes));
+
+    unsigned int conversion = bytes[0] % (sizeof(conversions) / sizeof(conversions[0]));
+    bool is_signed = conversions[conversion][0][0] == 'D' || conversions[conversion][0][0] == 'd';
+    bool is_string = conversions[conversion][0][0] == 's';
+
+    // The flags. The sign flags only make sense for the signed conversions, and the zero flag not at all for strings.
+    char flags[5];
+    unsigned int flag_count = 0;
+    if ((bytes[1] & 1) != 0)
+    {
+        flags[flag_count++] = '-';
+    }
+
+    if ((bytes[1] & 2) != 0 && !is_string)
+    {
+        flags[flag_count++] = '0';
+    }
+
+    if ((bytes[1] & 4) != 0 && is_signed)
+    {
+        flags[flag_count++] = '+';
+    }
+
+    if ((bytes[1] & 8) != 0 && is_signed)
+    {
+        flags[flag_count++] = ' ';
+    }
+
+    flags[flag_count] = '\0';
+
+    char width[8] = "";
+    if ((bytes[1] & 16) != 0)
+    {
+        snprintf(width, sizeof(width), "%u", bytes[2] % 40);
+    }
+
+    char precision[8] = "";
+    if ((bytes[1] & 32) != 0)
+    {
+        snprintf(precision, sizeof(precision), ".%u", bytes[3] % 30);
+    }
+
+    char format[32];
+    char expected_format[32];
+    snprintf(format, sizeof(format), "[%%%s%s%s%s]", flags, width, precision, conversions[conversion][0]);
+    snprintf(expected_format, sizeof(expected_format), "[%%%s%s%s%s]", flags, width, precision,
+             conversions[conversion][1]);
+
+    uint64_t value = 0;
+    memcpy(&value, &bytes[4], sizeof(value));
+
+    // The size of the output buffer is varied as well, to check the truncation.
+    unsigned int buffer_size = (bytes[1] & 64) != 0 ? bytes[11] % 64 : 128;
+    char output[128];
+    char expected[128];
+    memset(output, 0, sizeof(output));
+
+    switch (conversions[conversion][0][0])
+    {
+        case 'U':
+        case 'D':
+        case 'X':
+            format_to_buffer(output, buffer_size, format, value);
+            snprintf(expected, buffer_size, expected_format, value);
+            break;
+
+        case 's':
+            format_to_buffer(output, buffer_size, format, strings[value % 4]);
+            snprintf(expected, buffer_size, expected_format, strings[value % 4]);
+            break;
+
+        default:
+            format_to_buffer(output, buffer_size, format, (uint32_t) value);
+            snprintf(expected, buffer_size, expected_format, (uint32_t) value);
+            break;
+    }
+
+    if (buffer_size > 0 && strcmp(output, expected) != 0)
+    {
+        printf("Check failed: %s gave \"%s\", but %s gives \"%s\" (buffer size %u)\n", format, output, expected_format,
+               expected, buffer_size);
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,72 @@
+/*
+ * check.h - Checks of the invariants of the kernel code run by the hosted build. Each check compares what the code did
+ * with an independent model of what it should have done, and prints what is wrong if they differ.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#ifndef __CHECK_H__
+#define __CHECK_H__ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hosted.h"
+
+//// Type definitions and structures
+// What the paging structures look like, as found by check_paging_structures().
+typedef struct
+{
+    uint64_t pages[3];
+    uint64_t structure_pages;
+    uint64_t mapped_bytes;
+} check_paging_summary_t;
+
+//// Function prototypes
+/**
+ * Check the paging structures set up by vm_setup_paging_structures():
+ *
+ * - Everything from 4 KiB up to the end of the RAM (but at least 4 GiB, and including the framebuffer) is identity
+ *   mapped, and nothing else is.
+ * - Every page has the memory type given by the memory map, and the PAT has been programmed accordingly.
+ * - The largest possible pages are used: no page table or page directory covers a range that could have been mapped by
+ *   a single large page.
+ * - The paging structures are located in RAM below 4 GiB, outside of the ranges that were reserved beforehand, and are
+ *   all reserved in the boot information. No structure is referenced twice, and none is leaked.
+ *
+ * @param machine  The machine. Its boot information must have been passed to vm_setup_paging_structures().
+ * @param reserved_ranges_before  The number of reserved ranges in the boot information before the paging structures
+ * were set up.
+ * @param summary  The summary of the paging structures [out] May be NULL.
+ * @returns true if all the invariants hold, false otherwise.
+ */
+extern bool check_paging_structures(const hosted_machine_t *machine, uint32_t reserved_ranges_before,
+                                    check_paging_summary_t *summary);
+
+/**
+ * Check the page allocator, after it has been initialized with page_allocator_init(): the amount of free memory must be
+ * what the memory map and the reserved ranges say, and a series of allocations and frees must only ever hand out
+ * naturally aligned blocks of free RAM that don't overlap each other. Once all the blocks have been freed, the amount
+ * of free memory must be back where it started.
+ *
+ * @param machine  The machine. Its boot information must have been passed to page_allocator_init().
+ * @param operations  The allocations and frees to perform, one per byte: if the high bit is set, one of the blocks
+ * allocated so far is freed; otherwise, a block of the order given by the lower bits is allocated.
+ * @param size  The number of operations.
+ * @returns true if all the invariants hold, false otherwise.
+ */
+extern bool check_page_allocator(const hosted_machine_t *machine, const uint8_t *operations, size_t size);
+
+/**
+ * Check the formatting engine against the snprintf() of the C library, for a conversion specification and a value
+ * derived from a number of bytes.
+ *
+ * @param data  The bytes.
+ * @param size  The number of bytes.
+ * @returns true if the output is the same, false otherwise.
+ */
+extern bool check_format(const uint8_t *data, size_t size);
+
+#endif // !__CHECK_H__
@@ -0,0 +1,25 @@
+/*
+ * fuzz.c - The entry point used when the hosted build is fuzzed with libFuzzer (make fuzz). Every input is turned into a
+ * machine, a series of page allocator operations and a formatting check; see run_input(). Machines that halt (which is
+ * what the kernel code is supposed to do if there isn't enough RAM, for instance) are not considered errors, but any
+ * broken invariant is.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "run.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    if (run_input(data, size) == run_failed)
+    {
+        abort();
+    }
+
+    return 0;
+}
@@ -0,0 +1,191 @@
+/*
+ * hosted.c - The simulated machine that the hosted build runs the kernel code on: the physical memory, the CPU, and the
+ * functions the kernel code expects to find in the rest of the kernel (I/O, the memory primitives and HALT()).
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "common/cpu.h"
+#include "common/format.h"
+#include "common/memory.h"
+#include "common/memory_type.h"
+#include "hosted.h"
+
+// The amount of output kept when hosted_verbose is not set.
+#define TRANSCRIPT_SIZE                 4096
+
+uint8_t *hosted_arena;
+hosted_cpu_t hosted_cpu = { .has_1gib_pages = true, .has_pat = true };
+uint64_t hosted_pat;
+bool hosted_verbose;
+jmp_buf hosted_halt_target;
+bool hosted_halt_target_set;
+
+static uint64_t arena_size;
+
+static char transcript[TRANSCRIPT_SIZE];
+static size_t transcript_length;
+
+bool hosted_arena_create(uint64_t size)
+{
+    hosted_arena_destroy();
+
+    // MAP_NORESERVE makes Linux hand out the pages as they are touched, instead of committing the memory up front.
+    void *arena = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (arena == MAP_FAILED)
+    {
+        return false;
+    }
+
+    hosted_arena = arena;
+    arena_size = size;
+    return true;
+}
+
+void hosted_arena_destroy(void)
+{
+    if (hosted_arena != NULL)
+    {
+        munmap(hosted_arena, arena_size);
+        hosted_arena = NULL;
+        arena_size = 0;
+    }
+}
+
+void hosted_print_transcript(void)
+{
+    fwrite(transcript, 1, transcript_length, stdout);
+    if (transcript_length > 0 && transcript[transcript_length - 1] != '\n')
+    {
+        putchar('\n');
+    }
+
+    hosted_clear_transcript();
+}
+
+void hosted_clear_transcript(void)
+{
+    transcript_length = 0;
+}
+
+//// The simulated CPU (see common/cpu.h).
+void hosted_cpuid(uint32_t leaf, uint32_t subleaf, cpuid_registers_t *registers)
+{
+    (void) subleaf;
+    memset(registers, 0, sizeof(*registers));
+
+    switch (leaf)
+    {
+        case CPUID_LEAF_BASIC:
+            registers->eax = CPUID_LEAF_FEATURES;
+            break;
+
+        case CPUID_LEAF_FEATURES:
+            registers->edx = CPUID_FEATURES_EDX_TSC | CPUID_FEATURES_EDX_SSE2 |
+                             (hosted_cpu.has_pat ? CPUID_FEATURES_EDX_PAT : 0);
+            break;
+
+        case CPUID_LEAF_EXTENDED_BASIC:
+            registers->eax = CPUID_LEAF_EXTENDED_INFO;
+            break;
+
+        case CPUID_LEAF_EXTENDED_INFO:
+            registers->edx = hosted_cpu.has_1gib_pages ? CPUID_EXTENDED_INFO_EDX_PAGE_1GB : 0;
+            break;
+    }
+}
+
+uint64_t hosted_read_msr(uint32_t msr)
+{
+    return msr == MSR_IA32_PAT ? hosted_pat : 0;
+}
+
+void hosted_write_msr(uint32_t msr, uint64_t value)
+{
+    if (msr == MSR_IA32_PAT)
+    {
+        hosted_pat = value;
+    }
+}
+
+//// HALT() (see common/misc.h).
+void hosted_halt(void)
+{
+    if (hosted_halt_target_set)
+    {
+        longjmp(hosted_halt_target, 1);
+    }
+
+    hosted_print_transcript();
+    fprintf(stderr, "The kernel code halted outside of a test case.\n");
+    abort();
+}
+
+//// The memory primitives (see common/memory.h). The variants in memory.c need CR0 and CR4 to be set up for SSE, which
+//// can't be done from user space; the C library versions are the closest equivalent.
+void memory_zero(void *memory, size_t length)
+{
+    memset(memory, 0, length);
+}
+
+void memory_copy(void *target, const void *source, size_t length)
+{
+    memmove(target, source, length);
+}
+
+//// The I/O functions, which are used by both the 32-bit loader and the 64-bit kernel code.
+static void hosted_output(const char *string, unsigned int length, void *context)
+{
+    (void) context;
+
+    if (hosted_verbose)
+    {
+        fwrite(string, 1, length, stdout);
+        return;
+    }
+
+    // Keep the last half of the transcript when it runs full.
+    if (length > TRANSCRIPT_SIZE / 2)
+    {
+        string += length - TRANSCRIPT_SIZE / 2;
+        length = TRANSCRIPT_SIZE / 2;
+    }
+
+    if (transcript_length + length > TRANSCRIPT_SIZE)
+    {
+        memmove(transcript, transcript + transcript_length - TRANSCRIPT_SIZE / 2, TRANSCRIPT_SIZE / 2);
+        transcript_length = TRANSCRIPT_SIZE / 2;
+    }
+
+    memcpy(transcript + transcript_length, string, length);
+    transcript_length += length;
+}
+
+void io_print(const char *string)
+{
+    hosted_output(string, strlen(string), NULL);
+}
+
+void io_print_line(const char *string)
+{
+    io_print(string);
+    io_print("\n");
+}
+
+void io_print_formatted(const char *format, ...)
+{
+    va_list arguments;
+    va_start(arguments, format);
+    format_string(hosted_output, NULL, format, arguments);
+    va_end(arguments);
+}
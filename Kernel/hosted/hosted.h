@@ -0,0 +1,81 @@
+/*
+ * hosted.h - The simulated machine that the hosted build runs the kernel code on. The hosted build compiles the setup
+ * of the paging structures, the page allocator and the formatting engine as a Linux program, so that they can be
+ * profiled with perf, fuzzed, and checked against a model of what they should do, without booting anything.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#ifndef __HOSTED_H__
+#define __HOSTED_H__ 1
+
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "common/boot_info.h"
+
+//// Type definitions and structures
+// The CPU features of the simulated CPU.
+typedef struct
+{
+    bool has_1gib_pages;
+    bool has_pat;
+} hosted_cpu_t;
+
+// A simulated machine: the memory map and everything else the 32-bit loader would get from the boot loader.
+typedef struct
+{
+    boot_info_t boot_info;
+    uint64_t available_memory;
+    uint64_t framebuffer_address;
+    uint64_t framebuffer_size;
+    hosted_cpu_t cpu;
+} hosted_machine_t;
+
+//// Global variables
+// The simulated physical memory. Physical address 0 is at the start of it; see VM_PHYSICAL_TO_POINTER() in vm.h.
+extern uint8_t *hosted_arena;
+
+// The simulated CPU, as seen by cpu_cpuid().
+extern hosted_cpu_t hosted_cpu;
+
+// The value written to the IA32_PAT MSR, or 0 if it has not been written.
+extern uint64_t hosted_pat;
+
+// If set, the output of the kernel code goes to the standard output. Otherwise, only the last few lines of it are kept,
+// so that they can be shown if something goes wrong.
+extern bool hosted_verbose;
+
+// Where HALT() jumps to. Must be set with setjmp() before calling kernel code that can halt; otherwise, HALT() aborts.
+extern jmp_buf hosted_halt_target;
+extern bool hosted_halt_target_set;
+
+//// Function prototypes
+/**
+ * Create the simulated physical memory for a machine, replacing the previous one (if any). The memory is reserved but
+ * not committed, so only the pages that are actually touched take up any RAM on the host; this is what makes it
+ * possible to simulate machines with terabytes of memory.
+ *
+ * @param size  The size of the physical address space, in bytes.
+ * @returns true if the memory could be reserved, false otherwise.
+ */
+extern bool hosted_arena_create(uint64_t size);
+
+/**
+ * Release the simulated physical memory.
+ */
+extern void hosted_arena_destroy(void);
+
+/**
+ * Print the output of the kernel code that was kept because hosted_verbose was not set, and forget about it.
+ */
+extern void hosted_print_transcript(void);
+
+/**
+ * Forget about the output of the kernel code that was kept because hosted_verbose was not set.
+ */
+extern void hosted_clear_transcript(void);
+
+#endif // !__HOSTED_H__
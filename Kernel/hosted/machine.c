@@ -0,0 +1,198 @@
+/*
+ * machine.c - The simulated machines that the hosted build sets up the paging structures and the page allocator for.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "common/boot_info.h"
+#include "common/memory_map.h"
+#include "common/misc.h"
+#include "machine.h"
+
+// Where the 32-bit loader is loaded by the boot loader, and roughly how large it is. It is reserved by the loader, just
+// like the kernel image zone.
+#define LOADER_START                    (1 * MiB)
+#define LOADER_END                      (LOADER_START + 64 * KiB)
+
+// The largest physical address space a machine built from arbitrary bytes can have: 4 TiB of RAM, and then some.
+#define MAX_ADDRESS_SPACE_SIZE          (4100 * GiB)
+
+// The flags in the first byte of the input to machine_from_bytes().
+#define FLAG_1GIB_PAGES                 (1 << 0)
+#define FLAG_PAT                        (1 << 1)
+#define FLAG_FRAMEBUFFER                (1 << 2)
+
+/**
+ * Add a region at the end of the memory map, merging it with the last one if they are adjacent and of the same type.
+ */
+static void add_region(memory_map_t *memory_map, uint64_t base_address, uint64_t length, uint32_t type)
+{
+    if (memory_map->count > 0)
+    {
+        memory_map_region_t *last = &memory_map->regions[memory_map->count - 1];
+        if (last->type == type && last->base_address + last->length == base_address)
+        {
+            last->length += length;
+            return;
+        }
+    }
+
+    if (memory_map->count < MEMORY_MAP_MAX_REGIONS)
+    {
+        memory_map_region_t *region = &memory_map->regions[memory_map->count++];
+        region->base_address = base_address;
+        region->length = length;
+        region->type = type;
+    }
+}
+
+/**
+ * Do the things the 32-bit loader does with the memory map before setting up the paging structures: find the end of the
+ * RAM, and reserve the memory used by the loader and the kernel image.
+ */
+static void finish_machine(hosted_machine_t *machine)
+{
+    const memory_map_t *memory_map = &machine->boot_info.memory_map;
+    for (uint32_t i = 0; i < memory_map->count; i++)
+    {
+        const memory_map_region_t *region = &memory_map->regions[i];
+        if (region->type == MEMORY_REGION_TYPE_RAM && region->base_address + region->length > machine->available_memory)
+        {
+            machine->available_memory = region->base_address + region->length;
+        }
+    }
+
+    boot_info_add_reserved_range(&machine->boot_info, LOADER_START, LOADER_END);
+    boot_info_add_reserved_range(&machine->boot_info, KERNEL_IMAGE_ZONE_START, KERNEL_IMAGE_ZONE_END);
+}
+
+void machine_pc(hosted_machine_t *machine, uint64_t memory_size, hosted_cpu_t cpu)
+{
+    memset(machine, 0, sizeof(*machine));
+    machine->cpu = cpu;
+
+    memory_map_t *memory_map = &machine->boot_info.memory_map;
+    uint64_t low_memory_end = memory_size < 3 * GiB ? memory_size : 3 * GiB;
+
+    add_region(memory_map, 0, 0x9FC00, MEMORY_REGION_TYPE_RAM);
+    add_region(memory_map, 0x9FC00, 0x400, MEMORY_REGION_TYPE_RESERVED);
+    add_region(memory_map, 0xF0000, 0x10000, MEMORY_REGION_TYPE_RESERVED);
+    add_region(memory_map, 1 * MiB, low_memory_end - 128 * KiB - 1 * MiB, MEMORY_REGION_TYPE_RAM);
+    add_region(memory_map, low_memory_end - 128 * KiB, 64 * KiB, MEMORY_REGION_TYPE_ACPI);
+    add_region(memory_map, low_memory_end - 64 * KiB, 64 * KiB, MEMORY_REGION_TYPE_ACPI_NVS);
+    add_region(memory_map, 0xFEC00000, 4 * KiB, MEMORY_REGION_TYPE_RESERVED);
+    add_region(memory_map, 0xFEE00000, 4 * KiB, MEMORY_REGION_TYPE_RESERVED);
+    add_region(memory_map, 0xFFFC0000, 256 * KiB, MEMORY_REGION_TYPE_RESERVED);
+
+    if (memory_size > low_memory_end)
+    {
+        add_region(memory_map, 4 * GiB, memory_size - low_memory_end, MEMORY_REGION_TYPE_RAM);
+    }
+
+    // A 1024 x 768 x 32 bpp framebuffer, which is not a multiple of 2 MiB.
+    machine->framebuffer_address = 0xFD000000;
+    machine->framebuffer_size = 1024 * 768 * 4;
+
+    finish_machine(machine);
+}
+
+size_t machine_from_bytes(hosted_machine_t *machine, const uint8_t *data, size_t size)
+{
+    memset(machine, 0, sizeof(*machine));
+
+    size_t position = 0;
+    uint8_t flags = position < size ? data[position++] : 0;
+    unsigned int region_count = position < size ? data[position++] % (MEMORY_MAP_MAX_REGIONS + 1) : 0;
+
+    machine->cpu.has_1gib_pages = (flags & FLAG_1GIB_PAGES) != 0;
+    machine->cpu.has_pat = (flags & FLAG_PAT) != 0;
+
+    // Each region is given by four bytes: the type and the unit of the length, followed by the length in those units (and
+    // how far it should be shifted down, which makes small regions as likely as large ones). The regions follow each
+    // other, starting at address zero. The units go from 1 KiB (which gives regions that start and end in the middle of
+    // pages) up to 1 GiB. Most regions are RAM, since machines without enough of it just halt.
+    static const uint64_t units[] = { 1 * KiB, 4 * KiB, 2 * MiB, 1 * GiB };
+    static const uint32_t types[] =
+    {
+        MEMORY_REGION_TYPE_RAM, MEMORY_REGION_TYPE_RAM, MEMORY_REGION_TYPE_RAM, MEMORY_REGION_TYPE_RESERVED,
+        MEMORY_REGION_TYPE_ACPI, MEMORY_REGION_TYPE_ACPI_NVS, MEMORY_REGION_TYPE_BAD, 0
+    };
+
+    memory_map_t *memory_map = &machine->boot_info.memory_map;
+    uint64_t address = 0;
+    for (unsigned int i = 0; i < region_count && position + 4 <= size; i++, position += 4)
+    {
+        uint32_t type = types[data[position] & 7];
+        uint64_t unit = units[(data[position] >> 3) & 3];
+        uint64_t count = (data[position + 1] | data[position + 2] << 8) >> (data[position + 3] & 15);
+        uint64_t length = (count + 1) * unit;
+        if (address + length > MAX_ADDRESS_SPACE_SIZE)
+        {
+            break;
+        }
+
+        // Type 0 means a hole in the memory map, not covered by any region.
+        if (type != 0)
+        {
+            add_region(memory_map, address, length, type);
+        }
+
+        address += length;
+    }
+
+    // The framebuffer is placed somewhere below 4 GiB, on a 64 KiB boundary.
+    if ((flags & FLAG_FRAMEBUFFER) != 0 && position + 4 <= size)
+    {
+        machine->framebuffer_address = (uint64_t) (data[position] | data[position + 1] << 8) * 64 * KiB;
+        machine->framebuffer_size = (uint64_t) (1 + (data[position + 2] | data[position + 3] << 8)) * 4 * KiB;
+        position += 4;
+    }
+
+    finish_machine(machine);
+    return position;
+}
+
+uint64_t machine_address_space_size(const hosted_machine_t *machine)
+{
+    uint64_t size = machine->framebuffer_address + machine->framebuffer_size;
+    const memory_map_t *memory_map = &machine->boot_info.memory_map;
+    for (uint32_t i = 0; i < memory_map->count; i++)
+    {
+        const memory_map_region_t *region = &memory_map->regions[i];
+        if (region->base_address + region->length > size)
+        {
+            size = region->base_address + region->length;
+        }
+    }
+
+    return size;
+}
+
+void machine_print(const hosted_machine_t *machine)
+{
+    static const char *type_names[] = { "?", "RAM", "reserved", "ACPI", "ACPI NVS", "bad" };
+
+    const memory_map_t *memory_map = &machine->boot_info.memory_map;
+    for (uint32_t i = 0; i < memory_map->count; i++)
+    {
+        const memory_map_region_t *region = &memory_map->regions[i];
+        printf("  %016llX-%016llX %s\n", (unsigned long long) region->base_address,
+               (unsigned long long) (region->base_address + region->length),
+               region->type <= MEMORY_REGION_TYPE_BAD ? type_names[region->type] : "?");
+    }
+
+    if (machine->framebuffer_size > 0)
+    {
+        printf("  Framebuffer at %llX, %llu KiB\n", (unsigned long long) machine->framebuffer_address,
+               (unsigned long long) (machine->framebuffer_size / KiB));
+    }
+
+    printf("  1 GiB pages: %s, PAT: %s\n", machine->cpu.has_1gib_pages ? "yes" : "no",
+           machine->cpu.has_pat ? "yes" : "no");
+}
@@ -0,0 +1,54 @@
+/*
+ * machine.h - The simulated machines that the hosted build sets up the paging structures and the page allocator for.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#ifndef __MACHINE_H__
+#define __MACHINE_H__ 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hosted.h"
+
+//// Function prototypes
+/**
+ * Set up a machine with a given amount of RAM and a memory map like the ones found on real PC:s: the BIOS area and the
+ * video memory below 1 MiB, ACPI tables at the top of the low memory, a 1 GiB hole for memory-mapped I/O (including a
+ * framebuffer) below 4 GiB, and the rest of the RAM above 4 GiB.
+ *
+ * @param machine  The machine [out]
+ * @param memory_size  The amount of RAM, in bytes. At least 4 MiB.
+ * @param cpu  The CPU features.
+ */
+extern void machine_pc(hosted_machine_t *machine, uint64_t memory_size, hosted_cpu_t cpu);
+
+/**
+ * Set up a machine from arbitrary bytes, e.g. the input of a fuzzer. Any input gives a machine with a valid memory map
+ * (sorted, with no overlapping regions), but it does not necessarily have enough RAM to boot.
+ *
+ * @param machine  The machine [out]
+ * @param data  The bytes.
+ * @param size  The number of bytes.
+ * @returns the number of bytes used; the rest can be used for other purposes.
+ */
+extern size_t machine_from_bytes(hosted_machine_t *machine, const uint8_t *data, size_t size);
+
+/**
+ * Get the size of the physical address space of a machine, i.e. how large its simulated physical memory must be.
+ *
+ * @param machine  The machine.
+ * @returns the size, in bytes.
+ */
+extern uint64_t machine_address_space_size(const hosted_machine_t *machine);
+
+/**
+ * Print the memory map of a machine.
+ *
+ * @param machine  The machine.
+ */
+extern void machine_print(const hosted_machine_t *machine);
+
+#endif // !__MACHINE_H__
@@ -0,0 +1,288 @@
+/*
+ * main.c - The command line interface of the hosted build. See the usage() function below, or the README.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common/misc.h"
+#include "common/vm.h"
+#include "hosted.h"
+#include "machine.h"
+#include "run.h"
+
+// The memory sizes of the machines set up by the sweep command: 4 MiB, 16 MiB, 64 MiB and so on up to 4 TiB.
+#define SWEEP_MIN_MEMORY_SIZE           (4 * MiB)
+#define SWEEP_MAX_MEMORY_SIZE           (4096 * GiB)
+
+// The number of page allocator operations performed on each machine by the sweep and bench commands.
+#define OPERATIONS                      1024
+
+// The largest input of the fuzz command, in bytes.
+#define MAX_INPUT_SIZE                  1024
+
+static void usage(void)
+{
+    printf("Usage: cocos_hosted [-v] <command> [arguments]\n"
+           "\n"
+           "Commands:\n"
+           "  sweep                          Set up machines with 4 MiB to 4 TiB of RAM, with and without 1 GiB pages,\n"
+           "                                 check the invariants and show how long it took. This is the default.\n"
+           "  bench <MiB> [count] [no-1gib]  Set up the same machine over and over again (100 times by default), for\n"
+           "                                 profiling with perf. The invariants are checked after every build-out.\n"
+           "  fuzz [count] [seed]            Set up random machines (1000 by default), and check the invariants.\n"
+           "  replay <file>...               Run the machines given by files, e.g. ones saved by fuzz.\n"
+           "\n"
+           "  -v                             Show the output of the kernel code.\n");
+}
+
+static uint64_t xorshift(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static void random_operations(uint8_t *operations, size_t size, uint64_t seed)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        operations[i] = xorshift(&seed);
+    }
+}
+
+static void print_size(uint64_t bytes)
+{
+    if (bytes >= GiB)
+    {
+        printf("%6llu GiB", (unsigned long long) (bytes / GiB));
+    }
+    else
+    {
+        printf("%6llu MiB", (unsigned long long) (bytes / MiB));
+    }
+}
+
+static int sweep(void)
+{
+    uint8_t operations[OPERATIONS];
+    random_operations(operations, sizeof(operations), 0x9E3779B97F4A7C15ULL);
+
+    printf("RAM         1 GiB pages  4 KiB     2 MiB     1 GiB  Structures   VM setup  Page allocator init\n");
+
+    bool passed = true;
+    for (uint64_t memory_size = SWEEP_MIN_MEMORY_SIZE; memory_size <= SWEEP_MAX_MEMORY_SIZE; memory_size *= 4)
+    {
+        for (int has_1gib_pages = 1; has_1gib_pages >= 0; has_1gib_pages--)
+        {
+            hosted_machine_t machine;
+            hosted_cpu_t cpu = { .has_1gib_pages = has_1gib_pages, .has_pat = true };
+            machine_pc(&machine, memory_size, cpu);
+
+            // The first run pays for Linux handing out the pages of the simulated physical memory, so the times are
+            // taken from the second one.
+            run_statistics_t statistics;
+            run_outcome_e outcome = run_machine(&machine, operations, sizeof(operations), &statistics);
+            if (outcome == run_passed)
+            {
+                outcome = run_machine(&machine, operations, sizeof(operations), &statistics);
+            }
+
+            print_size(memory_size);
+            if (outcome != run_passed)
+            {
+                printf("  %-11s  %s\n", has_1gib_pages ? "yes" : "no",
+                       outcome == run_halted ? "HALTED" : "FAILED");
+                machine_print(&machine);
+                hosted_print_transcript();
+                passed = false;
+                continue;
+            }
+
+            printf("  %-11s  %-8llu  %-8llu  %-4llu  %6llu KiB  %6llu us  %6llu us\n", has_1gib_pages ? "yes" : "no",
+                   (unsigned long long) statistics.paging.pages[_4kib],
+                   (unsigned long long) statistics.paging.pages[_2mib],
+                   (unsigned long long) statistics.paging.pages[_1gib],
+                   (unsigned long long) (statistics.paging.structure_pages * VM_4KIB_PAGE_SIZE / KiB),
+                   (unsigned long long) (statistics.vm_nanoseconds / 1000),
+                   (unsigned long long) (statistics.page_allocator_nanoseconds / 1000));
+        }
+    }
+
+    hosted_arena_destroy();
+    printf(passed ? "All invariants hold.\n" : "FAILED\n");
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int compare_nanoseconds(const void *a, const void *b)
+{
+    uint64_t first = *(const uint64_t *) a;
+    uint64_t second = *(const uint64_t *) b;
+    return first < second ? -1 : first > second;
+}
+
+static int bench(uint64_t memory_size, unsigned int count, bool has_1gib_pages)
+{
+    uint8_t operations[OPERATIONS];
+    random_operations(operations, sizeof(operations), 0x9E3779B97F4A7C15ULL);
+
+    hosted_machine_t machine;
+    hosted_cpu_t cpu = { .has_1gib_pages = has_1gib_pages, .has_pat = true };
+    machine_pc(&machine, memory_size, cpu);
+
+    uint64_t *vm_nanoseconds = calloc(count, sizeof(uint64_t));
+    uint64_t *page_allocator_nanoseconds = calloc(count, sizeof(uint64_t));
+    for (unsigned int i = 0; i < count; i++)
+    {
+        run_statistics_t statistics;
+        run_outcome_e outcome = run_machine(&machine, operations, sizeof(operations), &statistics);
+        if (outcome != run_passed)
+        {
+            printf("Build-out %u %s.\n", i, outcome == run_halted ? "halted" : "failed");
+            machine_print(&machine);
+            hosted_print_transcript();
+            return EXIT_FAILURE;
+        }
+
+        vm_nanoseconds[i] = statistics.vm_nanoseconds;
+        page_allocator_nanoseconds[i] = statistics.page_allocator_nanoseconds;
+    }
+
+    qsort(vm_nanoseconds, count, sizeof(uint64_t), compare_nanoseconds);
+    qsort(page_allocator_nanoseconds, count, sizeof(uint64_t), compare_nanoseconds);
+
+    print_size(memory_size);
+    printf(" of RAM, %s 1 GiB pages, %u build-outs:\n", has_1gib_pages ? "with" : "without", count);
+    printf("  VM setup:            min %8.1f us, median %8.1f us\n", vm_nanoseconds[0] / 1000.0,
+           vm_nanoseconds[count / 2] / 1000.0);
+    printf("  Page allocator init: min %8.1f us, median %8.1f us\n", page_allocator_nanoseconds[0] / 1000.0,
+           page_allocator_nanoseconds[count / 2] / 1000.0);
+
+    free(vm_nanoseconds);
+    free(page_allocator_nanoseconds);
+    hosted_arena_destroy();
+    return EXIT_SUCCESS;
+}
+
+static int fuzz(unsigned long count, uint64_t seed)
+{
+    uint8_t input[MAX_INPUT_SIZE];
+    unsigned long halted = 0;
+
+    printf("Fuzzing with seed %llu.\n", (unsigned long long) seed);
+    for (unsigned long i = 0; i < count; i++)
+    {
+        uint64_t input_seed = seed + i;
+        uint64_t state = input_seed * 0x9E3779B97F4A7C15ULL + 1;
+        size_t size = xorshift(&state) % sizeof(input);
+        for (size_t j = 0; j < size; j++)
+        {
+            input[j] = xorshift(&state);
+        }
+
+        run_outcome_e outcome = run_input(input, size);
+        if (outcome == run_failed)
+        {
+            char file_name[64];
+            snprintf(file_name, sizeof(file_name), "crash-%llu.bin", (unsigned long long) input_seed);
+
+            FILE *file = fopen(file_name, "wb");
+            if (file != NULL)
+            {
+                fwrite(input, 1, size, file);
+                fclose(file);
+                printf("The input has been saved in %s.\n", file_name);
+            }
+
+            return EXIT_FAILURE;
+        }
+
+        if (outcome == run_halted)
+        {
+            halted++;
+        }
+    }
+
+    hosted_arena_destroy();
+    printf("%lu machines checked, %lu of which halted (e.g. because of too little RAM).\n", count, halted);
+    return EXIT_SUCCESS;
+}
+
+static int replay(int count, char **file_names)
+{
+    static uint8_t input[MAX_INPUT_SIZE * 16];
+    bool passed = true;
+
+    for (int i = 0; i < count; i++)
+    {
+        FILE *file = fopen(file_names[i], "rb");
+        if (file == NULL)
+        {
+            perror(file_names[i]);
+            return EXIT_FAILURE;
+        }
+
+        size_t size = fread(input, 1, sizeof(input), file);
+        fclose(file);
+
+        run_outcome_e outcome = run_input(input, size);
+        printf("%s: %s\n", file_names[i],
+               outcome == run_passed ? "passed" : outcome == run_halted ? "halted" : "FAILED");
+        passed = passed && outcome != run_failed;
+    }
+
+    hosted_arena_destroy();
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int main(int argc, char **argv)
+{
+    int first = 1;
+    if (first < argc && strcmp(argv[first], "-v") == 0)
+    {
+        hosted_verbose = true;
+        first++;
+    }
+
+    const char *command = first < argc ? argv[first] : "sweep";
+    int argument_count = argc > first ? argc - first - 1 : 0;
+    char **arguments = &argv[first + 1];
+
+    if (strcmp(command, "sweep") == 0 && argument_count == 0)
+    {
+        return sweep();
+    }
+    else if (strcmp(command, "bench") == 0 && argument_count >= 1 && argument_count <= 3)
+    {
+        uint64_t memory_size = strtoull(arguments[0], NULL, 0) * MiB;
+        unsigned int count = argument_count >= 2 ? strtoul(arguments[1], NULL, 0) : 100;
+        bool has_1gib_pages = argument_count < 3 || strcmp(arguments[2], "no-1gib") != 0;
+        if (memory_size < SWEEP_MIN_MEMORY_SIZE || count == 0)
+        {
+            printf("The machine must have at least 4 MiB of RAM, and be set up at least once.\n");
+            return EXIT_FAILURE;
+        }
+
+        return bench(memory_size, count, has_1gib_pages);
+    }
+    else if (strcmp(command, "fuzz") == 0 && argument_count <= 2)
+    {
+        unsigned long count = argument_count >= 1 ? strtoul(arguments[0], NULL, 0) : 1000;
+        uint64_t seed = argument_count >= 2 ? strtoull(arguments[1], NULL, 0) : 1;
+        return fuzz(count, seed);
+    }
+    else if (strcmp(command, "replay") == 0 && argument_count >= 1)
+    {
+        return replay(argument_count, arguments);
+    }
+
+    usage();
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,126 @@
+/*
+ * run.c - Running the kernel code on a simulated machine, and checking the result.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#include <setjmp.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "common/misc.h"
+#include "common/vm.h"
+#include "32bit_loader/vm32.h"
+#include "64bit_kernel/page_allocator.h"
+#include "check.h"
+#include "hosted.h"
+#include "machine.h"
+#include "run.h"
+
+// The simulated physical memory is never smaller than this. Nothing outside of the RAM is ever touched, so this costs
+// nothing but some address space.
+#define MIN_ARENA_SIZE                  (4 * GiB)
+
+static uint64_t current_arena_size;
+
+static uint64_t now(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t) time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+run_outcome_e run_machine(const hosted_machine_t *machine, const uint8_t *operations, size_t size,
+                          run_statistics_t *statistics)
+{
+    const uint64_t page_mask = VM_4KIB_PAGE_SIZE - 1;
+    uint64_t arena_size = (machine_address_space_size(machine) + page_mask) & ~page_mask;
+    if (arena_size < MIN_ARENA_SIZE)
+    {
+        arena_size = MIN_ARENA_SIZE;
+    }
+
+    if (arena_size != current_arena_size)
+    {
+        if (!hosted_arena_create(arena_size))
+        {
+            printf("Could not reserve %llu MiB of address space for the simulated physical memory.\n",
+                   (unsigned long long) (arena_size / MiB));
+            current_arena_size = 0;
+            return run_failed;
+        }
+
+        current_arena_size = arena_size;
+    }
+
+    // The kernel code adds the ranges it uses to the boot information, so it must be given a fresh copy every time.
+    static hosted_machine_t booted_machine;
+    booted_machine = *machine;
+    boot_info_t *boot_info = &booted_machine.boot_info;
+    uint32_t reserved_ranges_before = boot_info->reserved_range_count;
+
+    hosted_cpu = machine->cpu;
+    hosted_pat = 0;
+    hosted_clear_transcript();
+
+    run_statistics_t run_statistics = { 0 };
+    hosted_halt_target_set = true;
+    if (setjmp(hosted_halt_target) != 0)
+    {
+        hosted_halt_target_set = false;
+        return run_halted;
+    }
+
+    uint64_t start = now();
+    vm_setup_paging_structures(booted_machine.available_memory, boot_info, booted_machine.framebuffer_address,
+                               booted_machine.framebuffer_size);
+    run_statistics.vm_nanoseconds = now() - start;
+
+    if (!check_paging_structures(&booted_machine, reserved_ranges_before, &run_statistics.paging))
+    {
+        hosted_halt_target_set = false;
+        return run_failed;
+    }
+
+    start = now();
+    page_allocator_init(boot_info);
+    run_statistics.page_allocator_nanoseconds = now() - start;
+
+    hosted_halt_target_set = false;
+
+    if (!check_page_allocator(&booted_machine, operations, size))
+    {
+        return run_failed;
+    }
+
+    if (statistics != NULL)
+    {
+        *statistics = run_statistics;
+    }
+
+    return run_passed;
+}
+
+run_outcome_e run_input(const uint8_t *data, size_t size)
+{
+    hosted_machine_t machine;
+    size_t used = machine_from_bytes(&machine, data, size);
+
+    // The formatting check uses the first few bytes after the machine, and the page allocator all of them.
+    if (!check_format(data + used, size - used))
+    {
+        return run_failed;
+    }
+
+    run_outcome_e outcome = run_machine(&machine, data + used, size - used, NULL);
+    if (outcome == run_failed)
+    {
+        machine_print(&machine);
+        hosted_print_transcript();
+    }
+
+    return outcome;
+}
@@ -0,0 +1,66 @@
+/*
+ * run.h - Running the kernel code on a simulated machine, and checking the result.
+ *
+ * Author: Per Lundberg <per@halleluja.nu>
+ * Copyright: © 2017 Per Lundberg
+ */
+
+#ifndef __RUN_H__
+#define __RUN_H__ 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "check.h"
+#include "hosted.h"
+
+//// Enumerations
+typedef enum
+{
+    // The kernel code ran to completion, and all the invariants hold.
+    run_passed,
+
+    // The kernel code halted, e.g. because the machine didn't have enough RAM for the paging structures. This is what
+    // the code is supposed to do on a machine like that, so it is not an error in itself.
+    run_halted,
+
+    // An invariant was broken.
+    run_failed
+} run_outcome_e;
+
+//// Type definitions and structures
+typedef struct
+{
+    // The time it took to set up the paging structures and to initialize the page allocator.
+    uint64_t vm_nanoseconds;
+    uint64_t page_allocator_nanoseconds;
+
+    check_paging_summary_t paging;
+} run_statistics_t;
+
+//// Function prototypes
+/**
+ * Set up the paging structures and the page allocator for a machine, the same way as when booting it, and check the
+ * invariants of both. The simulated physical memory is kept between calls for machines of the same size, so that
+ * running the same machine over and over (when benchmarking) doesn't measure Linux handing out pages.
+ *
+ * @param machine  The machine.
+ * @param operations  The page allocator operations to check, as described for check_page_allocator().
+ * @param size  The number of operations.
+ * @param statistics  The statistics of the run [out] May be NULL.
+ * @returns the outcome.
+ */
+extern run_outcome_e run_machine(const hosted_machine_t *machine, const uint8_t *operations, size_t size,
+                                 run_statistics_t *statistics);
+
+/**
+ * Run a test case given by arbitrary bytes, e.g. the input of a fuzzer: a machine (see machine_from_bytes()), the page
+ * allocator operations, and a formatting check.
+ *
+ * @param data  The bytes.
+ * @param size  The number of bytes.
+ * @returns the outcome.
+ */
+extern run_outcome_e run_input(const uint8_t *data, size_t size);
+
+#endif // !__RUN_H__
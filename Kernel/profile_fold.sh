@@ -0,0 +1,77 @@
+#!/bin/sh
+#
+# Turn the samples dumped by the profiler (see 64bit_kernel/profile.h) into the "folded" format used by flamegraph.pl
+# from https://github.com/brendangregg/FlameGraph: one line per call stack, with the function names from the outermost
+# to the innermost separated by semicolons, followed by the number of samples. Used by make profile; see the README.
+#
+# Usage: profile_fold.sh [-c] <serial log>
+#
+#   -c  Keep the samples of each CPU apart, by adding the CPU as an outermost frame.
+#
+# Author: Per Lundberg <per@halleluja.nu>
+# Copyright: © 2017 Per Lundberg
+#
+
+PER_CPU=0
+if [ "${1:-}" = "-c" ]; then
+    PER_CPU=1
+    shift
+fi
+
+if [ $# -ne 1 ]; then
+    echo "Usage: $0 [-c] <serial log>" >&2
+    exit 1
+fi
+
+# The addresses are all written as 16 hexadecimal digits, so they can be compared as strings; awk has no hexadecimal
+# numbers. Concatenating an empty string makes sure they are compared as strings, even if they only consist of digits.
+awk -v per_cpu="$PER_CPU" '
+# Find the function containing an address. Return addresses point at the instruction after the call, which is the first
+# instruction of the next function if the call was the last instruction of the caller; they are looked up as if they
+# pointed one byte earlier.
+function lookup(address, is_return_address,    low, high, middle) {
+    low = 0
+    high = symbol_count
+    while (high - low > 1) {
+        middle = int((low + high) / 2)
+        if ((symbol_address[middle] "") < (address "") ||
+            (!is_return_address && (symbol_address[middle] "") == (address ""))) {
+            low = middle
+        } else {
+            high = middle
+        }
+    }
+
+    if (symbol_count == 0 || (symbol_address[low] "") > (address "")) {
+        return "[unknown]"
+    }
+
+    return symbol_name[low]
+}
+
+BEGIN {
+    symbol_count = 0
+}
+
+/^@symbol / {
+    symbol_address[symbol_count] = $2
+    symbol_name[symbol_count] = $3
+    symbol_count++
+    next
+}
+
+/^@stack / {
+    stack = per_cpu ? "cpu" $2 : ""
+    for (i = NF; i >= 4; i--) {
+        stack = stack (stack == "" ? "" : ";") lookup($i, i > 4)
+    }
+
+    samples[stack] += $3
+}
+
+END {
+    for (stack in samples) {
+        print stack, samples[stack]
+    }
+}
+' "$1" | sort
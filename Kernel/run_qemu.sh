@@ -0,0 +1,79 @@
+#!/bin/sh
+#
+# Boot cocOS in QEMU without a display, with the serial port as the only output, and wait for it to exit through the
+# isa-debug-exit device. Used by make test and make bench; see the README for details.
+#
+# Usage: run_qemu.sh [kernel command line options...]
+#
+# The following environment variables can be used to override the defaults:
+#
+#   QEMU       The QEMU binary (qemu-system-x86_64).
+#   SMP        The number of CPU:s (4).
+#   MEMORY     The amount of RAM, in MiB (512).
+#   TIMEOUT    The number of seconds to wait for the kernel to exit before giving up (120).
+#   LOG        The file to write the serial output to (qemu.log).
+#   RESULTS    If set, the results reported by the kernel are written to this file, one per line: name, value, unit.
+#
+# The exit status is 0 if the kernel ran to completion, and 1 otherwise.
+#
+# Author: Per Lundberg <per@halleluja.nu>
+# Copyright: © 2017 Per Lundberg
+#
+
+QEMU=${QEMU:-qemu-system-x86_64}
+SMP=${SMP:-4}
+MEMORY=${MEMORY:-512}
+TIMEOUT=${TIMEOUT:-120}
+LOG=${LOG:-qemu.log}
+
+cd "$(dirname "$0")" || exit 1
+
+if [ ! -f 32bit_loader/cocOS32.bin ] || [ ! -f 64bit_kernel/cocOS64.bin ]; then
+    echo "The kernel has not been built. Run make first." >&2
+    exit 1
+fi
+
+# The 32-bit loader is a Multiboot kernel, which QEMU can load directly; the 64-bit kernel is given to it as the first
+# module, just like GRUB does when booting from the floppy image.
+timeout "$TIMEOUT" "$QEMU" \
+    -kernel 32bit_loader/cocOS32.bin \
+    -initrd 64bit_kernel/cocOS64.bin \
+    -append "qemu_exit $*" \
+    -smp "$SMP" \
+    -m "$MEMORY" \
+    -display none \
+    -serial stdio \
+    -monitor none \
+    -no-reboot \
+    -device isa-debug-exit,iobase=0xf4,iosize=0x04 \
+    < /dev/null > "$LOG.raw"
+status=$?
+
+# The serial port sends CR LF line endings.
+tr -d '\r' < "$LOG.raw" > "$LOG"
+rm -f "$LOG.raw"
+cat "$LOG"
+
+if [ -n "${RESULTS:-}" ]; then
+    sed -n 's/^@result //p' "$LOG" > "$RESULTS"
+fi
+
+# The isa-debug-exit device makes QEMU exit with (value << 1) | 1, so 1 means success and 3 failure. timeout(1) exits
+# with 124 when the time is up.
+case $status in
+    1)
+        echo "PASS"
+        exit 0
+        ;;
+    3)
+        echo "FAIL: the kernel reported a failure."
+        ;;
+    124)
+        echo "FAIL: the kernel did not exit within $TIMEOUT seconds."
+        ;;
+    *)
+        echo "FAIL: QEMU exited with status $status."
+        ;;
+esac
+
+exit 1
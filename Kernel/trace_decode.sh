@@ -0,0 +1,69 @@
+#!/bin/sh
+#
+# Turn the trace records dumped by the kernel (see 64bit_kernel/trace.h) into the JSON trace event format, which can be
+# opened in Perfetto (https://ui.perfetto.dev) or chrome://tracing. Each CPU shows up as a thread of its own, so the
+# timelines of the CPU:s can be compared side by side. Used by make trace; see the README.
+#
+# Usage: trace_decode.sh <serial log>
+#
+# Author: Per Lundberg <per@halleluja.nu>
+# Copyright: © 2017 Per Lundberg
+#
+
+if [ $# -ne 1 ]; then
+    echo "Usage: $0 <serial log>" >&2
+    exit 1
+fi
+
+awk '
+BEGIN {
+    frequency = 0
+    emitted = 0
+    print "{\"displayTimeUnit\": \"ns\", \"traceEvents\": ["
+}
+
+# Write an event, with a comma before all but the first one.
+function emit(json) {
+    printf "%s%s", (emitted++ > 0 ? ",\n" : ""), json
+}
+
+/^@trace / {
+    frequency = $2
+    next
+}
+
+/^@trace_event / {
+    phase[$2] = $3
+    name[$2] = $4
+    value_name[$2, 0] = $5
+    value_name[$2, 1] = $6
+    next
+}
+
+/^@trace_record / {
+    cpu = $2
+    if (!(cpu in cpus)) {
+        cpus[cpu] = 1
+        emit(sprintf("{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": %d, " \
+                     "\"args\": {\"name\": \"CPU %d\"}}", cpu, cpu))
+    }
+
+    # The timestamps are in microseconds, relative to the oldest record.
+    event = $4
+    args = ""
+    for (i = 0; i < 2; i++) {
+        if (value_name[event, i] != "-" && value_name[event, i] != "") {
+            args = args (args == "" ? "" : ", ") sprintf("\"%s\": \"0x%s\"", value_name[event, i], $(5 + i))
+        }
+    }
+
+    emit(sprintf("{\"name\": \"%s\", \"ph\": \"%s\",%s \"ts\": %.3f, \"pid\": 0, \"tid\": %d, \"args\": {%s}}",
+                 name[event], phase[event], phase[event] == "i" ? " \"s\": \"t\"," : "",
+                 $3 * 1000000 / frequency, cpu, args))
+}
+
+END {
+    print ""
+    print "]}"
+}
+' "$1"